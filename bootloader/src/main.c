@@ -1,6 +1,7 @@
 #include "../Include/Uefi.h"
 #include "../Include/Protocol/LoadedImage.h"
 #include "../Include/Protocol/SimpleFileSystem.h"
+#include "../Include/Guid/Acpi.h"
 #include "../Include/Guid/FileInfo.h"
 #include "../Include/Protocol/GraphicsOutput.h"
 #include "../Include/Protocol/PartitionInfo.h"
@@ -696,6 +697,29 @@ void print_page_table(uint64_t *page_table, int level)
 #define PHYS_MEMMAP_ENTRY_COUNT 64
 struct PhysMemoryMapEntry physmemmap[PHYS_MEMMAP_ENTRY_COUNT];
 int physmemmap_count = 0;
+struct BootInfo boot_info;
+
+// Physical address of the ACPI RSDP from the system configuration table,
+// preferring the ACPI 2.0 entry. 0 if there is none.
+uint64_t find_acpi_rsdp()
+{
+    EFI_GUID acpi20 = EFI_ACPI_20_TABLE_GUID;
+    EFI_GUID acpi10 = ACPI_10_TABLE_GUID;
+    uint64_t found = 0;
+    for (UINTN i = 0; i < st->NumberOfTableEntries; ++i)
+    {
+        EFI_CONFIGURATION_TABLE *table = &st->ConfigurationTable[i];
+        if (!guid_cmp(&table->VendorGuid, &acpi20))
+        {
+            return (uint64_t)table->VendorTable;
+        }
+        if (!guid_cmp(&table->VendorGuid, &acpi10))
+        {
+            found = (uint64_t)table->VendorTable;
+        }
+    }
+    return found;
+}
 
 EFI_STATUS EFIAPI efi_main(IN EFI_HANDLE image_handle, IN EFI_SYSTEM_TABLE *system_table)
 {
@@ -944,11 +968,6 @@ EFI_STATUS EFIAPI efi_main(IN EFI_HANDLE image_handle, IN EFI_SYSTEM_TABLE *syst
 
     write_cr3((uint64_t)pml4);
 
-    uint64_t entry = elf->entry;
-    printf(u"Testing call to kernel entry %#llx...\r\n", entry);
-    int result = ((int (*)(void))entry)();
-    printf(u"Result was %d\r\n", result);
-
     {
         EFI_GUID protocol = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
         UINTN handle_count;
@@ -965,6 +984,11 @@ EFI_STATUS EFIAPI efi_main(IN EFI_HANDLE image_handle, IN EFI_SYSTEM_TABLE *syst
 
         init_console(interface);
 
+        boot_info.framebuffer.base = (uint32_t *)interface->Mode->FrameBufferBase;
+        boot_info.framebuffer.width = interface->Mode->Info->HorizontalResolution;
+        boot_info.framebuffer.height = interface->Mode->Info->VerticalResolution;
+        boot_info.framebuffer.pitch = interface->Mode->Info->PixelsPerScanLine;
+
         st->BootServices->FreePool(handles);
     }
 
@@ -1038,9 +1062,24 @@ EFI_STATUS EFIAPI efi_main(IN EFI_HANDLE image_handle, IN EFI_SYSTEM_TABLE *syst
         }
     }
 
+    physmemmap[physmemmap_count].start_frame = start;
+    physmemmap[physmemmap_count].frame_count = cursor - start;
+    physmemmap[physmemmap_count].type = type;
+    physmemmap_count++;
+
     printf(u"PhysMemmapEntryCount: %d\r\n", physmemmap_count);
 
-    
+    boot_info.version = VERSION;
+    boot_info.phys_memory_map.entries = physmemmap;
+    boot_info.phys_memory_map.entry_count = physmemmap_count;
+    boot_info.acpi_rsdp = find_acpi_rsdp();
+    printf(u"ACPI RSDP: %#llx\r\n", boot_info.acpi_rsdp);
+
+    // The kernel uses the System V calling convention, not the firmware's.
+    uint64_t entry = elf->entry;
+    printf(u"Calling kernel entry %#llx...\r\n", entry);
+    int result = ((int __attribute__((sysv_abi)) (*)(struct BootInfo *))entry)(&boot_info);
+    printf(u"Result was %d\r\n", result);
 
     wait_for_keypress_exit();
     return EFI_SUCCESS;
@@ -4,7 +4,7 @@
 #include "stdint.h"
 #include "stddef.h"
 
-#define VERSION 1
+#define VERSION 2
 
 struct Framebuffer {
     uint32_t *base;
@@ -18,21 +18,23 @@ enum PhysMemoryType {
     PhysReserved,
 };
 
-struct PhysMemoryMap {
-    struct PhysMemoryMap* entries;
-    size_t entry_count;
-};
-
 struct PhysMemoryMapEntry {
     uint64_t start_frame;
     uint64_t frame_count;
     enum PhysMemoryType type;
 };
 
+struct PhysMemoryMap {
+    struct PhysMemoryMapEntry* entries;
+    size_t entry_count;
+};
+
 struct BootInfo {
     uint32_t version;
     struct Framebuffer framebuffer;
     struct PhysMemoryMap phys_memory_map;
+    // Physical address of the ACPI RSDP, or 0 if the firmware has none.
+    uint64_t acpi_rsdp;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,83 @@
+#include "acpi.h"
+
+#include "../lib/string.h"
+#include "../log.h"
+#include "../mm/layout.h"
+
+struct [[gnu::packed]] AcpiRsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    // ACPI 2.0 and later.
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+};
+
+constexpr uint32_t kRsdpV1Length = 20;
+
+static const AcpiHeader* root;
+// Entries of the XSDT are 64-bit addresses, those of the RSDT 32-bit.
+static unsigned entry_size;
+
+static bool checksum_ok(const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; ++i) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+static const AcpiHeader* table_at(uint64_t phys) {
+    const AcpiHeader* table = (const AcpiHeader*)phys_to_virt(phys);
+    return checksum_ok(table, table->length) ? table : nullptr;
+}
+
+void acpi_init(uint64_t rsdp_phys) {
+    if (rsdp_phys == 0) {
+        kprintf("acpi: no RSDP\n");
+        return;
+    }
+    const AcpiRsdp* rsdp = (const AcpiRsdp*)phys_to_virt(rsdp_phys);
+    if (memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || !checksum_ok(rsdp, kRsdpV1Length)) {
+        kprintf("acpi: bad RSDP at 0x%lx\n", rsdp_phys);
+        return;
+    }
+    if (rsdp->revision >= 2 && rsdp->xsdt_address != 0 && checksum_ok(rsdp, rsdp->length)) {
+        root = table_at(rsdp->xsdt_address);
+        entry_size = sizeof(uint64_t);
+    } else {
+        root = table_at(rsdp->rsdt_address);
+        entry_size = sizeof(uint32_t);
+    }
+    if (!root) {
+        kprintf("acpi: bad root table\n");
+        return;
+    }
+    kprintf("acpi: %s at 0x%lx\n", entry_size == sizeof(uint64_t) ? "XSDT" : "RSDT", virt_to_phys(root));
+}
+
+bool acpi_available() {
+    return root != nullptr;
+}
+
+const AcpiHeader* acpi_find_table(const char* signature) {
+    if (!root) {
+        return nullptr;
+    }
+    const uint8_t* entries = (const uint8_t*)root + sizeof(AcpiHeader);
+    uint32_t count = (root->length - sizeof(AcpiHeader)) / entry_size;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t phys = 0;
+        memcpy(&phys, entries + i * entry_size, entry_size);
+        const AcpiHeader* table = (const AcpiHeader*)phys_to_virt(phys);
+        if (memcmp(table->signature, signature, 4) == 0 && checksum_ok(table, table->length)) {
+            return table;
+        }
+    }
+    return nullptr;
+}
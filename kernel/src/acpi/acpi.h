@@ -0,0 +1,41 @@
+#ifndef ACPI_ACPI_H
+#define ACPI_ACPI_H
+
+#include <stdint.h>
+
+struct [[gnu::packed]] AcpiHeader {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+};
+
+// Generic address structure, locating a register in one of several
+// address spaces.
+struct [[gnu::packed]] AcpiAddress {
+    uint8_t space;
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+};
+
+enum AcpiAddressSpace : uint8_t {
+    AcpiSpaceMemory = 0,
+    AcpiSpaceIo = 1,
+};
+
+// Locates the root table from the RSDP the bootloader found, given as a
+// physical address (0 if there is none). Tables are read through the
+// direct map, so this runs after vmm_init.
+void acpi_init(uint64_t rsdp_phys);
+bool acpi_available();
+// The first table with `signature` whose checksum holds, or null.
+const AcpiHeader* acpi_find_table(const char* signature);
+
+#endif // ACPI_ACPI_H
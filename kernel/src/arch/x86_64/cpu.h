@@ -0,0 +1,238 @@
+#ifndef ARCH_X86_64_CPU_H
+#define ARCH_X86_64_CPU_H
+
+#include <stdint.h>
+
+constexpr uint64_t kCr4Pge = 1ull << 7;
+constexpr uint64_t kCr4Pcide = 1ull << 17;
+// Set in a value written to CR3, keeps the TLB entries of the new PCID.
+constexpr uint64_t kCr3NoFlush = 1ull << 63;
+constexpr uint32_t kMsrGsBase = 0xC0000101;
+
+struct CpuidResult {
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+};
+
+inline CpuidResult cpuid(uint32_t leaf, uint32_t subleaf = 0) {
+    CpuidResult r;
+    asm volatile("cpuid"
+                 : "=a"(r.eax), "=b"(r.ebx), "=c"(r.ecx), "=d"(r.edx)
+                 : "a"(leaf), "c"(subleaf));
+    return r;
+}
+
+inline uint64_t read_msr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+inline void write_msr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" ::"c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// The pointer stored at the start of the GS segment. Not volatile: the GS
+// base only changes when a CPU comes up, so repeated reads can be merged.
+inline void* read_gs_pointer() {
+    void* value;
+    asm("mov %%gs:0, %0" : "=r"(value));
+    return value;
+}
+
+inline uint64_t read_cr2() {
+    uint64_t value;
+    asm volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+inline uint64_t read_cr0() {
+    uint64_t value;
+    asm volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+inline void write_cr0(uint64_t value) {
+    asm volatile("mov %0, %%cr0" ::"r"(value) : "memory");
+}
+
+inline uint64_t read_cr3() {
+    uint64_t value;
+    asm volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+inline void write_cr3(uint64_t value) {
+    asm volatile("mov %0, %%cr3" ::"r"(value) : "memory");
+}
+
+inline uint64_t read_cr4() {
+    uint64_t value;
+    asm volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+inline void write_cr4(uint64_t value) {
+    asm volatile("mov %0, %%cr4" ::"r"(value) : "memory");
+}
+
+inline void invlpg(uintptr_t virt) {
+    asm volatile("invlpg (%0)" ::"r"(virt) : "memory");
+}
+
+inline void write_xcr(uint32_t index, uint64_t value) {
+    asm volatile("xsetbv" ::"c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Extended-state saves and restores. `area` is 64-byte aligned (16 for
+// FXSAVE) and `mask` selects the components, intersected with XCR0.
+inline void fxsave(void* area) {
+    asm volatile("fxsave64 (%0)" ::"r"(area) : "memory");
+}
+
+inline void fxrstor(const void* area) {
+    asm volatile("fxrstor64 (%0)" ::"r"(area) : "memory");
+}
+
+inline void xsave(void* area, uint64_t mask) {
+    asm volatile("xsave64 (%0)" ::"r"(area), "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32)) : "memory");
+}
+
+inline void xsaveopt(void* area, uint64_t mask) {
+    asm volatile("xsaveopt64 (%0)" ::"r"(area), "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32)) : "memory");
+}
+
+inline void xsaves(void* area, uint64_t mask) {
+    asm volatile("xsaves64 (%0)" ::"r"(area), "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32)) : "memory");
+}
+
+inline void xrstor(const void* area, uint64_t mask) {
+    asm volatile("xrstor64 (%0)" ::"r"(area), "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32)) : "memory");
+}
+
+inline void xrstors(const void* area, uint64_t mask) {
+    asm volatile("xrstors64 (%0)" ::"r"(area), "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32)) : "memory");
+}
+
+inline void write_mxcsr(uint32_t value) {
+    asm volatile("ldmxcsr %0" ::"m"(value));
+}
+
+// Zeroes the upper halves of the YMM registers, which otherwise make later
+// SSE code pay for transitions between the two states. Needs AVX.
+inline void vzeroupper() {
+    asm volatile("vzeroupper");
+}
+
+enum InvpcidType : uint64_t {
+    // One address under one PCID.
+    InvpcidAddress,
+    // Everything under one PCID but global translations.
+    InvpcidContext,
+    // Everything under every PCID, global translations included.
+    InvpcidAll,
+    InvpcidAllNonGlobal,
+};
+
+inline void invpcid(InvpcidType type, uint16_t pcid, uintptr_t virt = 0) {
+    struct {
+        uint64_t pcid;
+        uint64_t virt;
+    } descriptor = {pcid, virt};
+    asm volatile("invpcid %0, %1" ::"m"(descriptor), "r"((uint64_t)type) : "memory");
+}
+
+inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+inline void cpu_pause() {
+    asm volatile("pause");
+}
+
+inline void cpu_halt() {
+    asm volatile("hlt");
+}
+
+// Enables interrupts and halts until one arrives, then disables them
+// again. STI only takes effect after the next instruction, so an interrupt
+// that is already pending wakes the HLT rather than slipping in before it.
+inline void cpu_idle() {
+    asm volatile("sti\n\t"
+                 "hlt\n\t"
+                 "cli" ::: "memory");
+}
+
+inline void irq_disable() {
+    asm volatile("cli" ::: "memory");
+}
+
+inline void irq_enable() {
+    asm volatile("sti" ::: "memory");
+}
+
+inline uint64_t irq_save() {
+    uint64_t rflags;
+    asm volatile("pushfq\n\t"
+                 "pop %0\n\t"
+                 "cli"
+                 : "=r"(rflags)
+                 :
+                 : "memory");
+    return rflags;
+}
+
+inline void irq_restore(uint64_t rflags) {
+    asm volatile("push %0\n\t"
+                 "popfq"
+                 :
+                 : "r"(rflags)
+                 : "memory", "cc");
+}
+
+inline void outb(uint16_t port, uint8_t value) {
+    asm volatile("outb %0, %1" ::"a"(value), "Nd"(port));
+}
+
+inline uint8_t inb(uint16_t port) {
+    uint8_t value;
+    asm volatile("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+inline void outw(uint16_t port, uint16_t value) {
+    asm volatile("outw %0, %1" ::"a"(value), "Nd"(port));
+}
+
+inline uint16_t inw(uint16_t port) {
+    uint16_t value;
+    asm volatile("inw %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+inline void outl(uint16_t port, uint32_t value) {
+    asm volatile("outl %0, %1" ::"a"(value), "Nd"(port));
+}
+
+inline uint32_t inl(uint16_t port) {
+    uint32_t value;
+    asm volatile("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// Flushes every TLB entry, including global ones, by toggling CR4.PGE.
+inline void flush_tlb_all() {
+    uint64_t cr4 = read_cr4();
+    if (cr4 & kCr4Pge) {
+        write_cr4(cr4 & ~kCr4Pge);
+        write_cr4(cr4);
+    } else {
+        write_cr3(read_cr3());
+    }
+}
+
+#endif // ARCH_X86_64_CPU_H
@@ -0,0 +1,265 @@
+#include "fpu.h"
+
+#include "../../lib/string.h"
+#include "../../lib/util.h"
+#include "../../log.h"
+#include "../../mm/slab.h"
+#include "../../panic.h"
+#include "cpu.h"
+#include "percpu.h"
+
+constexpr uint64_t kCr0Monitor = 1ull << 1;
+constexpr uint64_t kCr0Emulate = 1ull << 2;
+constexpr uint64_t kCr4Osfxsr = 1ull << 9;
+constexpr uint64_t kCr4Osxmmexcpt = 1ull << 10;
+constexpr uint64_t kCr4Osxsave = 1ull << 18;
+constexpr uint32_t kMsrXss = 0xDA0;
+
+constexpr uint32_t kCpuidXsave = 1u << 26;
+constexpr uint32_t kCpuidXsaveopt = 1u << 0;
+constexpr uint32_t kCpuidXsaves = 1u << 3;
+constexpr uint32_t kCpuidAvx2 = 1u << 5;
+constexpr uint64_t kComponentAvx = 1ull << 2;
+
+// x87, SSE, AVX and the three AVX-512 components. MPX is obsolete, and
+// PKRU and AMX need support of their own before user code may have them.
+constexpr uint64_t kUserComponents = 0xE7;
+constexpr unsigned kComponents = 64;
+
+// Layout of the area: the legacy FXSAVE region, then the XSAVE header.
+constexpr size_t kLegacySize = 512;
+constexpr size_t kHeaderSize = 64;
+constexpr size_t kFcwOffset = 0;
+constexpr size_t kMxcsrOffset = 24;
+constexpr size_t kXstateBvOffset = 512;
+constexpr size_t kXcompBvOffset = 520;
+constexpr uint64_t kXcompBvCompacted = 1ull << 63;
+constexpr uint16_t kFcwDefault = 0x37F;
+constexpr uint32_t kMxcsrDefault = 0x1F80;
+constexpr size_t kAreaAlign = 64;
+constexpr unsigned kNoCpu = UINT32_MAX;
+
+struct FpuState {
+    // The last CPU that loaded the state into its registers.
+    unsigned cpu;
+    // Aligned, in the same allocation.
+    uint8_t* area;
+};
+
+struct FpuCpu {
+    // The state the registers hold, if they hold one.
+    FpuState* live;
+    // Whether user code ran since `live` was last saved or restored.
+    bool dirty;
+    // The state of the thread running now.
+    FpuState* current;
+    // Inside a KernelFpuGuard.
+    bool kernel;
+    FpuStats stats;
+};
+
+static FpuSaveMode mode;
+static uint64_t components;
+static size_t state_size;
+static bool kernel_avx2;
+static uint32_t component_size[kComponents];
+static PER_CPU PerCpu<FpuCpu> fpu_cpus;
+
+static void enable() {
+    write_cr0((read_cr0() & ~kCr0Emulate) | kCr0Monitor);
+    if (mode == FpuFxsave) {
+        return;
+    }
+    write_xcr(0, components);
+    if (mode == FpuXsaves) {
+        // No supervisor components.
+        write_msr(kMsrXss, 0);
+    }
+}
+
+void fpu_init() {
+    uint64_t cr4 = read_cr4() | kCr4Osfxsr | kCr4Osxmmexcpt;
+    if (!(cpuid(1).ecx & kCpuidXsave)) {
+        write_cr4(cr4);
+        mode = FpuFxsave;
+        components = 0x3;
+        state_size = kLegacySize;
+    } else {
+        write_cr4(cr4 | kCr4Osxsave);
+        CpuidResult leaf = cpuid(0xD, 0);
+        components = (((uint64_t)leaf.edx << 32) | leaf.eax) & kUserComponents;
+        uint32_t instructions = cpuid(0xD, 1).eax;
+        mode = instructions & kCpuidXsaves ? FpuXsaves : instructions & kCpuidXsaveopt ? FpuXsaveopt : FpuXsave;
+    }
+    enable();
+    if (mode != FpuFxsave) {
+        // Both sizes follow what is enabled, so they are read afterwards.
+        state_size = mode == FpuXsaves ? cpuid(0xD, 1).ebx : cpuid(0xD, 0).ebx;
+        for (unsigned i = 2; i < kComponents; ++i) {
+            if (components & (1ull << i)) {
+                component_size[i] = cpuid(0xD, i).eax;
+            }
+        }
+    }
+    kernel_avx2 = (components & kComponentAvx) && (cpuid(7).ebx & kCpuidAvx2);
+    static const char* const names[] = {"FXSAVE", "XSAVE", "XSAVEOPT", "XSAVES"};
+    kprintf("fpu: %s, components 0x%lx, %lu-byte areas\n", names[mode], components, state_size);
+}
+
+void fpu_init_ap() {
+    enable();
+}
+
+FpuSaveMode fpu_save_mode() {
+    return mode;
+}
+
+size_t fpu_state_size() {
+    return state_size;
+}
+
+FpuState* fpu_state_alloc() {
+    FpuState* state = (FpuState*)kmalloc(sizeof(FpuState) + kAreaAlign - 1 + state_size);
+    if (!state) {
+        return nullptr;
+    }
+    state->cpu = kNoCpu;
+    state->area = (uint8_t*)align_up((uintptr_t)(state + 1), kAreaAlign);
+    memset(state->area, 0, state_size);
+    // An all-clear XSTATE_BV loads every component in its initial state,
+    // but MXCSR always comes from the legacy region.
+    *(uint16_t*)(state->area + kFcwOffset) = kFcwDefault;
+    *(uint32_t*)(state->area + kMxcsrOffset) = kMxcsrDefault;
+    if (mode == FpuXsaves) {
+        *(uint64_t*)(state->area + kXcompBvOffset) = kXcompBvCompacted | components;
+    }
+    return state;
+}
+
+void fpu_state_free(FpuState* state) {
+    FpuCpu* cpu = fpu_cpus.get();
+    if (cpu->live == state) {
+        cpu->live = nullptr;
+    }
+    if (cpu->current == state) {
+        cpu->current = nullptr;
+    }
+    kfree(state);
+}
+
+static size_t saved_bytes(const FpuState* state) {
+    if (mode == FpuFxsave) {
+        return kLegacySize;
+    }
+    uint64_t present = *(const uint64_t*)(state->area + kXstateBvOffset);
+    size_t bytes = kLegacySize + kHeaderSize;
+    for (uint64_t rest = present & ~0x3ull; rest; rest &= rest - 1) {
+        bytes += component_size[__builtin_ctzll(rest)];
+    }
+    return bytes;
+}
+
+static void save(FpuState* state) {
+    switch (mode) {
+    case FpuFxsave:
+        fxsave(state->area);
+        break;
+    case FpuXsave:
+        xsave(state->area, components);
+        break;
+    case FpuXsaveopt:
+        xsaveopt(state->area, components);
+        break;
+    case FpuXsaves:
+        xsaves(state->area, components);
+        break;
+    }
+}
+
+static void restore(const FpuState* state) {
+    switch (mode) {
+    case FpuFxsave:
+        fxrstor(state->area);
+        break;
+    case FpuXsave:
+    case FpuXsaveopt:
+        xrstor(state->area, components);
+        break;
+    case FpuXsaves:
+        xrstors(state->area, components);
+        break;
+    }
+}
+
+static void save_live(FpuCpu* cpu) {
+    if (cpu->live && cpu->dirty) {
+        save(cpu->live);
+        cpu->dirty = false;
+        cpu->stats.saves++;
+        cpu->stats.bytes_saved += saved_bytes(cpu->live);
+    }
+}
+
+void fpu_switch(FpuState* next) {
+    FpuCpu* cpu = fpu_cpus.get();
+    // The registers keep their values, so `live` stays valid here for as
+    // long as nothing else is loaded.
+    save_live(cpu);
+    cpu->current = next;
+}
+
+void fpu_return_to_user() {
+    FpuCpu* cpu = fpu_cpus.get();
+    FpuState* state = cpu->current;
+    KASSERT(state);
+    unsigned index = this_cpu()->index;
+    // A state that was loaded on another CPU since may have changed there.
+    if (cpu->live == state && state->cpu == index) {
+        cpu->stats.restores_skipped++;
+    } else {
+        restore(state);
+        state->cpu = index;
+        cpu->live = state;
+        cpu->stats.restores++;
+    }
+    cpu->dirty = true;
+}
+
+bool fpu_kernel_avx2() {
+    return kernel_avx2;
+}
+
+void fpu_kernel_begin() {
+    FpuCpu* cpu = fpu_cpus.get();
+    KASSERT(!cpu->kernel);
+    cpu->kernel = true;
+    save_live(cpu);
+    // The registers are about to be overwritten.
+    cpu->live = nullptr;
+    // User code may have unmasked exceptions or changed the rounding.
+    write_mxcsr(kMxcsrDefault);
+    cpu->stats.kernel_regions++;
+}
+
+void fpu_kernel_end() {
+    // AVX2 code leaves the upper YMM halves dirty, which would slow down
+    // whatever SSE code runs next.
+    if (kernel_avx2) {
+        vzeroupper();
+    }
+    fpu_cpus.get()->kernel = false;
+}
+
+FpuStats fpu_stats() {
+    FpuStats total = {};
+    // Other CPUs keep counting meanwhile; the sum is only a snapshot.
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        const FpuStats* cpu = &fpu_cpus.get(percpu_cpu(index))->stats;
+        total.saves += __atomic_load_n(&cpu->saves, __ATOMIC_RELAXED);
+        total.bytes_saved += __atomic_load_n(&cpu->bytes_saved, __ATOMIC_RELAXED);
+        total.restores += __atomic_load_n(&cpu->restores, __ATOMIC_RELAXED);
+        total.restores_skipped += __atomic_load_n(&cpu->restores_skipped, __ATOMIC_RELAXED);
+        total.kernel_regions += __atomic_load_n(&cpu->kernel_regions, __ATOMIC_RELAXED);
+    }
+    return total;
+}
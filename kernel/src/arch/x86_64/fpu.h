@@ -0,0 +1,88 @@
+#ifndef ARCH_X86_64_FPU_H
+#define ARCH_X86_64_FPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+struct FpuStats {
+    // Saves of user state and the bytes of non-initial state they held, so
+    // that bytes_saved / saves is the cost of a switch.
+    uint64_t saves;
+    uint64_t bytes_saved;
+    // Returns to user mode that had to load the state, and those that found
+    // it still in the registers.
+    uint64_t restores;
+    uint64_t restores_skipped;
+    // KernelFpuGuard regions.
+    uint64_t kernel_regions;
+};
+
+enum FpuSaveMode {
+    // No XSAVE: x87 and SSE only.
+    FpuFxsave,
+    FpuXsave,
+    // Skips components that are unmodified since the last restore.
+    FpuXsaveopt,
+    // Like XSAVEOPT, into compacted areas that only hold enabled components.
+    FpuXsaves,
+};
+
+// A thread's x87, SSE, AVX and AVX-512 registers, as far as the CPU has
+// them.
+struct FpuState;
+
+// Enables the extended state the CPU has on the boot CPU and picks the
+// best save instruction. Application processors inherit CR4 and call
+// fpu_init_ap for the rest.
+void fpu_init();
+void fpu_init_ap();
+FpuSaveMode fpu_save_mode();
+// Bytes of one save area, from CPUID leaf 0xD for the enabled components.
+size_t fpu_state_size();
+// A state in its initial configuration, or null when memory is short.
+FpuState* fpu_state_alloc();
+void fpu_state_free(FpuState* state);
+
+// The kernel is built without SSE and only touches these registers inside
+// a KernelFpuGuard, so user state stays in them across kernel entries. It
+// is only saved when the CPU switches threads and only loaded when it
+// returns to user mode. A thread that ran no user code in between, or that
+// the CPU switches back to before anything else was loaded, costs nothing.
+//
+// Called with the state of the thread the calling CPU switches to.
+void fpu_switch(FpuState* next);
+// Called last on the way back to user mode.
+void fpu_return_to_user();
+FpuStats fpu_stats();
+
+// Whether code built with k_simd_cflags, in the *.avx2.cc files, can run:
+// the CPU has AVX2 and fpu_init enabled the AVX state.
+bool fpu_kernel_avx2();
+// Brackets kernel use of the vector registers; see KernelFpuGuard.
+void fpu_kernel_begin();
+void fpu_kernel_end();
+
+// Lets the kernel use the SSE and AVX registers while it lives. User state
+// still in them is saved first, unless it already was, and only loaded
+// back on the next return to user mode, so back-to-back regions pay for
+// one save. Interrupts stay disabled throughout, which keeps the thread on
+// its CPU; interrupt handlers never use the registers. Regions do not nest.
+class KernelFpuGuard {
+public:
+    KernelFpuGuard() : rflags_(irq_save()) {
+        fpu_kernel_begin();
+    }
+    ~KernelFpuGuard() {
+        fpu_kernel_end();
+        irq_restore(rflags_);
+    }
+    KernelFpuGuard(const KernelFpuGuard&) = delete;
+    KernelFpuGuard& operator=(const KernelFpuGuard&) = delete;
+
+private:
+    uint64_t rflags_;
+};
+
+#endif // ARCH_X86_64_FPU_H
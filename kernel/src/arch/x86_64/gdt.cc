@@ -0,0 +1,81 @@
+#include "gdt.h"
+
+#include "percpu.h"
+
+struct Tss {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+struct GdtPointer {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed));
+
+constexpr uint64_t kKernelCodeDescriptor = 0x00AF9A000000FFFF;
+constexpr uint64_t kKernelDataDescriptor = 0x00CF92000000FFFF;
+constexpr uint64_t kTssAvailable = 0x89;
+
+// Each CPU needs a TSS of its own, if only for its IST stacks, and so a
+// GDT with its own TSS descriptor, which ltr marks busy.
+struct CpuTables {
+    // Null, kernel code, kernel data and the two halves of the TSS
+    // descriptor.
+    uint64_t gdt[5];
+    Tss tss;
+};
+
+static PER_CPU PerCpu<CpuTables> tables;
+alignas(16) static uint8_t boot_ist_stacks[kIstStacks][kIstStackSize];
+
+static void load(uint8_t* ist_stacks) {
+    CpuTables* local = tables.get();
+    uint64_t* gdt = local->gdt;
+    Tss& tss = local->tss;
+    for (unsigned i = 0; i < kIstStacks; ++i) {
+        tss.ist[i] = (uint64_t)(ist_stacks + (i + 1) * kIstStackSize);
+    }
+    // No I/O permission bitmap: the offset points past the segment limit.
+    tss.iomap_base = sizeof(tss);
+
+    uint64_t base = (uint64_t)&tss;
+    uint64_t limit = sizeof(tss) - 1;
+    gdt[0] = 0;
+    gdt[kKernelCodeSelector / 8] = kKernelCodeDescriptor;
+    gdt[kKernelDataSelector / 8] = kKernelDataDescriptor;
+    gdt[kTssSelector / 8] = (limit & 0xFFFF) | (base & 0xFFFFFF) << 16 | kTssAvailable << 40 |
+                            ((limit >> 16) & 0xF) << 48 | ((base >> 24) & 0xFF) << 56;
+    gdt[kTssSelector / 8 + 1] = base >> 32;
+
+    GdtPointer pointer = {sizeof(CpuTables::gdt) - 1, (uint64_t)gdt};
+    asm volatile("lgdt %0" ::"m"(pointer));
+    // CS can only be reloaded by a far transfer. FS and GS are left alone:
+    // only their bases matter, which live in MSRs, and GS already points
+    // at the per-CPU area.
+    asm volatile(
+        "pushq %[code]\n"
+        "leaq 1f(%%rip), %%rax\n"
+        "pushq %%rax\n"
+        "lretq\n"
+        "1:\n"
+        "mov %[data], %%ds\n"
+        "mov %[data], %%es\n"
+        "mov %[data], %%ss\n"
+        :
+        : [code] "i"(kKernelCodeSelector), [data] "r"(kKernelDataSelector)
+        : "rax", "memory");
+    asm volatile("ltr %0" ::"r"(kTssSelector));
+}
+
+void gdt_init() {
+    load(&boot_ist_stacks[0][0]);
+}
+
+void gdt_init_ap(uint8_t* ist_stacks) {
+    load(ist_stacks);
+}
@@ -0,0 +1,28 @@
+#ifndef ARCH_X86_64_GDT_H
+#define ARCH_X86_64_GDT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+constexpr uint16_t kKernelCodeSelector = 0x08;
+constexpr uint16_t kKernelDataSelector = 0x10;
+constexpr uint16_t kTssSelector = 0x18;
+
+// Interrupt stack table slots. Exceptions that can arrive while the
+// current stack is unusable, or in the middle of code that is not
+// reentrant with respect to it, switch to a stack of their own.
+constexpr uint8_t kIstDoubleFault = 1;
+constexpr uint8_t kIstNmi = 2;
+constexpr uint8_t kIstMachineCheck = 3;
+constexpr unsigned kIstStacks = 3;
+constexpr size_t kIstStackSize = 16 * 1024;
+
+// Replaces the firmware's descriptor tables with the kernel's own flat
+// code and data segments and a task state segment holding the IST stacks.
+// The tables are per CPU, so this runs after percpu_init_boot.
+void gdt_init();
+// The same on an application processor, whose `ist_stacks` are kIstStacks
+// stacks of kIstStackSize, one after the other.
+void gdt_init_ap(uint8_t* ist_stacks);
+
+#endif // ARCH_X86_64_GDT_H
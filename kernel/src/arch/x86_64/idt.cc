@@ -0,0 +1,178 @@
+#include "idt.h"
+
+#include "../../lib/util.h"
+#include "../../panic.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "percpu.h"
+
+struct IdtEntry {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t ist;
+    uint8_t type_attr;
+    uint16_t offset_mid;
+    uint32_t offset_high;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct IdtPointer {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed));
+
+struct HandlerSlot {
+    InterruptHandler handler;
+    void* context;
+};
+
+// One CPU's counts. Each CPU only ever writes its own block, so the entry
+// path needs no atomics and shares no cache lines.
+struct InterruptCounters {
+    uint64_t count[kInterruptVectors];
+    uint64_t cycles[kInterruptVectors];
+    uint64_t histogram[kInterruptVectors][kInterruptHistogramBuckets];
+};
+
+constexpr uint8_t kInterruptGate = 0x8E;
+constexpr uintptr_t kStubSize = 16;
+
+static IdtEntry idt[kInterruptVectors];
+static HandlerSlot handlers[kInterruptVectors];
+static PER_CPU PerCpu<InterruptCounters> counters;
+
+static const char* const exception_names[kFirstExternalVector] = {
+    "divide error", "debug", "NMI", "breakpoint", "overflow", "bound range exceeded", "invalid opcode",
+    "device not available", "double fault", "coprocessor segment overrun", "invalid TSS", "segment not present",
+    "stack-segment fault", "general protection fault", "page fault", "reserved", "x87 floating-point error",
+    "alignment check", "machine check", "SIMD floating-point error", "virtualization exception",
+    "control protection exception", "reserved", "reserved", "reserved", "reserved", "reserved", "reserved",
+    "hypervisor injection exception", "VMM communication exception", "security exception", "reserved",
+};
+
+extern "C" char interrupt_stubs[];
+
+// One 16-byte stub per vector. Each pushes a zero error code where the CPU
+// does not push one, so that every vector arrives at interrupt_common with
+// the same frame layout, then pushes its vector number. The common path
+// saves only the caller-saved registers: the C dispatcher preserves the
+// rest itself.
+asm(R"(
+    .text
+    .balign 16
+    .global interrupt_stubs
+interrupt_stubs:
+    .set vector, 0
+    .rept 256
+    .balign 16
+    .if vector < 32
+    .if ((0x60227D00 >> vector) & 1) == 0
+    pushq $0
+    .endif
+    .else
+    pushq $0
+    .endif
+    pushq $vector
+    jmp interrupt_common
+    .set vector, vector + 1
+    .endr
+
+interrupt_common:
+    push %rax
+    push %rcx
+    push %rdx
+    push %rsi
+    push %rdi
+    push %r8
+    push %r9
+    push %r10
+    push %r11
+    mov %rsp, %rdi
+    cld
+    call interrupt_dispatch
+    pop %r11
+    pop %r10
+    pop %r9
+    pop %r8
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %rcx
+    pop %rax
+    add $16, %rsp
+    iretq
+)");
+
+static unsigned histogram_bucket(uint64_t cycles) {
+    if (cycles >> kInterruptHistogramShift == 0) {
+        return 0;
+    }
+    return min(ilog2(cycles) - kInterruptHistogramShift, kInterruptHistogramBuckets - 1);
+}
+
+extern "C" void interrupt_dispatch(InterruptFrame* frame) {
+    uint64_t start = rdtsc();
+    unsigned vector = frame->vector;
+    const HandlerSlot& slot = handlers[vector];
+    InterruptHandler handler = __atomic_load_n(&slot.handler, __ATOMIC_ACQUIRE);
+    if (handler) {
+        handler(frame, slot.context);
+    } else if (vector < kFirstExternalVector && vector != kVectorNmi) {
+        panic("unhandled %s (vector %u, error 0x%lx, rip 0x%lx)", exception_names[vector], vector,
+              frame->error_code, frame->rip);
+    }
+    uint64_t cycles = rdtsc() - start;
+    InterruptCounters* local = counters.get();
+    local->count[vector]++;
+    local->cycles[vector] += cycles;
+    local->histogram[vector][histogram_bucket(cycles)]++;
+}
+
+static void set_gate(unsigned vector, uintptr_t stub, uint8_t ist) {
+    IdtEntry& entry = idt[vector];
+    entry.offset_low = stub & 0xFFFF;
+    entry.selector = kKernelCodeSelector;
+    entry.ist = ist;
+    entry.type_attr = kInterruptGate;
+    entry.offset_mid = (stub >> 16) & 0xFFFF;
+    entry.offset_high = stub >> 32;
+    entry.reserved = 0;
+}
+
+void idt_init() {
+    for (unsigned vector = 0; vector < kInterruptVectors; ++vector) {
+        set_gate(vector, (uintptr_t)interrupt_stubs + vector * kStubSize, 0);
+    }
+    idt[kVectorNmi].ist = kIstNmi;
+    idt[kVectorDoubleFault].ist = kIstDoubleFault;
+    idt[kVectorMachineCheck].ist = kIstMachineCheck;
+    idt_load();
+}
+
+void idt_load() {
+    IdtPointer pointer = {sizeof(idt) - 1, (uint64_t)idt};
+    asm volatile("lidt %0" ::"m"(pointer));
+}
+
+void interrupt_register(uint8_t vector, InterruptHandler handler, void* context) {
+    handlers[vector].context = context;
+    __atomic_store_n(&handlers[vector].handler, handler, __ATOMIC_RELEASE);
+}
+
+void interrupt_unregister(uint8_t vector) {
+    __atomic_store_n(&handlers[vector].handler, (InterruptHandler) nullptr, __ATOMIC_RELEASE);
+}
+
+InterruptStats interrupt_stats(uint8_t vector) {
+    InterruptStats stats = {};
+    // Other CPUs keep counting meanwhile; the sum is only a snapshot.
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        const InterruptCounters* cpu = counters.get(percpu_cpu(index));
+        stats.count += __atomic_load_n(&cpu->count[vector], __ATOMIC_RELAXED);
+        stats.cycles += __atomic_load_n(&cpu->cycles[vector], __ATOMIC_RELAXED);
+        for (unsigned i = 0; i < kInterruptHistogramBuckets; ++i) {
+            stats.histogram[i] += __atomic_load_n(&cpu->histogram[vector][i], __ATOMIC_RELAXED);
+        }
+    }
+    return stats;
+}
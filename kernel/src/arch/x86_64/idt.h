@@ -0,0 +1,51 @@
+#ifndef ARCH_X86_64_IDT_H
+#define ARCH_X86_64_IDT_H
+
+#include <stdint.h>
+
+constexpr unsigned kInterruptVectors = 256;
+constexpr uint8_t kVectorNmi = 2;
+constexpr uint8_t kVectorDoubleFault = 8;
+constexpr uint8_t kVectorPageFault = 14;
+constexpr uint8_t kVectorMachineCheck = 18;
+// Vectors below this one are reserved for CPU exceptions.
+constexpr uint8_t kFirstExternalVector = 32;
+
+// Register state saved by the entry stubs, lowest address first. Only the
+// registers a C function may clobber are saved; handlers that need the
+// callee-saved ones must not be written in C.
+struct InterruptFrame {
+    uint64_t r11, r10, r9, r8, rdi, rsi, rdx, rcx, rax;
+    uint64_t vector;
+    // Zero for vectors where the CPU does not push one.
+    uint64_t error_code;
+    uint64_t rip, cs, rflags, rsp, ss;
+};
+
+// Runs with interrupts disabled, on the interrupted stack or the vector's
+// IST stack.
+using InterruptHandler = void (*)(InterruptFrame* frame, void* context);
+
+// Handling time is bucketed by powers of two: bucket i counts entries
+// that took [2^(i + shift), 2^(i + shift + 1)) cycles, with the first and
+// last buckets also taking everything below and above.
+constexpr unsigned kInterruptHistogramBuckets = 16;
+constexpr unsigned kInterruptHistogramShift = 6;
+
+struct InterruptStats {
+    uint64_t count;
+    uint64_t cycles;
+    uint64_t histogram[kInterruptHistogramBuckets];
+};
+
+// Loads the IDT with an entry stub for every vector. Exceptions without a
+// registered handler panic; other vectors without one are only counted.
+void idt_init();
+// Loads the table idt_init built on an application processor.
+void idt_load();
+void interrupt_register(uint8_t vector, InterruptHandler handler, void* context = nullptr);
+void interrupt_unregister(uint8_t vector);
+// Counts for one vector, summed over every CPU.
+InterruptStats interrupt_stats(uint8_t vector);
+
+#endif // ARCH_X86_64_IDT_H
@@ -0,0 +1,288 @@
+#include "lapic.h"
+
+#include "../../lib/util.h"
+#include "../../log.h"
+#include "../../mm/layout.h"
+#include "../../mm/vmalloc.h"
+#include "../../panic.h"
+#include "cpu.h"
+#include "idt.h"
+#include "percpu.h"
+
+constexpr uint32_t kMsrApicBase = 0x1B;
+constexpr uint64_t kApicBaseExtended = 1ull << 10;
+constexpr uint64_t kApicBaseEnable = 1ull << 11;
+constexpr uint64_t kApicBaseAddressMask = 0x000FFFFFFFFFF000;
+constexpr uint32_t kMsrX2apicBase = 0x800;
+constexpr uint32_t kMsrTscDeadline = 0x6E0;
+
+constexpr uint32_t kCpuidX2apic = 1u << 21;
+constexpr uint32_t kCpuidTscDeadline = 1u << 24;
+
+// Register offsets in the xAPIC page; x2APIC MSRs are 0x800 + offset / 16.
+constexpr uint32_t kRegId = 0x20;
+constexpr uint32_t kRegTpr = 0x80;
+constexpr uint32_t kRegEoi = 0xB0;
+constexpr uint32_t kRegSpurious = 0xF0;
+constexpr uint32_t kRegIcr = 0x300;
+constexpr uint32_t kRegIcrHigh = 0x310;
+constexpr uint32_t kRegLvtTimer = 0x320;
+constexpr uint32_t kRegTimerInitial = 0x380;
+constexpr uint32_t kRegTimerCurrent = 0x390;
+constexpr uint32_t kRegTimerDivide = 0x3E0;
+
+constexpr uint32_t kSpuriousEnable = 1u << 8;
+constexpr uint32_t kLvtMasked = 1u << 16;
+constexpr uint32_t kLvtTscDeadline = 2u << 17;
+constexpr uint32_t kTimerDivideBy1 = 0xB;
+constexpr uint32_t kIcrPending = 1u << 12;
+
+// How long the one-shot timer is measured against the TSC at boot.
+constexpr uint64_t kCalibrationCycles = 1ull << 24;
+
+static bool x2apic;
+static volatile uint32_t* mmio;
+static LapicTimerMode timer_mode;
+// Timer ticks per TSC cycle, as a 32.32 fixed-point ratio, and the largest
+// TSC delta the conversion can take without overflowing.
+static uint64_t ticks_per_cycle;
+static uint64_t max_delta;
+// The deadline this CPU's timer is armed for, or 0.
+static PER_CPU PerCpu<uint64_t> armed;
+static void (*timer_handler)();
+
+static uint32_t read_reg(uint32_t offset) {
+    if (x2apic) {
+        return read_msr(kMsrX2apicBase + offset / 16);
+    }
+    return mmio[offset / 4];
+}
+
+static void write_reg(uint32_t offset, uint32_t value) {
+    if (x2apic) {
+        write_msr(kMsrX2apicBase + offset / 16, value);
+    } else {
+        mmio[offset / 4] = value;
+    }
+}
+
+// The 8259s are unused, but until masked they can still raise IRQs on
+// vectors that overlap the exceptions. Move them clear of those first.
+static void disable_pic() {
+    outb(0x20, 0x11);
+    outb(0xA0, 0x11);
+    outb(0x21, kFirstExternalVector);
+    outb(0xA1, kFirstExternalVector + 8);
+    outb(0x21, 0x04);
+    outb(0xA1, 0x02);
+    outb(0x21, 0x01);
+    outb(0xA1, 0x01);
+    outb(0x21, 0xFF);
+    outb(0xA1, 0xFF);
+}
+
+static void calibrate_one_shot() {
+    write_reg(kRegTimerDivide, kTimerDivideBy1);
+    write_reg(kRegLvtTimer, kLvtMasked | kVectorLapicTimer);
+    write_reg(kRegTimerInitial, UINT32_MAX);
+    uint64_t start = rdtsc();
+    uint64_t elapsed;
+    while ((elapsed = rdtsc() - start) < kCalibrationCycles) {
+        cpu_pause();
+    }
+    uint64_t ticks = UINT32_MAX - read_reg(kRegTimerCurrent);
+    write_reg(kRegTimerInitial, 0);
+    ticks_per_cycle = max<uint64_t>((ticks << 32) / elapsed, 1);
+    max_delta = UINT64_MAX / ticks_per_cycle;
+}
+
+static void timer_interrupt(InterruptFrame*, void*) {
+    *armed.get() = 0;
+    lapic_eoi();
+    if (timer_handler) {
+        timer_handler();
+    }
+}
+
+// Enables the calling CPU's local APIC in the mode the boot CPU picked.
+static void enable(uint64_t base) {
+    if (x2apic) {
+        // Valid from both the disabled and the xAPIC state.
+        write_msr(kMsrApicBase, base | kApicBaseEnable | kApicBaseExtended);
+    } else {
+        write_msr(kMsrApicBase, base | kApicBaseEnable);
+    }
+    write_reg(kRegTpr, 0);
+    write_reg(kRegSpurious, kSpuriousEnable | kVectorSpurious);
+}
+
+static void enable_timer() {
+    if (timer_mode == LapicTimerTscDeadline) {
+        write_reg(kRegLvtTimer, kLvtTscDeadline | kVectorLapicTimer);
+        // Orders the mode switch before the first deadline write.
+        asm volatile("mfence" ::: "memory");
+    } else {
+        write_reg(kRegTimerDivide, kTimerDivideBy1);
+        write_reg(kRegLvtTimer, kVectorLapicTimer);
+    }
+}
+
+void lapic_init() {
+    disable_pic();
+    uint64_t base = read_msr(kMsrApicBase);
+    CpuidResult features = cpuid(1);
+    x2apic = features.ecx & kCpuidX2apic;
+    if (!x2apic) {
+        mmio = (volatile uint32_t*)ioremap(base & kApicBaseAddressMask, kPageSize);
+        if (!mmio) {
+            panic("lapic: cannot map registers");
+        }
+    }
+    enable(base);
+    interrupt_register(kVectorLapicTimer, timer_interrupt);
+
+    if (features.ecx & kCpuidTscDeadline) {
+        timer_mode = LapicTimerTscDeadline;
+    } else {
+        timer_mode = LapicTimerOneShot;
+        calibrate_one_shot();
+    }
+    enable_timer();
+    this_cpu()->apic_id = lapic_id();
+    kprintf("lapic: id %u, %s, %s timer\n", lapic_id(), x2apic ? "x2APIC" : "xAPIC",
+            timer_mode == LapicTimerTscDeadline ? "TSC-deadline" : "one-shot");
+}
+
+void lapic_init_ap() {
+    // Every local APIC sits at the same address, so the boot CPU's mapping
+    // serves them all.
+    enable(read_msr(kMsrApicBase));
+    enable_timer();
+}
+
+uint32_t lapic_id() {
+    uint32_t id = read_reg(kRegId);
+    return x2apic ? id : id >> 24;
+}
+
+void lapic_eoi() {
+    write_reg(kRegEoi, 0);
+}
+
+bool lapic_is_x2apic() {
+    return x2apic;
+}
+
+LapicTimerMode lapic_timer_mode() {
+    return timer_mode;
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t command) {
+    if (x2apic) {
+        // WRMSR to the x2APIC does not wait for earlier stores, which the
+        // target may need to see.
+        asm volatile("mfence" ::: "memory");
+        write_msr(kMsrX2apicBase + kRegIcr / 16, (uint64_t)apic_id << 32 | command);
+        return;
+    }
+    write_reg(kRegIcrHigh, apic_id << 24);
+    write_reg(kRegIcr, command);
+    while (read_reg(kRegIcr) & kIcrPending) {
+        cpu_pause();
+    }
+}
+
+static void send_logical(uint32_t destination, uint32_t command) {
+    asm volatile("mfence" ::: "memory");
+    write_msr(kMsrX2apicBase + kRegIcr / 16, (uint64_t)destination << 32 | kIpiLogical | command);
+}
+
+void lapic_send_ipi_mask(const CpuMask& cpus, uint32_t command) {
+    unsigned self = this_cpu()->index;
+    unsigned count = percpu_count();
+    unsigned targets = 0;
+    for (unsigned index = 0; index < count; ++index) {
+        targets += index != self && cpus.test(index);
+    }
+    if (targets == 0) {
+        return;
+    }
+    if (targets == count - 1) {
+        // CPUs that never came up ignore it: they sit in the trampoline
+        // with interrupts disabled, or still wait for a startup IPI.
+        if (x2apic) {
+            asm volatile("mfence" ::: "memory");
+            write_msr(kMsrX2apicBase + kRegIcr / 16, kIpiAllButSelf | command);
+            return;
+        }
+        write_reg(kRegIcr, kIpiAllButSelf | command);
+        while (read_reg(kRegIcr) & kIcrPending) {
+            cpu_pause();
+        }
+        return;
+    }
+    if (!x2apic) {
+        for (unsigned index = 0; index < count; ++index) {
+            if (index != self && cpus.test(index)) {
+                lapic_send_ipi(percpu_cpu(index)->apic_id, command);
+            }
+        }
+        return;
+    }
+    // An x2APIC's logical ID is its cluster, the APIC ID over 16, in the
+    // high half and one bit for its place in the cluster in the low half.
+    // CPUs register roughly in APIC ID order, so runs of one cluster are
+    // gathered into one IPI; a cluster seen twice only costs a second one.
+    uint32_t cluster = UINT32_MAX;
+    uint32_t members = 0;
+    for (unsigned index = 0; index < count; ++index) {
+        if (index == self || !cpus.test(index)) {
+            continue;
+        }
+        uint32_t apic_id = percpu_cpu(index)->apic_id;
+        if (apic_id >> 4 != cluster) {
+            if (members) {
+                send_logical(cluster << 16 | members, command);
+            }
+            cluster = apic_id >> 4;
+            members = 0;
+        }
+        members |= 1u << (apic_id & 15);
+    }
+    send_logical(cluster << 16 | members, command);
+}
+
+void lapic_timer_arm(uint64_t deadline) {
+    deadline = max<uint64_t>(deadline, 1);
+    uint64_t* local = armed.get();
+    if (deadline == *local) {
+        return;
+    }
+    *local = deadline;
+    if (timer_mode == LapicTimerTscDeadline) {
+        write_msr(kMsrTscDeadline, deadline);
+        return;
+    }
+    uint64_t now = rdtsc();
+    uint64_t delta = deadline > now ? deadline - now : 0;
+    uint64_t ticks = delta < max_delta ? (delta * ticks_per_cycle) >> 32 : UINT32_MAX;
+    // A zero count would stop the timer rather than fire it.
+    write_reg(kRegTimerInitial, max<uint64_t>(min<uint64_t>(ticks, UINT32_MAX), 1));
+}
+
+void lapic_timer_disarm() {
+    uint64_t* local = armed.get();
+    if (!*local) {
+        return;
+    }
+    *local = 0;
+    if (timer_mode == LapicTimerTscDeadline) {
+        write_msr(kMsrTscDeadline, 0);
+    } else {
+        write_reg(kRegTimerInitial, 0);
+    }
+}
+
+void lapic_timer_set_handler(void (*handler)()) {
+    timer_handler = handler;
+}
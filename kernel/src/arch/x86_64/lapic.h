@@ -0,0 +1,55 @@
+#ifndef ARCH_X86_64_LAPIC_H
+#define ARCH_X86_64_LAPIC_H
+
+#include <stdint.h>
+
+#include "percpu.h"
+
+constexpr uint8_t kVectorLapicTimer = 0xEF;
+constexpr uint8_t kVectorTlbShootdown = 0xFD;
+constexpr uint8_t kVectorSpurious = 0xFF;
+
+// Interrupt command bits: delivery mode, destination mode, level and
+// destination shorthand.
+constexpr uint32_t kIpiFixed = 0x000;
+constexpr uint32_t kIpiInit = 0x500;
+constexpr uint32_t kIpiStartup = 0x600;
+constexpr uint32_t kIpiLogical = 1u << 11;
+constexpr uint32_t kIpiAssert = 1u << 14;
+constexpr uint32_t kIpiAllButSelf = 3u << 18;
+
+enum LapicTimerMode {
+    LapicTimerTscDeadline,
+    // One-shot countdown, with TSC deadlines converted to bus ticks through
+    // a ratio measured at boot.
+    LapicTimerOneShot,
+};
+
+// Enables the boot CPU's local APIC, in x2APIC mode when the CPU supports
+// it so that every register access is an MSR rather than MMIO, and masks
+// the legacy PICs.
+void lapic_init();
+// Enables an application processor's local APIC and timer the same way.
+void lapic_init_ap();
+uint32_t lapic_id();
+void lapic_eoi();
+bool lapic_is_x2apic();
+LapicTimerMode lapic_timer_mode();
+// Sends an interrupt command (kIpi* flags, plus the vector for fixed and
+// startup IPIs) to the CPU with `apic_id`, returning once it is sent.
+void lapic_send_ipi(uint32_t apic_id, uint32_t command);
+// Sends a fixed-delivery `command` to every registered CPU in `cpus` but
+// the caller. A set of all the others takes one broadcast; otherwise
+// x2APIC mode takes one logical IPI per cluster of 16 CPUs, and xAPIC
+// mode one IPI per CPU.
+void lapic_send_ipi_mask(const CpuMask& cpus, uint32_t command);
+
+// The timer is one-shot only; there is no periodic tick. Arming it for a
+// TSC value that has already passed fires it at once. A deadline beyond
+// the countdown's range fires early and must be re-armed.
+void lapic_timer_arm(uint64_t deadline);
+void lapic_timer_disarm();
+// Called from the timer interrupt after EOI, with the timer disarmed.
+void lapic_timer_set_handler(void (*handler)());
+
+#endif // ARCH_X86_64_LAPIC_H
@@ -0,0 +1,72 @@
+#include "percpu.h"
+
+#include "../../lib/string.h"
+#include "../../lib/util.h"
+#include "../../mm/frame.h"
+#include "../../panic.h"
+#include "../../sync/spinlock.h"
+
+// Room for the boot CPU's area. The template is checked against it.
+constexpr size_t kBootAreaSize = 64 * 1024;
+
+alignas(64) static uint8_t boot_area[kBootAreaSize];
+static Spinlock register_lock;
+static Cpu* cpus[kMaxCpus];
+static unsigned cpu_count = 0;
+
+static size_t area_size() {
+    return sizeof(Cpu) + (__stop_percpu - __start_percpu);
+}
+
+static Cpu* setup_area(void* area, uint32_t apic_id, unsigned node) {
+    Cpu* cpu = (Cpu*)area;
+    memset(cpu, 0, sizeof(Cpu));
+    memcpy(cpu + 1, __start_percpu, __stop_percpu - __start_percpu);
+    cpu->self = cpu;
+    cpu->apic_id = apic_id;
+    cpu->node = node;
+    return cpu;
+}
+
+void percpu_init_boot() {
+    if (area_size() > kBootAreaSize) {
+        panic("percpu: %lu bytes of per-CPU data, room for %lu", area_size(), kBootAreaSize);
+    }
+    // The APIC ID is filled in once the local APIC is up, the node by
+    // numa_init.
+    Cpu* cpu = setup_area(boot_area, 0, 0);
+    percpu_load(cpu);
+    percpu_register(cpu);
+}
+
+Cpu* percpu_alloc(uint32_t apic_id, unsigned node) {
+    if (percpu_count() == kMaxCpus) {
+        return nullptr;
+    }
+    unsigned order = ilog2(div_round_up(area_size(), kFrameSize) * 2 - 1);
+    Frame* frame = frame_alloc_node(order, 0, node);
+    return frame ? setup_area(frame_to_virt(frame), apic_id, node) : nullptr;
+}
+
+void percpu_load(Cpu* cpu) {
+    write_msr(kMsrGsBase, (uint64_t)cpu);
+}
+
+void percpu_register(Cpu* cpu) {
+    LockGuard<Spinlock> guard(register_lock);
+    if (cpu_count == kMaxCpus) {
+        panic("percpu: more than %u CPUs", kMaxCpus);
+    }
+    cpu->index = cpu_count;
+    cpus[cpu_count] = cpu;
+    // Readers take the count first, so the slot is filled before it grows.
+    __atomic_store_n(&cpu_count, cpu_count + 1, __ATOMIC_RELEASE);
+}
+
+unsigned percpu_count() {
+    return __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+}
+
+Cpu* percpu_cpu(unsigned index) {
+    return cpus[index];
+}
@@ -0,0 +1,106 @@
+#ifndef ARCH_X86_64_PERCPU_H
+#define ARCH_X86_64_PERCPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+constexpr unsigned kMaxCpus = 256;
+
+// The head of a CPU's per-CPU area, which the CPU's GS base points at. The
+// instances of every PER_CPU variable follow it, laid out as in the
+// template the linker gathers into the `percpu` section.
+struct alignas(64) Cpu {
+    // Lets this_cpu() find the area with one GS-relative load.
+    Cpu* self;
+    // Dense, in the order CPUs registered; the boot CPU is 0.
+    unsigned index;
+    uint32_t apic_id;
+    // NUMA node, which local allocations come from.
+    unsigned node;
+    // Kernel stack and IST stacks, which the boot CPU has statically.
+    uint8_t* stack;
+    uint8_t* ist_stacks;
+    // Bring-up timeline: the clock_ns() times at which the CPU entered the
+    // kernel and finished initialising. Zero for the boot CPU.
+    uint64_t start_ns;
+    uint64_t online_ns;
+};
+
+// A set of CPUs by index, which CPUs can add themselves to and remove
+// themselves from concurrently.
+struct CpuMask {
+    uint64_t bits[kMaxCpus / 64] = {};
+
+    void set(unsigned index) {
+        __atomic_fetch_or(&bits[index / 64], 1ull << (index % 64), __ATOMIC_SEQ_CST);
+    }
+    void clear(unsigned index) {
+        __atomic_fetch_and(&bits[index / 64], ~(1ull << (index % 64)), __ATOMIC_SEQ_CST);
+    }
+    bool test(unsigned index) const {
+        return __atomic_load_n(&bits[index / 64], __ATOMIC_RELAXED) >> (index % 64) & 1;
+    }
+    bool empty() const {
+        for (unsigned i = 0; i < kMaxCpus / 64; ++i) {
+            if (__atomic_load_n(&bits[i], __ATOMIC_RELAXED)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Places a PerCpu variable in the template section. Variables without it
+// would compute offsets outside the area.
+#define PER_CPU __attribute__((section("percpu")))
+
+extern "C" char __start_percpu[];
+extern "C" char __stop_percpu[];
+
+inline Cpu* this_cpu() {
+    return (Cpu*)read_gs_pointer();
+}
+
+// A variable with one instance per CPU, declared `static PER_CPU
+// PerCpu<T> name;`. The object in the section is only the template each
+// area is copied from when its CPU comes up, so T must be trivially
+// copyable. Accessing this CPU's instance costs a GS load and an add: the
+// offset into the area is a link-time constant, and code stays on the CPU
+// it runs on.
+template <typename T>
+class PerCpu {
+public:
+    constexpr PerCpu() = default;
+    constexpr explicit PerCpu(const T& value) : value_(value) {}
+    PerCpu(const PerCpu&) = delete;
+    PerCpu& operator=(const PerCpu&) = delete;
+
+    T* get() {
+        return get(this_cpu());
+    }
+    T* get(const Cpu* cpu) {
+        uintptr_t offset = (uintptr_t)&value_ - (uintptr_t)__start_percpu;
+        return (T*)((uintptr_t)(cpu + 1) + offset);
+    }
+
+private:
+    T value_ = {};
+};
+
+// Sets up the boot CPU's area, which is static since nothing can be
+// allocated yet, and points GS at it. Runs before anything touches
+// per-CPU data, which includes taking an exception.
+void percpu_init_boot();
+// A new area for a CPU that is about to come up, on `node`, or null when
+// memory is short or kMaxCpus CPUs are registered.
+Cpu* percpu_alloc(uint32_t apic_id, unsigned node);
+// Points the calling CPU's GS base at `cpu`.
+void percpu_load(Cpu* cpu);
+// Gives `cpu` the next index, after which it is counted by percpu_count.
+void percpu_register(Cpu* cpu);
+unsigned percpu_count();
+Cpu* percpu_cpu(unsigned index);
+
+#endif // ARCH_X86_64_PERCPU_H
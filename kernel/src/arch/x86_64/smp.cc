@@ -0,0 +1,464 @@
+#include "smp.h"
+
+#include "../../acpi/acpi.h"
+#include "../../lib/string.h"
+#include "../../lib/util.h"
+#include "../../log.h"
+#include "../../mm/frame.h"
+#include "../../mm/numa.h"
+#include "../../mm/prezero.h"
+#include "../../mm/tlb.h"
+#include "../../mm/vmm.h"
+#include "../../panic.h"
+#include "../../time/clock.h"
+#include "../../time/timer.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "lapic.h"
+#include "percpu.h"
+
+enum MadtEntryType : uint8_t {
+    MadtLocalApic = 0,
+    MadtLocalX2apic = 9,
+};
+
+constexpr uint32_t kMadtEnabled = 1u << 0;
+
+struct [[gnu::packed]] MadtEntry {
+    uint8_t type;
+    uint8_t length;
+};
+
+struct [[gnu::packed]] MadtLocalApicEntry {
+    MadtEntry header;
+    uint8_t processor;
+    uint8_t apic_id;
+    uint32_t flags;
+};
+
+struct [[gnu::packed]] MadtLocalX2apicEntry {
+    MadtEntry header;
+    uint16_t reserved;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t processor;
+};
+
+// The MADT header is followed by the local APIC address and flags.
+constexpr size_t kMadtEntriesOffset = sizeof(AcpiHeader) + 8;
+
+// A CPU being started, which finds its entry by APIC ID. The trampoline
+// reads these at fixed offsets.
+struct TrampolineCpu {
+    uint32_t apic_id;
+    uint64_t stack;
+    Cpu* cpu;
+};
+
+static_assert(offsetof(TrampolineCpu, stack) == 8 && offsetof(TrampolineCpu, cpu) == 16 &&
+              sizeof(TrampolineCpu) == 24);
+
+// The patchable tail of the trampoline below; the layouts must match.
+struct [[gnu::packed]] TrampolineData {
+    // Null, 32-bit code, data and 64-bit code.
+    uint64_t gdt[4];
+    uint64_t cpus;
+    uint64_t cpu_count;
+    uint64_t entry;
+    uint32_t cr3;
+    // The boot CPU's EFER, low half, minus the LMA bit the CPU sets itself.
+    uint32_t efer;
+    // Far pointers and the GDT pointer start out holding offsets into the
+    // trampoline, which the physical base is added to.
+    uint32_t far32;
+    uint16_t far32_selector;
+    uint32_t far64;
+    uint16_t far64_selector;
+    uint16_t gdt_limit;
+    uint32_t gdt_base;
+};
+
+// A startup IPI names a page below 1 MiB to start in. The trampoline's
+// page tables need only sit below 4 GiB, since it loads CR3 in 32-bit
+// mode.
+constexpr uint64_t kStartupLimit = 1ull << 20;
+constexpr uint64_t kTablesLimit = 1ull << 32;
+constexpr unsigned kTrampolineTables = 3;
+constexpr uint32_t kMsrEfer = 0xC0000080;
+constexpr uint64_t kEferLma = 1ull << 10;
+
+constexpr unsigned kStackOrder = 2;
+constexpr unsigned kIstOrder = 4;
+static_assert((kFrameSize << kIstOrder) >= kIstStacks * kIstStackSize);
+
+// The INIT-SIPI-SIPI sequence: 10 ms after INIT, then 200 us between the
+// two startup IPIs. Every CPU goes through it at once, so the delays are
+// paid once however many there are. A CPU that has not started well after
+// the second IPI is given up on, as is one that started but never
+// finished initialising.
+constexpr uint64_t kInitDelayNs = 10000000;
+constexpr uint64_t kStartupDelayNs = 200000;
+constexpr uint64_t kStartTimeoutNs = 100000000;
+constexpr uint64_t kOnlineTimeoutNs = 1000000000;
+
+extern "C" const char smp_trampoline[];
+extern "C" const char smp_trampoline_data[];
+extern "C" const char smp_trampoline_end[];
+extern "C" [[noreturn]] void smp_ap_entry(Cpu* cpu);
+
+// Copied to a page below 1 MiB, where an application processor starts in
+// real mode with CS at the page. It switches to protected mode and then
+// long mode on page tables that identity map the first 2 MiB next to the
+// kernel's half, looks its APIC ID up among the CPUs being started and
+// calls smp_ap_entry on the stack found there. Until paging is on, EBX
+// holds the physical base. The data at the end is patched once; all CPUs
+// run through the trampoline at the same time and only read it.
+asm(R"(
+    .pushsection .rodata.smp_trampoline, "a"
+    .global smp_trampoline
+    .global smp_trampoline_data
+    .global smp_trampoline_end
+    .balign 16
+    .code16
+smp_trampoline:
+trampoline_start:
+    cli
+    cld
+    mov %cs, %ax
+    mov %ax, %ds
+    xor %ebx, %ebx
+    mov %ax, %bx
+    shl $4, %ebx
+    lgdtl trampoline_gdt_pointer - trampoline_start
+    mov %cr0, %eax
+    or $1, %eax
+    mov %eax, %cr0
+    ljmpl *trampoline_far32 - trampoline_start
+
+    .code32
+trampoline_32:
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %ss
+    # CR4.PAE, then the boot CPU's EFER, which sets LME and NXE where the
+    # kernel's page tables use it, then CR0.PG, WP, NE, ET, MP and PE with
+    # caching enabled.
+    mov %cr4, %eax
+    or $0x20, %eax
+    mov %eax, %cr4
+    mov (trampoline_cr3 - trampoline_start)(%ebx), %eax
+    mov %eax, %cr3
+    mov $0xC0000080, %ecx
+    mov (trampoline_efer - trampoline_start)(%ebx), %eax
+    xor %edx, %edx
+    wrmsr
+    mov $0x80010033, %eax
+    mov %eax, %cr0
+    ljmpl *(trampoline_far64 - trampoline_start)(%ebx)
+
+    .code64
+trampoline_64:
+    # The x2APIC ID from CPUID leaf 0xB where there is one, as in
+    # numa.cc, else the initial APIC ID from leaf 1.
+    xor %eax, %eax
+    cpuid
+    cmp $0xB, %eax
+    jb 1f
+    mov $0xB, %eax
+    xor %ecx, %ecx
+    cpuid
+    mov %edx, %esi
+    test %ebx, %ebx
+    jnz 2f
+1:
+    mov $1, %eax
+    cpuid
+    shr $24, %ebx
+    mov %ebx, %esi
+2:
+    mov trampoline_cpus(%rip), %rdi
+    mov trampoline_cpu_count(%rip), %rcx
+3:
+    test %rcx, %rcx
+    jz 5f
+    cmp (%rdi), %esi
+    je 4f
+    add $24, %rdi
+    dec %rcx
+    jmp 3b
+4:
+    mov 8(%rdi), %rsp
+    mov 16(%rdi), %rdi
+    call *trampoline_entry(%rip)
+    # A CPU that was not asked to start has nowhere to go.
+5:
+    cli
+    hlt
+    jmp 5b
+
+    .balign 8
+smp_trampoline_data:
+trampoline_gdt:
+    .quad 0
+    .quad 0x00CF9A000000FFFF
+    .quad 0x00CF92000000FFFF
+    .quad 0x00AF9A000000FFFF
+trampoline_cpus:
+    .quad 0
+trampoline_cpu_count:
+    .quad 0
+trampoline_entry:
+    .quad 0
+trampoline_cr3:
+    .long 0
+trampoline_efer:
+    .long 0
+trampoline_far32:
+    .long trampoline_32 - trampoline_start
+    .word 0x08
+trampoline_far64:
+    .long trampoline_64 - trampoline_start
+    .word 0x18
+trampoline_gdt_pointer:
+    .word 4 * 8 - 1
+    .long trampoline_gdt - trampoline_start
+smp_trampoline_end:
+    .popsection
+)");
+
+static uint64_t trampoline_phys;
+// PML4, PDPT and page directory.
+static uint64_t trampoline_tables[kTrampolineTables];
+static uint64_t boot_cr4;
+// Every enabled CPU the MADT lists, the boot CPU included.
+static uint32_t listed_ids[kMaxCpus];
+static TrampolineCpu trampoline_cpus[kMaxCpus];
+
+void smp_reserve_trampoline() {
+    trampoline_phys = frame_reserve_low(kStartupLimit);
+    for (uint64_t& table : trampoline_tables) {
+        table = frame_reserve_low(kTablesLimit);
+        if (!table) {
+            trampoline_phys = 0;
+        }
+    }
+}
+
+static TrampolineData* prepare_trampoline() {
+    KASSERT(smp_trampoline_end - smp_trampoline <= (ptrdiff_t)kPageSize);
+    uint8_t* code = (uint8_t*)phys_to_virt(trampoline_phys);
+    memcpy(code, smp_trampoline, smp_trampoline_end - smp_trampoline);
+    TrampolineData* data = (TrampolineData*)(code + (smp_trampoline_data - smp_trampoline));
+    data->far32 += trampoline_phys;
+    data->far64 += trampoline_phys;
+    data->gdt_base += trampoline_phys;
+    data->cr3 = trampoline_tables[0];
+    data->efer = (uint32_t)(read_msr(kMsrEfer) & ~kEferLma);
+    data->entry = (uint64_t)smp_ap_entry;
+
+    uint64_t* tables[kTrampolineTables];
+    for (unsigned i = 0; i < kTrampolineTables; ++i) {
+        tables[i] = (uint64_t*)phys_to_virt(trampoline_tables[i]);
+        memset(tables[i], 0, kPageSize);
+    }
+    // A 2 MiB identity mapping covers the trampoline, and the upper half
+    // is the kernel's, whose PML4 entries never change.
+    tables[0][0] = trampoline_tables[1] | PagePresent | PageWritable;
+    tables[1][0] = trampoline_tables[2] | PagePresent | PageWritable;
+    tables[2][0] = PagePresent | PageWritable | PageHuge;
+    const uint64_t* kernel_pml4 = (const uint64_t*)phys_to_virt(kernel_space().root());
+    memcpy(tables[0] + 256, kernel_pml4 + 256, 256 * sizeof(uint64_t));
+    return data;
+}
+
+// Gives the CPU with `apic_id` its stacks and per-CPU area.
+static bool prepare_cpu(TrampolineCpu* slot, uint32_t apic_id) {
+    unsigned node = numa_node_of_cpu(apic_id);
+    Frame* stack = frame_alloc_node(kStackOrder, 0, node);
+    Frame* ist_stacks = frame_alloc_node(kIstOrder, 0, node);
+    Cpu* cpu = stack && ist_stacks ? percpu_alloc(apic_id, node) : nullptr;
+    if (!cpu) {
+        if (stack) {
+            frame_free(stack, kStackOrder);
+        }
+        if (ist_stacks) {
+            frame_free(ist_stacks, kIstOrder);
+        }
+        kprintf("smp: no memory for CPU with APIC ID %u\n", apic_id);
+        return false;
+    }
+    cpu->stack = (uint8_t*)frame_to_virt(stack);
+    cpu->ist_stacks = (uint8_t*)frame_to_virt(ist_stacks);
+    slot->apic_id = apic_id;
+    slot->stack = (uint64_t)(cpu->stack + (kFrameSize << kStackOrder));
+    slot->cpu = cpu;
+    return true;
+}
+
+static bool cpu_started(const Cpu* cpu) {
+    return __atomic_load_n(&cpu->start_ns, __ATOMIC_ACQUIRE) != 0;
+}
+
+static bool cpu_online(const Cpu* cpu) {
+    return __atomic_load_n(&cpu->online_ns, __ATOMIC_ACQUIRE) != 0;
+}
+
+static void delay(uint64_t ns) {
+    uint64_t deadline = clock_ns() + ns;
+    while (clock_ns() < deadline) {
+        cpu_pause();
+    }
+}
+
+// Each CPU brings itself up, in parallel with the others.
+extern "C" [[noreturn]] void smp_ap_entry(Cpu* cpu) {
+    percpu_load(cpu);
+    __atomic_store_n(&cpu->start_ns, clock_ns(), __ATOMIC_RELEASE);
+    write_cr4(boot_cr4);
+    // The trampoline's GDT and page tables are only mapped by those page
+    // tables, so the GDT goes first.
+    gdt_init_ap(cpu->ist_stacks);
+    kernel_space().activate();
+    fpu_init_ap();
+    idt_load();
+    lapic_init_ap();
+    timers_init();
+    percpu_register(cpu);
+    __atomic_store_n(&cpu->online_ns, clock_ns(), __ATOMIC_RELEASE);
+    // Daemons stay on the boot CPU; the time this CPU spends awake but
+    // idle goes to clearing memory of its own node.
+    for (;;) {
+        if (!prezero_refill_local()) {
+            tlb_enter_lazy();
+            cpu_idle();
+            tlb_leave_lazy();
+        }
+    }
+}
+
+// Collects the enabled CPUs of the MADT into listed_ids, returning how
+// many there are. Those past kMaxCpus are counted in `unused`.
+static unsigned parse_madt(const AcpiHeader* madt, unsigned* unused) {
+    unsigned listed = 0;
+    const uint8_t* end = (const uint8_t*)madt + madt->length;
+    for (const uint8_t* ptr = (const uint8_t*)madt + kMadtEntriesOffset; ptr + sizeof(MadtEntry) <= end;) {
+        const MadtEntry* entry = (const MadtEntry*)ptr;
+        if (entry->length < sizeof(MadtEntry) || ptr + entry->length > end) {
+            break;
+        }
+        uint32_t apic_id = 0;
+        uint32_t flags = 0;
+        if (entry->type == MadtLocalApic && entry->length >= sizeof(MadtLocalApicEntry)) {
+            const MadtLocalApicEntry* cpu = (const MadtLocalApicEntry*)ptr;
+            apic_id = cpu->apic_id;
+            flags = cpu->flags;
+        } else if (entry->type == MadtLocalX2apic && entry->length >= sizeof(MadtLocalX2apicEntry)) {
+            const MadtLocalX2apicEntry* cpu = (const MadtLocalX2apicEntry*)ptr;
+            apic_id = cpu->x2apic_id;
+            flags = cpu->flags;
+        }
+        ptr += entry->length;
+        if (!(flags & kMadtEnabled)) {
+            continue;
+        }
+        // Firmware may list a CPU in both kinds of entry.
+        bool duplicate = false;
+        for (unsigned i = 0; i < listed; ++i) {
+            duplicate |= listed_ids[i] == apic_id;
+        }
+        if (duplicate) {
+            continue;
+        }
+        if (listed == kMaxCpus) {
+            (*unused)++;
+            continue;
+        }
+        listed_ids[listed++] = apic_id;
+    }
+    return listed;
+}
+
+void smp_init() {
+    const AcpiHeader* madt = acpi_find_table("APIC");
+    if (!madt) {
+        kprintf("smp: no MADT, one CPU\n");
+        return;
+    }
+    if (!trampoline_phys) {
+        kprintf("smp: no low memory for the trampoline, one CPU\n");
+        return;
+    }
+    uint64_t start_ns = clock_ns();
+    boot_cr4 = read_cr4();
+    unsigned unused = 0;
+    unsigned listed = parse_madt(madt, &unused);
+    if (unused) {
+        kprintf("smp: %u CPUs past the first %u left unused\n", unused, kMaxCpus);
+    }
+    uint32_t self = lapic_id();
+    unsigned count = 0;
+    for (unsigned i = 0; i < listed; ++i) {
+        if (listed_ids[i] != self && prepare_cpu(&trampoline_cpus[count], listed_ids[i])) {
+            count++;
+        }
+    }
+    if (count == 0) {
+        kprintf("smp: one CPU\n");
+        return;
+    }
+    TrampolineData* data = prepare_trampoline();
+    data->cpus = (uint64_t)trampoline_cpus;
+    data->cpu_count = count;
+
+    uint32_t startup = kIpiStartup | kIpiAssert | (uint32_t)(trampoline_phys >> kFrameShift);
+    for (unsigned i = 0; i < count; ++i) {
+        lapic_send_ipi(trampoline_cpus[i].apic_id, kIpiInit | kIpiAssert);
+    }
+    delay(kInitDelayNs);
+    for (unsigned i = 0; i < count; ++i) {
+        lapic_send_ipi(trampoline_cpus[i].apic_id, startup);
+    }
+    delay(kStartupDelayNs);
+    // The second startup IPI is for CPUs that missed the first.
+    for (unsigned i = 0; i < count; ++i) {
+        if (!cpu_started(trampoline_cpus[i].cpu)) {
+            lapic_send_ipi(trampoline_cpus[i].apic_id, startup);
+        }
+    }
+    uint64_t ipi_ns = clock_ns();
+
+    // Boot goes on once every CPU is online or given up on.
+    for (bool waiting = true; waiting;) {
+        waiting = false;
+        uint64_t now = clock_ns();
+        for (unsigned i = 0; i < count && !waiting; ++i) {
+            const Cpu* cpu = trampoline_cpus[i].cpu;
+            uint64_t timeout = cpu_started(cpu) ? kOnlineTimeoutNs : kStartTimeoutNs;
+            waiting = !cpu_online(cpu) && now - ipi_ns < timeout;
+        }
+        cpu_pause();
+    }
+    uint64_t end_ns = clock_ns();
+
+    // The stacks and areas of CPUs given up on stay allocated: they may
+    // yet come up and run on them.
+    uint64_t slowest = 0;
+    uint64_t last = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        const Cpu* cpu = trampoline_cpus[i].cpu;
+        if (!cpu_started(cpu)) {
+            kprintf("smp: CPU with APIC ID %u did not start\n", cpu->apic_id);
+        } else if (!cpu_online(cpu)) {
+            kprintf("smp: CPU with APIC ID %u did not finish initialising\n", cpu->apic_id);
+        } else {
+            slowest = max(slowest, cpu->online_ns - cpu->start_ns);
+            last = max(last, cpu->online_ns);
+        }
+    }
+    kprintf("smp: %u of %u CPUs up in %lu us: IPIs %lu us, last online at +%lu us, slowest self-init %lu us\n",
+            percpu_count(), max(listed, 1u), (end_ns - start_ns) / 1000, (ipi_ns - start_ns) / 1000,
+            last ? (last - start_ns) / 1000 : 0, slowest / 1000);
+}
@@ -0,0 +1,17 @@
+#ifndef ARCH_X86_64_SMP_H
+#define ARCH_X86_64_SMP_H
+
+// Takes the page application processors start in, and the page tables
+// they first run on, out of the boot memory map. Runs between
+// frame_init_early and frame_init.
+void smp_reserve_trampoline();
+// Starts every enabled processor the ACPI MADT lists, giving each a
+// per-CPU area, a kernel stack and IST stacks on its own node. All of them
+// are sent INIT and startup IPIs together and initialise themselves in
+// parallel, so bring-up takes about as long for hundreds of CPUs as for
+// two. Waits for all of them to come online and reports the timeline;
+// each CPU's own times stay in its Cpu. Started CPUs idle until they have
+// work. Needs the local APIC, the timers and the clock.
+void smp_init();
+
+#endif // ARCH_X86_64_SMP_H
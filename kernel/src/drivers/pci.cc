@@ -0,0 +1,135 @@
+#include "pci.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../sync/spinlock.h"
+
+constexpr uint16_t kConfigAddress = 0xCF8;
+constexpr uint16_t kConfigData = 0xCFC;
+constexpr uint8_t kConfigVendor = 0x00;
+constexpr uint8_t kConfigDevice = 0x02;
+constexpr uint8_t kConfigHeaderType = 0x0E;
+constexpr uint8_t kConfigBar0 = 0x10;
+constexpr uint16_t kStatusCapabilities = 1u << 4;
+constexpr uint32_t kBarIo = 1u << 0;
+constexpr uint32_t kBarType64 = 2u << 1;
+constexpr uint32_t kBarTypeMask = 3u << 1;
+
+// The address and data ports form one register pair.
+static Spinlock config_lock;
+
+static uint32_t config_address(const PciDevice& device, uint8_t offset) {
+    return 1u << 31 | (uint32_t)device.bus << 16 | (uint32_t)device.slot << 11 | (uint32_t)device.function << 8 |
+           (offset & 0xFC);
+}
+
+uint32_t pci_read32(const PciDevice& device, uint8_t offset) {
+    LockGuard<Spinlock> guard(config_lock);
+    outl(kConfigAddress, config_address(device, offset));
+    return inl(kConfigData);
+}
+
+uint16_t pci_read16(const PciDevice& device, uint8_t offset) {
+    return pci_read32(device, offset) >> ((offset & 2) * 8);
+}
+
+uint8_t pci_read8(const PciDevice& device, uint8_t offset) {
+    return pci_read32(device, offset) >> ((offset & 3) * 8);
+}
+
+void pci_write32(const PciDevice& device, uint8_t offset, uint32_t value) {
+    LockGuard<Spinlock> guard(config_lock);
+    outl(kConfigAddress, config_address(device, offset));
+    outl(kConfigData, value);
+}
+
+void pci_write16(const PciDevice& device, uint8_t offset, uint16_t value) {
+    LockGuard<Spinlock> guard(config_lock);
+    outl(kConfigAddress, config_address(device, offset));
+    outw(kConfigData + (offset & 2), value);
+}
+
+bool pci_find(uint16_t vendor, uint16_t device_first, uint16_t device_last, PciDevice* found) {
+    for (unsigned bus = 0; bus < 256; ++bus) {
+        for (uint8_t slot = 0; slot < 32; ++slot) {
+            for (uint8_t function = 0; function < 8; ++function) {
+                PciDevice device = {(uint8_t)bus, slot, function, 0, 0};
+                uint16_t id = pci_read16(device, kConfigVendor);
+                if (id == 0xFFFF) {
+                    if (function == 0) {
+                        break;
+                    }
+                    continue;
+                }
+                device.vendor = id;
+                device.device = pci_read16(device, kConfigDevice);
+                if (device.vendor == vendor && device.device >= device_first && device.device <= device_last) {
+                    *found = device;
+                    return true;
+                }
+                if (function == 0 && !(pci_read8(device, kConfigHeaderType) & 0x80)) {
+                    break;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+bool pci_bar(const PciDevice& device, unsigned index, uint64_t* phys, uint64_t* size) {
+    if (index > 5) {
+        return false;
+    }
+    uint8_t offset = kConfigBar0 + index * 4;
+    uint32_t low = pci_read32(device, offset);
+    if (low & kBarIo) {
+        return false;
+    }
+    bool wide = (low & kBarTypeMask) == kBarType64;
+    if (wide && index == 5) {
+        return false;
+    }
+    // Size the BAR by writing all ones, with decoding off so that the
+    // probe address is never claimed.
+    uint16_t command = pci_read16(device, kPciConfigCommand);
+    pci_write16(device, kPciConfigCommand, command & ~(PciCommandIo | PciCommandMemory));
+    pci_write32(device, offset, 0xFFFFFFFF);
+    uint64_t mask = pci_read32(device, offset) & ~0xFull;
+    pci_write32(device, offset, low);
+    uint64_t high = 0;
+    if (wide) {
+        high = pci_read32(device, offset + 4);
+        pci_write32(device, offset + 4, 0xFFFFFFFF);
+        mask |= (uint64_t)pci_read32(device, offset + 4) << 32;
+        pci_write32(device, offset + 4, (uint32_t)high);
+    } else {
+        mask |= 0xFFFFFFFF00000000ull;
+    }
+    pci_write16(device, kPciConfigCommand, command);
+    if (mask == 0xFFFFFFFF00000000ull || mask == 0) {
+        return false;
+    }
+    *phys = (high << 32) | (low & ~0xFull);
+    *size = ~mask + 1;
+    return true;
+}
+
+uint8_t pci_find_capability(const PciDevice& device, uint8_t id, uint8_t after) {
+    if (!(pci_read16(device, kPciConfigStatus) & kStatusCapabilities)) {
+        return 0;
+    }
+    uint8_t offset = after ? pci_read8(device, after + 1) : pci_read8(device, kPciConfigCapabilities);
+    // Bounded in case of a malformed list.
+    for (unsigned i = 0; i < 48 && offset >= 0x40; ++i) {
+        offset &= 0xFC;
+        if (pci_read8(device, offset) == id) {
+            return offset;
+        }
+        offset = pci_read8(device, offset + 1);
+    }
+    return 0;
+}
+
+void pci_enable(const PciDevice& device) {
+    uint16_t command = pci_read16(device, kPciConfigCommand);
+    pci_write16(device, kPciConfigCommand, command | PciCommandMemory | PciCommandBusMaster);
+}
@@ -0,0 +1,46 @@
+#ifndef DRIVERS_PCI_H
+#define DRIVERS_PCI_H
+
+#include <stdint.h>
+
+constexpr uint8_t kPciConfigCommand = 0x04;
+constexpr uint8_t kPciConfigStatus = 0x06;
+constexpr uint8_t kPciConfigCapabilities = 0x34;
+
+enum PciCommand : uint16_t {
+    PciCommandIo = 1u << 0,
+    PciCommandMemory = 1u << 1,
+    PciCommandBusMaster = 1u << 2,
+};
+
+constexpr uint8_t kPciCapVendor = 0x09;
+
+struct PciDevice {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t function;
+    uint16_t vendor;
+    uint16_t device;
+};
+
+// Configuration space through the legacy 0xCF8/0xCFC ports, which every
+// PC chipset and hypervisor provides. Offsets are naturally aligned.
+uint32_t pci_read32(const PciDevice& device, uint8_t offset);
+uint16_t pci_read16(const PciDevice& device, uint8_t offset);
+uint8_t pci_read8(const PciDevice& device, uint8_t offset);
+void pci_write32(const PciDevice& device, uint8_t offset, uint32_t value);
+void pci_write16(const PciDevice& device, uint8_t offset, uint16_t value);
+
+// Scans every bus for the first function with `vendor` and a device ID in
+// [device_first, device_last].
+bool pci_find(uint16_t vendor, uint16_t device_first, uint16_t device_last, PciDevice* found);
+// Physical address and size of memory BAR `index`; fails for I/O BARs and
+// unimplemented ones.
+bool pci_bar(const PciDevice& device, unsigned index, uint64_t* phys, uint64_t* size);
+// Offset of the first capability with `id` after the one at `after`, or of
+// the first one at all if `after` is zero. Zero if there is none.
+uint8_t pci_find_capability(const PciDevice& device, uint8_t id, uint8_t after = 0);
+// Enables memory decoding and bus mastering.
+void pci_enable(const PciDevice& device);
+
+#endif // DRIVERS_PCI_H
@@ -0,0 +1,230 @@
+#include "virtio.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../lib/util.h"
+#include "../mm/frame.h"
+#include "../mm/vmalloc.h"
+
+enum VirtioStatus : uint8_t {
+    VirtioAcknowledge = 1u << 0,
+    VirtioDriver = 1u << 1,
+    VirtioDriverOk = 1u << 2,
+    VirtioFeaturesOk = 1u << 3,
+    VirtioFailed = 1u << 7,
+};
+
+enum VirtioPciCapType : uint8_t {
+    VirtioCapCommon = 1,
+    VirtioCapNotify = 2,
+    VirtioCapIsr = 3,
+    VirtioCapDevice = 4,
+};
+
+struct [[gnu::packed]] VirtioPciCap {
+    uint8_t vendor;
+    uint8_t next;
+    uint8_t length;
+    uint8_t type;
+    uint8_t bar;
+    uint8_t id;
+    uint8_t padding[2];
+    uint32_t offset;
+    uint32_t size;
+};
+
+// Maps the structure a vendor capability at `cap` points to.
+static volatile uint8_t* map_cap(const PciDevice& pci, uint8_t cap, uint32_t* multiplier) {
+    uint8_t bar = pci_read8(pci, cap + offsetof(VirtioPciCap, bar));
+    uint32_t offset = pci_read32(pci, cap + offsetof(VirtioPciCap, offset));
+    uint32_t size = pci_read32(pci, cap + offsetof(VirtioPciCap, size));
+    uint64_t phys, bar_size;
+    if (!pci_bar(pci, bar, &phys, &bar_size) || offset > bar_size || size > bar_size - offset) {
+        return nullptr;
+    }
+    if (multiplier) {
+        *multiplier = pci_read32(pci, cap + sizeof(VirtioPciCap));
+    }
+    return (volatile uint8_t*)ioremap(phys + offset, size);
+}
+
+bool virtio_init(VirtioDevice* device, const PciDevice& pci) {
+    *device = {};
+    device->pci = pci;
+    for (uint8_t cap = pci_find_capability(pci, kPciCapVendor); cap;
+         cap = pci_find_capability(pci, kPciCapVendor, cap)) {
+        uint8_t type = pci_read8(pci, cap + offsetof(VirtioPciCap, type));
+        // Only the first structure of each type is used.
+        if (type == VirtioCapCommon && !device->common) {
+            device->common = (volatile VirtioPciCommonCfg*)map_cap(pci, cap, nullptr);
+        } else if (type == VirtioCapNotify && !device->notify_base) {
+            device->notify_base = map_cap(pci, cap, &device->notify_multiplier);
+        } else if (type == VirtioCapIsr && !device->isr) {
+            device->isr = map_cap(pci, cap, nullptr);
+        } else if (type == VirtioCapDevice && !device->config) {
+            device->config = map_cap(pci, cap, nullptr);
+        }
+    }
+    if (!device->common || !device->notify_base || !device->isr) {
+        return false;
+    }
+    pci_enable(pci);
+    device->common->device_status = 0;
+    while (device->common->device_status != 0) {
+        cpu_pause();
+    }
+    device->common->device_status = VirtioAcknowledge;
+    device->common->device_status = VirtioAcknowledge | VirtioDriver;
+    return true;
+}
+
+bool virtio_negotiate(VirtioDevice* device, uint64_t wanted) {
+    volatile VirtioPciCommonCfg* common = device->common;
+    common->device_feature_select = 0;
+    uint64_t offered = common->device_feature;
+    common->device_feature_select = 1;
+    offered |= (uint64_t)common->device_feature << 32;
+    device->offered = offered;
+    if (!(offered & kVirtioFeatureVersion1)) {
+        return false;
+    }
+    device->features = offered & (wanted | kVirtioFeatureVersion1);
+    common->driver_feature_select = 0;
+    common->driver_feature = (uint32_t)device->features;
+    common->driver_feature_select = 1;
+    common->driver_feature = (uint32_t)(device->features >> 32);
+    common->device_status = common->device_status | VirtioFeaturesOk;
+    return common->device_status & VirtioFeaturesOk;
+}
+
+bool virtio_setup_queue(VirtioDevice* device, uint16_t index, Virtqueue* queue) {
+    volatile VirtioPciCommonCfg* common = device->common;
+    if (index >= common->num_queues) {
+        return false;
+    }
+    common->queue_select = index;
+    uint16_t size = common->queue_size;
+    if (size == 0 || common->queue_enable) {
+        return false;
+    }
+    // Queue sizes are powers of two, so this stays one.
+    size = min(size, kVirtqMaxSize);
+    common->queue_size = size;
+    Frame* frame = frame_alloc(0, AllocZero);
+    if (!frame) {
+        return false;
+    }
+    uint8_t* rings = (uint8_t*)frame_to_virt(frame);
+    size_t avail_offset = size * sizeof(VirtqDesc);
+    size_t used_offset = align_up(avail_offset + 6 + 2 * size, 4);
+    queue->index = index;
+    queue->size = size;
+    queue->desc = (VirtqDesc*)rings;
+    queue->avail = (VirtqAvail*)(rings + avail_offset);
+    queue->used = (volatile VirtqUsed*)(rings + used_offset);
+    queue->notify =
+        (volatile uint16_t*)(device->notify_base + common->queue_notify_off * device->notify_multiplier);
+    for (uint16_t i = 0; i < size; ++i) {
+        queue->desc[i].next = i + 1;
+        queue->tokens[i] = nullptr;
+    }
+    queue->free_head = 0;
+    queue->free_count = size;
+    queue->last_used = 0;
+    uint64_t phys = frame_to_phys(frame);
+    common->queue_desc = phys;
+    common->queue_driver = phys + avail_offset;
+    common->queue_device = phys + used_offset;
+    common->queue_enable = 1;
+    return true;
+}
+
+void virtio_driver_ok(VirtioDevice* device) {
+    device->common->device_status = device->common->device_status | VirtioDriverOk;
+}
+
+void virtio_fail(VirtioDevice* device) {
+    if (device->common) {
+        device->common->device_status = device->common->device_status | VirtioFailed;
+    }
+}
+
+uint8_t virtio_isr(VirtioDevice* device) {
+    return *device->isr;
+}
+
+uint32_t virtio_config_read32(VirtioDevice* device, size_t offset) {
+    uint8_t generation;
+    uint32_t value;
+    do {
+        generation = device->common->config_generation;
+        value = *(volatile uint32_t*)(device->config + offset);
+    } while (generation != device->common->config_generation);
+    return value;
+}
+
+void virtio_config_write32(VirtioDevice* device, size_t offset, uint32_t value) {
+    *(volatile uint32_t*)(device->config + offset) = value;
+}
+
+bool virtq_add(Virtqueue* queue, const VirtqBuffer* buffers, size_t count, void* token) {
+    if (count == 0 || count > queue->free_count) {
+        return false;
+    }
+    uint16_t head = queue->free_head;
+    uint16_t index = head;
+    for (size_t i = 0; i < count; ++i) {
+        VirtqDesc& desc = queue->desc[index];
+        desc.addr = buffers[i].phys;
+        desc.len = buffers[i].len;
+        desc.flags = buffers[i].device_writable ? VirtqDescWrite : 0;
+        if (i + 1 < count) {
+            desc.flags |= VirtqDescNext;
+            index = desc.next;
+        }
+    }
+    queue->free_head = queue->desc[index].next;
+    queue->free_count -= count;
+    queue->tokens[head] = token;
+    uint16_t avail = queue->avail->idx;
+    queue->avail->ring[avail % queue->size] = head;
+    // The device must see the ring entry before the index that covers it.
+    __atomic_store_n(&queue->avail->idx, (uint16_t)(avail + 1), __ATOMIC_RELEASE);
+    return true;
+}
+
+void virtq_kick(Virtqueue* queue) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    *queue->notify = queue->index;
+}
+
+void* virtq_next_used(Virtqueue* queue, uint32_t* len) {
+    if (queue->last_used == __atomic_load_n(&queue->used->idx, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    volatile VirtqUsedElem& elem = queue->used->ring[queue->last_used % queue->size];
+    queue->last_used++;
+    uint16_t head = elem.id;
+    if (len) {
+        *len = elem.len;
+    }
+    void* token = queue->tokens[head];
+    queue->tokens[head] = nullptr;
+    // Return the chain to the free list.
+    uint16_t tail = head;
+    uint16_t count = 1;
+    while (queue->desc[tail].flags & VirtqDescNext) {
+        tail = queue->desc[tail].next;
+        count++;
+    }
+    queue->desc[tail].next = queue->free_head;
+    queue->free_head = head;
+    queue->free_count += count;
+    return token;
+}
+
+void virtq_submit_wait(Virtqueue* queue, void* token) {
+    virtq_kick(queue);
+    while (virtq_next_used(queue) != token) {
+        cpu_pause();
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef DRIVERS_VIRTIO_H
+#define DRIVERS_VIRTIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pci.h"
+
+constexpr uint16_t kVirtioPciVendor = 0x1AF4;
+// Transitional devices use 0x1000 + a legacy ID, modern ones 0x1040 plus
+// the virtio device ID.
+constexpr uint16_t kVirtioPciModernBase = 0x1040;
+constexpr uint64_t kVirtioFeatureVersion1 = 1ull << 32;
+// Entries per queue; the rings of one queue then fit in a single frame.
+constexpr uint16_t kVirtqMaxSize = 128;
+
+enum VirtqDescFlags : uint16_t {
+    VirtqDescNext = 1u << 0,
+    // Written by the device rather than read.
+    VirtqDescWrite = 1u << 1,
+};
+
+struct VirtqDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+// The rings hold the queue's size in entries, at most kVirtqMaxSize.
+struct VirtqAvail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[kVirtqMaxSize];
+};
+
+struct VirtqUsedElem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct VirtqUsed {
+    uint16_t flags;
+    uint16_t idx;
+    VirtqUsedElem ring[kVirtqMaxSize];
+};
+
+// Split virtqueue. Buffers are physical ranges; each chain added carries a
+// token that comes back once the device has used it.
+struct Virtqueue {
+    uint16_t index;
+    uint16_t size;
+    VirtqDesc* desc;
+    VirtqAvail* avail;
+    volatile VirtqUsed* used;
+    volatile uint16_t* notify;
+    uint16_t free_head;
+    uint16_t free_count;
+    uint16_t last_used;
+    void* tokens[kVirtqMaxSize];
+};
+
+struct VirtqBuffer {
+    uint64_t phys;
+    uint32_t len;
+    bool device_writable;
+};
+
+struct [[gnu::packed]] VirtioPciCommonCfg {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint64_t queue_desc;
+    uint64_t queue_driver;
+    uint64_t queue_device;
+};
+
+// A device behind the virtio 1.0 PCI transport. Legacy-only devices are
+// not supported.
+struct VirtioDevice {
+    PciDevice pci;
+    volatile VirtioPciCommonCfg* common;
+    volatile uint8_t* notify_base;
+    uint32_t notify_multiplier;
+    volatile uint8_t* isr;
+    volatile uint8_t* config;
+    // Offered by the device, and agreed on.
+    uint64_t offered;
+    uint64_t features;
+};
+
+// Finds the transport structures, resets the device and acknowledges it.
+bool virtio_init(VirtioDevice* device, const PciDevice& pci);
+// Accepts the offered subset of `wanted`, plus VERSION_1.
+bool virtio_negotiate(VirtioDevice* device, uint64_t wanted);
+bool virtio_setup_queue(VirtioDevice* device, uint16_t index, Virtqueue* queue);
+void virtio_driver_ok(VirtioDevice* device);
+void virtio_fail(VirtioDevice* device);
+// Reading the ISR status acknowledges it; bit 1 reports a configuration
+// change.
+uint8_t virtio_isr(VirtioDevice* device);
+// Device-specific configuration, read consistently across generations.
+uint32_t virtio_config_read32(VirtioDevice* device, size_t offset);
+void virtio_config_write32(VirtioDevice* device, size_t offset, uint32_t value);
+
+bool virtq_add(Virtqueue* queue, const VirtqBuffer* buffers, size_t count, void* token);
+void virtq_kick(Virtqueue* queue);
+// The token of the next chain the device has used, or null. `len`
+// receives how many bytes it wrote.
+void* virtq_next_used(Virtqueue* queue, uint32_t* len = nullptr);
+// Kicks and spins until the device has used the chain with `token`. Only
+// for queues that have no other chain in flight.
+void virtq_submit_wait(Virtqueue* queue, void* token);
+
+#endif // DRIVERS_VIRTIO_H
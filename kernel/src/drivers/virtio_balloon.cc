@@ -0,0 +1,271 @@
+#include "virtio_balloon.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../lib/util.h"
+#include "../log.h"
+#include "../mm/frame.h"
+#include "../mm/reclaim.h"
+#include "../mm/swap.h"
+#include "../sched/daemon.h"
+#include "../sync/spinlock.h"
+#include "../time/clock.h"
+#include "virtio.h"
+
+constexpr uint16_t kBalloonDeviceId = 5;
+constexpr uint16_t kBalloonTransitionalId = 0x1002;
+constexpr size_t kConfigNumPages = 0;
+constexpr size_t kConfigActual = 4;
+// Page numbers passed per inflate or deflate request.
+constexpr size_t kPfnsPerRequest = 256;
+constexpr unsigned kReportOrder = kLargeOrder;
+constexpr size_t kReportCapacity = 32;
+constexpr uint64_t kPollNs = 50000000;
+
+enum BalloonFeatures : uint64_t {
+    BalloonMustTellHost = 1ull << 0,
+    BalloonStatsVq = 1ull << 1,
+    BalloonDeflateOnOom = 1ull << 2,
+    BalloonFreePageHint = 1ull << 3,
+    BalloonPageReporting = 1ull << 5,
+};
+
+enum BalloonStatTag : uint16_t {
+    BalloonStatSwapIn = 0,
+    BalloonStatSwapOut = 1,
+    BalloonStatMemFree = 4,
+    BalloonStatMemTotal = 5,
+};
+
+struct [[gnu::packed]] BalloonStat {
+    uint16_t tag;
+    uint64_t value;
+};
+
+constexpr size_t kStatCount = 4;
+// Layout of the frame shared with the device.
+constexpr size_t kStatsOffset = 2048;
+
+static VirtioDevice device;
+static Virtqueue inflate_queue;
+static Virtqueue deflate_queue;
+static Virtqueue stats_queue;
+static Virtqueue report_queue;
+// Serialises the queues between the daemon and the shrinker.
+static Spinlock balloon_lock;
+// Frames in the balloon, linked through Frame::node.
+static ListNode pages = {&pages, &pages};
+static uint32_t* pfns;
+static uint64_t pfns_phys;
+static BalloonStat* stat_buffer;
+static BalloonStats stats;
+
+static bool balloon_run(void* context);
+static uint64_t balloon_shrink(void* context, uint64_t count);
+
+static Daemon balloon_daemon("virtio-balloon", balloon_run);
+static Shrinker balloon_shrinker = {{nullptr, nullptr}, "virtio-balloon", balloon_shrink, nullptr};
+
+// Hands pfns[0, count) to the device through `queue` and waits for it.
+// Called with balloon_lock held.
+static void tell_host(Virtqueue* queue, size_t count) {
+    VirtqBuffer buffer = {pfns_phys, (uint32_t)(count * sizeof(uint32_t)), false};
+    if (virtq_add(queue, &buffer, 1, &buffer)) {
+        virtq_submit_wait(queue, &buffer);
+    }
+}
+
+static void update_actual() {
+    virtio_config_write32(&device, kConfigActual, (uint32_t)stats.pages);
+}
+
+static uint64_t inflate(uint64_t count) {
+    uint64_t free_frames = frame_stats().free_frames;
+    uint64_t high = watermarks().high;
+    count = min<uint64_t>(min<uint64_t>(count, kPfnsPerRequest), free_frames > high ? free_frames - high : 0);
+    size_t taken = 0;
+    while (taken < count) {
+        Frame* frame = frame_alloc(0, AllocNoReclaim);
+        if (!frame) {
+            break;
+        }
+        pfns[taken++] = (uint32_t)frame_to_pfn(frame);
+        list_push_back(&pages, &frame->node);
+    }
+    if (taken > 0) {
+        tell_host(&inflate_queue, taken);
+        stats.pages += taken;
+        stats.inflated += taken;
+    }
+    return taken;
+}
+
+static uint64_t deflate(uint64_t count) {
+    count = min<uint64_t>(count, kPfnsPerRequest);
+    ListNode taken;
+    list_init(&taken);
+    size_t released = 0;
+    while (released < count) {
+        ListNode* node = list_pop_back(&pages);
+        if (!node) {
+            break;
+        }
+        pfns[released++] = (uint32_t)frame_to_pfn(list_entry(node, Frame, node));
+        list_push_back(&taken, node);
+    }
+    if (released == 0) {
+        return 0;
+    }
+    // Without MUST_TELL_HOST the frames may be reused before the device
+    // has heard about it.
+    bool tell_first = device.features & BalloonMustTellHost;
+    if (tell_first) {
+        tell_host(&deflate_queue, released);
+    }
+    while (ListNode* node = list_pop_front(&taken)) {
+        frame_free(list_entry(node, Frame, node), 0);
+    }
+    if (!tell_first) {
+        tell_host(&deflate_queue, released);
+    }
+    stats.pages -= released;
+    stats.deflated += released;
+    return released;
+}
+
+// Reports one batch of free blocks. Returns whether there may be more.
+static bool report_free_pages() {
+    Frame* blocks[kReportCapacity];
+    size_t count = frame_report_take(blocks, kReportCapacity);
+    if (count == 0) {
+        return false;
+    }
+    VirtqBuffer buffers[kReportCapacity];
+    for (size_t i = 0; i < count; ++i) {
+        buffers[i] = {frame_to_phys(blocks[i]), (uint32_t)(kFrameSize << blocks[i]->order), true};
+        stats.reported_frames += 1ull << blocks[i]->order;
+    }
+    if (virtq_add(&report_queue, buffers, count, blocks)) {
+        virtq_submit_wait(&report_queue, blocks);
+    }
+    frame_report_return(blocks, count);
+    stats.reported_blocks += count;
+    return count == kReportCapacity;
+}
+
+static void send_stats() {
+    FrameStats frames = frame_stats();
+    SwapStats swap = swap_stats();
+    stat_buffer[0] = {BalloonStatSwapIn, swap.loaded};
+    stat_buffer[1] = {BalloonStatSwapOut, swap.stored};
+    stat_buffer[2] = {BalloonStatMemFree, frames.free_frames << kFrameShift};
+    stat_buffer[3] = {BalloonStatMemTotal, frames.total_frames << kFrameShift};
+    VirtqBuffer buffer = {pfns_phys + kStatsOffset, kStatCount * sizeof(BalloonStat), false};
+    if (virtq_add(&stats_queue, &buffer, 1, &stats_queue)) {
+        virtq_kick(&stats_queue);
+    }
+}
+
+static bool balloon_run(void*) {
+    LockGuard<Spinlock> guard(balloon_lock);
+    // The device hands the stats buffer back when it wants fresh numbers.
+    if ((device.features & BalloonStatsVq) && virtq_next_used(&stats_queue)) {
+        send_stats();
+    }
+    uint64_t target = virtio_config_read32(&device, kConfigNumPages);
+    uint64_t before = stats.pages;
+    bool busy = false;
+    if (target > stats.pages) {
+        busy = inflate(target - stats.pages) > 0 && target > stats.pages;
+    } else if (target < stats.pages) {
+        deflate(stats.pages - target);
+        busy = target < stats.pages;
+    }
+    if (stats.pages != before) {
+        update_actual();
+    }
+    if (device.features & BalloonPageReporting) {
+        busy |= report_free_pages();
+    }
+    // Work left over runs again at once; otherwise the next poll waits for
+    // the timer.
+    if (!busy) {
+        daemon_wake_at(&balloon_daemon, clock_ns() + kPollNs);
+    }
+    return busy;
+}
+
+static uint64_t balloon_shrink(void*, uint64_t count) {
+    // Reclaim may run inside an allocation made with the lock held.
+    if (!balloon_lock.try_lock()) {
+        return 0;
+    }
+    uint64_t freed = deflate(count);
+    if (freed > 0) {
+        update_actual();
+        stats.pressure_deflated += freed;
+    }
+    balloon_lock.unlock();
+    return freed;
+}
+
+bool virtio_balloon_init() {
+    PciDevice pci;
+    if (!pci_find(kVirtioPciVendor, kBalloonTransitionalId, kBalloonTransitionalId, &pci) &&
+        !pci_find(kVirtioPciVendor, kVirtioPciModernBase + kBalloonDeviceId, kVirtioPciModernBase + kBalloonDeviceId,
+                  &pci)) {
+        return false;
+    }
+    uint64_t wanted = BalloonMustTellHost | BalloonStatsVq | BalloonDeflateOnOom | BalloonPageReporting;
+    if (!virtio_init(&device, pci) || !device.config || !virtio_negotiate(&device, wanted)) {
+        virtio_fail(&device);
+        kprintf("virtio-balloon: unsupported device\n");
+        return false;
+    }
+    Frame* shared = frame_alloc(0, AllocZero);
+    if (!shared) {
+        virtio_fail(&device);
+        return false;
+    }
+    pfns = (uint32_t*)frame_to_virt(shared);
+    pfns_phys = frame_to_phys(shared);
+    stat_buffer = (BalloonStat*)((uint8_t*)pfns + kStatsOffset);
+    // Queues are numbered by what the device offers: one it offers but we
+    // decline still takes its index.
+    uint16_t next = 2;
+    bool ok = virtio_setup_queue(&device, 0, &inflate_queue) && virtio_setup_queue(&device, 1, &deflate_queue);
+    if (device.offered & BalloonStatsVq) {
+        ok = ok && virtio_setup_queue(&device, next, &stats_queue);
+        next++;
+    }
+    if (device.offered & BalloonFreePageHint) {
+        next++;
+    }
+    if (device.features & BalloonPageReporting) {
+        ok = ok && virtio_setup_queue(&device, next, &report_queue);
+    }
+    if (!ok) {
+        virtio_fail(&device);
+        frame_free(shared, 0);
+        kprintf("virtio-balloon: queue setup failed\n");
+        return false;
+    }
+    virtio_driver_ok(&device);
+    if (device.features & BalloonStatsVq) {
+        send_stats();
+    }
+    daemon_register(&balloon_daemon);
+    daemon_wake(&balloon_daemon);
+    if (device.features & BalloonDeflateOnOom) {
+        shrinker_register(&balloon_shrinker);
+    }
+    if (device.features & BalloonPageReporting) {
+        frame_report_register(&balloon_daemon, kReportOrder);
+    }
+    kprintf("virtio-balloon: features 0x%lx\n", device.features);
+    return true;
+}
+
+BalloonStats virtio_balloon_stats() {
+    LockGuard<Spinlock> guard(balloon_lock);
+    return stats;
+}
@@ -0,0 +1,32 @@
+#ifndef DRIVERS_VIRTIO_BALLOON_H
+#define DRIVERS_VIRTIO_BALLOON_H
+
+#include <stdint.h>
+
+struct BalloonStats {
+    // Frames currently held for the host.
+    uint64_t pages;
+    uint64_t inflated;
+    uint64_t deflated;
+    // Frames handed back to the kernel by reclaim rather than the host.
+    uint64_t pressure_deflated;
+    // Free blocks, and the frames in them, reported as unused.
+    uint64_t reported_blocks;
+    uint64_t reported_frames;
+};
+
+// Virtio memory balloon. The host sets a target number of pages; the
+// driver inflates by taking frames from the allocator and handing their
+// numbers to the device, and deflates by giving them back. Inflation only
+// uses memory above the high watermark and never reclaims for it. With
+// DEFLATE_ON_OOM, reclaim deflates the balloon before it evicts anything.
+// With PAGE_REPORTING, free buddy blocks of 2 MiB and up are reported to
+// the host so that it can drop their backing; they stay free, and a block
+// is reported again only after it was allocated or merged.
+//
+// Without interrupt routing the driver polls: its daemon checks the
+// target every kPollNs, sleeping on a timer deadline in between.
+bool virtio_balloon_init();
+BalloonStats virtio_balloon_stats();
+
+#endif // DRIVERS_VIRTIO_BALLOON_H
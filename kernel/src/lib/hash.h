@@ -0,0 +1,42 @@
+#ifndef LIB_HASH_H
+#define LIB_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Non-cryptographic 64-bit hash in the style of xxHash64, over whole words.
+// Four independent lanes keep the multiplier busy on long inputs.
+constexpr uint64_t kHashPrime1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t kHashPrime2 = 0xC2B2AE3D27D4EB4Full;
+constexpr uint64_t kHashPrime3 = 0x165667B19E3779F9ull;
+
+inline uint64_t hash_rotl(uint64_t value, unsigned bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t hash_round(uint64_t acc, uint64_t word) {
+    return hash_rotl(acc + word * kHashPrime2, 31) * kHashPrime1;
+}
+
+// `count` must be a multiple of four.
+inline uint64_t hash_words(const uint64_t* words, size_t count, uint64_t seed = 0) {
+    uint64_t lanes[4] = {seed + kHashPrime1 + kHashPrime2, seed + kHashPrime2, seed, seed - kHashPrime1};
+    for (size_t i = 0; i < count; i += 4) {
+        for (unsigned lane = 0; lane < 4; ++lane) {
+            lanes[lane] = hash_round(lanes[lane], words[i + lane]);
+        }
+    }
+    uint64_t hash = hash_rotl(lanes[0], 1) + hash_rotl(lanes[1], 7) + hash_rotl(lanes[2], 12) +
+                    hash_rotl(lanes[3], 18);
+    for (uint64_t lane : lanes) {
+        hash = (hash ^ hash_round(0, lane)) * kHashPrime1 + kHashPrime3;
+    }
+    hash += count * sizeof(uint64_t);
+    hash ^= hash >> 33;
+    hash *= kHashPrime2;
+    hash ^= hash >> 29;
+    hash *= kHashPrime3;
+    return hash ^ (hash >> 32);
+}
+
+#endif // LIB_HASH_H
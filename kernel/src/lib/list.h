@@ -0,0 +1,78 @@
+#ifndef LIB_LIST_H
+#define LIB_LIST_H
+
+#include "util.h"
+
+// Intrusive circular doubly linked list. A head is a ListNode that is
+// not embedded in any element; it must be initialised with list_init.
+struct ListNode {
+    ListNode* prev;
+    ListNode* next;
+};
+
+inline void list_init(ListNode* head) {
+    head->prev = head;
+    head->next = head;
+}
+
+inline bool list_empty(const ListNode* head) {
+    return head->next == head;
+}
+
+inline void list_insert_between(ListNode* node, ListNode* prev, ListNode* next) {
+    node->prev = prev;
+    node->next = next;
+    prev->next = node;
+    next->prev = node;
+}
+
+inline void list_push_front(ListNode* head, ListNode* node) {
+    list_insert_between(node, head, head->next);
+}
+
+inline void list_push_back(ListNode* head, ListNode* node) {
+    list_insert_between(node, head->prev, head);
+}
+
+inline void list_remove(ListNode* node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = nullptr;
+    node->next = nullptr;
+}
+
+inline ListNode* list_pop_front(ListNode* head) {
+    if (list_empty(head)) {
+        return nullptr;
+    }
+    ListNode* node = head->next;
+    list_remove(node);
+    return node;
+}
+
+inline ListNode* list_pop_back(ListNode* head) {
+    if (list_empty(head)) {
+        return nullptr;
+    }
+    ListNode* node = head->prev;
+    list_remove(node);
+    return node;
+}
+
+// Moves every element of `from` to the back of `to`, leaving `from` empty.
+inline void list_splice_back(ListNode* to, ListNode* from) {
+    if (list_empty(from)) {
+        return;
+    }
+    ListNode* first = from->next;
+    ListNode* last = from->prev;
+    first->prev = to->prev;
+    to->prev->next = first;
+    last->next = to;
+    to->prev = last;
+    list_init(from);
+}
+
+#define list_entry(node, type, member) container_of(node, type, member)
+
+#endif // LIB_LIST_H
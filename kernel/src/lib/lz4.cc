@@ -0,0 +1,163 @@
+#include "lz4.h"
+
+#include "string.h"
+
+constexpr size_t kMinMatch = 4;
+// The last match must start this far before the end of the input, and the
+// last five bytes are always literals.
+constexpr size_t kMatchStartLimit = 12;
+constexpr size_t kLastLiterals = 5;
+constexpr size_t kMaxOffset = 65535;
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - kLz4HashLog);
+}
+
+static uint8_t* write_length(uint8_t* op, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Emits literals [literals, literals + literal_count) followed by a match
+// of `match_length` at `offset`, or by nothing when `match_length` is 0.
+// Returns null if the sequence does not fit before `op_end`.
+static uint8_t* emit_sequence(uint8_t* op, uint8_t* op_end, const uint8_t* literals, size_t literal_count,
+                              size_t match_length, size_t offset) {
+    size_t worst = 1 + literal_count / 255 + 1 + literal_count + 2 + match_length / 255 + 1;
+    if (worst > (size_t)(op_end - op)) {
+        return nullptr;
+    }
+    uint8_t* token = op++;
+    *token = (uint8_t)((literal_count < 15 ? literal_count : 15) << 4);
+    if (literal_count >= 15) {
+        op = write_length(op, literal_count - 15);
+    }
+    memcpy(op, literals, literal_count);
+    op += literal_count;
+    if (match_length == 0) {
+        return op;
+    }
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t extra = match_length - kMinMatch;
+    *token |= (uint8_t)(extra < 15 ? extra : 15);
+    if (extra >= 15) {
+        op = write_length(op, extra - 15);
+    }
+    return op;
+}
+
+size_t lz4_compress(const void* src, size_t size, void* dst, size_t capacity, void* workspace) {
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* end = in + size;
+    const uint8_t* anchor = in;
+    uint8_t* op = (uint8_t*)dst;
+    uint8_t* op_end = op + capacity;
+    uint16_t* table = (uint16_t*)workspace;
+    if (size > kMaxOffset) {
+        return 0;
+    }
+    if (size > kMatchStartLimit) {
+        memset(table, 0, kLz4WorkspaceSize);
+        const uint8_t* match_start_end = end - kMatchStartLimit;
+        const uint8_t* match_end_limit = end - kLastLiterals;
+        const uint8_t* ip = in + 1;
+        while (ip < match_start_end) {
+            uint32_t h = hash(read32(ip));
+            const uint8_t* ref = in + table[h];
+            table[h] = (uint16_t)(ip - in);
+            if (read32(ref) != read32(ip)) {
+                ++ip;
+                continue;
+            }
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            size_t length = kMinMatch;
+            while (ip + length < match_end_limit && ip[length] == ref[length]) {
+                ++length;
+            }
+            op = emit_sequence(op, op_end, anchor, ip - anchor, length, ip - ref);
+            if (!op) {
+                return 0;
+            }
+            ip += length;
+            anchor = ip;
+            if (ip < match_start_end) {
+                table[hash(read32(ip - 2))] = (uint16_t)(ip - 2 - in);
+            }
+        }
+    }
+    op = emit_sequence(op, op_end, anchor, end - anchor, 0, 0);
+    return op ? op - (uint8_t*)dst : 0;
+}
+
+// Reads an extended length; returns false on truncated input.
+static bool read_length(const uint8_t** ip, const uint8_t* end, size_t* length) {
+    uint8_t byte;
+    do {
+        if (*ip >= end) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+int64_t lz4_decompress(const void* src, size_t size, void* dst, size_t capacity) {
+    const uint8_t* ip = (const uint8_t*)src;
+    const uint8_t* end = ip + size;
+    uint8_t* out = (uint8_t*)dst;
+    uint8_t* op = out;
+    uint8_t* op_end = out + capacity;
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && !read_length(&ip, end, &literal_count)) {
+            return -1;
+        }
+        if (literal_count > (size_t)(end - ip) || literal_count > (size_t)(op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, literal_count);
+        ip += literal_count;
+        op += literal_count;
+        if (ip == end) {
+            break;
+        }
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) {
+            return -1;
+        }
+        size_t length = token & 15;
+        if (length == 15 && !read_length(&ip, end, &length)) {
+            return -1;
+        }
+        length += kMinMatch;
+        if (length > (size_t)(op_end - op)) {
+            return -1;
+        }
+        // Matches may overlap their own output, so copy byte by byte.
+        const uint8_t* match = op - offset;
+        for (size_t i = 0; i < length; ++i) {
+            op[i] = match[i];
+        }
+        op += length;
+    }
+    return op - out;
+}
@@ -0,0 +1,18 @@
+#ifndef LIB_LZ4_H
+#define LIB_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// LZ4 block format (no frame header), for inputs below 64 KiB.
+constexpr unsigned kLz4HashLog = 12;
+constexpr size_t kLz4WorkspaceSize = (1u << kLz4HashLog) * sizeof(uint16_t);
+
+// Returns the compressed size, or 0 if the result would not fit in
+// `capacity`. `workspace` holds kLz4WorkspaceSize bytes of match table.
+size_t lz4_compress(const void* src, size_t size, void* dst, size_t capacity, void* workspace);
+// Returns the decompressed size, or -1 if the input is malformed or the
+// output would not fit in `capacity`.
+int64_t lz4_decompress(const void* src, size_t size, void* dst, size_t capacity);
+
+#endif // LIB_LZ4_H
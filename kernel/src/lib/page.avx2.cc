@@ -0,0 +1,41 @@
+#include <immintrin.h>
+
+#include "../mm/layout.h"
+#include "page.h"
+
+constexpr unsigned kPageVectors = kPageSize / sizeof(__m256i);
+// Four vectors, two cache lines, per iteration.
+constexpr unsigned kUnroll = 4;
+
+bool page_same_filled_avx2(const void* page, uint64_t* value) {
+    const __m256i* vectors = (const __m256i*)page;
+    uint64_t first = *(const uint64_t*)page;
+    __m256i fill = _mm256_set1_epi64x((long long)first);
+    for (unsigned i = 0; i < kPageVectors; i += kUnroll) {
+        __m256i diff = _mm256_xor_si256(_mm256_load_si256(&vectors[i]), fill);
+        for (unsigned j = 1; j < kUnroll; ++j) {
+            diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_load_si256(&vectors[i + j]), fill));
+        }
+        if (!_mm256_testz_si256(diff, diff)) {
+            return false;
+        }
+    }
+    *value = first;
+    return true;
+}
+
+bool page_equal_avx2(const void* a, const void* b) {
+    const __m256i* left = (const __m256i*)a;
+    const __m256i* right = (const __m256i*)b;
+    for (unsigned i = 0; i < kPageVectors; i += kUnroll) {
+        __m256i diff = _mm256_setzero_si256();
+        for (unsigned j = 0; j < kUnroll; ++j) {
+            diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_load_si256(&left[i + j]),
+                                                          _mm256_load_si256(&right[i + j])));
+        }
+        if (!_mm256_testz_si256(diff, diff)) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,32 @@
+#include "page.h"
+
+#include <stddef.h>
+
+#include "../arch/x86_64/fpu.h"
+#include "../mm/layout.h"
+#include "string.h"
+
+constexpr size_t kPageWords = kPageSize / sizeof(uint64_t);
+
+bool page_same_filled(const void* page, uint64_t* value) {
+    if (fpu_kernel_avx2()) {
+        KernelFpuGuard guard;
+        return page_same_filled_avx2(page, value);
+    }
+    const uint64_t* words = (const uint64_t*)page;
+    for (size_t i = 1; i < kPageWords; ++i) {
+        if (words[i] != words[0]) {
+            return false;
+        }
+    }
+    *value = words[0];
+    return true;
+}
+
+bool page_equal(const void* a, const void* b) {
+    if (fpu_kernel_avx2()) {
+        KernelFpuGuard guard;
+        return page_equal_avx2(a, b);
+    }
+    return memcmp(a, b, kPageSize) == 0;
+}
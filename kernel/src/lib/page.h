@@ -0,0 +1,18 @@
+#ifndef LIB_PAGE_H
+#define LIB_PAGE_H
+
+#include <stdint.h>
+
+// Scans over whole 4 KiB pages, the hot loops of same-page merging and
+// compressed swap. They run on AVX2 inside a KernelFpuGuard when the CPU
+// has it, and on words otherwise.
+
+// Whether `page` is one word repeated, which it stores in `value`.
+bool page_same_filled(const void* page, uint64_t* value);
+bool page_equal(const void* a, const void* b);
+
+// The AVX2 versions, in page.avx2.cc. Only to be called by the above.
+bool page_same_filled_avx2(const void* page, uint64_t* value);
+bool page_equal_avx2(const void* a, const void* b);
+
+#endif // LIB_PAGE_H
@@ -0,0 +1,257 @@
+#include "rbtree.h"
+
+static bool is_red(const RbNode* node) {
+    return node && node->red;
+}
+
+static void replace_child(RbTree* tree, RbNode* parent, RbNode* old_child, RbNode* new_child) {
+    if (!parent) {
+        tree->root = new_child;
+    } else if (parent->left == old_child) {
+        parent->left = new_child;
+    } else {
+        parent->right = new_child;
+    }
+}
+
+// Moves `node` down to the left; its right child takes its place. Only the
+// two nodes involved see their subtrees change.
+static void rotate_left(RbTree* tree, RbNode* node, RbUpdate update) {
+    RbNode* pivot = node->right;
+    node->right = pivot->left;
+    if (pivot->left) {
+        pivot->left->parent = node;
+    }
+    pivot->parent = node->parent;
+    replace_child(tree, node->parent, node, pivot);
+    pivot->left = node;
+    node->parent = pivot;
+    if (update) {
+        update(node);
+        update(pivot);
+    }
+}
+
+static void rotate_right(RbTree* tree, RbNode* node, RbUpdate update) {
+    RbNode* pivot = node->left;
+    node->left = pivot->right;
+    if (pivot->right) {
+        pivot->right->parent = node;
+    }
+    pivot->parent = node->parent;
+    replace_child(tree, node->parent, node, pivot);
+    pivot->right = node;
+    node->parent = pivot;
+    if (update) {
+        update(node);
+        update(pivot);
+    }
+}
+
+void rb_propagate(RbNode* node, RbUpdate update) {
+    for (; node; node = node->parent) {
+        update(node);
+    }
+}
+
+void rb_insert(RbTree* tree, RbNode* node, RbUpdate update) {
+    if (update) {
+        rb_propagate(node, update);
+    }
+    while (is_red(node->parent)) {
+        RbNode* parent = node->parent;
+        // The root is black, so a red parent always has a parent.
+        RbNode* grandparent = parent->parent;
+        if (parent == grandparent->left) {
+            RbNode* uncle = grandparent->right;
+            if (is_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(tree, parent, update);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            rotate_right(tree, grandparent, update);
+        } else {
+            RbNode* uncle = grandparent->left;
+            if (is_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(tree, parent, update);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            rotate_left(tree, grandparent, update);
+        }
+    }
+    tree->root->red = false;
+}
+
+// Exchanges the positions and colours of `node` and its in-order successor
+// `next`, which has no left child.
+static void swap_with_successor(RbTree* tree, RbNode* node, RbNode* next) {
+    RbNode* parent = node->parent;
+    RbNode* left = node->left;
+    RbNode* right = node->right;
+    bool red = node->red;
+    RbNode* next_parent = next->parent;
+    RbNode* next_right = next->right;
+    bool next_red = next->red;
+
+    replace_child(tree, parent, node, next);
+    next->parent = parent;
+    next->left = left;
+    left->parent = next;
+    next->red = red;
+    if (right == next) {
+        next->right = node;
+        node->parent = next;
+    } else {
+        next->right = right;
+        right->parent = next;
+        next_parent->left = node;
+        node->parent = next_parent;
+    }
+    node->left = nullptr;
+    node->right = next_right;
+    if (next_right) {
+        next_right->parent = node;
+    }
+    node->red = next_red;
+}
+
+// Restores the black height after a black node was removed from below
+// `parent`, leaving `node` (possibly null) in its place.
+static void erase_fixup(RbTree* tree, RbNode* node, RbNode* parent, RbUpdate update) {
+    while (node != tree->root && !is_red(node)) {
+        if (node == parent->left) {
+            RbNode* sibling = parent->right;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_left(tree, parent, update);
+                sibling = parent->right;
+            }
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!is_red(sibling->right)) {
+                sibling->left->red = false;
+                sibling->red = true;
+                rotate_right(tree, sibling, update);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rotate_left(tree, parent, update);
+        } else {
+            RbNode* sibling = parent->left;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_right(tree, parent, update);
+                sibling = parent->left;
+            }
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!is_red(sibling->left)) {
+                sibling->right->red = false;
+                sibling->red = true;
+                rotate_left(tree, sibling, update);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rotate_right(tree, parent, update);
+        }
+        node = tree->root;
+    }
+    if (node) {
+        node->red = false;
+    }
+}
+
+void rb_erase(RbTree* tree, RbNode* node, RbUpdate update) {
+    if (node->left && node->right) {
+        RbNode* next = node->right;
+        while (next->left) {
+            next = next->left;
+        }
+        swap_with_successor(tree, node, next);
+    }
+    RbNode* child = node->left ? node->left : node->right;
+    RbNode* parent = node->parent;
+    if (child) {
+        child->parent = parent;
+    }
+    replace_child(tree, parent, node, child);
+    // The successor, if it moved, now sits on this path too.
+    if (update && parent) {
+        rb_propagate(parent, update);
+    }
+    if (!node->red) {
+        erase_fixup(tree, child, parent, update);
+    }
+}
+
+RbNode* rb_first(const RbTree* tree) {
+    RbNode* node = tree->root;
+    if (!node) {
+        return nullptr;
+    }
+    while (node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+RbNode* rb_next(RbNode* node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return node;
+    }
+    while (node->parent && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+RbNode* rb_prev(RbNode* node) {
+    if (node->left) {
+        node = node->left;
+        while (node->right) {
+            node = node->right;
+        }
+        return node;
+    }
+    while (node->parent && node == node->parent->left) {
+        node = node->parent;
+    }
+    return node->parent;
+}
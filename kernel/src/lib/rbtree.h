@@ -0,0 +1,50 @@
+#ifndef LIB_RBTREE_H
+#define LIB_RBTREE_H
+
+#include "util.h"
+
+// Intrusive red-black tree. The tree never compares keys: callers walk
+// down to the insertion point themselves, attach the node there with
+// rb_link and then rebalance with rb_insert.
+//
+// An augmented tree keeps data in each node that is derived from the
+// node's whole subtree, such as the largest of some per-node value.
+// `update` recomputes it for one node from the node itself and its two
+// children. Insertion, removal and rotations call it wherever a subtree
+// changed; after changing the value a node contributes, callers refresh
+// its ancestors with rb_propagate.
+struct RbNode {
+    RbNode* parent;
+    RbNode* left;
+    RbNode* right;
+    bool red;
+};
+
+struct RbTree {
+    RbNode* root;
+};
+
+using RbUpdate = void (*)(RbNode* node);
+
+// `link` is the null child pointer of `parent` (or the root pointer of an
+// empty tree) where `node` belongs.
+inline void rb_link(RbNode* node, RbNode* parent, RbNode** link) {
+    node->parent = parent;
+    node->left = nullptr;
+    node->right = nullptr;
+    node->red = true;
+    *link = node;
+}
+
+void rb_insert(RbTree* tree, RbNode* node, RbUpdate update = nullptr);
+void rb_erase(RbTree* tree, RbNode* node, RbUpdate update = nullptr);
+// Calls `update` on `node` and each of its ancestors, bottom up.
+void rb_propagate(RbNode* node, RbUpdate update);
+
+RbNode* rb_first(const RbTree* tree);
+RbNode* rb_next(RbNode* node);
+RbNode* rb_prev(RbNode* node);
+
+#define rb_entry(node, type, member) container_of(node, type, member)
+
+#endif // LIB_RBTREE_H
@@ -0,0 +1,68 @@
+#include "string.h"
+
+#include <stdint.h>
+
+extern "C" void* memset(void* dest, int value, size_t count) {
+    void* d = dest;
+    asm volatile("rep stosb"
+                 : "+D"(d), "+c"(count)
+                 : "a"(value)
+                 : "memory");
+    return dest;
+}
+
+extern "C" void* memcpy(void* dest, const void* src, size_t count) {
+    void* d = dest;
+    asm volatile("rep movsb"
+                 : "+D"(d), "+S"(src), "+c"(count)
+                 :
+                 : "memory");
+    return dest;
+}
+
+extern "C" void* memmove(void* dest, const void* src, size_t count) {
+    if (dest <= src || (const uint8_t*)src + count <= (uint8_t*)dest) {
+        return memcpy(dest, src, count);
+    }
+    void* d = (uint8_t*)dest + count - 1;
+    const void* s = (const uint8_t*)src + count - 1;
+    asm volatile("std\n\t"
+                 "rep movsb\n\t"
+                 "cld"
+                 : "+D"(d), "+S"(s), "+c"(count)
+                 :
+                 : "memory");
+    return dest;
+}
+
+extern "C" int memcmp(const void* a, const void* b, size_t count) {
+    const uint8_t* pa = (const uint8_t*)a;
+    const uint8_t* pb = (const uint8_t*)b;
+    for (size_t i = 0; i < count; ++i) {
+        if (pa[i] != pb[i]) {
+            return pa[i] < pb[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+extern "C" size_t strlen(const char* str) {
+    const char* p = str;
+    for (; *p != 0; ++p) {}
+    return p - str;
+}
+
+void memzero_nontemporal(void* dest, size_t count) {
+    uint64_t* d = (uint64_t*)dest;
+    for (size_t i = 0; i < count / 8; i += 4) {
+        asm volatile("movnti %1, 0(%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)"
+                     :
+                     : "r"(d + i), "r"(0ull)
+                     : "memory");
+    }
+    // Weakly ordered stores must be visible before the memory is handed out.
+    asm volatile("sfence" ::: "memory");
+}
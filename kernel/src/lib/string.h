@@ -0,0 +1,21 @@
+#ifndef LIB_STRING_H
+#define LIB_STRING_H
+
+#include <stddef.h>
+
+extern "C" {
+
+void* memset(void* dest, int value, size_t count);
+void* memcpy(void* dest, const void* src, size_t count);
+void* memmove(void* dest, const void* src, size_t count);
+int memcmp(const void* a, const void* b, size_t count);
+size_t strlen(const char* str);
+
+}
+
+// Clears memory with non-temporal stores that bypass the cache, for large
+// buffers that will not be read soon. `dest` must be 8-byte aligned and
+// `count` a multiple of 32.
+void memzero_nontemporal(void* dest, size_t count);
+
+#endif // LIB_STRING_H
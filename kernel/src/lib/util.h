@@ -0,0 +1,41 @@
+#ifndef LIB_UTIL_H
+#define LIB_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define container_of(ptr, type, member) \
+    ((type*)((uint8_t*)(ptr) - offsetof(type, member)))
+
+template <typename T>
+constexpr T min(T a, T b) {
+    return a < b ? a : b;
+}
+
+template <typename T>
+constexpr T max(T a, T b) {
+    return a > b ? a : b;
+}
+
+constexpr uint64_t align_down(uint64_t value, uint64_t align) {
+    return value & ~(align - 1);
+}
+
+constexpr uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+constexpr bool is_aligned(uint64_t value, uint64_t align) {
+    return (value & (align - 1)) == 0;
+}
+
+constexpr uint64_t div_round_up(uint64_t value, uint64_t divisor) {
+    return (value + divisor - 1) / divisor;
+}
+
+// Floor of log2; undefined for 0.
+constexpr unsigned ilog2(uint64_t value) {
+    return 63 - __builtin_clzll(value);
+}
+
+#endif // LIB_UTIL_H
@@ -0,0 +1,124 @@
+#include "log.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arch/x86_64/cpu.h"
+#include "sync/spinlock.h"
+
+constexpr uint16_t kCom1 = 0x3F8;
+
+static Spinlock log_lock;
+
+void log_init() {
+    outb(kCom1 + 1, 0x00);
+    outb(kCom1 + 3, 0x80);
+    outb(kCom1 + 0, 0x01);
+    outb(kCom1 + 1, 0x00);
+    outb(kCom1 + 3, 0x03);
+    outb(kCom1 + 2, 0xC7);
+    outb(kCom1 + 4, 0x03);
+}
+
+static void put_char(char c) {
+    if (c == '\n') {
+        put_char('\r');
+    }
+    while (!(inb(kCom1 + 5) & 0x20)) {
+        cpu_pause();
+    }
+    outb(kCom1, c);
+}
+
+static void put_padded(const char* str, size_t len, int width, char pad) {
+    for (int i = (int)len; i < width; ++i) {
+        put_char(pad);
+    }
+    for (size_t i = 0; i < len; ++i) {
+        put_char(str[i]);
+    }
+}
+
+static void put_number(uint64_t value, unsigned base, bool upper, bool negative, int width, char pad) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char buffer[24];
+    char* ptr = &buffer[sizeof(buffer)];
+    do {
+        *--ptr = digits[value % base];
+        value /= base;
+    } while (value > 0);
+    if (negative) {
+        *--ptr = '-';
+    }
+    put_padded(ptr, &buffer[sizeof(buffer)] - ptr, width, pad);
+}
+
+void kvprintf(const char* fmt, va_list args) {
+    LockGuard<Spinlock> guard(log_lock);
+    for (; *fmt; ++fmt) {
+        if (*fmt != '%') {
+            put_char(*fmt);
+            continue;
+        }
+        ++fmt;
+        char pad = ' ';
+        if (*fmt == '0') {
+            pad = '0';
+            ++fmt;
+        }
+        int width = 0;
+        for (; *fmt >= '0' && *fmt <= '9'; ++fmt) {
+            width = width * 10 + (*fmt - '0');
+        }
+        int length = 0;
+        for (; *fmt == 'l' || *fmt == 'z'; ++fmt) {
+            length = *fmt == 'z' ? 2 : length + 1;
+        }
+        switch (*fmt) {
+        case 'd':
+        case 'i': {
+            int64_t value = length ? va_arg(args, int64_t) : va_arg(args, int);
+            put_number(value < 0 ? -(uint64_t)value : value, 10, false, value < 0, width, pad);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X': {
+            uint64_t value = length ? va_arg(args, uint64_t) : va_arg(args, unsigned);
+            put_number(value, *fmt == 'u' ? 10 : 16, *fmt == 'X', false, width, pad);
+            break;
+        }
+        case 'p':
+            put_char('0');
+            put_char('x');
+            put_number((uintptr_t)va_arg(args, void*), 16, false, false, 16, '0');
+            break;
+        case 's': {
+            const char* str = va_arg(args, const char*);
+            size_t len = 0;
+            for (; str[len]; ++len) {}
+            put_padded(str, len, width, ' ');
+            break;
+        }
+        case 'c':
+            put_char((char)va_arg(args, int));
+            break;
+        case '%':
+            put_char('%');
+            break;
+        case '\0':
+            return;
+        default:
+            put_char('%');
+            put_char(*fmt);
+            break;
+        }
+    }
+}
+
+void kprintf(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    kvprintf(fmt, args);
+    va_end(args);
+}
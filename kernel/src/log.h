@@ -0,0 +1,10 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+
+void log_init();
+void kprintf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void kvprintf(const char* fmt, va_list args);
+
+#endif // LOG_H
@@ -1,9 +1,61 @@
 #include "../../common/bootinfo.h"
-
-template <typename T>
-void consume(T){}
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/fpu.h"
+#include "arch/x86_64/gdt.h"
+#include "arch/x86_64/idt.h"
+#include "arch/x86_64/lapic.h"
+#include "arch/x86_64/percpu.h"
+#include "arch/x86_64/smp.h"
+#include "drivers/virtio_balloon.h"
+#include "log.h"
+#include "mm/cma.h"
+#include "mm/compact.h"
+#include "mm/fault.h"
+#include "mm/frame.h"
+#include "mm/hugetlb.h"
+#include "mm/ksm.h"
+#include "mm/numa.h"
+#include "mm/pagecache.h"
+#include "mm/prezero.h"
+#include "mm/reclaim.h"
+#include "mm/tlb.h"
+#include "mm/vmalloc.h"
+#include "mm/vmm.h"
+#include "mm/zram.h"
+#include "sched/daemon.h"
+#include "time/clock.h"
+#include "time/timer.h"
 
 extern "C" int kmain(BootInfo* boot_info) {
-    consume(boot_info);
-    return 0;
+    irq_disable();
+    log_init();
+    percpu_init_boot();
+    gdt_init();
+    idt_init();
+    fpu_init();
+    frame_init_early(boot_info);
+    smp_reserve_trampoline();
+    vmm_init(boot_info);
+    numa_init(boot_info);
+    frame_init();
+    hugetlb_init(kHugetlbBootLargePages, kHugetlbBootHugePages);
+    vmalloc_init();
+    lapic_init();
+    tlb_init();
+    timers_init();
+    clock_init();
+    smp_init();
+    cma_init(kCmaDefaultSize);
+    compact_init();
+    prezero_init();
+    reclaim_init();
+    zram_init();
+    ksm_init();
+    page_cache_init();
+    fault_init();
+    virtio_balloon_init();
+
+    FrameStats frames = frame_stats();
+    kprintf("memory: %lu of %lu frames free\n", frames.free_frames, frames.total_frames);
+    idle_loop();
 }
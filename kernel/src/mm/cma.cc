@@ -0,0 +1,143 @@
+#include "cma.h"
+
+#include "../lib/string.h"
+#include "../lib/util.h"
+#include "../log.h"
+#include "../panic.h"
+#include "../sync/spinlock.h"
+#include "migrate.h"
+
+static Spinlock cma_lock;
+static uint64_t region_start = 0;
+static uint64_t region_end = 0;
+// One bit per region frame, set while the frame belongs to a cma_alloc block.
+static uint64_t* claimed = nullptr;
+static CmaStats stats;
+
+static bool claimed_test(uint64_t pfn) {
+    uint64_t bit = pfn - region_start;
+    return claimed[bit / 64] & (1ull << (bit % 64));
+}
+
+static void claimed_set(uint64_t start, uint64_t count, bool value) {
+    for (uint64_t pfn = start; pfn < start + count; ++pfn) {
+        uint64_t bit = pfn - region_start;
+        if (value) {
+            claimed[bit / 64] |= 1ull << (bit % 64);
+        } else {
+            claimed[bit / 64] &= ~(1ull << (bit % 64));
+        }
+    }
+}
+
+void cma_init(uint64_t size) {
+    FrameStats frames = frame_stats();
+    size = min(size, (frames.total_frames << kFrameShift) / 8);
+    if (size < kLargePageSize) {
+        return;
+    }
+    Frame* block = nullptr;
+    unsigned order = min(ilog2(size >> kFrameShift), kMaxOrder);
+    for (; order >= kLargeOrder; --order) {
+        if ((block = frame_alloc(order))) {
+            break;
+        }
+    }
+    if (!block) {
+        kprintf("cma: no contiguous block available\n");
+        return;
+    }
+    uint64_t count = 1ull << order;
+    unsigned bitmap_order = ilog2(div_round_up(count / 8, kFrameSize) * 2 - 1);
+    Frame* bitmap = frame_alloc(bitmap_order, AllocZero);
+    if (!bitmap) {
+        frame_free(block, order);
+        return;
+    }
+    claimed = (uint64_t*)frame_to_virt(bitmap);
+    for (uint64_t i = 0; i < count; ++i) {
+        block[i].flags |= FrameCma;
+    }
+    region_start = frame_to_pfn(block);
+    region_end = region_start + count;
+    stats.region_frames = count;
+    frame_free(block, order);
+    kprintf("cma: %lu MiB at 0x%lx\n", (count << kFrameShift) >> 20, region_start << kFrameShift);
+}
+
+static bool range_claimable(uint64_t start, uint64_t count) {
+    for (uint64_t pfn = start; pfn < start + count; ++pfn) {
+        if (claimed_test(pfn)) {
+            return false;
+        }
+        Frame* frame = pfn_to_frame(pfn);
+        uint32_t flags = __atomic_load_n(&frame->flags, __ATOMIC_RELAXED);
+        if (frame->refcount != 0 && !(flags & FrameMovable)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool evacuate(uint64_t start, uint64_t count) {
+    for (uint64_t pfn = start; pfn < start + count; ++pfn) {
+        Frame* frame = pfn_to_frame(pfn);
+        if (__atomic_load_n(&frame->flags, __ATOMIC_ACQUIRE) & FrameIsolated) {
+            continue;
+        }
+        if (!migrate_frame(frame)) {
+            return false;
+        }
+        stats.migrated_frames++;
+    }
+    return frame_range_isolated(start, start + count);
+}
+
+Frame* cma_alloc(uint64_t count, unsigned align_order) {
+    if (count == 0 || !claimed) {
+        return nullptr;
+    }
+    LockGuard<Spinlock> guard(cma_lock);
+    uint64_t align = 1ull << align_order;
+    for (uint64_t start = align_up(region_start, align); start + count <= region_end; start += align) {
+        if (!range_claimable(start, count)) {
+            continue;
+        }
+        if (!frame_isolate_range(start, start + count)) {
+            break;
+        }
+        if (!evacuate(start, count)) {
+            frame_unisolate_range(start, start + count, false);
+            continue;
+        }
+        frame_unisolate_range(start, start + count, true);
+        claimed_set(start, count, true);
+        Frame* frame = pfn_to_frame(start);
+        frame->refcount = 1;
+        frame->order = 0;
+        stats.allocations++;
+        stats.allocated_frames += count;
+        return frame;
+    }
+    stats.failures++;
+    return nullptr;
+}
+
+void cma_release(Frame* frame, uint64_t count) {
+    uint64_t start = frame_to_pfn(frame);
+    KASSERT(start >= region_start && start + count <= region_end);
+    {
+        LockGuard<Spinlock> guard(cma_lock);
+        claimed_set(start, count, false);
+        stats.allocated_frames -= count;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        frame[i].order = 0;
+        frame_free(&frame[i], 0);
+    }
+}
+
+CmaStats cma_stats() {
+    LockGuard<Spinlock> guard(cma_lock);
+    return stats;
+}
@@ -0,0 +1,27 @@
+#ifndef MM_CMA_H
+#define MM_CMA_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+constexpr uint64_t kCmaDefaultSize = 64ull << 20;
+
+struct CmaStats {
+    uint64_t region_frames;
+    uint64_t allocated_frames;
+    uint64_t allocations;
+    uint64_t failures;
+    uint64_t migrated_frames;
+};
+
+// Contiguous memory allocator. A naturally aligned block is set aside at
+// boot; while unclaimed its frames serve AllocMovable requests, and
+// cma_alloc migrates whatever movable data sits in a candidate range out
+// of the way before handing the range over.
+void cma_init(uint64_t size);
+Frame* cma_alloc(uint64_t count, unsigned align_order = 0);
+void cma_release(Frame* frame, uint64_t count);
+CmaStats cma_stats();
+
+#endif // MM_CMA_H
@@ -0,0 +1,136 @@
+#include "compact.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../sched/daemon.h"
+#include "../sync/spinlock.h"
+#include "frame.h"
+#include "migrate.h"
+
+constexpr uint64_t kBlockFrames = 1ull << kLargeOrder;
+// The background daemon stops once this many 2 MiB blocks are free.
+constexpr uint64_t kFreeBlockTarget = 16;
+// Blocks a single direct compaction may scan.
+constexpr uint64_t kDirectScanBlocks = 512;
+
+static Spinlock compact_lock;
+static CompactStats stats;
+// Next block each scanner looks at, as a pfn.
+static uint64_t background_cursor = 0;
+static uint64_t direct_cursor = 0;
+
+static bool compact_run(void* context);
+
+static Daemon compact_daemon("compact", compact_run);
+
+void compact_init() {
+    daemon_register(&compact_daemon);
+}
+
+void compact_wake() {
+    daemon_wake(&compact_daemon);
+}
+
+// Free blocks of at least `order`, counted in units of that order.
+static uint64_t free_blocks(unsigned order) {
+    FrameStats frames = frame_stats();
+    uint64_t count = 0;
+    for (unsigned o = order; o <= kMaxOrder; ++o) {
+        count += frames.free_blocks[o] << (o - order);
+    }
+    return count;
+}
+
+// Whether every used frame of the block could be migrated, and there is
+// at least one.
+static bool block_movable(uint64_t start) {
+    uint64_t free = frame_count_free(start, start + kBlockFrames);
+    if (free == kBlockFrames) {
+        return false;
+    }
+    uint64_t movable = 0;
+    for (uint64_t pfn = start; pfn < start + kBlockFrames; ++pfn) {
+        if (__atomic_load_n(&pfn_to_frame(pfn)->flags, __ATOMIC_RELAXED) & FrameMovable) {
+            ++movable;
+        }
+    }
+    return free + movable == kBlockFrames;
+}
+
+// Migrates everything out of the block at `start`. Its free frames are
+// isolated first so that the copies land in other blocks.
+static bool evacuate_block(uint64_t start) {
+    uint64_t end = start + kBlockFrames;
+    if (!frame_isolate_range(start, end)) {
+        return false;
+    }
+    stats.attempts++;
+    for (uint64_t pfn = start; pfn < end; ++pfn) {
+        Frame* frame = pfn_to_frame(pfn);
+        if (__atomic_load_n(&frame->flags, __ATOMIC_ACQUIRE) & FrameIsolated) {
+            continue;
+        }
+        if (!migrate_frame(frame)) {
+            break;
+        }
+        stats.migrated++;
+    }
+    bool freed = frame_range_isolated(start, end);
+    frame_unisolate_range(start, end, false);
+    if (freed) {
+        stats.successes++;
+    }
+    return freed;
+}
+
+// Examines the block at `*cursor` and advances the cursor, wrapping at the
+// end of memory. Returns whether the block was freed.
+static bool compact_next(uint64_t* cursor) {
+    uint64_t start = *cursor;
+    *cursor = start + 2 * kBlockFrames > frame_map_count ? 0 : start + kBlockFrames;
+    stats.blocks_scanned++;
+    return block_movable(start) && evacuate_block(start);
+}
+
+bool compact_direct(unsigned order) {
+    if (order > kLargeOrder || frame_map_count < kBlockFrames) {
+        return false;
+    }
+    LockGuard<Spinlock> guard(compact_lock);
+    uint64_t start = rdtsc();
+    stats.direct_runs++;
+    bool done = free_blocks(order) > 0;
+    for (uint64_t i = 0; i < kDirectScanBlocks && !done; ++i) {
+        done = compact_next(&direct_cursor) && free_blocks(order) > 0;
+    }
+    stats.cycles += rdtsc() - start;
+    compact_wake();
+    return done;
+}
+
+static bool compact_run(void*) {
+    if (frame_map_count < kBlockFrames) {
+        return false;
+    }
+    LockGuard<Spinlock> guard(compact_lock);
+    uint64_t start = rdtsc();
+    stats.background_runs++;
+    bool more = true;
+    while (rdtsc() - start < kDaemonRunCycles) {
+        if (free_blocks(kLargeOrder) >= kFreeBlockTarget) {
+            more = false;
+            break;
+        }
+        compact_next(&background_cursor);
+        if (background_cursor == 0) {
+            // One full pass per wakeup.
+            more = false;
+            break;
+        }
+    }
+    stats.cycles += rdtsc() - start;
+    return more;
+}
+
+CompactStats compact_stats() {
+    return stats;
+}
@@ -0,0 +1,33 @@
+#ifndef MM_COMPACT_H
+#define MM_COMPACT_H
+
+#include <stdint.h>
+
+// Allocations of this order and above compact memory before failing.
+constexpr unsigned kCompactMinOrder = 4;
+
+struct CompactStats {
+    uint64_t background_runs;
+    uint64_t direct_runs;
+    uint64_t blocks_scanned;
+    // 2 MiB blocks evacuation was attempted on, and those that became free.
+    uint64_t attempts;
+    uint64_t successes;
+    uint64_t migrated;
+    uint64_t cycles;
+};
+
+// Memory compaction. Physical memory is scanned in 2 MiB blocks; a block
+// whose used frames are all movable has them migrated elsewhere so that
+// it merges back into a free 2 MiB block. A background daemon keeps a
+// reserve of such blocks, spending a bounded number of cycles per run, and
+// allocations of kCompactMinOrder or more compact synchronously when the
+// free lists cannot serve them.
+void compact_init();
+// Compacts until a block of `order` (at most kLargeOrder) is free or a
+// scan budget runs out. Returns whether such a block is now available.
+bool compact_direct(unsigned order);
+void compact_wake();
+CompactStats compact_stats();
+
+#endif // MM_COMPACT_H
@@ -0,0 +1,313 @@
+#include "fault.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/idt.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/string.h"
+#include "../lib/util.h"
+#include "../panic.h"
+#include "ksm.h"
+#include "layout.h"
+#include "migrate.h"
+#include "pagecache.h"
+#include "reclaim.h"
+#include "region.h"
+#include "swap.h"
+#include "thp.h"
+#include "vmalloc.h"
+
+static Frame* zero;
+static unsigned around_pages = kFaultAroundPages;
+static PER_CPU PerCpu<FaultStats> stats;
+
+static void page_fault_handler(InterruptFrame* frame, void* context);
+
+void fault_init() {
+    zero = frame_alloc(0, AllocZero);
+    if (!zero) {
+        panic("fault: cannot allocate the zero frame");
+    }
+    zero->flags |= FrameReserved;
+    thp_init();
+    interrupt_register(kVectorPageFault, page_fault_handler);
+}
+
+Frame* zero_frame() {
+    return zero;
+}
+
+void fault_set_around_pages(unsigned pages) {
+    pages = min(pages, kMaxFaultAroundPages);
+    __atomic_store_n(&around_pages, pages > 1 ? 1u << ilog2(pages) : 0u, __ATOMIC_RELAXED);
+}
+
+// Whether the current translation already allows the access, meaning the
+// fault raced with another CPU resolving it or hit a stale TLB entry.
+static bool access_allowed(AddressSpace& space, uintptr_t addr, uint64_t error) {
+    uint64_t phys, flags;
+    if (!space.translate(addr, &phys, &flags)) {
+        return false;
+    }
+    if ((error & FaultWrite) && !(flags & PageWritable)) {
+        return false;
+    }
+    return !((error & FaultFetch) && (flags & PageNoExecute));
+}
+
+// Makes a page that only `space` maps known to migration, reclaim and
+// same-page merging.
+static void track(Frame* frame, AddressSpace& space, uintptr_t page) {
+    frame_set_movable(frame, &space, page);
+    lru_add(frame);
+    ksm_note_anon_page();
+}
+
+static bool map_fresh_frame(AddressSpace& space, uintptr_t page, uint64_t flags) {
+    Frame* frame = frame_alloc(0, AllocZero | AllocMovable);
+    if (!frame) {
+        return false;
+    }
+    if (!space.map(page, frame_to_phys(frame), kPageSize, flags)) {
+        frame_free(frame, 0);
+        return false;
+    }
+    track(frame, space, page);
+    stats.get()->anon_allocs++;
+    return true;
+}
+
+static bool copy_on_write(AddressSpace& space, uintptr_t page, uint64_t phys, uint64_t flags) {
+    Frame* frame = phys_to_frame(phys);
+    if (frame == zero) {
+        return map_fresh_frame(space, page, flags);
+    }
+    if (__atomic_load_n(&frame->refcount, __ATOMIC_ACQUIRE) == 1) {
+        if (!space.protect(page, kPageSize, flags)) {
+            return false;
+        }
+        track(frame, space, page);
+        stats.get()->cow_reuses++;
+        return true;
+    }
+    Frame* copy = frame_alloc(0, AllocMovable);
+    if (!copy) {
+        return false;
+    }
+    memcpy(frame_to_virt(copy), frame_to_virt(frame), kPageSize);
+    if (!space.map(page, frame_to_phys(copy), kPageSize, flags)) {
+        frame_free(copy, 0);
+        return false;
+    }
+    track(copy, space, page);
+    frame_put(frame, 0);
+    stats.get()->cow_copies++;
+    return true;
+}
+
+static bool swap_in(AddressSpace& space, uintptr_t page, uint64_t slot, uint64_t flags) {
+    Frame* frame = frame_alloc(0, AllocMovable);
+    if (!frame) {
+        return false;
+    }
+    // Mapping over the swap entry releases the slot.
+    if (!swap_load(slot, frame_to_virt(frame)) || !space.map(page, frame_to_phys(frame), kPageSize, flags)) {
+        frame_free(frame, 0);
+        return false;
+    }
+    track(frame, space, page);
+    stats.get()->swap_ins++;
+    return true;
+}
+
+// Maps the pages of the aligned window around `page` that the page cache
+// already holds, read-only, so that a sequential scan takes one fault per
+// window rather than one per page. Pages that are not cached are left to
+// fault on their own rather than read here.
+static void fault_around(AddressSpace& space, VmRegion* region, uintptr_t page, uint64_t flags) {
+    uint64_t window = (uint64_t)__atomic_load_n(&around_pages, __ATOMIC_RELAXED) << kFrameShift;
+    if (window == 0) {
+        return;
+    }
+    uintptr_t start = max(align_down(page, window), region->start);
+    uintptr_t end = min(align_down(page, window) + window, region->end);
+    for (uintptr_t virt = start; virt < end; virt += kPageSize) {
+        uint64_t index = region_cache_index(region, virt);
+        if (index >= region->cache->pages) {
+            break;
+        }
+        if (virt == page) {
+            continue;
+        }
+        Frame* frame = page_cache_find(region->cache, index);
+        if (!frame) {
+            continue;
+        }
+        if (!space.map_new_page(virt, frame_to_phys(frame), flags & ~PageWritable)) {
+            frame_put(frame, 0);
+            continue;
+        }
+        stats.get()->around_maps++;
+    }
+}
+
+static bool file_fault(AddressSpace& space, VmRegion* region, uintptr_t addr, uint64_t error) {
+    uintptr_t page = align_down(addr, kPageSize);
+    uint64_t index = region_cache_index(region, page);
+    if (index >= region->cache->pages) {
+        return false;
+    }
+    uint64_t flags = region_page_flags(region->flags);
+    bool is_private = region->flags & RegionPrivate;
+    uint64_t phys, current, slot;
+    if (space.translate(page, &phys, &current)) {
+        if (!(error & FaultWrite) || (current & PageWritable)) {
+            stats.get()->spurious++;
+            if (space.is_active()) {
+                invlpg(page);
+            }
+            return true;
+        }
+        if (is_private) {
+            return copy_on_write(space, page, phys, flags);
+        }
+        // Fault-around maps the pages of shared regions read-only too.
+        if (!space.protect(page, kPageSize, flags)) {
+            return false;
+        }
+        page_cache_set_dirty(phys_to_frame(phys));
+        return true;
+    }
+    if (space.swap_slot(page, &slot)) {
+        // A private copy that reclaim evicted.
+        return swap_in(space, page, slot, flags);
+    }
+    Frame* frame = page_cache_get(region->cache, index);
+    if (!frame) {
+        return false;
+    }
+    if ((error & FaultWrite) && is_private) {
+        Frame* copy = frame_alloc(0, AllocMovable);
+        if (copy) {
+            memcpy(frame_to_virt(copy), frame_to_virt(frame), kPageSize);
+        }
+        frame_put(frame, 0);
+        if (!copy) {
+            return false;
+        }
+        if (!space.map(page, frame_to_phys(copy), kPageSize, flags)) {
+            frame_free(copy, 0);
+            return false;
+        }
+        track(copy, space, page);
+        stats.get()->cow_copies++;
+        return true;
+    }
+    if (!space.map(page, frame_to_phys(frame), kPageSize, is_private ? flags & ~PageWritable : flags)) {
+        frame_put(frame, 0);
+        return false;
+    }
+    if (!is_private && (flags & PageWritable)) {
+        page_cache_set_dirty(frame);
+    }
+    stats.get()->file_maps++;
+    if (!(error & FaultWrite)) {
+        fault_around(space, region, page, flags);
+    }
+    return true;
+}
+
+static bool user_fault(AddressSpace& space, uintptr_t addr, uint64_t error) {
+    ReadGuard guard(space.regions_lock());
+    VmRegion* region = space.find_region(addr);
+    if (!region || (!(region->flags & RegionAnonymous) && !region->cache)) {
+        return false;
+    }
+    if ((error & FaultWrite) && !(region->flags & RegionWrite)) {
+        return false;
+    }
+    if ((error & FaultFetch) && !(region->flags & RegionExec)) {
+        return false;
+    }
+    if (!(region->flags & (RegionRead | RegionWrite | RegionExec))) {
+        return false;
+    }
+    LockGuard<Spinlock> region_guard(region->lock);
+    if (region->cache) {
+        return file_fault(space, region, addr, error);
+    }
+    if (thp_handle_fault(space, region, addr, error)) {
+        return true;
+    }
+    uintptr_t page = align_down(addr, kPageSize);
+    uint64_t flags = region_page_flags(region->flags);
+    uint64_t phys, current, slot;
+    if (!space.translate(page, &phys, &current)) {
+        if (space.swap_slot(page, &slot)) {
+            return swap_in(space, page, slot, flags);
+        }
+        if (error & FaultWrite) {
+            return map_fresh_frame(space, page, flags);
+        }
+        if (!space.map(page, frame_to_phys(zero), kPageSize, flags & ~PageWritable)) {
+            return false;
+        }
+        stats.get()->zero_maps++;
+        return true;
+    }
+    if ((error & FaultWrite) && !(current & PageWritable)) {
+        return copy_on_write(space, page, phys, flags);
+    }
+    stats.get()->spurious++;
+    if (space.is_active()) {
+        invlpg(page);
+    }
+    return true;
+}
+
+bool handle_page_fault(AddressSpace& space, uintptr_t addr, uint64_t error) {
+    uint64_t start = rdtsc();
+    FaultStats* local = stats.get();
+    local->faults++;
+    bool handled;
+    if (error & FaultReserved) {
+        handled = false;
+    } else if (addr >= kKernelHalfBase) {
+        local->kernel_faults++;
+        handled = vmalloc_handle_fault(addr) || access_allowed(kernel_space(), addr, error);
+    } else {
+        handled = user_fault(space, addr, error);
+    }
+    if (!handled) {
+        local->failed++;
+    }
+    local->cycles += rdtsc() - start;
+    return handled;
+}
+
+FaultStats fault_stats() {
+    FaultStats total = {};
+    // Other CPUs keep counting meanwhile; the sum is only a snapshot.
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        const FaultStats* cpu = stats.get(percpu_cpu(index));
+        total.faults += __atomic_load_n(&cpu->faults, __ATOMIC_RELAXED);
+        total.kernel_faults += __atomic_load_n(&cpu->kernel_faults, __ATOMIC_RELAXED);
+        total.zero_maps += __atomic_load_n(&cpu->zero_maps, __ATOMIC_RELAXED);
+        total.anon_allocs += __atomic_load_n(&cpu->anon_allocs, __ATOMIC_RELAXED);
+        total.cow_copies += __atomic_load_n(&cpu->cow_copies, __ATOMIC_RELAXED);
+        total.cow_reuses += __atomic_load_n(&cpu->cow_reuses, __ATOMIC_RELAXED);
+        total.swap_ins += __atomic_load_n(&cpu->swap_ins, __ATOMIC_RELAXED);
+        total.file_maps += __atomic_load_n(&cpu->file_maps, __ATOMIC_RELAXED);
+        total.around_maps += __atomic_load_n(&cpu->around_maps, __ATOMIC_RELAXED);
+        total.spurious += __atomic_load_n(&cpu->spurious, __ATOMIC_RELAXED);
+        total.failed += __atomic_load_n(&cpu->failed, __ATOMIC_RELAXED);
+        total.cycles += __atomic_load_n(&cpu->cycles, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+static void page_fault_handler(InterruptFrame* frame, void*) {
+    uintptr_t addr = read_cr2();
+    if (!handle_page_fault(*AddressSpace::current(), addr, frame->error_code)) {
+        panic("unhandled page fault at 0x%lx (error 0x%lx, rip 0x%lx)", addr, frame->error_code, frame->rip);
+    }
+}
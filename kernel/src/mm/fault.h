@@ -0,0 +1,51 @@
+#ifndef MM_FAULT_H
+#define MM_FAULT_H
+
+#include <stdint.h>
+
+#include "frame.h"
+#include "vmm.h"
+
+// Pages of a file region that a read fault maps at once, counting the
+// faulting page, when the page cache already holds them.
+constexpr unsigned kFaultAroundPages = 16;
+constexpr unsigned kMaxFaultAroundPages = 512;
+
+enum FaultError : uint64_t {
+    FaultPresent = 1u << 0,
+    FaultWrite = 1u << 1,
+    FaultUser = 1u << 2,
+    FaultReserved = 1u << 3,
+    FaultFetch = 1u << 4,
+};
+
+struct FaultStats {
+    uint64_t faults;
+    uint64_t kernel_faults;
+    // Read faults satisfied by mapping the shared zero frame.
+    uint64_t zero_maps;
+    // Faults that needed a fresh zeroed frame, including the first write
+    // to a page that was mapped to the zero frame.
+    uint64_t anon_allocs;
+    uint64_t cow_copies;
+    // Write faults on a copy-on-write page whose other users had gone.
+    uint64_t cow_reuses;
+    uint64_t swap_ins;
+    // Faults on file regions that mapped a page-cache page, and the
+    // neighbouring pages fault-around mapped along with them.
+    uint64_t file_maps;
+    uint64_t around_maps;
+    uint64_t spurious;
+    uint64_t failed;
+    uint64_t cycles;
+};
+
+void fault_init();
+bool handle_page_fault(AddressSpace& space, uintptr_t addr, uint64_t error);
+// Sets the fault-around window, rounded down to a power of two and capped
+// at kMaxFaultAroundPages. One page or none turns fault-around off.
+void fault_set_around_pages(unsigned pages);
+Frame* zero_frame();
+FaultStats fault_stats();
+
+#endif // MM_FAULT_H
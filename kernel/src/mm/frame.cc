@@ -0,0 +1,510 @@
+#include "frame.h"
+
+#include "../lib/string.h"
+#include "../lib/util.h"
+#include "../panic.h"
+#include "../sched/daemon.h"
+#include "../sync/spinlock.h"
+#include "compact.h"
+#include "hugetlb.h"
+#include "numa.h"
+#include "prezero.h"
+#include "reclaim.h"
+
+struct EarlyRange {
+    uint64_t start;
+    uint64_t end;
+};
+
+constexpr size_t kMaxEarlyRanges = 64;
+
+Frame* frame_map = nullptr;
+uint64_t frame_map_count = 0;
+
+static EarlyRange early_ranges[kMaxEarlyRanges];
+static size_t early_range_count = 0;
+static bool allocator_ready = false;
+
+enum FreeListKind {
+    FreeNormal,
+    FreeCma,
+    FreeListKinds,
+};
+
+// The free memory of one NUMA node. Blocks never merge across nodes.
+struct Zone {
+    ListNode free_lists[FreeListKinds][kMaxOrder + 1];
+    uint64_t free_block_counts[FreeListKinds][kMaxOrder + 1];
+    uint64_t free_frames;
+    uint64_t total_frames;
+    uint64_t local_allocs;
+    uint64_t remote_allocs;
+};
+
+static Spinlock frame_lock;
+static Zone zones[kMaxNodes];
+static uint64_t free_frame_count = 0;
+static uint64_t free_cma_frame_count = 0;
+static uint64_t total_frame_count = 0;
+static uint64_t isolated_start = 0;
+static uint64_t isolated_end = 0;
+static Daemon* report_daemon = nullptr;
+static unsigned report_min_order = kMaxOrder + 1;
+
+void frame_init_early(const BootInfo* boot_info) {
+    const PhysMemoryMap& map = boot_info->phys_memory_map;
+    for (size_t i = 0; i < map.entry_count; ++i) {
+        const PhysMemoryMapEntry& entry = map.entries[i];
+        if (entry.type != PhysFree || entry.frame_count == 0) {
+            continue;
+        }
+        if (early_range_count == kMaxEarlyRanges) {
+            panic("frame: too many free memory ranges");
+        }
+        // Frame 0 stays reserved so that a zero physical address can mean failure.
+        uint64_t start = max<uint64_t>(entry.start_frame, 1);
+        uint64_t end = entry.start_frame + entry.frame_count;
+        if (start >= end) {
+            continue;
+        }
+        early_ranges[early_range_count++] = {start, end};
+        frame_map_count = max(frame_map_count, end);
+    }
+}
+
+static uint64_t early_alloc(uint64_t count) {
+    for (size_t i = early_range_count; i > 0; --i) {
+        EarlyRange& range = early_ranges[i - 1];
+        if (range.end - range.start >= count) {
+            range.end -= count;
+            return range.end;
+        }
+    }
+    return 0;
+}
+
+static FreeListKind free_list_kind(const Frame* frame) {
+    return frame->flags & FrameCma ? FreeCma : FreeNormal;
+}
+
+static void add_free_block(Frame* frame, unsigned order) {
+    FreeListKind kind = free_list_kind(frame);
+    Zone& zone = zones[frame->nid];
+    frame->flags = FrameFree | (frame->flags & FrameCma);
+    frame->order = order;
+    frame->owner = nullptr;
+    list_push_front(&zone.free_lists[kind][order], &frame->node);
+    zone.free_block_counts[kind][order]++;
+    if (kind == FreeCma) {
+        free_cma_frame_count += 1ull << order;
+    }
+}
+
+static void remove_free_block(Frame* frame, unsigned order) {
+    FreeListKind kind = free_list_kind(frame);
+    list_remove(&frame->node);
+    frame->flags &= ~FrameFree;
+    zones[frame->nid].free_block_counts[kind][order]--;
+    if (kind == FreeCma) {
+        free_cma_frame_count -= 1ull << order;
+    }
+}
+
+static Frame* alloc_block_from(Zone& zone, FreeListKind kind, unsigned order) {
+    for (unsigned o = order; o <= kMaxOrder; ++o) {
+        if (list_empty(&zone.free_lists[kind][o])) {
+            continue;
+        }
+        Frame* frame = list_entry(zone.free_lists[kind][o].next, Frame, node);
+        remove_free_block(frame, o);
+        while (o > order) {
+            --o;
+            add_free_block(frame + (1ull << o), o);
+        }
+        frame->flags &= FrameCma;
+        frame->order = order;
+        free_frame_count -= 1ull << order;
+        zone.free_frames -= 1ull << order;
+        return frame;
+    }
+    return nullptr;
+}
+
+static Frame* alloc_block(unsigned order, uint32_t flags, unsigned node) {
+    const uint8_t* nodes = numa_fallback_order(node);
+    unsigned count = flags & AllocThisNode ? 1 : numa_node_count();
+    for (unsigned i = 0; i < count; ++i) {
+        Zone& zone = zones[nodes[i]];
+        // Movable allocations drain the CMA region first; that memory is
+        // otherwise idle until a contiguous request claims it.
+        if (flags & AllocMovable) {
+            if (Frame* frame = alloc_block_from(zone, FreeCma, order)) {
+                return frame;
+            }
+        }
+        if (Frame* frame = alloc_block_from(zone, FreeNormal, order)) {
+            return frame;
+        }
+    }
+    return nullptr;
+}
+
+static void park_frames(uint64_t start, uint64_t end) {
+    for (uint64_t pfn = start; pfn < end; ++pfn) {
+        Frame* frame = pfn_to_frame(pfn);
+        frame->flags = FrameIsolated | (frame->flags & FrameCma);
+        frame->refcount = 0;
+        frame->owner = nullptr;
+    }
+}
+
+// Returns the head of the free block the frames ended up in, or null if
+// they were parked in the isolated range.
+static Frame* free_block(Frame* frame, unsigned order) {
+    uint64_t pfn = frame_to_pfn(frame);
+    if (pfn >= isolated_start && pfn < isolated_end) {
+        park_frames(pfn, pfn + (1ull << order));
+        return nullptr;
+    }
+    // The frame may end up a tail of a merged block, where nothing would
+    // clear what its last user left behind.
+    frame->flags &= FrameCma;
+    frame->refcount = 0;
+    frame->owner = nullptr;
+    free_frame_count += 1ull << order;
+    zones[frame->nid].free_frames += 1ull << order;
+    while (order < kMaxOrder) {
+        uint64_t buddy_pfn = pfn ^ (1ull << order);
+        if (buddy_pfn + (1ull << order) > frame_map_count) {
+            break;
+        }
+        Frame* buddy = pfn_to_frame(buddy_pfn);
+        if (!(buddy->flags & FrameFree) || buddy->order != order || buddy->nid != frame->nid ||
+            (buddy->flags & FrameCma) != (frame->flags & FrameCma)) {
+            break;
+        }
+        remove_free_block(buddy, order);
+        pfn &= ~(1ull << order);
+        ++order;
+    }
+    Frame* head = pfn_to_frame(pfn);
+    add_free_block(head, order);
+    return head;
+}
+
+// Frees [start, end) as the largest naturally aligned blocks that fit.
+static void free_range(uint64_t start, uint64_t end) {
+    while (start < end) {
+        unsigned order = min<unsigned>(kMaxOrder, ilog2(end - start));
+        if (start != 0) {
+            order = min<unsigned>(order, __builtin_ctzll(start));
+        }
+        free_block(pfn_to_frame(start), order);
+        start += 1ull << order;
+    }
+}
+
+// Head of the free block containing `pfn`, if the frame is free.
+static Frame* free_block_head(uint64_t pfn) {
+    for (unsigned order = 0; order <= kMaxOrder; ++order) {
+        uint64_t head_pfn = pfn & ~((1ull << order) - 1);
+        Frame* head = pfn_to_frame(head_pfn);
+        if ((head->flags & FrameFree) && head->order >= order) {
+            return head_pfn + (1ull << head->order) > pfn ? head : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+void frame_init() {
+    uint64_t map_frames = div_round_up(frame_map_count * sizeof(Frame), kFrameSize);
+    uint64_t map_pfn = early_alloc(map_frames);
+    if (map_pfn == 0) {
+        panic("frame: no room for %lu frame descriptors", frame_map_count);
+    }
+    frame_map = (Frame*)phys_to_virt(map_pfn << kFrameShift);
+    for (uint64_t pfn = 0; pfn < frame_map_count; ++pfn) {
+        Frame& frame = frame_map[pfn];
+        frame.node = {nullptr, nullptr};
+        frame.flags = FrameReserved;
+        frame.order = 0;
+        frame.nid = numa_node_of_pfn(pfn);
+        frame.refcount = 0;
+        frame.owner = nullptr;
+    }
+    for (Zone& zone : zones) {
+        for (unsigned kind = 0; kind < FreeListKinds; ++kind) {
+            for (unsigned order = 0; order <= kMaxOrder; ++order) {
+                list_init(&zone.free_lists[kind][order]);
+            }
+        }
+    }
+    for (size_t i = 0; i < early_range_count; ++i) {
+        // Free each run of frames on one node separately, so that no
+        // block straddles two zones.
+        for (uint64_t start = early_ranges[i].start; start < early_ranges[i].end;) {
+            uint8_t node = frame_map[start].nid;
+            uint64_t end = start + 1;
+            while (end < early_ranges[i].end && frame_map[end].nid == node) {
+                ++end;
+            }
+            free_range(start, end);
+            zones[node].total_frames += end - start;
+            total_frame_count += end - start;
+            start = end;
+        }
+    }
+    allocator_ready = true;
+}
+
+Frame* frame_alloc(unsigned order, uint32_t flags) {
+    return frame_alloc_node(order, flags, numa_current_node());
+}
+
+// Takes a block and accounts it to `node`'s locality counters.
+static Frame* take_block(unsigned order, uint32_t flags, unsigned node) {
+    LockGuard<Spinlock> guard(frame_lock);
+    Frame* frame = alloc_block(order, flags, node);
+    if (frame && frame->nid == node) {
+        zones[node].local_allocs++;
+    } else if (frame) {
+        zones[node].remote_allocs++;
+    }
+    return frame;
+}
+
+Frame* frame_alloc_node(unsigned order, uint32_t flags, unsigned node) {
+    KASSERT(allocator_ready && order <= kMaxOrder && node < numa_node_count());
+    if (flags & AllocZero) {
+        if (Frame* frame = prezero_take(order, node)) {
+            __atomic_add_fetch(&zones[node].local_allocs, 1, __ATOMIC_RELAXED);
+            return frame;
+        }
+    }
+    Frame* frame = take_block(order, flags, node);
+    if (!frame && prezero_drain()) {
+        frame = take_block(order, flags, node);
+    }
+    if (!frame && !(flags & AllocNoReclaim) && reclaim_direct(node, 1ull << order) > 0) {
+        frame = take_block(order, flags, node);
+    }
+    if (!frame && !(flags & AllocNoReclaim) && order >= kCompactMinOrder && order <= kLargeOrder &&
+        compact_direct(order)) {
+        frame = take_block(order, flags, node);
+    }
+    if (!frame) {
+        return nullptr;
+    }
+    reclaim_check(frame->nid, __atomic_load_n(&zones[frame->nid].free_frames, __ATOMIC_RELAXED));
+    frame->refcount = 1;
+    if (flags & AllocZero) {
+        memset(frame_to_virt(frame), 0, kFrameSize << order);
+    }
+    return frame;
+}
+
+void frame_free(Frame* frame, unsigned order) {
+    KASSERT(!(frame->flags & (FrameFree | FrameReserved | FrameLru | FrameHugetlb | FramePageCache)));
+    Frame* head;
+    {
+        LockGuard<Spinlock> guard(frame_lock);
+        head = free_block(frame, order);
+    }
+    if (head && head->order >= report_min_order) {
+        daemon_wake(report_daemon);
+    }
+}
+
+void frame_put(Frame* frame, unsigned order) {
+    if (frame->flags & FrameReserved) {
+        return;
+    }
+    if (__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (frame->flags & FrameHugetlb) {
+            hugetlb_frame_released(frame);
+            return;
+        }
+        if (frame->flags & FrameLru) {
+            lru_remove(frame);
+        }
+        frame_free(frame, order);
+    }
+}
+
+void frame_split(Frame* frame, unsigned order) {
+    for (uint64_t i = 0; i < (1ull << order); ++i) {
+        // Frames that were merged into a free block keep stale state.
+        frame[i].flags &= FrameCma;
+        frame[i].refcount = frame->refcount;
+        frame[i].order = 0;
+        frame[i].owner = nullptr;
+    }
+}
+
+uint64_t frame_alloc_phys(unsigned order, uint32_t flags) {
+    if (allocator_ready) {
+        Frame* frame = frame_alloc(order, flags);
+        return frame ? frame_to_phys(frame) : 0;
+    }
+    uint64_t pfn = early_alloc(1ull << order);
+    if (pfn != 0 && (flags & AllocZero)) {
+        memset(phys_to_virt(pfn << kFrameShift), 0, kFrameSize << order);
+    }
+    return pfn << kFrameShift;
+}
+
+void frame_free_phys(uint64_t phys, unsigned order) {
+    frame_free(phys_to_frame(phys), order);
+}
+
+uint64_t frame_reserve_low(uint64_t limit) {
+    KASSERT(!allocator_ready);
+    size_t best = early_range_count;
+    for (size_t i = 0; i < early_range_count; ++i) {
+        const EarlyRange& range = early_ranges[i];
+        if (range.start < range.end && (best == early_range_count || range.start < early_ranges[best].start)) {
+            best = i;
+        }
+    }
+    if (best == early_range_count || early_ranges[best].start >= limit >> kFrameShift) {
+        return 0;
+    }
+    return early_ranges[best].start++ << kFrameShift;
+}
+
+bool frame_isolate_range(uint64_t start_pfn, uint64_t end_pfn) {
+    LockGuard<Spinlock> guard(frame_lock);
+    if (isolated_start != isolated_end) {
+        return false;
+    }
+    isolated_start = start_pfn;
+    isolated_end = end_pfn;
+    for (uint64_t pfn = start_pfn; pfn < end_pfn;) {
+        Frame* head = free_block_head(pfn);
+        if (!head) {
+            ++pfn;
+            continue;
+        }
+        uint64_t head_pfn = frame_to_pfn(head);
+        uint64_t head_end = head_pfn + (1ull << head->order);
+        remove_free_block(head, head->order);
+        free_frame_count -= head_end - head_pfn;
+        zones[head->nid].free_frames -= head_end - head_pfn;
+        park_frames(max(head_pfn, start_pfn), min(head_end, end_pfn));
+        // Parts of the block outside the range go straight back.
+        free_range(head_pfn, start_pfn > head_pfn ? start_pfn : head_pfn);
+        free_range(end_pfn < head_end ? end_pfn : head_end, head_end);
+        pfn = min(head_end, end_pfn);
+    }
+    return true;
+}
+
+bool frame_range_isolated(uint64_t start_pfn, uint64_t end_pfn) {
+    LockGuard<Spinlock> guard(frame_lock);
+    for (uint64_t pfn = start_pfn; pfn < end_pfn; ++pfn) {
+        if (!(pfn_to_frame(pfn)->flags & FrameIsolated)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void frame_unisolate_range(uint64_t start_pfn, uint64_t end_pfn, bool claim) {
+    LockGuard<Spinlock> guard(frame_lock);
+    isolated_start = isolated_end = 0;
+    for (uint64_t pfn = start_pfn; pfn < end_pfn; ++pfn) {
+        Frame* frame = pfn_to_frame(pfn);
+        if (!(frame->flags & FrameIsolated)) {
+            continue;
+        }
+        frame->flags &= ~FrameIsolated;
+        if (!claim) {
+            free_block(frame, 0);
+        }
+    }
+}
+
+uint64_t frame_count_free(uint64_t start_pfn, uint64_t end_pfn) {
+    LockGuard<Spinlock> guard(frame_lock);
+    uint64_t count = 0;
+    for (uint64_t pfn = start_pfn; pfn < end_pfn;) {
+        Frame* head = free_block_head(pfn);
+        if (!head) {
+            ++pfn;
+            continue;
+        }
+        uint64_t head_end = min<uint64_t>(frame_to_pfn(head) + (1ull << head->order), end_pfn);
+        count += head_end - pfn;
+        pfn = head_end;
+    }
+    return count;
+}
+
+void frame_report_register(Daemon* daemon, unsigned min_order) {
+    LockGuard<Spinlock> guard(frame_lock);
+    report_daemon = daemon;
+    report_min_order = min_order;
+}
+
+size_t frame_report_take(Frame** blocks, size_t max) {
+    LockGuard<Spinlock> guard(frame_lock);
+    size_t count = 0;
+    for (unsigned node = 0; node < numa_node_count(); ++node) {
+        Zone& zone = zones[node];
+        for (unsigned kind = 0; kind < FreeListKinds; ++kind) {
+            for (unsigned order = kMaxOrder; order >= report_min_order && order <= kMaxOrder; --order) {
+                ListNode* list = &zone.free_lists[kind][order];
+                // Unreported blocks come first; the walk ends at the
+                // first reported one.
+                while (count < max && !list_empty(list)) {
+                    Frame* frame = list_entry(list->next, Frame, node);
+                    if (frame->flags & FrameReported) {
+                        break;
+                    }
+                    remove_free_block(frame, order);
+                    frame->order = order;
+                    free_frame_count -= 1ull << order;
+                    zone.free_frames -= 1ull << order;
+                    blocks[count++] = frame;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+void frame_report_return(Frame* const* blocks, size_t count) {
+    LockGuard<Spinlock> guard(frame_lock);
+    for (size_t i = 0; i < count; ++i) {
+        Frame* block = blocks[i];
+        unsigned order = block->order;
+        Frame* head = free_block(block, order);
+        if (head == block && head->order == order) {
+            head->flags |= FrameReported;
+            list_remove(&head->node);
+            list_push_back(&zones[head->nid].free_lists[free_list_kind(head)][order], &head->node);
+        }
+    }
+}
+
+FrameStats frame_stats() {
+    LockGuard<Spinlock> guard(frame_lock);
+    FrameStats stats;
+    stats.total_frames = total_frame_count;
+    stats.free_frames = free_frame_count;
+    stats.free_cma_frames = free_cma_frame_count;
+    for (unsigned order = 0; order <= kMaxOrder; ++order) {
+        stats.free_blocks[order] = 0;
+        for (const Zone& zone : zones) {
+            stats.free_blocks[order] +=
+                zone.free_block_counts[FreeNormal][order] + zone.free_block_counts[FreeCma][order];
+        }
+    }
+    return stats;
+}
+
+FrameNodeStats frame_node_stats(unsigned node) {
+    LockGuard<Spinlock> guard(frame_lock);
+    const Zone& zone = zones[node];
+    return {zone.total_frames, zone.free_frames, zone.local_allocs, zone.remote_allocs};
+}
@@ -0,0 +1,189 @@
+#ifndef MM_FRAME_H
+#define MM_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../../common/bootinfo.h"
+#include "../lib/list.h"
+#include "layout.h"
+
+struct Daemon;
+
+constexpr unsigned kFrameShift = 12;
+constexpr uint64_t kFrameSize = 1ull << kFrameShift;
+// Orders run from a single frame up to a 1 GiB block.
+constexpr unsigned kMaxOrder = 18;
+constexpr unsigned kLargeOrder = 9;
+constexpr unsigned kHugeOrder = 18;
+
+enum FrameFlags : uint32_t {
+    FrameReserved = 1u << 0,
+    // Head of a block sitting on a buddy free list.
+    FrameFree = 1u << 1,
+    FramePageTable = 1u << 2,
+    FrameSlab = 1u << 3,
+    // Part of the CMA region; only movable allocations are served from it.
+    FrameCma = 1u << 4,
+    // Mapped exactly once, at `index` in the AddressSpace `owner`, and may
+    // be migrated to another frame.
+    FrameMovable = 1u << 5,
+    // Unused frame inside an isolated range, held off the free lists.
+    FrameIsolated = 1u << 6,
+    // On an LRU list of its node (mm/reclaim.cc); FrameActive selects the
+    // active or the inactive one.
+    FrameLru = 1u << 7,
+    FrameActive = 1u << 8,
+    // Read-only page shared by identical mappings (mm/ksm.cc); `index`
+    // holds the hash of its contents.
+    FrameKsm = 1u << 9,
+    // Part of a page of the hugetlb pool (mm/hugetlb.cc), whose size
+    // `order` gives.
+    FrameHugetlb = 1u << 10,
+    // Page `index` of the PageCache `owner` (mm/pagecache.cc), linked into
+    // its hash table through `node`.
+    FramePageCache = 1u << 11,
+    // Free block whose memory was reported to the hypervisor as unused
+    // (drivers/virtio_balloon.cc). Reported blocks sit at the tail of their
+    // free list; allocating or merging a block clears the flag.
+    FrameReported = 1u << 12,
+    // Page cache page that a shared mapping may have written. Nothing
+    // writes it back, so reclaim keeps it for as long as it is cached.
+    FrameDirty = 1u << 13,
+};
+
+// One descriptor per physical frame below the highest usable frame.
+struct Frame {
+    ListNode node;
+    // Link on an LRU list (mm/reclaim.cc) while FrameLru is set. Kept apart
+    // from `node`, which chains page cache pages into their hash bucket.
+    ListNode lru;
+    uint32_t flags;
+    uint8_t order;
+    // NUMA node of the memory; fixed once frame_init has run.
+    uint8_t nid;
+    int32_t refcount;
+    // The SlabCache of a FrameSlab frame, the AddressSpace of a
+    // FrameMovable one, the PageCache of a FramePageCache one.
+    void* owner;
+    uint64_t index;
+};
+
+enum AllocFlags : uint32_t {
+    AllocZero = 1u << 0,
+    // The caller will mark the frame FrameMovable right after mapping it,
+    // which lets the allocator serve it from the CMA region.
+    AllocMovable = 1u << 1,
+    // Fail rather than reclaim or compact memory when nothing suitable is
+    // free, for callers that hold locks those paths may need.
+    AllocNoReclaim = 1u << 2,
+    // Only take memory from the requested node.
+    AllocThisNode = 1u << 3,
+};
+
+struct FrameStats {
+    uint64_t total_frames;
+    uint64_t free_frames;
+    uint64_t free_cma_frames;
+    uint64_t free_blocks[kMaxOrder + 1];
+};
+
+struct FrameNodeStats {
+    uint64_t total_frames;
+    uint64_t free_frames;
+    // Allocations that asked for this node and got it, and those that
+    // had to fall back to a more distant one.
+    uint64_t local_allocs;
+    uint64_t remote_allocs;
+};
+
+extern Frame* frame_map;
+extern uint64_t frame_map_count;
+
+inline uint64_t frame_to_pfn(const Frame* frame) {
+    return frame - frame_map;
+}
+
+inline Frame* pfn_to_frame(uint64_t pfn) {
+    return &frame_map[pfn];
+}
+
+inline uint64_t frame_to_phys(const Frame* frame) {
+    return frame_to_pfn(frame) << kFrameShift;
+}
+
+inline Frame* phys_to_frame(uint64_t phys) {
+    return pfn_to_frame(phys >> kFrameShift);
+}
+
+inline void* frame_to_virt(const Frame* frame) {
+    return phys_to_virt(frame_to_phys(frame));
+}
+
+void frame_init_early(const BootInfo* boot_info);
+void frame_init();
+
+// Allocations come from the node of the calling CPU, falling back to the
+// other nodes by distance.
+Frame* frame_alloc(unsigned order, uint32_t flags = 0);
+Frame* frame_alloc_node(unsigned order, uint32_t flags, unsigned node);
+void frame_free(Frame* frame, unsigned order);
+
+// Reference counting for frames that are mapped or otherwise shared. The
+// block is freed when the last reference goes; reserved frames are never
+// freed.
+inline void frame_get(Frame* frame) {
+    __atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+}
+// Takes a reference unless the last one is already being dropped.
+inline bool frame_get_unless_zero(Frame* frame) {
+    int32_t count = __atomic_load_n(&frame->refcount, __ATOMIC_RELAXED);
+    while (count > 0) {
+        if (__atomic_compare_exchange_n(&frame->refcount, &count, count + 1, true, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+void frame_put(Frame* frame, unsigned order);
+// Turns an allocated block into 1 << order single frames, each holding
+// the reference the block had. Used for memory that may later be mapped,
+// unmapped or shared at 4 KiB granularity.
+void frame_split(Frame* frame, unsigned order);
+
+// Usable before frame_init, where it hands out unaligned frames from the
+// boot memory map that are never returned. Returns 0 on failure.
+uint64_t frame_alloc_phys(unsigned order, uint32_t flags = 0);
+void frame_free_phys(uint64_t phys, unsigned order);
+// Takes the lowest free frame below physical address `limit` out of the
+// boot memory map for good, for code and data that must sit low, such as
+// the application processors' startup trampoline. Only usable before
+// frame_init. Returns 0 when there is none.
+uint64_t frame_reserve_low(uint64_t limit);
+
+// Takes every free frame of [start_pfn, end_pfn) off the free lists and
+// parks frames freed into the range while it stays isolated. Only one
+// range can be isolated at a time; fails while another one is.
+bool frame_isolate_range(uint64_t start_pfn, uint64_t end_pfn);
+bool frame_range_isolated(uint64_t start_pfn, uint64_t end_pfn);
+// Ends isolation. With `claim` the parked frames become an allocated block
+// owned by the caller, otherwise they go back to the free lists.
+void frame_unisolate_range(uint64_t start_pfn, uint64_t end_pfn, bool claim);
+
+// Number of frames of [start_pfn, end_pfn) that sit on the free lists.
+uint64_t frame_count_free(uint64_t start_pfn, uint64_t end_pfn);
+
+// Free-page reporting. Once registered, `daemon` is woken whenever a free
+// block of at least `min_order` forms. frame_report_take pulls up to `max`
+// such blocks that have not been reported yet off the free lists, each
+// keeping its order in Frame::order; frame_report_return puts them back
+// marked as reported, unless they merge with a buddy meanwhile.
+void frame_report_register(Daemon* daemon, unsigned min_order);
+size_t frame_report_take(Frame** blocks, size_t max);
+void frame_report_return(Frame* const* blocks, size_t count);
+
+FrameStats frame_stats();
+FrameNodeStats frame_node_stats(unsigned node);
+
+#endif // MM_FRAME_H
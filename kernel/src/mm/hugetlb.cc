@@ -0,0 +1,129 @@
+#include "hugetlb.h"
+
+#include "../lib/string.h"
+#include "../lib/util.h"
+#include "../log.h"
+#include "../sync/spinlock.h"
+
+struct HugetlbPool {
+    unsigned order;
+    ListNode free = {nullptr, nullptr};
+    HugetlbStats stats = {0, 0, 0, 0};
+};
+
+static Spinlock hugetlb_lock;
+static HugetlbPool pools[HugetlbSizes] = {{kLargeOrder}, {kHugeOrder}};
+
+static void mark(Frame* page, unsigned order) {
+    for (uint64_t i = 0; i < (1ull << order); ++i) {
+        page[i].flags = FrameHugetlb;
+        page[i].order = order;
+        page[i].refcount = 0;
+        page[i].owner = nullptr;
+    }
+}
+
+static void unmark(Frame* page, unsigned order) {
+    for (uint64_t i = 0; i < (1ull << order); ++i) {
+        page[i].flags = 0;
+        page[i].order = 0;
+    }
+}
+
+// Callers hold hugetlb_lock.
+static void add_free(HugetlbPool& pool, Frame* page) {
+    list_push_front(&pool.free, &page->node);
+    pool.stats.free_pages++;
+}
+
+static uint64_t resize(HugetlbSize size, uint64_t count, uint32_t alloc_flags) {
+    HugetlbPool& pool = pools[size];
+    for (;;) {
+        Frame* page = nullptr;
+        {
+            LockGuard<Spinlock> guard(hugetlb_lock);
+            if (pool.stats.total_pages == count) {
+                break;
+            }
+            if (pool.stats.total_pages > count) {
+                if (pool.stats.free_pages == 0) {
+                    break;
+                }
+                page = list_entry(list_pop_front(&pool.free), Frame, node);
+                pool.stats.free_pages--;
+                pool.stats.total_pages--;
+            }
+        }
+        if (page) {
+            unmark(page, pool.order);
+            page->refcount = 1;
+            frame_free(page, pool.order);
+            continue;
+        }
+        // The lock is dropped here, so the allocator may reclaim.
+        page = frame_alloc(pool.order, alloc_flags);
+        if (!page) {
+            break;
+        }
+        mark(page, pool.order);
+        LockGuard<Spinlock> guard(hugetlb_lock);
+        add_free(pool, page);
+        pool.stats.total_pages++;
+    }
+    LockGuard<Spinlock> guard(hugetlb_lock);
+    return pool.stats.total_pages;
+}
+
+void hugetlb_init(uint64_t large_pages, uint64_t huge_pages) {
+    for (HugetlbPool& pool : pools) {
+        list_init(&pool.free);
+    }
+    uint64_t large = resize(HugetlbLarge, large_pages, AllocNoReclaim);
+    uint64_t huge = resize(HugetlbHuge, huge_pages, AllocNoReclaim);
+    if (large != large_pages || huge != huge_pages) {
+        kprintf("hugetlb: reserved %lu of %lu 2 MiB and %lu of %lu 1 GiB pages\n", large, large_pages, huge,
+                huge_pages);
+    }
+}
+
+uint64_t hugetlb_resize(HugetlbSize size, uint64_t count) {
+    return resize(size, count, 0);
+}
+
+Frame* hugetlb_alloc(HugetlbSize size) {
+    HugetlbPool& pool = pools[size];
+    Frame* page;
+    {
+        LockGuard<Spinlock> guard(hugetlb_lock);
+        if (pool.stats.free_pages == 0) {
+            pool.stats.failures++;
+            return nullptr;
+        }
+        page = list_entry(list_pop_front(&pool.free), Frame, node);
+        pool.stats.free_pages--;
+        pool.stats.allocations++;
+    }
+    uint64_t frames = 1ull << pool.order;
+    for (uint64_t i = 0; i < frames; ++i) {
+        page[i].refcount = 1;
+    }
+    // The head counts the frames that are still referenced.
+    page->index = frames;
+    memset(frame_to_virt(page), 0, kFrameSize << pool.order);
+    return page;
+}
+
+void hugetlb_frame_released(Frame* frame) {
+    unsigned order = frame->order;
+    Frame* page = pfn_to_frame(align_down(frame_to_pfn(frame), 1ull << order));
+    if (__atomic_sub_fetch(&page->index, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    LockGuard<Spinlock> guard(hugetlb_lock);
+    add_free(pools[order == kLargeOrder ? HugetlbLarge : HugetlbHuge], page);
+}
+
+HugetlbStats hugetlb_stats(HugetlbSize size) {
+    LockGuard<Spinlock> guard(hugetlb_lock);
+    return pools[size].stats;
+}
@@ -0,0 +1,41 @@
+#ifndef MM_HUGETLB_H
+#define MM_HUGETLB_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+enum HugetlbSize {
+    HugetlbLarge,
+    HugetlbHuge,
+    HugetlbSizes,
+};
+
+// Pages set aside at boot, while memory is least fragmented.
+constexpr uint64_t kHugetlbBootLargePages = 0;
+constexpr uint64_t kHugetlbBootHugePages = 0;
+
+struct HugetlbStats {
+    uint64_t total_pages;
+    uint64_t free_pages;
+    uint64_t allocations;
+    uint64_t failures;
+};
+
+// Explicit huge pages. Pools of 2 MiB and 1 GiB pages are carved out of the
+// frame allocator and only serve regions created with RegionHugetlb. Those
+// are populated in full when they are created, so they never fault, and
+// their pages are neither split, migrated nor reclaimed. Every frame of a
+// pool page carries FrameHugetlb; once the last reference to all of them
+// is gone the page goes back to its pool instead of the free lists.
+void hugetlb_init(uint64_t large_pages, uint64_t huge_pages);
+// Grows or shrinks the pool of `size` towards `count` pages; shrinking
+// only gives back free pages. Returns the resulting number of pages.
+uint64_t hugetlb_resize(HugetlbSize size, uint64_t count);
+// A cleared page in which every frame holds one reference, or null.
+Frame* hugetlb_alloc(HugetlbSize size);
+// Called by frame_put when a FrameHugetlb frame loses its last reference.
+void hugetlb_frame_released(Frame* frame);
+HugetlbStats hugetlb_stats(HugetlbSize size);
+
+#endif // MM_HUGETLB_H
@@ -0,0 +1,208 @@
+#include "ksm.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../lib/hash.h"
+#include "../lib/page.h"
+#include "../lib/string.h"
+#include "../sched/daemon.h"
+#include "../sync/spinlock.h"
+#include "fault.h"
+#include "frame.h"
+#include "migrate.h"
+#include "vmm.h"
+
+constexpr uint64_t kPageWords = kPageSize / sizeof(uint64_t);
+// Pages examined per run and cycles a run may take, whichever ends first.
+// Merging only saves memory rather than freeing it under pressure, so it
+// gets half the budget of the other daemons.
+constexpr uint64_t kRunPages = 256;
+constexpr uint64_t kRunCycles = kDaemonRunCycles / 2;
+// New anonymous pages that start another pass over memory.
+constexpr uint64_t kWakeInterval = 1024;
+constexpr size_t kStableBuckets = 1024;
+constexpr size_t kUnstableSlots = 4096;
+constexpr size_t kUnstableProbes = 4;
+
+// A page seen earlier in the current pass. Entries from older passes are
+// stale and get reused; when all of a probe sequence is taken, a new hash
+// replaces the first entry.
+struct UnstableEntry {
+    uint64_t hash;
+    uint64_t pfn;
+    uint64_t pass;
+};
+
+static Spinlock ksm_lock;
+// Shared frames by hash, linked through Frame::node. The table holds a
+// reference on each, so that a shared frame never becomes writable again
+// through the copy-on-write reuse path; frames nothing else maps any more
+// are dropped as the scan passes them.
+static ListNode stable[kStableBuckets];
+static UnstableEntry unstable[kUnstableSlots];
+static uint64_t pass = 1;
+static uint64_t cursor = 0;
+static uint64_t new_pages = 0;
+static KsmStats stats;
+
+static bool ksm_run(void* context);
+
+static Daemon ksm_daemon("ksm", ksm_run);
+
+void ksm_init() {
+    for (ListNode& bucket : stable) {
+        list_init(&bucket);
+    }
+    daemon_register(&ksm_daemon);
+}
+
+void ksm_note_anon_page() {
+    if (__atomic_add_fetch(&new_pages, 1, __ATOMIC_RELAXED) % kWakeInterval == 0) {
+        daemon_wake(&ksm_daemon);
+    }
+}
+
+static uint64_t hash_page(const void* page) {
+    return hash_words((const uint64_t*)page, kPageWords);
+}
+
+static bool zero_filled(const void* page) {
+    uint64_t value;
+    return page_same_filled(page, &value) && value == 0;
+}
+
+static Frame* stable_find(uint64_t hash, const void* data) {
+    ListNode* bucket = &stable[hash % kStableBuckets];
+    for (ListNode* node = bucket->next; node != bucket; node = node->next) {
+        Frame* frame = list_entry(node, Frame, node);
+        if (frame->index == hash && page_equal(frame_to_virt(frame), data)) {
+            return frame;
+        }
+    }
+    return nullptr;
+}
+
+// Drops a shared frame that only the table still references.
+static void stable_prune(Frame* frame) {
+    if (__atomic_load_n(&frame->refcount, __ATOMIC_ACQUIRE) != 1) {
+        return;
+    }
+    list_remove(&frame->node);
+    __atomic_and_fetch(&frame->flags, ~FrameKsm, __ATOMIC_RELAXED);
+    stats.shared--;
+    frame_put(frame, 0);
+}
+
+// Points the mapping of `frame`, which the caller holds a reference on,
+// at `target`.
+static bool merge(Frame* frame, Frame* target) {
+    if (!(__atomic_load_n(&frame->flags, __ATOMIC_ACQUIRE) & FrameMovable)) {
+        return false;
+    }
+    AddressSpace* space = (AddressSpace*)frame->owner;
+    if (!space->replace_page(frame->index, frame_to_phys(frame), frame_to_phys(target))) {
+        stats.races++;
+        return false;
+    }
+    frame_clear_movable(frame);
+    return true;
+}
+
+// The entry `hash` is recorded in during this pass: the one already
+// holding it, else a stale one, else the first of its probe sequence.
+static UnstableEntry& unstable_slot(uint64_t hash) {
+    size_t first = hash % kUnstableSlots;
+    UnstableEntry* victim = &unstable[first];
+    for (size_t i = 0; i < kUnstableProbes; ++i) {
+        UnstableEntry& entry = unstable[(first + i) % kUnstableSlots];
+        if (entry.pass == pass && entry.hash == hash) {
+            return entry;
+        }
+        if (entry.pass != pass && victim->pass == pass) {
+            victim = &entry;
+        }
+    }
+    return *victim;
+}
+
+// Turns the page recorded for `hash` earlier in this pass into a shared
+// frame if it still holds the same data as `candidate`; otherwise records
+// `candidate` in its place.
+static Frame* promote(uint64_t hash, Frame* candidate) {
+    UnstableEntry& entry = unstable_slot(hash);
+    uint64_t pfn = frame_to_pfn(candidate);
+    bool seen = entry.pass == pass && entry.hash == hash && entry.pfn != pfn;
+    Frame* frame = pfn_to_frame(entry.pfn);
+    entry = {hash, pfn, pass};
+    if (!seen || !(__atomic_load_n(&frame->flags, __ATOMIC_ACQUIRE) & FrameLru) ||
+        !frame_get_unless_zero(frame)) {
+        return nullptr;
+    }
+    AddressSpace* space = (AddressSpace*)frame->owner;
+    // Once read-only the page can only change by being copied away, which
+    // the comparison in replace_page catches.
+    if (!(frame->flags & FrameMovable) || !space->write_protect_page(frame->index, frame_to_phys(frame)) ||
+        !page_equal(frame_to_virt(frame), frame_to_virt(candidate))) {
+        frame_put(frame, 0);
+        return nullptr;
+    }
+    frame_clear_movable(frame);
+    frame->index = hash;
+    __atomic_or_fetch(&frame->flags, FrameKsm, __ATOMIC_RELAXED);
+    // The reference taken above is now the table's.
+    list_push_front(&stable[hash % kStableBuckets], &frame->node);
+    stats.shared++;
+    entry.pass = 0;
+    return frame;
+}
+
+static void scan_page(Frame* frame) {
+    if (!(__atomic_load_n(&frame->flags, __ATOMIC_ACQUIRE) & FrameLru) || !frame_get_unless_zero(frame)) {
+        return;
+    }
+    stats.scanned++;
+    const void* data = frame_to_virt(frame);
+    if (zero_filled(data)) {
+        if (merge(frame, zero_frame())) {
+            stats.zero_merged++;
+        }
+    } else {
+        uint64_t hash = hash_page(data);
+        Frame* target = stable_find(hash, data);
+        if (!target) {
+            target = promote(hash, frame);
+        }
+        if (target && merge(frame, target)) {
+            stats.merged++;
+        }
+    }
+    frame_put(frame, 0);
+}
+
+static bool ksm_run(void*) {
+    LockGuard<Spinlock> guard(ksm_lock);
+    uint64_t start = rdtsc();
+    bool more = true;
+    for (uint64_t scanned = 0; scanned < kRunPages && rdtsc() - start < kRunCycles; ++scanned) {
+        if (cursor >= frame_map_count) {
+            cursor = 0;
+            pass++;
+            stats.full_scans++;
+            more = false;
+            break;
+        }
+        Frame* frame = pfn_to_frame(cursor++);
+        uint32_t flags = __atomic_load_n(&frame->flags, __ATOMIC_ACQUIRE);
+        if (flags & FrameKsm) {
+            stable_prune(frame);
+        } else if (flags & FrameLru) {
+            scan_page(frame);
+        }
+    }
+    stats.cycles += rdtsc() - start;
+    return more;
+}
+
+KsmStats ksm_stats() {
+    LockGuard<Spinlock> guard(ksm_lock);
+    return stats;
+}
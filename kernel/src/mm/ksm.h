@@ -0,0 +1,33 @@
+#ifndef MM_KSM_H
+#define MM_KSM_H
+
+#include <stdint.h>
+
+struct KsmStats {
+    // Shared frames currently kept, and mappings merged into them so far.
+    uint64_t shared;
+    uint64_t merged;
+    // Mappings of all-zero pages replaced by the zero frame.
+    uint64_t zero_merged;
+    uint64_t scanned;
+    uint64_t full_scans;
+    // Merges abandoned because the page changed or was unmapped meanwhile.
+    uint64_t races;
+    uint64_t cycles;
+};
+
+// Same-page merging for anonymous memory. A daemon walks physical memory
+// for pages on the LRU, hashes them, and looks the hash up first among
+// the shared frames and then among the pages seen earlier in the same
+// pass. A match is confirmed by a full comparison with the candidate's
+// leaf not present, after which the leaf is pointed at a single read-only
+// frame; a later write copies it again through the copy-on-write path.
+// All-zero pages are merged into the zero frame. Each run scans a bounded
+// number of pages, and a pass over memory only starts once enough new
+// anonymous pages have been created since the last one.
+void ksm_init();
+// Called for every anonymous page that gets mapped.
+void ksm_note_anon_page();
+KsmStats ksm_stats();
+
+#endif // MM_KSM_H
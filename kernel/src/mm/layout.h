@@ -0,0 +1,36 @@
+#ifndef MM_LAYOUT_H
+#define MM_LAYOUT_H
+
+#include <stdint.h>
+
+// Upper-half virtual memory layout. Every region starts on a PML4 entry
+// boundary so that all address spaces can share the kernel's PDPTs.
+constexpr uintptr_t kKernelHalfBase = 0xFFFF800000000000;
+// End of the canonical lower half, which holds user mappings.
+constexpr uintptr_t kUserEnd = 0x0000800000000000;
+// Lowest address handed out by map_region_anywhere, which leaves the
+// first pages unmapped so that null dereferences keep faulting.
+constexpr uintptr_t kUserMmapBase = 0x10000;
+constexpr uintptr_t kKernelImageBase = 0xFFFF800000000000;
+constexpr uintptr_t kPhysMapBase = 0xFFFF888000000000;
+constexpr uint64_t kPhysMapSize = 64ull << 40;
+constexpr uintptr_t kVmallocBase = 0xFFFFC90000000000;
+constexpr uint64_t kVmallocSize = 32ull << 40;
+
+constexpr uint64_t kPageSize = 1ull << 12;
+constexpr uint64_t kLargePageSize = 1ull << 21;
+constexpr uint64_t kHugePageSize = 1ull << 30;
+
+// Offset of the direct map. Zero while the kernel still runs on the
+// firmware's identity map, kPhysMapBase once vmm_init has switched over.
+extern uintptr_t phys_offset;
+
+inline void* phys_to_virt(uint64_t phys) {
+    return (void*)(phys + phys_offset);
+}
+
+inline uint64_t virt_to_phys(const void* virt) {
+    return (uintptr_t)virt - phys_offset;
+}
+
+#endif // MM_LAYOUT_H
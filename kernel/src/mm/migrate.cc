@@ -0,0 +1,84 @@
+#include "migrate.h"
+
+#include "../arch/x86_64/percpu.h"
+#include "../sync/spinlock.h"
+#include "reclaim.h"
+#include "vmm.h"
+
+static PER_CPU PerCpu<MigrateStats> stats;
+// Guards the owner records of movable frames. Migration pins the recorded
+// space under it, and a space clears the records of the pages it unmaps
+// under it, so a pinned space is always still alive.
+static Spinlock rmap_lock;
+
+static void forget(Frame* frame) {
+    lru_remove(frame);
+    __atomic_and_fetch(&frame->flags, ~FrameMovable, __ATOMIC_RELEASE);
+    frame->owner = nullptr;
+}
+
+void frame_set_movable(Frame* frame, AddressSpace* space, uintptr_t virt) {
+    LockGuard<Spinlock> guard(rmap_lock);
+    frame->owner = space;
+    frame->index = virt;
+    __atomic_or_fetch(&frame->flags, FrameMovable, __ATOMIC_RELEASE);
+}
+
+void frame_clear_movable(Frame* frame) {
+    LockGuard<Spinlock> guard(rmap_lock);
+    forget(frame);
+}
+
+void frame_unmapped(Frame* frame, AddressSpace* space) {
+    LockGuard<Spinlock> guard(rmap_lock);
+    if ((frame->flags & FrameMovable) && frame->owner == space) {
+        forget(frame);
+    }
+}
+
+// The space that maps `frame`, pinned, or null if the frame is not movable.
+static AddressSpace* pin_owner(Frame* frame, uintptr_t* virt) {
+    LockGuard<Spinlock> guard(rmap_lock);
+    if (!(frame->flags & FrameMovable)) {
+        return nullptr;
+    }
+    AddressSpace* space = (AddressSpace*)frame->owner;
+    *virt = frame->index;
+    space->pin();
+    return space;
+}
+
+bool migrate_frame(Frame* frame) {
+    uintptr_t virt;
+    AddressSpace* space = pin_owner(frame, &virt);
+    if (!space) {
+        stats.get()->failed++;
+        return false;
+    }
+    Frame* target = frame_alloc(0);
+    bool moved = target && space->migrate_page(virt, frame_to_phys(frame), frame_to_phys(target));
+    space->unpin();
+    if (!moved) {
+        if (target) {
+            frame_free(target, 0);
+        }
+        stats.get()->failed++;
+        return false;
+    }
+    // The mapping's reference. Anyone who found the frame since the copy
+    // holds their own and frees it when they are done.
+    frame_put(frame, 0);
+    stats.get()->migrated++;
+    return true;
+}
+
+MigrateStats migrate_stats() {
+    MigrateStats total = {};
+    // Other CPUs keep counting meanwhile; the sum is only a snapshot.
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        const MigrateStats* cpu = stats.get(percpu_cpu(index));
+        total.migrated += __atomic_load_n(&cpu->migrated, __ATOMIC_RELAXED);
+        total.failed += __atomic_load_n(&cpu->failed, __ATOMIC_RELAXED);
+    }
+    return total;
+}
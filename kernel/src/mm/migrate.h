@@ -0,0 +1,29 @@
+#ifndef MM_MIGRATE_H
+#define MM_MIGRATE_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+class AddressSpace;
+
+struct MigrateStats {
+    uint64_t migrated;
+    uint64_t failed;
+};
+
+// Records the single mapping of `frame` so that it can be migrated.
+void frame_set_movable(Frame* frame, AddressSpace* space, uintptr_t virt);
+void frame_clear_movable(Frame* frame);
+// Called by `space` when it drops a mapping of `frame`. Clears the record
+// unless it names another space by now.
+void frame_unmapped(Frame* frame, AddressSpace* space);
+
+// Copies a movable frame to a newly allocated, non-CMA frame, points its
+// mapping at the copy and drops the mapping's reference on the original.
+// Fails if anything else holds a reference to the frame.
+bool migrate_frame(Frame* frame);
+
+MigrateStats migrate_stats();
+
+#endif // MM_MIGRATE_H
@@ -0,0 +1,247 @@
+#include "numa.h"
+
+#include "../acpi/acpi.h"
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/string.h"
+#include "../log.h"
+#include "frame.h"
+
+constexpr size_t kMaxMemoryRanges = 64;
+
+enum SratEntryType : uint8_t {
+    SratProcessor = 0,
+    SratMemory = 1,
+    SratX2apic = 2,
+};
+
+constexpr uint32_t kSratEnabled = 1u << 0;
+
+struct [[gnu::packed]] SratEntry {
+    uint8_t type;
+    uint8_t length;
+};
+
+struct [[gnu::packed]] SratProcessorEntry {
+    SratEntry header;
+    uint8_t domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+};
+
+struct [[gnu::packed]] SratMemoryEntry {
+    SratEntry header;
+    uint32_t domain;
+    uint16_t reserved0;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+};
+
+struct [[gnu::packed]] SratX2apicEntry {
+    SratEntry header;
+    uint16_t reserved0;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved1;
+};
+
+// The SRAT header is followed by 12 reserved bytes, the SLIT header by
+// the number of localities and a square matrix of their distances.
+constexpr size_t kSratEntriesOffset = sizeof(AcpiHeader) + 12;
+constexpr size_t kSlitMatrixOffset = sizeof(AcpiHeader) + 8;
+
+struct MemoryRange {
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint8_t node;
+};
+
+struct CpuAffinity {
+    uint32_t apic_id;
+    uint8_t node;
+};
+
+static uint32_t node_domains[kMaxNodes];
+static unsigned node_count = 1;
+static MemoryRange memory_ranges[kMaxMemoryRanges];
+static size_t memory_range_count = 0;
+static CpuAffinity cpus[kMaxCpus];
+static size_t cpu_count = 0;
+static uint8_t distances[kMaxNodes][kMaxNodes];
+static uint8_t fallback[kMaxNodes][kMaxNodes];
+
+// The node for proximity domain `domain`, allocating one on first use.
+// Domains past kMaxNodes share node 0.
+static uint8_t node_of_domain(uint32_t domain) {
+    for (unsigned node = 0; node < node_count; ++node) {
+        if (node_domains[node] == domain) {
+            return node;
+        }
+    }
+    if (node_count == kMaxNodes) {
+        kprintf("numa: too many nodes, domain %u folded into node 0\n", domain);
+        return 0;
+    }
+    node_domains[node_count] = domain;
+    return node_count++;
+}
+
+static void add_cpu(uint32_t apic_id, uint32_t domain) {
+    uint8_t node = node_of_domain(domain);
+    if (cpu_count < kMaxCpus) {
+        cpus[cpu_count++] = {apic_id, node};
+    }
+}
+
+static void add_memory(uint64_t base, uint64_t length, uint32_t domain) {
+    uint8_t node = node_of_domain(domain);
+    uint64_t start = base >> kFrameShift;
+    uint64_t end = (base + length) >> kFrameShift;
+    if (start >= end || memory_range_count == kMaxMemoryRanges) {
+        return;
+    }
+    memory_ranges[memory_range_count++] = {start, end, node};
+}
+
+// Returns whether the table described at least one node.
+static bool parse_srat(const AcpiHeader* srat) {
+    // Node 0 is taken by the first domain the table names, not by a default.
+    node_count = 0;
+    const uint8_t* end = (const uint8_t*)srat + srat->length;
+    for (const uint8_t* ptr = (const uint8_t*)srat + kSratEntriesOffset; ptr + sizeof(SratEntry) <= end;) {
+        const SratEntry* entry = (const SratEntry*)ptr;
+        if (entry->length < sizeof(SratEntry) || ptr + entry->length > end) {
+            break;
+        }
+        if (entry->type == SratProcessor && entry->length >= sizeof(SratProcessorEntry)) {
+            const SratProcessorEntry* cpu = (const SratProcessorEntry*)ptr;
+            if (cpu->flags & kSratEnabled) {
+                uint32_t domain = cpu->domain_low | (uint32_t)cpu->domain_high[0] << 8 |
+                                  (uint32_t)cpu->domain_high[1] << 16 | (uint32_t)cpu->domain_high[2] << 24;
+                add_cpu(cpu->apic_id, domain);
+            }
+        } else if (entry->type == SratMemory && entry->length >= sizeof(SratMemoryEntry)) {
+            const SratMemoryEntry* memory = (const SratMemoryEntry*)ptr;
+            if (memory->flags & kSratEnabled) {
+                add_memory(memory->base, memory->length, memory->domain);
+            }
+        } else if (entry->type == SratX2apic && entry->length >= sizeof(SratX2apicEntry)) {
+            const SratX2apicEntry* cpu = (const SratX2apicEntry*)ptr;
+            if (cpu->flags & kSratEnabled) {
+                add_cpu(cpu->x2apic_id, cpu->domain);
+            }
+        }
+        ptr += entry->length;
+    }
+    if (node_count == 0) {
+        node_count = 1;
+        return false;
+    }
+    return true;
+}
+
+static void parse_slit(const AcpiHeader* slit) {
+    uint64_t localities;
+    memcpy(&localities, (const uint8_t*)slit + sizeof(AcpiHeader), sizeof(localities));
+    if (kSlitMatrixOffset + localities * localities > slit->length) {
+        return;
+    }
+    const uint8_t* matrix = (const uint8_t*)slit + kSlitMatrixOffset;
+    for (unsigned from = 0; from < node_count; ++from) {
+        for (unsigned to = 0; to < node_count; ++to) {
+            uint64_t i = node_domains[from];
+            uint64_t j = node_domains[to];
+            if (i < localities && j < localities) {
+                distances[from][to] = matrix[i * localities + j];
+            }
+        }
+    }
+}
+
+static uint32_t current_apic_id() {
+    if (cpuid(0).eax >= 0xB && cpuid(0xB).ebx != 0) {
+        return cpuid(0xB).edx;
+    }
+    return cpuid(1).ebx >> 24;
+}
+
+void numa_init(const BootInfo* boot_info) {
+    acpi_init(boot_info->acpi_rsdp);
+    const AcpiHeader* srat = acpi_find_table("SRAT");
+    if (!srat || !parse_srat(srat)) {
+        kprintf("numa: no SRAT, one node\n");
+        return;
+    }
+    for (unsigned from = 0; from < node_count; ++from) {
+        for (unsigned to = 0; to < node_count; ++to) {
+            distances[from][to] = from == to ? kLocalDistance : kRemoteDistance;
+        }
+    }
+    if (const AcpiHeader* slit = acpi_find_table("SLIT")) {
+        parse_slit(slit);
+    }
+    // Insertion sort by distance; ties keep node order.
+    for (unsigned node = 0; node < node_count; ++node) {
+        uint8_t* order = fallback[node];
+        for (unsigned i = 0; i < node_count; ++i) {
+            uint8_t candidate = i;
+            unsigned j = i;
+            for (; j > 0 && distances[node][order[j - 1]] > distances[node][candidate]; --j) {
+                order[j] = order[j - 1];
+            }
+            order[j] = candidate;
+        }
+    }
+    this_cpu()->node = numa_node_of_cpu(current_apic_id());
+    for (unsigned node = 0; node < node_count; ++node) {
+        uint64_t frames = 0;
+        for (size_t i = 0; i < memory_range_count; ++i) {
+            if (memory_ranges[i].node == node) {
+                frames += memory_ranges[i].end_pfn - memory_ranges[i].start_pfn;
+            }
+        }
+        kprintf("numa: node %u (domain %u): %lu MiB\n", node, node_domains[node], (frames << kFrameShift) >> 20);
+    }
+}
+
+unsigned numa_node_count() {
+    return node_count;
+}
+
+unsigned numa_node_of_pfn(uint64_t pfn) {
+    for (size_t i = 0; i < memory_range_count; ++i) {
+        if (pfn >= memory_ranges[i].start_pfn && pfn < memory_ranges[i].end_pfn) {
+            return memory_ranges[i].node;
+        }
+    }
+    return 0;
+}
+
+unsigned numa_node_of_cpu(uint32_t apic_id) {
+    for (size_t i = 0; i < cpu_count; ++i) {
+        if (cpus[i].apic_id == apic_id) {
+            return cpus[i].node;
+        }
+    }
+    return 0;
+}
+
+unsigned numa_current_node() {
+    return this_cpu()->node;
+}
+
+uint8_t numa_distance(unsigned from, unsigned to) {
+    return distances[from][to];
+}
+
+const uint8_t* numa_fallback_order(unsigned node) {
+    return fallback[node];
+}
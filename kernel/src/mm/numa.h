@@ -0,0 +1,30 @@
+#ifndef MM_NUMA_H
+#define MM_NUMA_H
+
+#include <stdint.h>
+
+#include "../../../common/bootinfo.h"
+
+constexpr unsigned kMaxNodes = 8;
+// SLIT distances: a node to itself, and the default between two nodes
+// when the firmware gives no table.
+constexpr uint8_t kLocalDistance = 10;
+constexpr uint8_t kRemoteDistance = 20;
+
+// NUMA topology from the ACPI SRAT and SLIT. Proximity domains are
+// numbered densely as nodes in the order the SRAT mentions them. Without
+// an SRAT, or memory it does not cover, everything belongs to node 0.
+// Runs after vmm_init, which maps the ACPI tables, and before frame_init,
+// which splits memory into per-node zones.
+void numa_init(const BootInfo* boot_info);
+unsigned numa_node_count();
+unsigned numa_node_of_pfn(uint64_t pfn);
+// Node of the CPU with `apic_id`, 0 for CPUs the SRAT does not list.
+unsigned numa_node_of_cpu(uint32_t apic_id);
+// Node of the CPU this runs on.
+unsigned numa_current_node();
+uint8_t numa_distance(unsigned from, unsigned to);
+// All nodes by increasing distance from `node`, `node` first.
+const uint8_t* numa_fallback_order(unsigned node);
+
+#endif // MM_NUMA_H
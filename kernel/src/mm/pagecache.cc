@@ -0,0 +1,140 @@
+#include "pagecache.h"
+
+#include "../lib/hash.h"
+#include "../sync/spinlock.h"
+#include "reclaim.h"
+
+constexpr unsigned kBucketShift = 12;
+constexpr size_t kBuckets = 1ull << kBucketShift;
+
+static Spinlock cache_lock;
+// Cached frames linked through Frame::node; `owner` is the PageCache and
+// `index` the page index.
+static ListNode buckets[kBuckets];
+static PageCacheStats stats;
+
+void page_cache_init() {
+    for (ListNode& bucket : buckets) {
+        list_init(&bucket);
+    }
+}
+
+static ListNode* bucket_of(const PageCache* cache, uint64_t index) {
+    return &buckets[hash_round(hash_round(0, (uintptr_t)cache), index) >> (64 - kBucketShift)];
+}
+
+// Called with cache_lock held.
+static Frame* lookup(ListNode* bucket, const PageCache* cache, uint64_t index) {
+    for (ListNode* node = bucket->next; node != bucket; node = node->next) {
+        Frame* frame = list_entry(node, Frame, node);
+        if (frame->owner == cache && frame->index == index) {
+            frame_get(frame);
+            return frame;
+        }
+    }
+    return nullptr;
+}
+
+Frame* page_cache_find(PageCache* cache, uint64_t index) {
+    ListNode* bucket = bucket_of(cache, index);
+    LockGuard<Spinlock> guard(cache_lock);
+    Frame* frame = lookup(bucket, cache, index);
+    if (frame) {
+        stats.hits++;
+    }
+    return frame;
+}
+
+Frame* page_cache_get(PageCache* cache, uint64_t index) {
+    if (index >= cache->pages) {
+        return nullptr;
+    }
+    Frame* frame = page_cache_find(cache, index);
+    if (frame) {
+        return frame;
+    }
+    // Read without the lock; if another CPU inserts the page meanwhile,
+    // its copy wins.
+    Frame* page = frame_alloc(0);
+    if (!page) {
+        return nullptr;
+    }
+    if (!cache->read(cache->context, index, frame_to_virt(page))) {
+        frame_free(page, 0);
+        LockGuard<Spinlock> guard(cache_lock);
+        stats.read_failures++;
+        return nullptr;
+    }
+    ListNode* bucket = bucket_of(cache, index);
+    LockGuard<Spinlock> guard(cache_lock);
+    frame = lookup(bucket, cache, index);
+    if (frame) {
+        frame_free(page, 0);
+        return frame;
+    }
+    page->owner = cache;
+    page->index = index;
+    page->flags |= FramePageCache;
+    // One reference for the table, one for the caller.
+    frame_get(page);
+    list_push_front(bucket, &page->node);
+    stats.misses++;
+    stats.cached_pages++;
+    lru_add(page);
+    return page;
+}
+
+void page_cache_set_dirty(Frame* frame) {
+    __atomic_or_fetch(&frame->flags, FrameDirty, __ATOMIC_RELAXED);
+}
+
+bool page_cache_evict(Frame* frame) {
+    {
+        LockGuard<Spinlock> guard(cache_lock);
+        // Lookups take their reference under the lock, so the count cannot
+        // grow behind the check.
+        uint32_t flags = __atomic_load_n(&frame->flags, __ATOMIC_RELAXED);
+        if ((flags & (FramePageCache | FrameDirty)) != FramePageCache ||
+            __atomic_load_n(&frame->refcount, __ATOMIC_RELAXED) != 2) {
+            return false;
+        }
+        list_remove(&frame->node);
+        lru_drop_cached(frame);
+        frame->owner = nullptr;
+        stats.cached_pages--;
+        stats.evictions++;
+    }
+    // The table's reference; the caller's keeps the frame.
+    frame_put(frame, 0);
+    return true;
+}
+
+void page_cache_drop(PageCache* cache) {
+    ListNode dropped;
+    list_init(&dropped);
+    {
+        LockGuard<Spinlock> guard(cache_lock);
+        for (ListNode& bucket : buckets) {
+            for (ListNode* node = bucket.next; node != &bucket;) {
+                Frame* frame = list_entry(node, Frame, node);
+                node = node->next;
+                if (frame->owner != cache) {
+                    continue;
+                }
+                list_remove(&frame->node);
+                lru_drop_cached(frame);
+                frame->owner = nullptr;
+                list_push_back(&dropped, &frame->node);
+                stats.cached_pages--;
+            }
+        }
+    }
+    while (ListNode* node = list_pop_front(&dropped)) {
+        frame_put(list_entry(node, Frame, node), 0);
+    }
+}
+
+PageCacheStats page_cache_stats() {
+    LockGuard<Spinlock> guard(cache_lock);
+    return stats;
+}
@@ -0,0 +1,50 @@
+#ifndef MM_PAGECACHE_H
+#define MM_PAGECACHE_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+// Contents of a mappable object, such as a file, kept in memory a page at
+// a time. `read` fills all 4 KiB of `page` with page `index` of the
+// object; faults past `pages` fail. A cache must outlive every region
+// that maps it.
+struct PageCache {
+    const char* name;
+    bool (*read)(void* context, uint64_t index, void* page);
+    void* context;
+    uint64_t pages;
+};
+
+struct PageCacheStats {
+    uint64_t cached_pages;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t read_failures;
+    // Pages reclaim dropped.
+    uint64_t evictions;
+};
+
+// Cached pages are found through one global hash table keyed by cache and
+// page index. The table holds a reference on each page, and every mapping
+// of it another. Pages sit on the LRU lists of mm/reclaim.cc, which drops
+// them once nothing maps them, unless a shared mapping may have written
+// them.
+void page_cache_init();
+// The cached page, read in first on a miss, with a reference for the
+// caller. Null if it cannot be read.
+Frame* page_cache_get(PageCache* cache, uint64_t index);
+// Like page_cache_get, but never reads: null unless the page is cached.
+Frame* page_cache_find(PageCache* cache, uint64_t index);
+// Marks `frame`, a cached page, as possibly written through a shared
+// mapping; it then stays cached until its cache is dropped.
+void page_cache_set_dirty(Frame* frame);
+// Drops `frame` from its cache if it is clean and nothing but the table
+// and the caller holds it. The caller's reference is left to drop.
+bool page_cache_evict(Frame* frame);
+// Evicts every page of `cache`. Pages still mapped live on until they are
+// unmapped.
+void page_cache_drop(PageCache* cache);
+PageCacheStats page_cache_stats();
+
+#endif // MM_PAGECACHE_H
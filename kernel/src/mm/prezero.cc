@@ -0,0 +1,200 @@
+#include "prezero.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/string.h"
+#include "../sched/daemon.h"
+#include "../sync/spinlock.h"
+#include "numa.h"
+
+// Blocks the daemon clears per run, so that one run stays short.
+constexpr uint64_t kRefillBatch = 32;
+// Free memory the pools never dip into, so that they do not compete with
+// real allocations when memory runs low. Split evenly between nodes.
+constexpr uint64_t kMinFreeFrames = 4096;
+
+struct ZeroPool {
+    ListNode blocks = {nullptr, nullptr};
+    uint64_t count = 0;
+    // Refill up to `high` once the pool drops below `low`.
+    uint64_t low = 0;
+    uint64_t high = 0;
+    unsigned order = 0;
+    unsigned node = 0;
+    Spinlock lock;
+};
+
+struct PoolShape {
+    unsigned order;
+    uint64_t low;
+    uint64_t high;
+};
+
+constexpr PoolShape kPoolShapes[] = {
+    {0, 128, 512},
+    {kLargeOrder, 2, 4},
+};
+
+constexpr size_t kPoolsPerNode = sizeof(kPoolShapes) / sizeof(kPoolShapes[0]);
+
+static ZeroPool pools[kMaxNodes][kPoolsPerNode];
+// Set once the pools are set up; application processors come up and go
+// idle before that.
+static bool ready;
+static PER_CPU PerCpu<PrezeroStats> stats;
+
+static bool prezero_run(void* context);
+
+static Daemon prezero_daemon("prezero", prezero_run);
+
+void prezero_init() {
+    for (unsigned node = 0; node < kMaxNodes; ++node) {
+        for (size_t i = 0; i < kPoolsPerNode; ++i) {
+            ZeroPool& pool = pools[node][i];
+            list_init(&pool.blocks);
+            pool.low = kPoolShapes[i].low;
+            pool.high = kPoolShapes[i].high;
+            pool.order = kPoolShapes[i].order;
+            pool.node = node;
+        }
+    }
+    __atomic_store_n(&ready, true, __ATOMIC_RELEASE);
+    daemon_register(&prezero_daemon);
+    daemon_wake(&prezero_daemon);
+}
+
+static ZeroPool* pool_for(unsigned order, unsigned node) {
+    for (ZeroPool& pool : pools[node]) {
+        if (pool.order == order) {
+            return &pool;
+        }
+    }
+    return nullptr;
+}
+
+Frame* prezero_take(unsigned order, unsigned node) {
+    ZeroPool* pool = pool_for(order, node);
+    if (!pool) {
+        return nullptr;
+    }
+    Frame* frame = nullptr;
+    bool refill;
+    {
+        LockGuard<Spinlock> guard(pool->lock);
+        if (pool->count > 0) {
+            frame = list_entry(list_pop_front(&pool->blocks), Frame, node);
+            pool->count--;
+        }
+        refill = pool->count < pool->low;
+    }
+    if (refill) {
+        daemon_wake(&prezero_daemon);
+    }
+    if (frame) {
+        stats.get()->hits++;
+    } else {
+        stats.get()->misses++;
+    }
+    return frame;
+}
+
+static bool drain(ZeroPool& pool) {
+    bool drained = false;
+    for (;;) {
+        Frame* frame;
+        {
+            LockGuard<Spinlock> guard(pool.lock);
+            if (pool.count == 0) {
+                break;
+            }
+            frame = list_entry(list_pop_front(&pool.blocks), Frame, node);
+            pool.count--;
+        }
+        frame_free(frame, pool.order);
+        drained = true;
+    }
+    return drained;
+}
+
+bool prezero_drain() {
+    bool drained = false;
+    for (unsigned node = 0; node < numa_node_count(); ++node) {
+        for (ZeroPool& pool : pools[node]) {
+            drained |= drain(pool);
+        }
+    }
+    return drained;
+}
+
+// Clears up to kRefillBatch blocks for `pool`. Returns whether it is
+// still below its high mark.
+static bool refill(ZeroPool& pool) {
+    uint64_t reserve = kMinFreeFrames / numa_node_count();
+    for (uint64_t i = 0; i < kRefillBatch; ++i) {
+        {
+            LockGuard<Spinlock> guard(pool.lock);
+            if (pool.count >= pool.high) {
+                return false;
+            }
+        }
+        if (frame_node_stats(pool.node).free_frames < reserve + (1ull << pool.order)) {
+            return false;
+        }
+        Frame* frame = frame_alloc_node(pool.order, AllocNoReclaim | AllocThisNode, pool.node);
+        if (!frame) {
+            return false;
+        }
+        memzero_nontemporal(frame_to_virt(frame), kFrameSize << pool.order);
+        stats.get()->zeroed_bytes += kFrameSize << pool.order;
+        LockGuard<Spinlock> guard(pool.lock);
+        list_push_back(&pool.blocks, &frame->node);
+        pool.count++;
+    }
+    return true;
+}
+
+static bool prezero_run(void*) {
+    uint64_t start = rdtsc();
+    bool more = false;
+    for (unsigned node = 0; node < numa_node_count(); ++node) {
+        for (ZeroPool& pool : pools[node]) {
+            if (refill(pool)) {
+                more = true;
+            }
+        }
+    }
+    stats.get()->cycles += rdtsc() - start;
+    return more;
+}
+
+bool prezero_refill_local() {
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    uint64_t start = rdtsc();
+    bool more = false;
+    for (ZeroPool& pool : pools[this_cpu()->node]) {
+        if (refill(pool)) {
+            more = true;
+        }
+    }
+    stats.get()->cycles += rdtsc() - start;
+    return more;
+}
+
+PrezeroStats prezero_stats() {
+    PrezeroStats result = {};
+    // Other CPUs keep counting meanwhile; the sum is only a snapshot.
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        const PrezeroStats* cpu = stats.get(percpu_cpu(index));
+        result.hits += __atomic_load_n(&cpu->hits, __ATOMIC_RELAXED);
+        result.misses += __atomic_load_n(&cpu->misses, __ATOMIC_RELAXED);
+        result.zeroed_bytes += __atomic_load_n(&cpu->zeroed_bytes, __ATOMIC_RELAXED);
+        result.cycles += __atomic_load_n(&cpu->cycles, __ATOMIC_RELAXED);
+    }
+    for (unsigned node = 0; node < numa_node_count(); ++node) {
+        result.pooled_frames += pools[node][0].count;
+        result.pooled_blocks += pools[node][1].count;
+    }
+    return result;
+}
@@ -0,0 +1,40 @@
+#ifndef MM_PREZERO_H
+#define MM_PREZERO_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+struct PrezeroStats {
+    uint64_t pooled_frames;
+    uint64_t pooled_blocks;
+    // AllocZero requests served from, and missed by, the pools.
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t zeroed_bytes;
+    uint64_t cycles;
+};
+
+// Pools of already cleared 4 KiB frames and 2 MiB blocks, one pair per
+// NUMA node. A daemon running from the idle loop takes free memory of the
+// node, clears it with non-temporal stores so the caches are left alone,
+// and parks it here; AllocZero requests of either size are served from the
+// pools before the buddy allocator, which keeps page clearing off the
+// fault path.
+//
+// Daemons only run on the boot CPU, so its daemon refills the pools of
+// every node. Idle application processors also refill their own node's
+// pools whenever something wakes them, clearing memory local to them;
+// nothing wakes one for that alone.
+void prezero_init();
+// A cleared block of `order` from `node`, or null if the matching pool is
+// empty.
+Frame* prezero_take(unsigned order, unsigned node);
+// Returns every pooled block to the allocator. Returns whether there was any.
+bool prezero_drain();
+// Refills the pools of the calling CPU's node by one batch, for the idle
+// loop of application processors. Returns whether they are still short.
+bool prezero_refill_local();
+PrezeroStats prezero_stats();
+
+#endif // MM_PREZERO_H
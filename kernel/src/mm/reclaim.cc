@@ -0,0 +1,436 @@
+#include "reclaim.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/util.h"
+#include "../sched/daemon.h"
+#include "../sync/spinlock.h"
+#include "../time/clock.h"
+#include "migrate.h"
+#include "numa.h"
+#include "pagecache.h"
+#include "swap.h"
+#include "vmm.h"
+
+// Pages taken off a list per aging or eviction step.
+constexpr size_t kScanBatch = 32;
+// Pages one direct reclaim may scan, which bounds its latency.
+constexpr uint64_t kDirectScanLimit = 256;
+// Interval of the aging pass that runs without memory pressure.
+constexpr uint64_t kAgeIntervalNs = kNsPerSecond;
+
+// Anonymous pages only go to swap, so their lists are left alone while
+// there is none; page cache pages are simply dropped.
+enum LruList {
+    LruInactiveAnon,
+    LruActiveAnon,
+    LruInactiveFile,
+    LruActiveFile,
+    LruLists,
+};
+
+// Page cache first, which costs no I/O to drop.
+constexpr LruList kInactiveLists[] = {LruInactiveFile, LruInactiveAnon};
+
+// The LRU lists of one NUMA node, holding the frames of its memory.
+struct NodeLru {
+    ListNode lists[LruLists] = {};
+    uint64_t counts[LruLists] = {};
+    Watermarks marks = {};
+    Spinlock lock;
+};
+
+static NodeLru nodes[kMaxNodes];
+// Nodes below their low watermark, which the daemon brings back up.
+static uint32_t pending_nodes;
+static uint64_t next_aging;
+// Registered during boot only, so the list is walked without a lock.
+static ListNode shrinkers = {&shrinkers, &shrinkers};
+static PER_CPU PerCpu<ReclaimStats> stats;
+// Set while the CPU reclaims, so that allocations made on the way (by a
+// swap backend, say) fail instead of recursing.
+static PER_CPU PerCpu<bool> reclaiming;
+
+static bool reclaim_run(void* context);
+
+static Daemon reclaim_daemon("reclaim", reclaim_run);
+
+void reclaim_init() {
+    for (NodeLru& lru : nodes) {
+        for (ListNode& list : lru.lists) {
+            list_init(&list);
+        }
+    }
+    for (unsigned node = 0; node < numa_node_count(); ++node) {
+        uint64_t total = frame_node_stats(node).total_frames;
+        // A node without memory has nothing to keep free.
+        if (total == 0) {
+            continue;
+        }
+        Watermarks& marks = nodes[node].marks;
+        marks.min = max<uint64_t>(total / 128, 128);
+        marks.low = marks.min + marks.min / 4;
+        marks.high = marks.min + marks.min / 2;
+    }
+    daemon_register(&reclaim_daemon);
+    next_aging = clock_ns() + kAgeIntervalNs;
+    daemon_wake_at(&reclaim_daemon, next_aging);
+}
+
+Watermarks watermarks() {
+    Watermarks total = {};
+    for (unsigned node = 0; node < numa_node_count(); ++node) {
+        total.min += nodes[node].marks.min;
+        total.low += nodes[node].marks.low;
+        total.high += nodes[node].marks.high;
+    }
+    return total;
+}
+
+Watermarks node_watermarks(unsigned node) {
+    return nodes[node].marks;
+}
+
+void shrinker_register(Shrinker* shrinker) {
+    list_push_back(&shrinkers, &shrinker->node);
+}
+
+static uint64_t run_shrinkers(uint64_t count) {
+    uint64_t freed = 0;
+    for (ListNode* node = shrinkers.next; node != &shrinkers && freed < count; node = node->next) {
+        Shrinker* shrinker = list_entry(node, Shrinker, node);
+        freed += shrinker->shrink(shrinker->context, count - freed);
+    }
+    stats.get()->shrunk += freed;
+    return freed;
+}
+
+void reclaim_check(unsigned node, uint64_t free_frames) {
+    if (free_frames < nodes[node].marks.low) {
+        __atomic_or_fetch(&pending_nodes, 1u << node, __ATOMIC_RELAXED);
+        daemon_wake(&reclaim_daemon);
+    }
+}
+
+static LruList list_of(const Frame* frame) {
+    uint32_t flags = __atomic_load_n(&frame->flags, __ATOMIC_RELAXED);
+    if (flags & FramePageCache) {
+        return flags & FrameActive ? LruActiveFile : LruInactiveFile;
+    }
+    return flags & FrameActive ? LruActiveAnon : LruInactiveAnon;
+}
+
+static bool is_active(LruList list) {
+    return list == LruActiveAnon || list == LruActiveFile;
+}
+
+// Callers hold the lock of the frame's node.
+static void link(Frame* frame, bool active, ListNode* prev = nullptr) {
+    NodeLru& lru = nodes[frame->nid];
+    __atomic_or_fetch(&frame->flags, active ? FrameLru | FrameActive : FrameLru, __ATOMIC_RELAXED);
+    LruList list = list_of(frame);
+    if (!prev) {
+        prev = &lru.lists[list];
+    }
+    list_insert_between(&frame->lru, prev, prev->next);
+    lru.counts[list]++;
+}
+
+static void unlink(Frame* frame) {
+    list_remove(&frame->lru);
+    nodes[frame->nid].counts[list_of(frame)]--;
+    __atomic_and_fetch(&frame->flags, ~(FrameLru | FrameActive), __ATOMIC_RELAXED);
+}
+
+void lru_add(Frame* frame) {
+    LockGuard<Spinlock> guard(nodes[frame->nid].lock);
+    if (!(frame->flags & FrameLru)) {
+        link(frame, false);
+    }
+}
+
+void lru_remove(Frame* frame) {
+    LockGuard<Spinlock> guard(nodes[frame->nid].lock);
+    if (frame->flags & FrameLru) {
+        unlink(frame);
+    }
+}
+
+void lru_drop_cached(Frame* frame) {
+    LockGuard<Spinlock> guard(nodes[frame->nid].lock);
+    if (frame->flags & FrameLru) {
+        unlink(frame);
+    }
+    __atomic_and_fetch(&frame->flags, ~(FramePageCache | FrameDirty), __ATOMIC_RELAXED);
+}
+
+void lru_replace(Frame* frame, Frame* target) {
+    bool active;
+    ListNode* prev = nullptr;
+    {
+        LockGuard<Spinlock> guard(nodes[frame->nid].lock);
+        if (!(frame->flags & FrameLru)) {
+            return;
+        }
+        active = frame->flags & FrameActive;
+        if (target->nid == frame->nid) {
+            // Same lists: the target takes the frame's place in them.
+            prev = frame->lru.prev;
+            unlink(frame);
+            link(target, active, prev);
+            return;
+        }
+        unlink(frame);
+    }
+    // On another node the target starts out at the head of its list.
+    LockGuard<Spinlock> guard(nodes[target->nid].lock);
+    link(target, active);
+}
+
+// Takes up to kScanBatch pages off the cold end of `list`. Each keeps an
+// extra reference while it is off the list, so that it cannot be freed
+// under the scanner; pages already on their way to being freed are left.
+static size_t isolate(unsigned node, LruList list, Frame** batch) {
+    NodeLru& lru = nodes[node];
+    LockGuard<Spinlock> guard(lru.lock);
+    size_t count = 0;
+    while (count < kScanBatch && lru.counts[list] > 0) {
+        Frame* frame = list_entry(lru.lists[list].prev, Frame, lru);
+        unlink(frame);
+        if (frame_get_unless_zero(frame)) {
+            batch[count++] = frame;
+        }
+    }
+    return count;
+}
+
+static void putback(Frame* frame, bool active) {
+    {
+        LockGuard<Spinlock> guard(nodes[frame->nid].lock);
+        // A fork while the page was isolated made it shared and no longer
+        // reclaimable, and a dropped cache let go of its page.
+        uint32_t flags = __atomic_load_n(&frame->flags, __ATOMIC_RELAXED);
+        if ((flags & (FrameMovable | FramePageCache)) && !(flags & FrameLru)) {
+            link(frame, active);
+        }
+    }
+    frame_put(frame, 0);
+}
+
+// A page cache page has no single mapping to ask, so it counts as
+// referenced while anything but its cache and the scanner holds it.
+static bool referenced(Frame* frame) {
+    uint32_t flags = __atomic_load_n(&frame->flags, __ATOMIC_ACQUIRE);
+    if (flags & FramePageCache) {
+        return __atomic_load_n(&frame->refcount, __ATOMIC_RELAXED) > 2;
+    }
+    if (!(flags & FrameMovable)) {
+        return false;
+    }
+    AddressSpace* space = (AddressSpace*)frame->owner;
+    return space->test_and_clear_accessed(frame->index, frame_to_phys(frame));
+}
+
+static bool evict(Frame* frame) {
+    uint32_t flags = __atomic_load_n(&frame->flags, __ATOMIC_ACQUIRE);
+    if (flags & FramePageCache) {
+        return page_cache_evict(frame);
+    }
+    if (!(flags & FrameMovable)) {
+        return false;
+    }
+    AddressSpace* space = (AddressSpace*)frame->owner;
+    if (!space->swap_out(frame->index, frame_to_phys(frame))) {
+        return false;
+    }
+    frame_clear_movable(frame);
+    // The reference the mapping held; the scanner's goes in shrink_inactive.
+    frame_put(frame, 0);
+    return true;
+}
+
+// Moves referenced pages from the cold end of an active list back to its
+// head and the others to the inactive list.
+static void age_active(unsigned node, LruList list) {
+    ReclaimStats* local = stats.get();
+    Frame* batch[kScanBatch];
+    size_t count = isolate(node, list, batch);
+    for (size_t i = 0; i < count; ++i) {
+        local->scanned++;
+        if (referenced(batch[i])) {
+            putback(batch[i], true);
+        } else {
+            local->deactivated++;
+            putback(batch[i], false);
+        }
+    }
+}
+
+static uint64_t shrink_inactive(unsigned node, LruList list) {
+    ReclaimStats* local = stats.get();
+    Frame* batch[kScanBatch];
+    size_t count = isolate(node, list, batch);
+    uint64_t reclaimed = 0;
+    for (size_t i = 0; i < count; ++i) {
+        local->scanned++;
+        if (referenced(batch[i])) {
+            local->activated++;
+            putback(batch[i], true);
+        } else if (evict(batch[i])) {
+            frame_put(batch[i], 0);
+            reclaimed++;
+        } else {
+            putback(batch[i], false);
+        }
+    }
+    return reclaimed;
+}
+
+// One round over the page cache lists of `node`, and the anonymous ones
+// when there is swap to put their pages in.
+static uint64_t shrink_node_once(unsigned node) {
+    uint64_t reclaimed = 0;
+    for (LruList inactive : kInactiveLists) {
+        if (inactive == LruInactiveAnon && !swap_available()) {
+            continue;
+        }
+        LruList active = (LruList)(inactive + 1);
+        uint64_t active_count, inactive_count;
+        {
+            LockGuard<Spinlock> guard(nodes[node].lock);
+            active_count = nodes[node].counts[active];
+            inactive_count = nodes[node].counts[inactive];
+        }
+        // Keep the inactive list at least as long as the active one, so
+        // that pages get a fair chance to be referenced before eviction.
+        if (inactive_count < active_count) {
+            age_active(node, active);
+        }
+        if (inactive_count + active_count > 0) {
+            reclaimed += shrink_inactive(node, inactive);
+        }
+    }
+    return reclaimed;
+}
+
+static uint64_t shrink(unsigned node, uint64_t target, uint64_t scan_limit) {
+    ReclaimStats* local = stats.get();
+    uint64_t reclaimed = 0;
+    uint64_t scan_start = local->scanned;
+    while (reclaimed < target && local->scanned - scan_start < scan_limit) {
+        uint64_t scanned = local->scanned;
+        reclaimed += shrink_node_once(node);
+        if (local->scanned == scanned) {
+            break;
+        }
+    }
+    local->reclaimed += reclaimed;
+    return reclaimed;
+}
+
+uint64_t reclaim_direct(unsigned node, uint64_t count) {
+    bool* guard = reclaiming.get();
+    if (*guard) {
+        return 0;
+    }
+    *guard = true;
+    ReclaimStats* local = stats.get();
+    uint64_t start = rdtsc();
+    local->direct_runs++;
+    uint64_t reclaimed = run_shrinkers(count);
+    // The requested node first, then the others by distance, all within
+    // one scan limit.
+    const uint8_t* order = numa_fallback_order(node);
+    uint64_t scan_start = local->scanned;
+    for (unsigned i = 0; i < numa_node_count() && reclaimed < count; ++i) {
+        uint64_t scanned = local->scanned - scan_start;
+        if (scanned >= kDirectScanLimit) {
+            break;
+        }
+        reclaimed += shrink(order[i], count - reclaimed, kDirectScanLimit - scanned);
+    }
+    local->cycles += rdtsc() - start;
+    *guard = false;
+    return reclaimed;
+}
+
+// Harvests the Accessed bits of one batch per active list and node, so
+// that the lists still order pages by use when pressure arrives after a
+// long quiet spell.
+static void age_all() {
+    for (unsigned node = 0; node < numa_node_count(); ++node) {
+        age_active(node, LruActiveFile);
+        age_active(node, LruActiveAnon);
+    }
+}
+
+// Brings `node` back up to its high watermark. Returns whether it is
+// still short when the budget runs out.
+static bool balance(unsigned node, uint64_t start) {
+    while (rdtsc() - start < kDaemonRunCycles) {
+        if (frame_node_stats(node).free_frames >= nodes[node].marks.high) {
+            return false;
+        }
+        if (run_shrinkers(kScanBatch) == 0 && shrink(node, kScanBatch, 4 * kScanBatch) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool reclaim_run(void*) {
+    bool* guard = reclaiming.get();
+    if (*guard) {
+        return false;
+    }
+    *guard = true;
+    ReclaimStats* local = stats.get();
+    uint64_t start = rdtsc();
+    uint64_t now = clock_ns();
+    if (now >= next_aging) {
+        age_all();
+        next_aging = now + kAgeIntervalNs;
+        daemon_wake_at(&reclaim_daemon, next_aging);
+    }
+    uint32_t pending = __atomic_exchange_n(&pending_nodes, 0, __ATOMIC_RELAXED);
+    uint32_t short_nodes = 0;
+    if (pending) {
+        local->background_runs++;
+    }
+    for (unsigned node = 0; node < numa_node_count(); ++node) {
+        if ((pending & (1u << node)) && balance(node, start)) {
+            short_nodes |= 1u << node;
+        }
+    }
+    __atomic_or_fetch(&pending_nodes, short_nodes, __ATOMIC_RELAXED);
+    local->cycles += rdtsc() - start;
+    *guard = false;
+    return short_nodes != 0;
+}
+
+ReclaimStats reclaim_stats() {
+    ReclaimStats total = {};
+    // Other CPUs keep counting meanwhile; the sum is only a snapshot.
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        const ReclaimStats* cpu = stats.get(percpu_cpu(index));
+        total.scanned += __atomic_load_n(&cpu->scanned, __ATOMIC_RELAXED);
+        total.activated += __atomic_load_n(&cpu->activated, __ATOMIC_RELAXED);
+        total.deactivated += __atomic_load_n(&cpu->deactivated, __ATOMIC_RELAXED);
+        total.reclaimed += __atomic_load_n(&cpu->reclaimed, __ATOMIC_RELAXED);
+        total.shrunk += __atomic_load_n(&cpu->shrunk, __ATOMIC_RELAXED);
+        total.background_runs += __atomic_load_n(&cpu->background_runs, __ATOMIC_RELAXED);
+        total.direct_runs += __atomic_load_n(&cpu->direct_runs, __ATOMIC_RELAXED);
+        total.cycles += __atomic_load_n(&cpu->cycles, __ATOMIC_RELAXED);
+    }
+    for (unsigned node = 0; node < numa_node_count(); ++node) {
+        LockGuard<Spinlock> guard(nodes[node].lock);
+        for (int list = 0; list < LruLists; ++list) {
+            if (is_active((LruList)list)) {
+                total.active += nodes[node].counts[list];
+            } else {
+                total.inactive += nodes[node].counts[list];
+            }
+        }
+    }
+    return total;
+}
@@ -0,0 +1,82 @@
+#ifndef MM_RECLAIM_H
+#define MM_RECLAIM_H
+
+#include <stdint.h>
+
+#include "../lib/list.h"
+#include "frame.h"
+
+struct Watermarks {
+    // Direct reclaim below `min`, background reclaim from `low` up to `high`.
+    uint64_t min;
+    uint64_t low;
+    uint64_t high;
+};
+
+// Memory a subsystem holds on to but can give back under pressure, such as
+// the pages a balloon took for the host. `shrink` frees up to `count`
+// frames without allocating and returns how many it freed.
+struct Shrinker {
+    ListNode node;
+    const char* name;
+    uint64_t (*shrink)(void* context, uint64_t count);
+    void* context;
+};
+
+struct ReclaimStats {
+    uint64_t active;
+    uint64_t inactive;
+    uint64_t scanned;
+    // Pages moved to the active list because their Accessed bit was set,
+    // and back to the inactive list because it was not.
+    uint64_t activated;
+    uint64_t deactivated;
+    uint64_t reclaimed;
+    // Frames that shrinkers handed back.
+    uint64_t shrunk;
+    uint64_t background_runs;
+    uint64_t direct_runs;
+    uint64_t cycles;
+};
+
+// Page reclaim. Every NUMA node keeps its own LRU lists and watermarks,
+// and a frame lives on the lists of the node its memory belongs to.
+// Anonymous pages that a single address space maps sit on an active and
+// an inactive list; aging harvests the page-table Accessed bits in
+// batches through the reverse map, promoting referenced pages and
+// demoting idle ones, and eviction writes idle inactive pages to the swap
+// backend. Page cache pages have lists of their own, count as referenced
+// while mapped, and are dropped rather than written anywhere, so they are
+// reclaimed even without swap.
+//
+// A daemon reclaims in the background whenever a node's free memory falls
+// below its low watermark, and also ages the active lists at a low rate
+// so that they stay ordered through quiet spells. A failing allocation
+// reclaims a bounded batch synchronously, from its node first. Both ask
+// the registered shrinkers first, which is cheaper than evicting pages.
+void reclaim_init();
+void shrinker_register(Shrinker* shrinker);
+// Summed over all nodes.
+Watermarks watermarks();
+Watermarks node_watermarks(unsigned node);
+// Wakes the background daemon if `free_frames`, the free memory of
+// `node`, is below its low mark.
+void reclaim_check(unsigned node, uint64_t free_frames);
+// Reclaims up to `count` frames, preferring `node`, scanning a bounded
+// number of pages. Returns how many were freed.
+uint64_t reclaim_direct(unsigned node, uint64_t count);
+
+// The frame is mapped once, at the place frame_set_movable recorded, or
+// is a page cache page.
+void lru_add(Frame* frame);
+void lru_remove(Frame* frame);
+// Takes a page that its cache lets go of off the LRU lists and clears
+// FramePageCache and FrameDirty, under the lock that keeps a scanner
+// holding the page from putting it back.
+void lru_drop_cached(Frame* frame);
+// Hands the LRU position of `frame` to `target` when it is migrated.
+void lru_replace(Frame* frame, Frame* target);
+
+ReclaimStats reclaim_stats();
+
+#endif // MM_RECLAIM_H
@@ -0,0 +1,392 @@
+#include "region.h"
+
+#include "../lib/string.h"
+#include "../lib/util.h"
+#include "frame.h"
+#include "hugetlb.h"
+#include "ksm.h"
+#include "layout.h"
+#include "migrate.h"
+#include "reclaim.h"
+#include "slab.h"
+#include "swap.h"
+
+static SlabCache region_cache("vm-region", sizeof(VmRegion));
+
+static VmRegion* region_of(ListNode* node) {
+    return list_entry(node, VmRegion, node);
+}
+
+static VmRegion* rb_region(RbNode* node) {
+    return rb_entry(node, VmRegion, rb);
+}
+
+static VmRegion* alloc_region(uintptr_t start, uintptr_t end, uint32_t flags, PageCache* cache,
+                              uint64_t cache_index) {
+    VmRegion* region = (VmRegion*)region_cache.alloc();
+    if (!region) {
+        return nullptr;
+    }
+    memset((void*)region, 0, sizeof(VmRegion));
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    region->cache = cache;
+    region->cache_index = cache_index;
+    return region;
+}
+
+static void update_subtree_gap(RbNode* node) {
+    VmRegion* region = rb_region(node);
+    uint64_t gap = region->gap;
+    if (node->left) {
+        gap = max(gap, rb_region(node->left)->subtree_gap);
+    }
+    if (node->right) {
+        gap = max(gap, rb_region(node->right)->subtree_gap);
+    }
+    region->subtree_gap = gap;
+}
+
+// Recomputes the gap below `region` from its current list neighbour.
+static void compute_gap(ListNode* regions, VmRegion* region) {
+    uintptr_t floor = kUserMmapBase;
+    if (region->node.prev != regions) {
+        floor = max(floor, region_of(region->node.prev)->end);
+    }
+    region->gap = region->start > floor ? region->start - floor : 0;
+}
+
+void AddressSpace::update_gap(VmRegion* region) {
+    compute_gap(&regions_, region);
+    rb_propagate(&region->rb, update_subtree_gap);
+}
+
+void AddressSpace::link_region(VmRegion* region, ListNode* next) {
+    list_insert_between(&region->node, next->prev, next);
+    RbNode* parent = nullptr;
+    RbNode** link = &region_tree_.root;
+    while (*link) {
+        parent = *link;
+        link = region->start < rb_region(parent)->start ? &parent->left : &parent->right;
+    }
+    rb_link(&region->rb, parent, link);
+    compute_gap(&regions_, region);
+    rb_insert(&region_tree_, &region->rb, update_subtree_gap);
+    if (next != &regions_) {
+        update_gap(region_of(next));
+    }
+}
+
+void AddressSpace::unlink_region(VmRegion* region) {
+    ListNode* next = region->node.next;
+    list_remove(&region->node);
+    rb_erase(&region_tree_, &region->rb, update_subtree_gap);
+    if (next != &regions_) {
+        update_gap(region_of(next));
+    }
+}
+
+VmRegion* AddressSpace::find_region(uintptr_t virt) {
+    RbNode* node = region_tree_.root;
+    while (node) {
+        VmRegion* region = rb_region(node);
+        if (virt < region->start) {
+            node = node->left;
+        } else if (virt >= region->end) {
+            node = node->right;
+        } else {
+            return region;
+        }
+    }
+    return nullptr;
+}
+
+VmRegion* AddressSpace::next_region(uintptr_t virt) {
+    VmRegion* found = nullptr;
+    RbNode* node = region_tree_.root;
+    while (node) {
+        VmRegion* region = rb_region(node);
+        if (region->end > virt) {
+            found = region;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+uintptr_t AddressSpace::find_free_range(uint64_t size, uint64_t align) {
+    // Any gap this long fits an aligned range wherever it starts.
+    uint64_t length = size + align - kPageSize;
+    RbNode* node = region_tree_.root;
+    if (node && rb_region(node)->subtree_gap >= length) {
+        // Subtree maxima are exact, so the walk never has to back up.
+        for (;;) {
+            VmRegion* region = rb_region(node);
+            if (node->left && rb_region(node->left)->subtree_gap >= length) {
+                node = node->left;
+            } else if (region->gap >= length) {
+                return align_up(region->start - region->gap, align);
+            } else {
+                node = node->right;
+            }
+        }
+    }
+    uintptr_t floor = kUserMmapBase;
+    if (!list_empty(&regions_)) {
+        floor = max(floor, region_of(regions_.prev)->end);
+    }
+    uintptr_t start = align_up(floor, align);
+    if (start >= kUserEnd || kUserEnd - start < size) {
+        return 0;
+    }
+    return start;
+}
+
+// Maps a fresh pool page at each page of a hugetlb region.
+static bool populate_hugetlb(AddressSpace& space, const VmRegion* region) {
+    HugetlbSize size = region->flags & RegionHugetlb1G ? HugetlbHuge : HugetlbLarge;
+    uint64_t page_size = region_page_size(region->flags);
+    // Each page is one pool allocation, which may be split and merged again.
+    uint64_t flags = region_page_flags(region->flags) | PageMergeable;
+    TlbBatch batch(space);
+    for (uintptr_t virt = region->start; virt < region->end; virt += page_size) {
+        Frame* page = hugetlb_alloc(size);
+        if (!page) {
+            return false;
+        }
+        if (!space.map(virt, frame_to_phys(page), page_size, flags, batch)) {
+            batch.release(frame_to_phys(page), page->order);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool valid_region(uintptr_t start, uint64_t size, uint32_t flags) {
+    uintptr_t end = start + size;
+    uint64_t page_size = region_page_size(flags);
+    if (!is_aligned(start, page_size) || !is_aligned(size, page_size) || size == 0 || end > kUserEnd ||
+        end < start) {
+        return false;
+    }
+    // Hugetlb regions are populated up front and never take the
+    // demand-paging path.
+    return !((flags & RegionHugetlb) && (flags & RegionAnonymous));
+}
+
+bool AddressSpace::map_region(uintptr_t start, uint64_t size, uint32_t flags) {
+    return add_region(start, size, flags, true, nullptr, 0);
+}
+
+bool AddressSpace::map_file_region(uintptr_t start, uint64_t size, uint32_t flags, PageCache* cache,
+                                   uint64_t offset) {
+    if (!cache || (flags & (RegionAnonymous | RegionHugetlb)) || !is_aligned(offset, kPageSize)) {
+        return false;
+    }
+    return add_region(start, size, flags, true, cache, offset >> kFrameShift);
+}
+
+bool AddressSpace::map_region_anywhere(uint64_t size, uint32_t flags, uintptr_t* start) {
+    if (!valid_region(0, size, flags)) {
+        return false;
+    }
+    LockGuard<RwLock> guard(regions_lock_);
+    uintptr_t found = find_free_range(size, region_page_size(flags));
+    if (found == 0 || !insert_region(found, size, flags, true, nullptr, 0)) {
+        return false;
+    }
+    *start = found;
+    return true;
+}
+
+bool AddressSpace::add_region(uintptr_t start, uint64_t size, uint32_t flags, bool populate, PageCache* cache,
+                              uint64_t cache_index) {
+    if (!valid_region(start, size, flags)) {
+        return false;
+    }
+    LockGuard<RwLock> guard(regions_lock_);
+    return insert_region(start, size, flags, populate, cache, cache_index);
+}
+
+bool AddressSpace::insert_region(uintptr_t start, uint64_t size, uint32_t flags, bool populate,
+                                 PageCache* cache, uint64_t cache_index) {
+    uintptr_t end = start + size;
+    VmRegion* next = next_region(start);
+    if (next && next->start < end) {
+        return false;
+    }
+    VmRegion* region = alloc_region(start, end, flags, cache, cache_index);
+    if (!region) {
+        return false;
+    }
+    link_region(region, next ? &next->node : &regions_);
+    if ((flags & RegionHugetlb) && populate && !populate_hugetlb(*this, region)) {
+        unlink_region(region);
+        region_cache.free(region);
+        TlbBatch batch(*this);
+        unmap(start, size, batch, true);
+        return false;
+    }
+    return true;
+}
+
+// Whether cutting [start, end) out of the regions from `first` on would
+// split a hugetlb page.
+static bool splits_hugetlb_page(ListNode* regions, VmRegion* first, uintptr_t start, uintptr_t end) {
+    for (ListNode* node = &first->node; node != regions; node = node->next) {
+        VmRegion* region = region_of(node);
+        if (region->start >= end) {
+            break;
+        }
+        if (!(region->flags & RegionHugetlb)) {
+            continue;
+        }
+        uint64_t page_size = region_page_size(region->flags);
+        if ((start > region->start && !is_aligned(start, page_size)) ||
+            (end < region->end && !is_aligned(end, page_size))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool AddressSpace::unmap_region(uintptr_t start, uint64_t size) {
+    uintptr_t end = start + size;
+    if (!is_aligned(start, kPageSize) || !is_aligned(size, kPageSize)) {
+        return false;
+    }
+    // A region that straddles both ends needs a second descriptor.
+    VmRegion* spare = alloc_region(0, 0, 0, nullptr, 0);
+    LockGuard<RwLock> guard(regions_lock_);
+    VmRegion* first = next_region(start);
+    if (first && splits_hugetlb_page(&regions_, first, start, end)) {
+        if (spare) {
+            region_cache.free(spare);
+        }
+        return false;
+    }
+    for (ListNode* node = first ? &first->node : &regions_; node != &regions_;) {
+        VmRegion* region = region_of(node);
+        node = node->next;
+        if (region->start >= end) {
+            break;
+        }
+        if (region->start < start && region->end > end) {
+            if (!spare) {
+                return false;
+            }
+            spare->start = end;
+            spare->end = region->end;
+            spare->flags = region->flags;
+            if (region->cache) {
+                spare->cache = region->cache;
+                spare->cache_index = region_cache_index(region, end);
+            }
+            region->end = start;
+            link_region(spare, node);
+            spare = nullptr;
+        } else if (region->start < start) {
+            region->end = start;
+            if (node != &regions_) {
+                update_gap(region_of(node));
+            }
+        } else if (region->end > end) {
+            if (region->cache) {
+                region->cache_index = region_cache_index(region, end);
+            }
+            region->start = end;
+            update_gap(region);
+        } else {
+            unlink_region(region);
+            region_cache.free(region);
+        }
+    }
+    if (spare) {
+        region_cache.free(spare);
+    }
+    TlbBatch batch(*this);
+    return unmap(start, size, batch, true);
+}
+
+struct ForkContext {
+    AddressSpace* parent;
+    AddressSpace* child;
+    uint64_t flags;
+    bool cow;
+    bool failed;
+};
+
+static void fork_leaf(void* context, uintptr_t virt, uint64_t* entry, int level, TlbBatch& batch) {
+    ForkContext* fork = (ForkContext*)context;
+    if (fork->failed) {
+        return;
+    }
+    if (!(*entry & PagePresent)) {
+        // Swapped-out pages are read back first so that both sides can
+        // share them like any other page. The parent's lock is held, so
+        // the allocation must not reclaim.
+        Frame* frame = frame_alloc(0, AllocNoReclaim | AllocMovable);
+        uint64_t slot = swap_entry_slot(*entry);
+        if (!frame || !swap_load(slot, frame_to_virt(frame))) {
+            if (frame) {
+                frame_free(frame, 0);
+            }
+            fork->failed = true;
+            return;
+        }
+        swap_free(slot);
+        *entry = frame_to_phys(frame) | fork->flags | PagePresent;
+        // Tracked as a fault would track it, until the child maps it too.
+        frame_set_movable(frame, fork->parent, virt);
+        lru_add(frame);
+        ksm_note_anon_page();
+    }
+    uint64_t size = page_level_size(level);
+    uint64_t phys = leaf_phys(*entry, level);
+    uint64_t flags = *entry & (kPageProtMask | PageMergeable);
+    if (fork->cow) {
+        if (*entry & PageWritable) {
+            *entry &= ~PageWritable;
+            batch.add(virt);
+        }
+        flags &= ~PageWritable;
+    }
+    if (!fork->child->map(virt, phys, size, flags)) {
+        fork->failed = true;
+        return;
+    }
+    if ((phys >> kFrameShift) < frame_map_count) {
+        Frame* frame = phys_to_frame(phys);
+        for (uint64_t i = 0; i < size / kPageSize; ++i) {
+            // Two mappings now exist; the single-owner reverse map no longer holds.
+            if (frame[i].flags & FrameMovable) {
+                frame_clear_movable(&frame[i]);
+            }
+            frame_get(&frame[i]);
+        }
+    }
+}
+
+bool AddressSpace::fork(AddressSpace& child) {
+    LockGuard<RwLock> guard(regions_lock_);
+    TlbBatch batch(*this);
+    for (ListNode* node = regions_.next; node != &regions_; node = node->next) {
+        VmRegion* region = region_of(node);
+        if (!child.add_region(region->start, region->end - region->start, region->flags, false, region->cache,
+                              region->cache_index)) {
+            child.destroy();
+            return false;
+        }
+        bool cow = (region->flags & (RegionPrivate | RegionHugetlb)) == RegionPrivate;
+        ForkContext context = {this, &child, region_page_flags(region->flags), cow, false};
+        visit_leaves(region->start, region->end, fork_leaf, &context, batch);
+        if (context.failed) {
+            child.destroy();
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef MM_REGION_H
+#define MM_REGION_H
+
+#include <stdint.h>
+
+#include "../lib/list.h"
+#include "../lib/rbtree.h"
+#include "../sync/spinlock.h"
+#include "layout.h"
+#include "pagecache.h"
+#include "vmm.h"
+
+enum RegionFlags : uint32_t {
+    RegionRead = 1u << 0,
+    RegionWrite = 1u << 1,
+    RegionExec = 1u << 2,
+    // Zero-filled memory, populated on first touch.
+    RegionAnonymous = 1u << 3,
+    // Copy-on-write across fork. Otherwise parent and child share the
+    // frames that were populated before the fork.
+    RegionPrivate = 1u << 4,
+    // Backed by pages of the hugetlb pool, 2 MiB ones unless
+    // RegionHugetlb1G is set too. The whole region is populated when it
+    // is created, and it is shared rather than copied across fork. Its
+    // bounds, and those of any part unmapped, are multiples of the page.
+    RegionHugetlb = 1u << 5,
+    RegionHugetlb1G = 1u << 6,
+};
+
+// A range of a user address space with uniform protection and backing.
+// Regions sit both on a list sorted by address and in a tree keyed by
+// start address for lookups.
+struct VmRegion {
+    ListNode node;
+    RbNode rb;
+    uintptr_t start;
+    uintptr_t end;
+    uint32_t flags;
+    // Backing object of a file region, and its page shown at `start`.
+    // Null for other regions.
+    PageCache* cache;
+    uint64_t cache_index;
+    // Free space between this region and the previous one, or
+    // kUserMmapBase for the first region, and the largest such gap in the
+    // region's subtree.
+    uint64_t gap;
+    uint64_t subtree_gap;
+    // Serialises the faults within the region. Taken with the address
+    // space's region lock held for reading.
+    Spinlock lock;
+};
+
+inline uint64_t region_cache_index(const VmRegion* region, uintptr_t virt) {
+    return region->cache_index + ((virt - region->start) >> kFrameShift);
+}
+
+// Granularity of the pages backing a region.
+inline uint64_t region_page_size(uint32_t flags) {
+    if (!(flags & RegionHugetlb)) {
+        return kPageSize;
+    }
+    return flags & RegionHugetlb1G ? kHugePageSize : kLargePageSize;
+}
+
+inline uint64_t region_page_flags(uint32_t flags) {
+    uint64_t page_flags = PageUser;
+    if (flags & RegionWrite) {
+        page_flags |= PageWritable;
+    }
+    if (!(flags & RegionExec)) {
+        page_flags |= PageNoExecute;
+    }
+    return page_flags;
+}
+
+#endif // MM_REGION_H
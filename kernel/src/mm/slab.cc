@@ -0,0 +1,157 @@
+#include "slab.h"
+
+#include "../lib/util.h"
+#include "../panic.h"
+#include "frame.h"
+#include "layout.h"
+
+constexpr uint32_t kMinObjectsPerSlab = 8;
+constexpr unsigned kMaxSlabOrder = 3;
+
+struct SlabCache::Slab {
+    ListNode node;
+    void* free_list;
+    uint32_t in_use;
+};
+
+static SlabCache kmalloc_caches[] = {
+    {"kmalloc-16", 16},
+    {"kmalloc-32", 32},
+    {"kmalloc-64", 64},
+    {"kmalloc-128", 128},
+    {"kmalloc-256", 256},
+    {"kmalloc-512", 512},
+    {"kmalloc-1024", 1024},
+    {"kmalloc-2048", 2048},
+};
+
+constexpr size_t kMaxKmallocSize = 2048;
+
+void SlabCache::setup() {
+    uint32_t header = align_up(sizeof(Slab), 8);
+    order_ = 0;
+    while (order_ < kMaxSlabOrder && ((kFrameSize << order_) - header) / object_size_ < kMinObjectsPerSlab) {
+        ++order_;
+    }
+    objects_per_slab_ = ((kFrameSize << order_) - header) / object_size_;
+    KASSERT(objects_per_slab_ > 0);
+    for (ListNode& partial : partial_) {
+        list_init(&partial);
+    }
+    list_init(&full_);
+    ready_ = true;
+}
+
+SlabCache::Slab* SlabCache::grow(unsigned node, uint32_t flags) {
+    // The cache lock is held, and reclaim may allocate from this cache.
+    Frame* frame = frame_alloc_node(order_, AllocNoReclaim | flags, node);
+    if (!frame) {
+        return nullptr;
+    }
+    for (uint64_t i = 0; i < (1ull << order_); ++i) {
+        frame[i].flags |= FrameSlab;
+        frame[i].owner = this;
+    }
+    Slab* slab = (Slab*)frame_to_virt(frame);
+    slab->in_use = 0;
+    slab->free_list = nullptr;
+    uint8_t* objects = (uint8_t*)slab + align_up(sizeof(Slab), 8);
+    for (uint32_t i = objects_per_slab_; i > 0; --i) {
+        void** object = (void**)(objects + (i - 1) * object_size_);
+        *object = slab->free_list;
+        slab->free_list = object;
+    }
+    list_push_front(&partial_[frame->nid], &slab->node);
+    stats_.slabs++;
+    return slab;
+}
+
+SlabCache::Slab* SlabCache::find_partial(unsigned node) {
+    if (list_empty(&partial_[node])) {
+        return nullptr;
+    }
+    return list_entry(partial_[node].next, Slab, node);
+}
+
+void* SlabCache::alloc() {
+    LockGuard<Spinlock> guard(lock_);
+    if (!ready_) {
+        setup();
+    }
+    // Local free objects, then fresh local memory, and only then what the
+    // other nodes have to offer, nearest first.
+    unsigned node = numa_current_node();
+    Slab* slab = find_partial(node);
+    if (!slab) {
+        slab = grow(node, AllocThisNode);
+    }
+    const uint8_t* nodes = numa_fallback_order(node);
+    for (unsigned i = 1; !slab && i < numa_node_count(); ++i) {
+        slab = find_partial(nodes[i]);
+    }
+    if (!slab && !(slab = grow(node, 0))) {
+        return nullptr;
+    }
+    void** object = (void**)slab->free_list;
+    slab->free_list = *object;
+    if (++slab->in_use == objects_per_slab_) {
+        list_remove(&slab->node);
+        list_push_front(&full_, &slab->node);
+    }
+    stats_.objects_in_use++;
+    return object;
+}
+
+void SlabCache::free(void* object) {
+    LockGuard<Spinlock> guard(lock_);
+    Slab* slab = (Slab*)align_down((uintptr_t)object, kFrameSize << order_);
+    Frame* frame = phys_to_frame(virt_to_phys(slab));
+    ListNode* partial = &partial_[frame->nid];
+    if (slab->in_use-- == objects_per_slab_) {
+        list_remove(&slab->node);
+        list_push_front(partial, &slab->node);
+    }
+    *(void**)object = slab->free_list;
+    slab->free_list = object;
+    stats_.objects_in_use--;
+    // An empty slab is kept while it is the node's only partial one, so
+    // that alloc/free pairs at a slab boundary do not bounce frames through
+    // the buddy allocator; with other partial slabs to allocate from, it
+    // goes back.
+    if (slab->in_use == 0 && partial->next != partial->prev) {
+        list_remove(&slab->node);
+        for (uint64_t i = 0; i < (1ull << order_); ++i) {
+            frame[i].flags &= ~FrameSlab;
+            frame[i].owner = nullptr;
+        }
+        frame_free(frame, order_);
+        stats_.slabs--;
+    }
+}
+
+SlabStats SlabCache::stats() {
+    LockGuard<Spinlock> guard(lock_);
+    return stats_;
+}
+
+void* kmalloc(size_t size) {
+    if (size > kMaxKmallocSize) {
+        unsigned order = ilog2(div_round_up(size, kFrameSize) * 2 - 1);
+        Frame* frame = frame_alloc(order);
+        return frame ? frame_to_virt(frame) : nullptr;
+    }
+    size_t index = size <= 16 ? 0 : ilog2(size - 1) - 3;
+    return kmalloc_caches[index].alloc();
+}
+
+void kfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    Frame* frame = phys_to_frame(virt_to_phys(ptr));
+    if (frame->flags & FrameSlab) {
+        ((SlabCache*)frame->owner)->free(ptr);
+    } else {
+        frame_free(frame, frame->order);
+    }
+}
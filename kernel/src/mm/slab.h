@@ -0,0 +1,61 @@
+#ifndef MM_SLAB_H
+#define MM_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../lib/list.h"
+#include "../sync/spinlock.h"
+#include "numa.h"
+
+struct SlabStats {
+    uint64_t slabs;
+    uint64_t objects_in_use;
+};
+
+// Fixed-size object cache. Each slab is a buddy block whose first bytes
+// hold a small header; the remaining space is carved into objects kept
+// on a per-slab free list. Every frame of a slab points back at its
+// cache, which is how kfree finds the cache of an object. Slabs with free
+// objects are kept per NUMA node, and objects come from the calling CPU's
+// node whenever it has memory.
+class SlabCache {
+public:
+    constexpr SlabCache(const char* name, uint32_t object_size)
+        : name_(name), object_size_(object_size < 8 ? 8 : (object_size + 7) & ~7u) {}
+    SlabCache(const SlabCache&) = delete;
+    SlabCache& operator=(const SlabCache&) = delete;
+
+    void* alloc();
+    void free(void* object);
+
+    const char* name() const {
+        return name_;
+    }
+    uint32_t object_size() const {
+        return object_size_;
+    }
+    SlabStats stats();
+
+private:
+    struct Slab;
+
+    void setup();
+    Slab* grow(unsigned node, uint32_t flags);
+    Slab* find_partial(unsigned node);
+
+    const char* name_;
+    uint32_t object_size_;
+    uint32_t objects_per_slab_ = 0;
+    unsigned order_ = 0;
+    bool ready_ = false;
+    Spinlock lock_;
+    ListNode partial_[kMaxNodes] = {};
+    ListNode full_ = {nullptr, nullptr};
+    SlabStats stats_ = {0, 0};
+};
+
+void* kmalloc(size_t size);
+void kfree(void* ptr);
+
+#endif // MM_SLAB_H
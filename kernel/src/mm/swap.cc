@@ -0,0 +1,43 @@
+#include "swap.h"
+
+static SwapBackend* active;
+static SwapStats stats;
+
+void swap_register(SwapBackend* backend) {
+    __atomic_store_n(&active, backend, __ATOMIC_RELEASE);
+}
+
+bool swap_available() {
+    return __atomic_load_n(&active, __ATOMIC_ACQUIRE) != nullptr;
+}
+
+bool swap_store(const void* page, uint64_t* slot) {
+    SwapBackend* backend = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    if (!backend || !backend->store(backend->context, page, slot)) {
+        __atomic_add_fetch(&stats.store_failures, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    __atomic_add_fetch(&stats.stored, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.slots_in_use, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool swap_load(uint64_t slot, void* page) {
+    SwapBackend* backend = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    if (!backend || !backend->load(backend->context, slot, page)) {
+        return false;
+    }
+    __atomic_add_fetch(&stats.loaded, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void swap_free(uint64_t slot) {
+    SwapBackend* backend = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    backend->discard(backend->context, slot);
+    __atomic_add_fetch(&stats.discarded, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats.slots_in_use, 1, __ATOMIC_RELAXED);
+}
+
+SwapStats swap_stats() {
+    return stats;
+}
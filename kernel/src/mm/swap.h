@@ -0,0 +1,37 @@
+#ifndef MM_SWAP_H
+#define MM_SWAP_H
+
+#include <stdint.h>
+
+// Largest slot number that fits in a swap entry's address bits.
+constexpr uint64_t kMaxSwapSlot = (1ull << 40) - 1;
+
+// Where evicted anonymous pages go. A backend stores a copy of a 4 KiB
+// page under a slot number of its choosing, at most kMaxSwapSlot, and
+// hands it back on a fault.
+struct SwapBackend {
+    const char* name;
+    bool (*store)(void* context, const void* page, uint64_t* slot);
+    bool (*load)(void* context, uint64_t slot, void* page);
+    void (*discard)(void* context, uint64_t slot);
+    void* context;
+};
+
+struct SwapStats {
+    uint64_t stored;
+    uint64_t loaded;
+    uint64_t discarded;
+    uint64_t store_failures;
+    uint64_t slots_in_use;
+};
+
+// Only one backend is active at a time; registering replaces it.
+void swap_register(SwapBackend* backend);
+bool swap_available();
+bool swap_store(const void* page, uint64_t* slot);
+bool swap_load(uint64_t slot, void* page);
+// Called once the last reference to a slot goes away.
+void swap_free(uint64_t slot);
+SwapStats swap_stats();
+
+#endif // MM_SWAP_H
@@ -0,0 +1,314 @@
+#include "thp.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/string.h"
+#include "../lib/util.h"
+#include "../sched/daemon.h"
+#include "../sync/spinlock.h"
+#include "fault.h"
+#include "layout.h"
+#include "slab.h"
+
+constexpr uint64_t kLargePageFrames = 1ull << kLargeOrder;
+// 2 MiB ranges the collapse daemon examines per run.
+constexpr unsigned kCollapseBudget = 16;
+
+// An address space with ranges waiting to be collapsed, and how far the
+// daemon has got through it.
+struct CollapseSlot {
+    ListNode node;
+    AddressSpace* space;
+    uintptr_t cursor;
+    bool busy;
+    // Queued again while being scanned; start over once the scan ends.
+    bool requeued;
+};
+
+static Frame* huge_zero;
+static PER_CPU PerCpu<ThpStats> stats;
+static SlabCache slot_cache("thp-slot", sizeof(CollapseSlot));
+static ListNode slots = {&slots, &slots};
+static Spinlock slots_lock;
+
+static bool collapse_run(void* context);
+
+static Daemon collapse_daemon("thp-collapse", collapse_run);
+
+void thp_init() {
+    // Without a huge zero page, read faults simply map 4 KiB zero pages.
+    huge_zero = frame_alloc(kLargeOrder, AllocZero);
+    if (huge_zero) {
+        frame_split(huge_zero, kLargeOrder);
+        for (uint64_t i = 0; i < kLargePageFrames; ++i) {
+            huge_zero[i].flags |= FrameReserved;
+        }
+    }
+    daemon_register(&collapse_daemon);
+}
+
+Frame* huge_zero_frame() {
+    return huge_zero;
+}
+
+static CollapseSlot* find_slot(AddressSpace& space) {
+    for (ListNode* node = slots.next; node != &slots; node = node->next) {
+        CollapseSlot* slot = list_entry(node, CollapseSlot, node);
+        if (slot->space == &space) {
+            return slot;
+        }
+    }
+    return nullptr;
+}
+
+static void queue_collapse(AddressSpace& space) {
+    {
+        LockGuard<Spinlock> guard(slots_lock);
+        CollapseSlot* slot = find_slot(space);
+        if (slot) {
+            slot->requeued = slot->busy;
+        } else {
+            slot = (CollapseSlot*)slot_cache.alloc();
+            if (!slot) {
+                return;
+            }
+            slot->space = &space;
+            slot->cursor = 0;
+            slot->busy = false;
+            slot->requeued = false;
+            list_push_back(&slots, &slot->node);
+        }
+    }
+    daemon_wake(&collapse_daemon);
+}
+
+void thp_forget(AddressSpace& space) {
+    for (;;) {
+        {
+            LockGuard<Spinlock> guard(slots_lock);
+            CollapseSlot* slot = find_slot(space);
+            if (!slot) {
+                return;
+            }
+            if (!slot->busy) {
+                list_remove(&slot->node);
+                slot_cache.free(slot);
+                return;
+            }
+        }
+        // The collapse may be waiting for this CPU's TLB flush.
+        tlb_drain();
+        cpu_pause();
+    }
+}
+
+static void note_leaf(void* context, uintptr_t, uint64_t*, int, TlbBatch&) {
+    *(bool*)context = true;
+}
+
+static bool range_empty(AddressSpace& space, uintptr_t base) {
+    bool mapped = false;
+    TlbBatch batch(space);
+    space.visit_leaves(base, base + kLargePageSize, note_leaf, &mapped, batch);
+    return !mapped;
+}
+
+static bool map_huge(AddressSpace& space, uintptr_t base, uint64_t flags) {
+    Frame* frame = frame_alloc(kLargeOrder, AllocZero);
+    if (!frame) {
+        stats.get()->fallbacks++;
+        queue_collapse(space);
+        return false;
+    }
+    if (!space.map(base, frame_to_phys(frame), kLargePageSize, flags)) {
+        frame_free(frame, kLargeOrder);
+        return false;
+    }
+    frame_split(frame, kLargeOrder);
+    stats.get()->huge_faults++;
+    return true;
+}
+
+static bool huge_copy_on_write(AddressSpace& space, uintptr_t base, uint64_t phys, uint64_t flags) {
+    Frame* head = phys_to_frame(phys);
+    if (head == huge_zero) {
+        if (map_huge(space, base, flags)) {
+            return true;
+        }
+        // Give up the huge zero page; the range refaults with 4 KiB pages.
+        space.unmap(base, kLargePageSize);
+        return false;
+    }
+    bool exclusive = true;
+    for (uint64_t i = 0; i < kLargePageFrames && exclusive; ++i) {
+        exclusive = __atomic_load_n(&head[i].refcount, __ATOMIC_ACQUIRE) == 1;
+    }
+    if (exclusive) {
+        if (!space.protect(base, kLargePageSize, flags)) {
+            return false;
+        }
+        stats.get()->cow_reuses++;
+        return true;
+    }
+    // Without a free 2 MiB block only the faulting 4 KiB page is copied,
+    // which splits the leaf.
+    Frame* copy = frame_alloc(kLargeOrder);
+    if (!copy) {
+        stats.get()->fallbacks++;
+        return false;
+    }
+    memcpy(frame_to_virt(copy), frame_to_virt(head), kLargePageSize);
+    if (!space.map(base, frame_to_phys(copy), kLargePageSize, flags)) {
+        frame_free(copy, kLargeOrder);
+        return false;
+    }
+    frame_split(copy, kLargeOrder);
+    for (uint64_t i = 0; i < kLargePageFrames; ++i) {
+        frame_put(&head[i], 0);
+    }
+    stats.get()->cow_copies++;
+    return true;
+}
+
+bool thp_handle_fault(AddressSpace& space, VmRegion* region, uintptr_t addr, uint64_t error) {
+    uintptr_t base = align_down(addr, kLargePageSize);
+    if (!(region->flags & RegionAnonymous) || base < region->start || region->end - base < kLargePageSize) {
+        return false;
+    }
+    uint64_t flags = region_page_flags(region->flags);
+    uint64_t phys, current;
+    int level;
+    if (!space.translate(addr, &phys, &current, &level)) {
+        if (!range_empty(space, base)) {
+            // Already populated with 4 KiB pages; the daemon may promote it
+            // once the rest of the range has been touched.
+            queue_collapse(space);
+            return false;
+        }
+        if (!(error & FaultWrite) && huge_zero) {
+            if (!space.map(base, frame_to_phys(huge_zero), kLargePageSize, flags & ~PageWritable)) {
+                return false;
+            }
+            stats.get()->zero_maps++;
+            return true;
+        }
+        return map_huge(space, base, flags);
+    }
+    if (level != 2 || !(error & FaultWrite) || (current & PageWritable)) {
+        return false;
+    }
+    return huge_copy_on_write(space, base, align_down(phys, kLargePageSize), flags);
+}
+
+struct CollapseScan {
+    uint64_t pages;
+    uint64_t zero_pages;
+    bool eligible;
+};
+
+static void scan_leaf(void* context, uintptr_t, uint64_t* entry, int level, TlbBatch&) {
+    CollapseScan* scan = (CollapseScan*)context;
+    uint64_t phys = leaf_phys(*entry, level);
+    if (!(*entry & PagePresent) || level != 1 || (phys >> kFrameShift) >= frame_map_count) {
+        scan->eligible = false;
+        return;
+    }
+    Frame* frame = phys_to_frame(phys);
+    if (frame == zero_frame()) {
+        scan->zero_pages++;
+    } else if ((frame->flags & FrameReserved) || __atomic_load_n(&frame->refcount, __ATOMIC_ACQUIRE) != 1) {
+        // Shared with another address space, or not anonymous memory.
+        scan->eligible = false;
+    }
+    scan->pages++;
+}
+
+static void try_collapse(AddressSpace& space, VmRegion* region, uintptr_t base) {
+    stats.get()->scanned++;
+    CollapseScan scan = {0, 0, true};
+    {
+        TlbBatch batch(space);
+        space.visit_leaves(base, base + kLargePageSize, scan_leaf, &scan, batch);
+    }
+    if (!scan.eligible || scan.pages != kLargePageFrames || scan.zero_pages == kLargePageFrames) {
+        return;
+    }
+    Frame* frame = frame_alloc(kLargeOrder);
+    if (!frame) {
+        stats.get()->collapse_failed++;
+        return;
+    }
+    if (!space.collapse(base, frame_to_phys(frame), region_page_flags(region->flags))) {
+        frame_free(frame, kLargeOrder);
+        stats.get()->collapse_failed++;
+        return;
+    }
+    frame_split(frame, kLargeOrder);
+    stats.get()->collapsed++;
+}
+
+// Scans the next few ranges of the slot's address space. Returns whether
+// the end of the address space was reached.
+static bool scan_space(CollapseSlot* slot) {
+    AddressSpace& space = *slot->space;
+    ReadGuard guard(space.regions_lock());
+    for (unsigned budget = kCollapseBudget; budget > 0; --budget) {
+        VmRegion* region = space.next_region(slot->cursor);
+        if (!region) {
+            return true;
+        }
+        uintptr_t base = align_up(max(slot->cursor, region->start), kLargePageSize);
+        if (!(region->flags & RegionAnonymous) || base >= region->end || region->end - base < kLargePageSize) {
+            slot->cursor = region->end;
+            continue;
+        }
+        slot->cursor = base + kLargePageSize;
+        LockGuard<Spinlock> region_guard(region->lock);
+        try_collapse(space, region, base);
+    }
+    return false;
+}
+
+static bool collapse_run(void*) {
+    CollapseSlot* slot;
+    {
+        LockGuard<Spinlock> guard(slots_lock);
+        if (list_empty(&slots)) {
+            return false;
+        }
+        slot = list_entry(slots.next, CollapseSlot, node);
+        slot->busy = true;
+    }
+    bool done = scan_space(slot);
+    LockGuard<Spinlock> guard(slots_lock);
+    slot->busy = false;
+    list_remove(&slot->node);
+    if (done && !slot->requeued) {
+        slot_cache.free(slot);
+    } else {
+        if (done) {
+            slot->cursor = 0;
+            slot->requeued = false;
+        }
+        // Round-robin between address spaces.
+        list_push_back(&slots, &slot->node);
+    }
+    return !list_empty(&slots);
+}
+
+ThpStats thp_stats() {
+    ThpStats total = {};
+    // Other CPUs keep counting meanwhile; the sum is only a snapshot.
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        const ThpStats* cpu = stats.get(percpu_cpu(index));
+        total.huge_faults += __atomic_load_n(&cpu->huge_faults, __ATOMIC_RELAXED);
+        total.zero_maps += __atomic_load_n(&cpu->zero_maps, __ATOMIC_RELAXED);
+        total.fallbacks += __atomic_load_n(&cpu->fallbacks, __ATOMIC_RELAXED);
+        total.cow_copies += __atomic_load_n(&cpu->cow_copies, __ATOMIC_RELAXED);
+        total.cow_reuses += __atomic_load_n(&cpu->cow_reuses, __ATOMIC_RELAXED);
+        total.scanned += __atomic_load_n(&cpu->scanned, __ATOMIC_RELAXED);
+        total.collapsed += __atomic_load_n(&cpu->collapsed, __ATOMIC_RELAXED);
+        total.collapse_failed += __atomic_load_n(&cpu->collapse_failed, __ATOMIC_RELAXED);
+    }
+    return total;
+}
@@ -0,0 +1,40 @@
+#ifndef MM_THP_H
+#define MM_THP_H
+
+#include <stdint.h>
+
+#include "frame.h"
+#include "region.h"
+#include "vmm.h"
+
+struct ThpStats {
+    // 2 MiB pages allocated by the fault path.
+    uint64_t huge_faults;
+    uint64_t zero_maps;
+    // Faults in a range that could have used a 2 MiB page but got 4 KiB
+    // pages because no free 2 MiB block was available.
+    uint64_t fallbacks;
+    uint64_t cow_copies;
+    uint64_t cow_reuses;
+    // 2 MiB ranges examined, and promoted, by the collapse daemon.
+    uint64_t scanned;
+    uint64_t collapsed;
+    uint64_t collapse_failed;
+};
+
+// Transparent huge pages for anonymous regions. Any 2 MiB aligned range
+// that lies wholly inside an anonymous region is populated with a single
+// 2 MiB page on its first fault, or mapped to a shared huge zero page when
+// that fault is a read. Ranges that end up with 4 KiB pages instead are
+// queued for a background daemon that copies them into a 2 MiB page once
+// all 512 of them are resident.
+void thp_init();
+// Called with the region's own lock held. Returns false when the fault should be
+// resolved with a 4 KiB page instead.
+bool thp_handle_fault(AddressSpace& space, VmRegion* region, uintptr_t addr, uint64_t error);
+// Drops `space` from the collapse queue; called before it is destroyed.
+void thp_forget(AddressSpace& space);
+Frame* huge_zero_frame();
+ThpStats thp_stats();
+
+#endif // MM_THP_H
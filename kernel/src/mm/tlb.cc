@@ -0,0 +1,409 @@
+#include "tlb.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/idt.h"
+#include "../arch/x86_64/lapic.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/string.h"
+#include "../log.h"
+#include "../sync/spinlock.h"
+#include "frame.h"
+#include "vmm.h"
+
+// Past this many queued addresses a CPU flushes everything, as a batch
+// does past TlbBatch::kMaxAddresses.
+constexpr size_t kQueueAddresses = 32;
+// PCIDs 1 to kPcidSlots go to user spaces; few processes alternate on one
+// CPU faster than their translations age out anyway.
+constexpr unsigned kPcidSlots = 6;
+// The generation of a PCID whose translations are unknown.
+constexpr uint64_t kNoGeneration = UINT64_MAX;
+
+constexpr uint32_t kCpuidPcid = 1u << 17;
+constexpr uint32_t kCpuidInvpcid = 1u << 10;
+
+enum TlbMode : uint32_t {
+    TlbActive,
+    TlbLazy,
+    // Lazy, and a shootdown skipped the CPU since it became so.
+    TlbLazyStale,
+};
+
+// Invalidations other CPUs asked this one for. Requests are numbered; the
+// owner drains the queue all at once and publishes the last number it
+// covered in `done`, which requesters wait for.
+struct TlbQueue {
+    Spinlock lock;
+    uintptr_t addresses[kQueueAddresses] = {};
+    size_t count = 0;
+    bool flush_all = false;
+    // A full flush that must include global kernel translations.
+    bool flush_global = false;
+    // Whether an IPI is on its way that will drain the requests so far.
+    bool ipi_pending = false;
+    uint64_t requested = 0;
+    uint64_t done = 0;
+    uint32_t mode = TlbActive;
+    // Set by the owner while it drains, so that waiting for the queue's
+    // own lock does not drain again.
+    bool draining = false;
+};
+
+struct PcidSlot {
+    // AddressSpace::id of the space whose translations the PCID holds, or
+    // zero while it is unused.
+    uint64_t space;
+    // The space's TLB generation the translations are current with.
+    uint64_t generation;
+};
+
+struct PcidCpu {
+    PcidSlot slots[kPcidSlots] = {};
+    // The slot to hand out next, the one assigned longest ago.
+    unsigned next = 0;
+    // PCID 0 starts out with whatever the trampoline's tables left in it.
+    uint64_t kernel_generation = kNoGeneration;
+};
+
+static bool pcids;
+static bool has_invpcid;
+static PER_CPU PerCpu<TlbQueue> queues;
+static PER_CPU PerCpu<PcidCpu> pcid_cpus;
+static PER_CPU PerCpu<TlbStats> stats;
+
+// Flushes everything, global translations and other PCIDs included.
+static void flush_global() {
+    if (has_invpcid) {
+        invpcid(InvpcidAll, 0);
+    } else {
+        flush_tlb_all();
+    }
+}
+
+static void flush_local(const uintptr_t* addresses, size_t count, bool all, bool global, TlbStats* local) {
+    if (all) {
+        local->full_flushes++;
+        if (global) {
+            flush_global();
+        } else {
+            write_cr3(read_cr3());
+        }
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        invlpg(addresses[i]);
+    }
+    local->invlpg += count;
+}
+
+static void drain(TlbQueue* queue) {
+    // Lock waits call this on every spin, so the common empty case stays
+    // off the lock.
+    if (queue->draining || __atomic_load_n(&queue->requested, __ATOMIC_RELAXED) == queue->done) {
+        return;
+    }
+    uintptr_t addresses[kQueueAddresses];
+    size_t count;
+    bool all;
+    bool global;
+    uint64_t requested;
+    queue->draining = true;
+    {
+        LockGuard<Spinlock> guard(queue->lock);
+        requested = queue->requested;
+        count = queue->count;
+        all = queue->flush_all;
+        global = queue->flush_global;
+        memcpy(addresses, queue->addresses, count * sizeof(uintptr_t));
+        queue->count = 0;
+        queue->flush_all = false;
+        queue->flush_global = false;
+        // Requests from here on need an interrupt of their own.
+        queue->ipi_pending = false;
+    }
+    queue->draining = false;
+    TlbStats* local = stats.get();
+    flush_local(addresses, count, all, global, local);
+    local->remote_flushes++;
+    __atomic_store_n(&queue->done, requested, __ATOMIC_RELEASE);
+}
+
+static void shootdown_interrupt(InterruptFrame*, void*) {
+    lapic_eoi();
+    drain(queues.get());
+}
+
+// Marks a lazy CPU stale, in which case it can be skipped. A CPU that
+// leaves lazy mode swaps in TlbActive, so either it sees the mark and
+// flushes or this sees it active and sends it the request.
+static bool skip_lazy(TlbQueue* queue) {
+    uint32_t mode = TlbLazy;
+    return __atomic_compare_exchange_n(&queue->mode, &mode, TlbLazyStale, false, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_SEQ_CST) ||
+           mode == TlbLazyStale;
+}
+
+static void shoot_down(AddressSpace& space, const uintptr_t* addresses, size_t count, bool all, bool tables) {
+    unsigned cpus = percpu_count();
+    if (cpus == 1) {
+        return;
+    }
+    bool kernel = &space == &kernel_space();
+    unsigned self = this_cpu()->index;
+    TlbStats* local = stats.get();
+    CpuMask interrupt;
+    CpuMask waiting;
+    uint64_t tickets[kMaxCpus];
+    // The page-table changes must be visible before the mask is read: a
+    // CPU that loads the space later then walks the new tables.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (unsigned index = 0; index < cpus; ++index) {
+        if (index == self || (!kernel && !space.cpus().test(index))) {
+            continue;
+        }
+        TlbQueue* queue = queues.get(percpu_cpu(index));
+        // Freed page tables may still be cached by a lazy CPU's walks,
+        // which can run speculatively at any time.
+        if (!kernel && !tables && skip_lazy(queue)) {
+            local->lazy_skipped++;
+            continue;
+        }
+        LockGuard<Spinlock> guard(queue->lock);
+        if (all || queue->count + count > kQueueAddresses) {
+            queue->flush_all = true;
+            queue->flush_global |= kernel;
+        } else {
+            memcpy(&queue->addresses[queue->count], addresses, count * sizeof(uintptr_t));
+            queue->count += count;
+        }
+        tickets[index] = ++queue->requested;
+        waiting.set(index);
+        if (queue->ipi_pending) {
+            local->coalesced++;
+        } else {
+            queue->ipi_pending = true;
+            interrupt.set(index);
+            local->ipis++;
+        }
+    }
+    if (waiting.empty()) {
+        return;
+    }
+    local->shootdowns++;
+    lapic_send_ipi_mask(interrupt, kIpiFixed | kVectorTlbShootdown);
+    TlbQueue* own = queues.get();
+    for (unsigned index = 0; index < cpus; ++index) {
+        if (!waiting.test(index)) {
+            continue;
+        }
+        const TlbQueue* queue = queues.get(percpu_cpu(index));
+        while (__atomic_load_n(&queue->done, __ATOMIC_ACQUIRE) < tickets[index]) {
+            // The target may itself be waiting on this CPU, with
+            // interrupts disabled as they are everywhere but in idle.
+            drain(own);
+            cpu_pause();
+        }
+    }
+}
+
+// The generation this CPU's translations of `space` are current with and
+// the PCID they are under, or null if no PCID holds them.
+static uint64_t* cached_generation(AddressSpace& space, uint16_t* pcid) {
+    PcidCpu* cpu = pcid_cpus.get();
+    if (&space == &kernel_space()) {
+        *pcid = 0;
+        return &cpu->kernel_generation;
+    }
+    for (unsigned slot = 0; slot < kPcidSlots; ++slot) {
+        if (cpu->slots[slot].space == space.id()) {
+            *pcid = slot + 1;
+            return &cpu->slots[slot].generation;
+        }
+    }
+    return nullptr;
+}
+
+// Brings this CPU's PCID for `space` from `generation` to the next one,
+// which the batch being flushed started. A PCID that was already stale
+// stays so: the flushes it missed are unknown. The translations of a space
+// that is not loaded need INVPCID, except for global kernel ones, which
+// INVLPG reached on any PCID.
+static void flush_cached(AddressSpace& space, uint64_t generation, const uintptr_t* addresses, size_t count,
+                         bool all) {
+    uint16_t pcid;
+    uint64_t* cached = pcids ? cached_generation(space, &pcid) : nullptr;
+    if (!cached || *cached != generation) {
+        return;
+    }
+    if (!space.is_active()) {
+        if (!has_invpcid) {
+            return;
+        }
+        TlbStats* local = stats.get();
+        if (all) {
+            invpcid(InvpcidContext, pcid);
+            local->invpcid++;
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                invpcid(InvpcidAddress, pcid, addresses[i]);
+            }
+            local->invpcid += count;
+        }
+    }
+    *cached = generation + 1;
+}
+
+TlbBatch::TlbBatch(AddressSpace& space) : space_(space) {
+    list_init(&freed_);
+}
+
+TlbBatch::~TlbBatch() {
+    flush();
+}
+
+void TlbBatch::add(uintptr_t virt) {
+    if (flush_all_) {
+        return;
+    }
+    if (count_ == kMaxAddresses) {
+        flush_all_ = true;
+        return;
+    }
+    addresses_[count_++] = virt;
+}
+
+void TlbBatch::add_all() {
+    flush_all_ = true;
+}
+
+void TlbBatch::defer_free(uint64_t table_phys) {
+    Frame* frame = phys_to_frame(table_phys);
+    if (frame_map == nullptr || !(frame->flags & FramePageTable)) {
+        // Tables inherited from the bootloader or allocated before the frame
+        // allocator existed are never returned.
+        return;
+    }
+    list_push_back(&freed_, &frame->node);
+}
+
+void TlbBatch::release(uint64_t phys, unsigned order) {
+    if (released_count_ == kMaxReleased) {
+        flush();
+    }
+    released_[released_count_++] = {phys, order};
+}
+
+void TlbBatch::flush() {
+    if (count_ == 0 && !flush_all_ && list_empty(&freed_) && released_count_ == 0) {
+        return;
+    }
+    bool kernel = &space_ == &kernel_space();
+    bool tables = !list_empty(&freed_);
+    if (kernel || space_.is_active()) {
+        TlbStats* local = stats.get();
+        local->batches++;
+        flush_local(addresses_, count_, flush_all_, kernel, local);
+    }
+    if (count_ || flush_all_ || tables) {
+        // Bumped before shoot_down reads the mask, so that CPUs outside it
+        // that hold the space under a PCID find it stale.
+        uint64_t generation = space_.advance_tlb_generation();
+        flush_cached(space_, generation, addresses_, count_, flush_all_);
+        shoot_down(space_, addresses_, count_, flush_all_, tables);
+    }
+    count_ = 0;
+    flush_all_ = false;
+    while (ListNode* node = list_pop_front(&freed_)) {
+        Frame* frame = list_entry(node, Frame, node);
+        frame->flags &= ~FramePageTable;
+        frame_free(frame, 0);
+    }
+    for (size_t i = 0; i < released_count_; ++i) {
+        Frame* frame = phys_to_frame(released_[i].phys);
+        for (uint64_t j = 0; j < (1ull << released_[i].order); ++j) {
+            frame_put(&frame[j], 0);
+        }
+    }
+    released_count_ = 0;
+}
+
+void tlb_init() {
+    interrupt_register(kVectorTlbShootdown, shootdown_interrupt);
+    // CR3 holds the kernel space with PCID 0, as enabling PCIDs requires.
+    pcids = cpuid(1).ecx & kCpuidPcid;
+    if (pcids) {
+        write_cr4(read_cr4() | kCr4Pcide);
+        has_invpcid = cpuid(7).ebx & kCpuidInvpcid;
+    }
+    kprintf("tlb: PCIDs %s, INVPCID %s\n", pcids ? "on" : "off", has_invpcid ? "on" : "off");
+}
+
+void tlb_switch(AddressSpace& space) {
+    if (space.is_active()) {
+        return;
+    }
+    if (!pcids) {
+        write_cr3(space.root());
+        return;
+    }
+    TlbStats* local = stats.get();
+    uint64_t generation = space.tlb_generation();
+    uint16_t pcid;
+    uint64_t* cached = cached_generation(space, &pcid);
+    if (cached && *cached == generation) {
+        local->pcid_kept++;
+        write_cr3(space.root() | pcid | kCr3NoFlush);
+        return;
+    }
+    if (cached) {
+        local->pcid_flushed++;
+    } else {
+        PcidCpu* cpu = pcid_cpus.get();
+        unsigned slot = cpu->next;
+        cpu->next = (slot + 1) % kPcidSlots;
+        local->pcid_recycled += cpu->slots[slot].space != 0;
+        cpu->slots[slot].space = space.id();
+        cached = &cpu->slots[slot].generation;
+        pcid = slot + 1;
+    }
+    *cached = generation;
+    // Without kCr3NoFlush the write drops whatever the PCID held.
+    write_cr3(space.root() | pcid);
+}
+
+void tlb_drain() {
+    drain(queues.get());
+}
+
+void tlb_enter_lazy() {
+    __atomic_store_n(&queues.get()->mode, TlbLazy, __ATOMIC_SEQ_CST);
+}
+
+void tlb_leave_lazy() {
+    if (__atomic_exchange_n(&queues.get()->mode, TlbActive, __ATOMIC_SEQ_CST) == TlbLazyStale) {
+        write_cr3(read_cr3());
+        stats.get()->lazy_flushes++;
+    }
+}
+
+TlbStats tlb_stats() {
+    TlbStats total = {};
+    // Other CPUs keep counting meanwhile; the sum is only a snapshot.
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        const TlbStats* cpu = stats.get(percpu_cpu(index));
+        total.batches += __atomic_load_n(&cpu->batches, __ATOMIC_RELAXED);
+        total.invlpg += __atomic_load_n(&cpu->invlpg, __ATOMIC_RELAXED);
+        total.full_flushes += __atomic_load_n(&cpu->full_flushes, __ATOMIC_RELAXED);
+        total.shootdowns += __atomic_load_n(&cpu->shootdowns, __ATOMIC_RELAXED);
+        total.ipis += __atomic_load_n(&cpu->ipis, __ATOMIC_RELAXED);
+        total.coalesced += __atomic_load_n(&cpu->coalesced, __ATOMIC_RELAXED);
+        total.lazy_skipped += __atomic_load_n(&cpu->lazy_skipped, __ATOMIC_RELAXED);
+        total.lazy_flushes += __atomic_load_n(&cpu->lazy_flushes, __ATOMIC_RELAXED);
+        total.remote_flushes += __atomic_load_n(&cpu->remote_flushes, __ATOMIC_RELAXED);
+        total.pcid_kept += __atomic_load_n(&cpu->pcid_kept, __ATOMIC_RELAXED);
+        total.pcid_flushed += __atomic_load_n(&cpu->pcid_flushed, __ATOMIC_RELAXED);
+        total.pcid_recycled += __atomic_load_n(&cpu->pcid_recycled, __ATOMIC_RELAXED);
+        total.invpcid += __atomic_load_n(&cpu->invpcid, __ATOMIC_RELAXED);
+    }
+    return total;
+}
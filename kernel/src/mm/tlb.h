@@ -0,0 +1,104 @@
+#ifndef MM_TLB_H
+#define MM_TLB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../lib/list.h"
+
+class AddressSpace;
+
+struct TlbStats {
+    uint64_t batches;
+    uint64_t invlpg;
+    uint64_t full_flushes;
+    // Batches that had to reach other CPUs, the CPUs they interrupted, and
+    // the requests that joined an interrupt already on its way instead.
+    uint64_t shootdowns;
+    uint64_t ipis;
+    uint64_t coalesced;
+    // CPUs a shootdown skipped because they were lazy, and the full
+    // flushes those CPUs did when they came back.
+    uint64_t lazy_skipped;
+    uint64_t lazy_flushes;
+    // Requests other CPUs ran on a CPU's behalf.
+    uint64_t remote_flushes;
+    // Address-space switches that kept the PCID's translations, those that
+    // had to flush them, and those that took a PCID from another space.
+    uint64_t pcid_kept;
+    uint64_t pcid_flushed;
+    uint64_t pcid_recycled;
+    // Translations of spaces held under other PCIDs invalidated in place.
+    uint64_t invpcid;
+};
+
+// Collects the virtual addresses whose translations changed during a range
+// operation and invalidates them in one go. Past kMaxAddresses a single
+// full flush is cheaper than walking the list. Page-table frames that were
+// unlinked, and the references to mapped frames that unmap gave up, are
+// only dropped after the flush, once no TLB or paging-structure cache can
+// still reference them.
+//
+// The flush reaches every other CPU that has the space loaded, all of them
+// for the kernel space, and waits for them. Each CPU keeps one queue of
+// pending invalidations that any number of batches add to and a single
+// IPI drains, so concurrent shootdowns share their interrupts. Lazy CPUs
+// are skipped when only translations changed: they flush everything once
+// they leave lazy mode instead.
+class TlbBatch {
+public:
+    explicit TlbBatch(AddressSpace& space);
+    ~TlbBatch();
+    TlbBatch(const TlbBatch&) = delete;
+    TlbBatch& operator=(const TlbBatch&) = delete;
+
+    void add(uintptr_t virt);
+    void add_all();
+    void defer_free(uint64_t table_phys);
+    // Drops one reference on each of the 1 << order frames at `phys`.
+    void release(uint64_t phys, unsigned order);
+    void flush();
+    AddressSpace& space() const {
+        return space_;
+    }
+
+private:
+    static constexpr size_t kMaxAddresses = 32;
+    static constexpr size_t kMaxReleased = 64;
+
+    struct Released {
+        uint64_t phys;
+        unsigned order;
+    };
+
+    AddressSpace& space_;
+    uintptr_t addresses_[kMaxAddresses];
+    size_t count_ = 0;
+    bool flush_all_ = false;
+    ListNode freed_;
+    Released released_[kMaxReleased];
+    size_t released_count_ = 0;
+};
+
+// Registers the shootdown interrupt and turns on PCIDs when the CPU has
+// them. Runs before other CPUs start, which inherit CR4 from this one.
+void tlb_init();
+// Loads `space`'s page tables on the calling CPU. With PCIDs, each CPU
+// hands out a few of them round robin, the kernel space always getting
+// PCID 0, so that switching back to a space it ran recently keeps the
+// space's translations, unless the space's TLB generation moved on while
+// the CPU was away. Called by AddressSpace::activate.
+void tlb_switch(AddressSpace& space);
+// Runs the invalidations other CPUs queued for the calling CPU. A CPU only
+// takes the shootdown interrupt while idle, so every loop that waits for
+// another CPU with interrupts disabled calls this, lock waits included:
+// the CPU it waits for may itself be waiting for this one's flush.
+void tlb_drain();
+// Lazy mode covers stretches in which the calling CPU uses no lower-half
+// translation, like idling, so that user-space flushes can leave it alone.
+// Kernel-space flushes and page-table frees still reach it.
+void tlb_enter_lazy();
+void tlb_leave_lazy();
+TlbStats tlb_stats();
+
+#endif // MM_TLB_H
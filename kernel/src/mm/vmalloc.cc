@@ -0,0 +1,255 @@
+#include "vmalloc.h"
+
+#include "../lib/list.h"
+#include "../lib/string.h"
+#include "../lib/util.h"
+#include "../sync/spinlock.h"
+#include "frame.h"
+#include "layout.h"
+#include "migrate.h"
+#include "slab.h"
+#include "vmm.h"
+
+constexpr uint64_t kGuardSize = kPageSize;
+constexpr uint32_t kAreaIo = 1u << 31;
+constexpr uint64_t kKernelDataFlags = PageWritable | PageGlobal | PageNoExecute;
+constexpr uint64_t kIoFlags = kKernelDataFlags | PageCacheDisable | PageWriteThrough | PageMergeable;
+
+struct VmArea {
+    ListNode node;
+    uintptr_t start;
+    uint64_t size;
+    uint64_t mapped_pages;
+    uint32_t flags;
+};
+
+static SlabCache area_cache("vmalloc-area", sizeof(VmArea));
+static Spinlock area_lock;
+static ListNode areas;
+// Next-fit cursor: searches resume after this area unless a hole before it
+// that was skipped earlier could satisfy the request.
+static VmArea* search_from = nullptr;
+static uint64_t cached_hole_size = 0;
+static VmallocStats stats;
+
+static VmArea* area_of(ListNode* node) {
+    return list_entry(node, VmArea, node);
+}
+
+static uintptr_t area_end(const VmArea* area) {
+    return area->start + area->size + kGuardSize;
+}
+
+void vmalloc_init() {
+    list_init(&areas);
+}
+
+static VmArea* reserve(uint64_t size, uint64_t align, uint32_t flags) {
+    VmArea* area = (VmArea*)area_cache.alloc();
+    if (!area) {
+        return nullptr;
+    }
+    LockGuard<Spinlock> guard(area_lock);
+    uint64_t span = size + kGuardSize;
+    if (!search_from || span <= cached_hole_size) {
+        search_from = nullptr;
+        cached_hole_size = 0;
+    }
+    ListNode* prev = search_from ? &search_from->node : &areas;
+    uintptr_t candidate = search_from ? area_end(search_from) : kVmallocBase;
+    for (;;) {
+        ListNode* next = prev->next;
+        uintptr_t hole_end = next == &areas ? kVmallocBase + kVmallocSize : area_of(next)->start;
+        uintptr_t start = align_up(candidate, align);
+        if (start < hole_end && hole_end - start >= span) {
+            area->start = start;
+            area->size = size;
+            area->mapped_pages = 0;
+            area->flags = flags;
+            list_insert_between(&area->node, prev, next);
+            search_from = area;
+            stats.areas++;
+            stats.reserved_bytes += size;
+            return area;
+        }
+        if (next == &areas) {
+            break;
+        }
+        cached_hole_size = max<uint64_t>(cached_hole_size, hole_end - candidate);
+        candidate = area_end(area_of(next));
+        prev = next;
+    }
+    area_cache.free(area);
+    return nullptr;
+}
+
+static void unlink(VmArea* area) {
+    if (search_from && area->start <= search_from->start) {
+        search_from = nullptr;
+    }
+    list_remove(&area->node);
+    stats.areas--;
+    stats.reserved_bytes -= area->size;
+}
+
+static void release(VmArea* area) {
+    {
+        TlbBatch batch(kernel_space());
+        kernel_space().unmap(area->start, area->size, batch, !(area->flags & kAreaIo));
+    }
+    if (!(area->flags & kAreaIo)) {
+        LockGuard<Spinlock> guard(area_lock);
+        stats.mapped_pages -= area->mapped_pages;
+    }
+    area_cache.free(area);
+}
+
+static bool populate(VmArea* area) {
+    AddressSpace& space = kernel_space();
+    TlbBatch batch(space);
+    uint32_t alloc_flags = area->flags & VmallocZero ? (uint32_t)AllocZero : 0;
+    for (uint64_t offset = 0; offset < area->size;) {
+        uintptr_t virt = area->start + offset;
+        unsigned order = 0;
+        Frame* frame = nullptr;
+        if (is_aligned(virt, kLargePageSize) && area->size - offset >= kLargePageSize) {
+            frame = frame_alloc(kLargeOrder, alloc_flags);
+            order = kLargeOrder;
+        }
+        if (!frame) {
+            frame = frame_alloc(0, alloc_flags | AllocMovable);
+            order = 0;
+        }
+        if (!frame) {
+            return false;
+        }
+        if (!space.map(virt, frame_to_phys(frame), kPageSize << order, kKernelDataFlags, batch)) {
+            frame_free(frame, order);
+            return false;
+        }
+        if (order == kLargeOrder) {
+            frame_split(frame, order);
+        } else {
+            frame_set_movable(frame, &space, virt);
+        }
+        {
+            LockGuard<Spinlock> guard(area_lock);
+            if (order == kLargeOrder) {
+                stats.large_chunks++;
+            }
+            stats.mapped_pages += 1ull << order;
+        }
+        area->mapped_pages += 1ull << order;
+        offset += kPageSize << order;
+    }
+    return true;
+}
+
+void* vmalloc(size_t size, uint32_t flags) {
+    if (size == 0) {
+        return nullptr;
+    }
+    size = align_up(size, kPageSize);
+    uint64_t align = size >= kLargePageSize ? kLargePageSize : kPageSize;
+    VmArea* area = reserve(size, align, flags & (VmallocLazy | VmallocZero));
+    if (!area) {
+        return nullptr;
+    }
+    if (!(flags & VmallocLazy) && !populate(area)) {
+        {
+            LockGuard<Spinlock> guard(area_lock);
+            unlink(area);
+        }
+        release(area);
+        return nullptr;
+    }
+    return (void*)area->start;
+}
+
+static VmArea* take_area(uintptr_t start) {
+    LockGuard<Spinlock> guard(area_lock);
+    for (ListNode* node = areas.next; node != &areas; node = node->next) {
+        VmArea* area = area_of(node);
+        if (area->start == start) {
+            unlink(area);
+            return area;
+        }
+    }
+    return nullptr;
+}
+
+void vfree(void* addr) {
+    if (!addr) {
+        return;
+    }
+    VmArea* area = take_area((uintptr_t)addr);
+    if (area) {
+        release(area);
+    }
+}
+
+void* ioremap(uint64_t phys, size_t size) {
+    uint64_t offset = phys & (kPageSize - 1);
+    size = align_up(size + offset, kPageSize);
+    VmArea* area = reserve(size, kPageSize, kAreaIo);
+    if (!area) {
+        return nullptr;
+    }
+    if (!kernel_space().map(area->start, phys - offset, size, kIoFlags)) {
+        {
+            LockGuard<Spinlock> guard(area_lock);
+            unlink(area);
+        }
+        release(area);
+        return nullptr;
+    }
+    return (void*)(area->start + offset);
+}
+
+void iounmap(void* addr) {
+    vfree((void*)align_down((uintptr_t)addr, kPageSize));
+}
+
+bool vmalloc_handle_fault(uintptr_t virt) {
+    if (virt < kVmallocBase || virt - kVmallocBase >= kVmallocSize) {
+        return false;
+    }
+    LockGuard<Spinlock> guard(area_lock);
+    for (ListNode* node = areas.next; node != &areas; node = node->next) {
+        VmArea* area = area_of(node);
+        if (virt < area->start) {
+            break;
+        }
+        if (virt - area->start >= area->size) {
+            continue;
+        }
+        if (!(area->flags & VmallocLazy)) {
+            return false;
+        }
+        uintptr_t page = align_down(virt, kPageSize);
+        uint64_t phys;
+        if (kernel_space().translate(page, &phys)) {
+            // Another CPU populated the page while we were trapping.
+            return true;
+        }
+        Frame* frame = frame_alloc(0, AllocZero | AllocMovable);
+        if (!frame) {
+            return false;
+        }
+        if (!kernel_space().map(page, frame_to_phys(frame), kPageSize, kKernelDataFlags)) {
+            frame_free(frame, 0);
+            return false;
+        }
+        frame_set_movable(frame, &kernel_space(), page);
+        stats.lazy_faults++;
+        stats.mapped_pages++;
+        area->mapped_pages++;
+        return true;
+    }
+    return false;
+}
+
+VmallocStats vmalloc_stats() {
+    LockGuard<Spinlock> guard(area_lock);
+    return stats;
+}
@@ -0,0 +1,39 @@
+#ifndef MM_VMALLOC_H
+#define MM_VMALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum VmallocFlags : uint32_t {
+    // Back pages on first touch instead of at allocation time.
+    VmallocLazy = 1u << 0,
+    VmallocZero = 1u << 1,
+};
+
+struct VmallocStats {
+    uint64_t areas;
+    uint64_t reserved_bytes;
+    uint64_t mapped_pages;
+    uint64_t large_chunks;
+    uint64_t lazy_faults;
+};
+
+// Virtually contiguous kernel memory in [kVmallocBase, +kVmallocSize),
+// backed by frames that need not be physically contiguous. Each area is
+// followed by an unmapped guard page. Requests of 2 MiB or more are
+// 2 MiB aligned and opportunistically backed by order-9 blocks so that
+// they end up on large leaves; everything else uses single frames.
+void vmalloc_init();
+void* vmalloc(size_t size, uint32_t flags = 0);
+void vfree(void* addr);
+
+// Maps device memory uncached into the vmalloc area.
+void* ioremap(uint64_t phys, size_t size);
+void iounmap(void* addr);
+
+// Resolves a fault on a VmallocLazy area; false if `virt` is not in one.
+bool vmalloc_handle_fault(uintptr_t virt);
+
+VmallocStats vmalloc_stats();
+
+#endif // MM_VMALLOC_H
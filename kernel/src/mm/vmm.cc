@@ -0,0 +1,747 @@
+#include "vmm.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/page.h"
+#include "../lib/string.h"
+#include "../lib/util.h"
+#include "../panic.h"
+#include "frame.h"
+#include "layout.h"
+#include "migrate.h"
+#include "reclaim.h"
+#include "swap.h"
+#include "thp.h"
+
+constexpr uint64_t kSmallPat = 1ull << 7;
+constexpr uint64_t kLargePat = 1ull << 12;
+constexpr uint64_t kAccessedDirty = PageAccessed | PageDirty;
+constexpr unsigned kEntries = 512;
+constexpr uint32_t kMsrEfer = 0xC0000080;
+constexpr uint64_t kEferNxe = 1ull << 11;
+
+uintptr_t phys_offset = 0;
+
+static AddressSpace kernel;
+static PER_CPU PerCpu<AddressSpace*> active(&kernel);
+static bool has_huge_leaves = false;
+// Without NX, bit 63 of an entry is reserved and faults every access.
+static bool has_no_execute = false;
+static VmmStats stats;
+static uint64_t last_space_id = 0;
+
+static unsigned level_index(uintptr_t virt, int level) {
+    return (virt >> (12 + 9 * (level - 1))) & (kEntries - 1);
+}
+
+static uint64_t* table_virt(uint64_t phys) {
+    return (uint64_t*)phys_to_virt(phys);
+}
+
+static bool is_leaf(uint64_t entry, int level) {
+    return level == 1 || (entry & PageHuge);
+}
+
+static uint64_t leaf_addr_mask(int level) {
+    return kPageAddrMask & ~(page_level_size(level) - 1);
+}
+
+static uint64_t large_to_small_attrs(uint64_t attrs) {
+    uint64_t pat = attrs & kLargePat;
+    attrs &= ~(kLargePat | PageHuge);
+    return pat ? attrs | kSmallPat : attrs;
+}
+
+static uint64_t small_to_large_attrs(uint64_t attrs) {
+    uint64_t pat = attrs & kSmallPat;
+    attrs &= ~kSmallPat;
+    return (pat ? attrs | kLargePat : attrs) | PageHuge;
+}
+
+static uint64_t table_entry(uint64_t table_phys, uintptr_t virt) {
+    uint64_t entry = table_phys | PagePresent | PageWritable;
+    return virt < kKernelHalfBase ? entry | PageUser : entry;
+}
+
+static uint64_t alloc_table() {
+    // Called with the page-table lock held, which reclaim may need.
+    uint64_t phys = frame_alloc_phys(0, AllocZero | AllocNoReclaim);
+    if (phys != 0 && frame_map != nullptr) {
+        phys_to_frame(phys)->flags |= FramePageTable;
+    }
+    return phys;
+}
+
+// The flags to put in a leaf, minus those the CPU does not support.
+static uint64_t leaf_flags(uint64_t flags) {
+    return has_no_execute ? flags : flags & ~PageNoExecute;
+}
+
+static bool can_use_leaf(int level, uintptr_t virt, uintptr_t end, uint64_t phys) {
+    if (level != 2 && !(level == 3 && has_huge_leaves)) {
+        return false;
+    }
+    uint64_t size = page_level_size(level);
+    return is_aligned(virt, size) && is_aligned(phys, size) && end - virt >= size;
+}
+
+// End of the part of [virt, end) that falls into the entry covering virt.
+static uintptr_t chunk_end(uintptr_t virt, uintptr_t end, int level) {
+    uintptr_t entry_last = align_down(virt, page_level_size(level)) + page_level_size(level) - 1;
+    return entry_last < end - 1 ? entry_last + 1 : end;
+}
+
+static bool table_empty(uint64_t table_phys) {
+    uint64_t* table = table_virt(table_phys);
+    for (unsigned i = 0; i < kEntries; ++i) {
+        if (table[i] & (PagePresent | PageSwapped)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void free_table_tree(uint64_t table_phys, int level, TlbBatch& batch) {
+    if (level > 1) {
+        uint64_t* table = table_virt(table_phys);
+        for (unsigned i = 0; i < kEntries; ++i) {
+            if ((table[i] & PagePresent) && !is_leaf(table[i], level)) {
+                free_table_tree(table[i] & kPageAddrMask, level - 1, batch);
+            }
+        }
+    }
+    batch.defer_free(table_phys);
+}
+
+// Replaces the large leaf in `entry` by a table of next-level entries that
+// map the same memory with the same attributes.
+static bool split_leaf(uint64_t* entry, int level, uintptr_t base, TlbBatch& batch) {
+    uint64_t table_phys = alloc_table();
+    if (table_phys == 0) {
+        return false;
+    }
+    uint64_t* table = table_virt(table_phys);
+    uint64_t phys = *entry & leaf_addr_mask(level);
+    uint64_t attrs = *entry & ~leaf_addr_mask(level);
+    if (level == 2) {
+        attrs = large_to_small_attrs(attrs);
+    }
+    uint64_t child_size = page_level_size(level - 1);
+    for (unsigned i = 0; i < kEntries; ++i) {
+        table[i] = (phys + i * child_size) | attrs;
+    }
+    *entry = table_entry(table_phys, base);
+    batch.add(base);
+    stats.splits++;
+    return true;
+}
+
+// Folds the table referenced by `entry` into a single large leaf if all of
+// its entries are PageMergeable leaves mapping one aligned, contiguous
+// physical run with identical attributes. Frames that migration or reclaim
+// track one page at a time are left alone.
+static void try_merge(uint64_t* entry, int level, uintptr_t base, TlbBatch& batch) {
+    if (level != 2 && !(level == 3 && has_huge_leaves)) {
+        return;
+    }
+    if (!(*entry & PagePresent) || is_leaf(*entry, level)) {
+        return;
+    }
+    int child_level = level - 1;
+    uint64_t child_mask = leaf_addr_mask(child_level);
+    uint64_t child_size = page_level_size(child_level);
+    uint64_t table_phys = *entry & kPageAddrMask;
+    uint64_t* table = table_virt(table_phys);
+    uint64_t first = table[0];
+    if (!(first & PagePresent) || !is_leaf(first, child_level)) {
+        return;
+    }
+    uint64_t phys = first & child_mask;
+    if (!is_aligned(phys, page_level_size(level))) {
+        return;
+    }
+    uint64_t attrs = first & ~child_mask & ~kAccessedDirty;
+    if (!(attrs & PageMergeable)) {
+        return;
+    }
+    uint64_t accessed_dirty = 0;
+    for (unsigned i = 0; i < kEntries; ++i) {
+        uint64_t child = table[i];
+        if ((child & child_mask) != phys + i * child_size ||
+            (child & ~child_mask & ~kAccessedDirty) != attrs) {
+            return;
+        }
+        accessed_dirty |= child & kAccessedDirty;
+    }
+    if (child_level == 1 && (phys >> kFrameShift) < frame_map_count) {
+        Frame* frame = phys_to_frame(phys);
+        for (unsigned i = 0; i < kEntries; ++i) {
+            if (__atomic_load_n(&frame[i].flags, __ATOMIC_RELAXED) & (FrameMovable | FrameLru)) {
+                return;
+            }
+        }
+    }
+    if (child_level == 1) {
+        attrs = small_to_large_attrs(attrs);
+    }
+    *entry = phys | attrs | accessed_dirty;
+    batch.add(base);
+    batch.defer_free(table_phys);
+    stats.merges++;
+}
+
+static bool map_table(uint64_t table_phys, int level, uintptr_t virt, uintptr_t end, uint64_t phys,
+                      uint64_t flags, TlbBatch& batch) {
+    uint64_t* table = table_virt(table_phys);
+    while (virt < end) {
+        uintptr_t next = chunk_end(virt, end, level);
+        uint64_t* entry = &table[level_index(virt, level)];
+        if (level == 1) {
+            if (*entry & PagePresent) {
+                batch.add(virt);
+            } else if (*entry & PageSwapped) {
+                swap_free(swap_entry_slot(*entry));
+            }
+            *entry = phys | flags | PagePresent;
+        } else if (can_use_leaf(level, virt, next, phys)) {
+            uint64_t old = *entry;
+            *entry = phys | flags | PagePresent | PageHuge;
+            if (old & PagePresent) {
+                batch.add(virt);
+                if (!is_leaf(old, level)) {
+                    free_table_tree(old & kPageAddrMask, level - 1, batch);
+                }
+            }
+            if (level == 2) {
+                stats.large_leaves++;
+            } else {
+                stats.huge_leaves++;
+            }
+        } else {
+            uintptr_t base = align_down(virt, page_level_size(level));
+            if (!(*entry & PagePresent)) {
+                uint64_t child = alloc_table();
+                if (child == 0) {
+                    return false;
+                }
+                *entry = table_entry(child, virt);
+            } else if (is_leaf(*entry, level) && !split_leaf(entry, level, base, batch)) {
+                return false;
+            }
+            if (!map_table(*entry & kPageAddrMask, level - 1, virt, next, phys, flags, batch)) {
+                return false;
+            }
+            try_merge(entry, level, base, batch);
+        }
+        phys += next - virt;
+        virt = next;
+    }
+    return true;
+}
+
+static bool unmap_table(uint64_t table_phys, int level, uintptr_t virt, uintptr_t end, TlbBatch& batch,
+                        bool release) {
+    uint64_t* table = table_virt(table_phys);
+    while (virt < end) {
+        uintptr_t next = chunk_end(virt, end, level);
+        uint64_t* entry = &table[level_index(virt, level)];
+        uintptr_t base = align_down(virt, page_level_size(level));
+        if (!(*entry & PagePresent)) {
+            if (level == 1 && (*entry & PageSwapped)) {
+                swap_free(swap_entry_slot(*entry));
+                *entry = 0;
+            }
+            virt = next;
+            continue;
+        }
+        if (is_leaf(*entry, level)) {
+            if (virt == base && next - virt == page_level_size(level)) {
+                uint64_t phys = *entry & leaf_addr_mask(level);
+                *entry = 0;
+                batch.add(virt);
+                if (release && (phys >> kFrameShift) < frame_map_count) {
+                    if (level == 1) {
+                        frame_unmapped(phys_to_frame(phys), &batch.space());
+                    }
+                    batch.release(phys, level == 1 ? 0 : 9 * (level - 1));
+                }
+                virt = next;
+                continue;
+            }
+            if (!split_leaf(entry, level, base, batch)) {
+                return false;
+            }
+        }
+        uint64_t child = *entry & kPageAddrMask;
+        if (!unmap_table(child, level - 1, virt, next, batch, release)) {
+            return false;
+        }
+        // The kernel half's PDPTs are shared by every address space.
+        bool shared = level == 4 && virt >= kKernelHalfBase;
+        if (!shared && table_empty(child)) {
+            *entry = 0;
+            batch.defer_free(child);
+        }
+        virt = next;
+    }
+    return true;
+}
+
+static bool protect_table(uint64_t table_phys, int level, uintptr_t virt, uintptr_t end, uint64_t flags,
+                          TlbBatch& batch) {
+    uint64_t* table = table_virt(table_phys);
+    while (virt < end) {
+        uintptr_t next = chunk_end(virt, end, level);
+        uint64_t* entry = &table[level_index(virt, level)];
+        uintptr_t base = align_down(virt, page_level_size(level));
+        if (!(*entry & PagePresent)) {
+            virt = next;
+            continue;
+        }
+        if (is_leaf(*entry, level)) {
+            if (level == 1 || (virt == base && next - virt == page_level_size(level))) {
+                uint64_t updated = (*entry & ~kPageProtMask) | (flags & kPageProtMask);
+                if (updated != *entry) {
+                    *entry = updated;
+                    batch.add(virt);
+                }
+                virt = next;
+                continue;
+            }
+            if (!split_leaf(entry, level, base, batch)) {
+                return false;
+            }
+        }
+        if (!protect_table(*entry & kPageAddrMask, level - 1, virt, next, flags, batch)) {
+            return false;
+        }
+        try_merge(entry, level, base, batch);
+        virt = next;
+    }
+    return true;
+}
+
+static void visit_table(uint64_t table_phys, int level, uintptr_t virt, uintptr_t end,
+                        AddressSpace::LeafVisitor visit, void* context, TlbBatch& batch) {
+    uint64_t* table = table_virt(table_phys);
+    while (virt < end) {
+        uintptr_t next = chunk_end(virt, end, level);
+        uint64_t* entry = &table[level_index(virt, level)];
+        if (*entry & PagePresent) {
+            if (is_leaf(*entry, level)) {
+                visit(context, align_down(virt, page_level_size(level)), entry, level, batch);
+            } else {
+                visit_table(*entry & kPageAddrMask, level - 1, virt, next, visit, context, batch);
+            }
+        } else if (level == 1 && (*entry & PageSwapped)) {
+            visit(context, virt, entry, level, batch);
+        }
+        virt = next;
+    }
+}
+
+bool AddressSpace::init() {
+    list_init(&regions_);
+    region_tree_.root = nullptr;
+    root_ = alloc_table();
+    if (root_ == 0) {
+        return false;
+    }
+    id_ = __atomic_add_fetch(&last_space_id, 1, __ATOMIC_RELAXED);
+    uint64_t* table = table_virt(root_);
+    uint64_t* shared = table_virt(kernel.root_);
+    for (unsigned i = kEntries / 2; i < kEntries; ++i) {
+        table[i] = shared[i];
+    }
+    return true;
+}
+
+void AddressSpace::destroy() {
+    KASSERT(this != &kernel && !is_active() && cpus_.empty());
+    thp_forget(*this);
+    unmap_region(0, kUserEnd);
+    // Unmapping cleared the owner records naming the space, so no new pins
+    // come; migrations that pinned it before still use the tables.
+    while (__atomic_load_n(&pins_, __ATOMIC_ACQUIRE)) {
+        tlb_drain();
+        cpu_pause();
+    }
+    TlbBatch batch(*this);
+    uint64_t* table = table_virt(root_);
+    for (unsigned i = 0; i < kEntries / 2; ++i) {
+        if (table[i] & PagePresent) {
+            free_table_tree(table[i] & kPageAddrMask, 3, batch);
+        }
+    }
+    batch.defer_free(root_);
+    root_ = 0;
+}
+
+bool AddressSpace::map(uintptr_t virt, uint64_t phys, uint64_t size, uint64_t flags, TlbBatch& batch) {
+    KASSERT(is_aligned(virt, kPageSize) && is_aligned(phys, kPageSize) && is_aligned(size, kPageSize));
+    LockGuard<Spinlock> guard(lock_);
+    return map_table(root_, 4, virt, virt + size, phys, leaf_flags(flags) & ~PageHuge, batch);
+}
+
+bool AddressSpace::unmap(uintptr_t virt, uint64_t size, TlbBatch& batch, bool release) {
+    KASSERT(is_aligned(virt, kPageSize) && is_aligned(size, kPageSize));
+    LockGuard<Spinlock> guard(lock_);
+    return unmap_table(root_, 4, virt, virt + size, batch, release);
+}
+
+bool AddressSpace::protect(uintptr_t virt, uint64_t size, uint64_t flags, TlbBatch& batch) {
+    KASSERT(is_aligned(virt, kPageSize) && is_aligned(size, kPageSize));
+    LockGuard<Spinlock> guard(lock_);
+    return protect_table(root_, 4, virt, virt + size, leaf_flags(flags), batch);
+}
+
+bool AddressSpace::map(uintptr_t virt, uint64_t phys, uint64_t size, uint64_t flags) {
+    TlbBatch batch(*this);
+    return map(virt, phys, size, flags, batch);
+}
+
+bool AddressSpace::unmap(uintptr_t virt, uint64_t size) {
+    TlbBatch batch(*this);
+    return unmap(virt, size, batch);
+}
+
+bool AddressSpace::protect(uintptr_t virt, uint64_t size, uint64_t flags) {
+    TlbBatch batch(*this);
+    return protect(virt, size, flags, batch);
+}
+
+// Leaf entry for `virt` and its level, or null if nothing is mapped there.
+static uint64_t* find_leaf(uint64_t root, uintptr_t virt, int* level_out) {
+    uint64_t table_phys = root;
+    for (int level = 4; level >= 1; --level) {
+        uint64_t* entry = &table_virt(table_phys)[level_index(virt, level)];
+        if (!(*entry & PagePresent)) {
+            return nullptr;
+        }
+        if (is_leaf(*entry, level)) {
+            *level_out = level;
+            return entry;
+        }
+        table_phys = *entry & kPageAddrMask;
+    }
+    return nullptr;
+}
+
+// The 4 KiB leaf for `virt` if it maps `phys`.
+static uint64_t* find_page(uint64_t root, uintptr_t virt, uint64_t phys) {
+    int level;
+    uint64_t* entry = find_leaf(root, virt, &level);
+    if (!entry || level != 1 || (*entry & kPageAddrMask) != phys) {
+        return nullptr;
+    }
+    return entry;
+}
+
+void AddressSpace::visit_leaves(uintptr_t start, uintptr_t end, LeafVisitor visit, void* context,
+                                TlbBatch& batch) {
+    LockGuard<Spinlock> guard(lock_);
+    visit_table(root_, 4, start, end, visit, context, batch);
+}
+
+bool AddressSpace::translate(uintptr_t virt, uint64_t* phys, uint64_t* flags, int* level_out) {
+    LockGuard<Spinlock> guard(lock_);
+    int level;
+    uint64_t* entry = find_leaf(root_, virt, &level);
+    if (!entry) {
+        return false;
+    }
+    if (level_out) {
+        *level_out = level;
+    }
+    uint64_t mask = leaf_addr_mask(level);
+    *phys = (*entry & mask) + (virt & (page_level_size(level) - 1));
+    if (flags) {
+        *flags = level == 1 ? *entry & ~mask : large_to_small_attrs(*entry & ~mask);
+    }
+    return true;
+}
+
+bool AddressSpace::map_new_page(uintptr_t virt, uint64_t phys, uint64_t flags) {
+    KASSERT(is_aligned(virt, kPageSize) && is_aligned(phys, kPageSize));
+    LockGuard<Spinlock> guard(lock_);
+    uint64_t table_phys = root_;
+    for (int level = 4; level >= 2; --level) {
+        uint64_t* entry = &table_virt(table_phys)[level_index(virt, level)];
+        if (!(*entry & PagePresent)) {
+            uint64_t child = alloc_table();
+            if (child == 0) {
+                return false;
+            }
+            *entry = table_entry(child, virt);
+        } else if (is_leaf(*entry, level)) {
+            return false;
+        }
+        table_phys = *entry & kPageAddrMask;
+    }
+    uint64_t* entry = &table_virt(table_phys)[level_index(virt, 1)];
+    if (*entry != 0) {
+        return false;
+    }
+    *entry = phys | (leaf_flags(flags) & ~PageHuge) | PagePresent;
+    return true;
+}
+
+bool AddressSpace::migrate_page(uintptr_t virt, uint64_t old_phys, uint64_t new_phys) {
+    LockGuard<Spinlock> guard(lock_);
+    uint64_t* entry = find_page(root_, virt, old_phys);
+    if (!entry) {
+        return false;
+    }
+    // Freezing the count at zero keeps scanners that find the frame from
+    // taking a reference during the copy; fork takes its references under
+    // this lock.
+    Frame* frame = phys_to_frame(old_phys);
+    int32_t mapped = 1;
+    if (!__atomic_compare_exchange_n(&frame->refcount, &mapped, 0, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    // Accesses that race with the copy fault on the non-present entry and
+    // wait for this lock in the fault handler.
+    uint64_t old = *entry;
+    *entry = 0;
+    {
+        TlbBatch batch(*this);
+        batch.add(virt);
+    }
+    memcpy(phys_to_virt(new_phys), phys_to_virt(old_phys), kPageSize);
+    *entry = new_phys | (old & ~kPageAddrMask);
+    Frame* target = phys_to_frame(new_phys);
+    lru_replace(frame, target);
+    frame_clear_movable(frame);
+    frame_set_movable(target, this, virt);
+    __atomic_store_n(&frame->refcount, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool AddressSpace::collapse(uintptr_t virt, uint64_t phys, uint64_t flags) {
+    KASSERT(is_aligned(virt, kLargePageSize) && is_aligned(phys, kLargePageSize));
+    LockGuard<Spinlock> guard(lock_);
+    uint64_t table_phys = root_;
+    uint64_t* entry = nullptr;
+    for (int level = 4; level >= 2; --level) {
+        entry = &table_virt(table_phys)[level_index(virt, level)];
+        if (!(*entry & PagePresent) || is_leaf(*entry, level)) {
+            return false;
+        }
+        table_phys = *entry & kPageAddrMask;
+    }
+    uint64_t* table = table_virt(table_phys);
+    for (unsigned i = 0; i < kEntries; ++i) {
+        if (!(table[i] & PagePresent)) {
+            return false;
+        }
+    }
+    TlbBatch batch(*this);
+    // As in migrate_page, accesses during the copy fault on the empty entry
+    // and wait in the fault handler.
+    uint64_t old = *entry;
+    *entry = 0;
+    batch.add_all();
+    batch.flush();
+    for (unsigned i = 0; i < kEntries; ++i) {
+        memcpy(phys_to_virt(phys + i * kPageSize), phys_to_virt(table[i] & kPageAddrMask), kPageSize);
+    }
+    *entry = phys | (leaf_flags(flags) & kPageProtMask) | PagePresent | PageHuge;
+    stats.large_leaves++;
+    for (unsigned i = 0; i < kEntries; ++i) {
+        uint64_t page = table[i] & kPageAddrMask;
+        if ((page >> kFrameShift) < frame_map_count) {
+            frame_unmapped(phys_to_frame(page), this);
+            batch.release(page, 0);
+        }
+    }
+    batch.defer_free(old & kPageAddrMask);
+    return true;
+}
+
+bool AddressSpace::test_and_clear_accessed(uintptr_t virt, uint64_t phys) {
+    LockGuard<Spinlock> guard(lock_);
+    uint64_t* entry = find_page(root_, virt, phys);
+    if (!entry) {
+        return false;
+    }
+    return __atomic_fetch_and(entry, ~(uint64_t)PageAccessed, __ATOMIC_RELAXED) & PageAccessed;
+}
+
+bool AddressSpace::swap_out(uintptr_t virt, uint64_t phys) {
+    uint64_t old;
+    {
+        LockGuard<Spinlock> guard(lock_);
+        uint64_t* entry = find_page(root_, virt, phys);
+        if (!entry) {
+            return false;
+        }
+        old = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+        if (old & PageAccessed) {
+            return false;
+        }
+    }
+    // The page is compressed without the lock and stays mapped meanwhile.
+    // Once no TLB holds the translation, any access walks the tables and
+    // sets the Accessed bit, which makes the exchange below fail and
+    // throws the copy away.
+    {
+        TlbBatch batch(*this);
+        batch.add(virt);
+    }
+    uint64_t slot;
+    if (!swap_store(phys_to_virt(phys), &slot)) {
+        return false;
+    }
+    LockGuard<Spinlock> guard(lock_);
+    uint64_t* entry = find_page(root_, virt, phys);
+    if (!entry || !__atomic_compare_exchange_n(entry, &old, swap_entry(slot), false, __ATOMIC_ACQ_REL,
+                                               __ATOMIC_RELAXED)) {
+        swap_free(slot);
+        return false;
+    }
+    return true;
+}
+
+bool AddressSpace::write_protect_page(uintptr_t virt, uint64_t phys) {
+    LockGuard<Spinlock> guard(lock_);
+    uint64_t* entry = find_page(root_, virt, phys);
+    if (!entry) {
+        return false;
+    }
+    if (__atomic_fetch_and(entry, ~(uint64_t)PageWritable, __ATOMIC_ACQ_REL) & PageWritable) {
+        TlbBatch batch(*this);
+        batch.add(virt);
+    }
+    return true;
+}
+
+bool AddressSpace::replace_page(uintptr_t virt, uint64_t old_phys, uint64_t new_phys) {
+    LockGuard<Spinlock> guard(lock_);
+    uint64_t* entry = find_page(root_, virt, old_phys);
+    if (!entry) {
+        return false;
+    }
+    // As in migrate_page, accesses during the comparison fault on the
+    // empty entry and wait in the fault handler.
+    uint64_t old = __atomic_exchange_n(entry, 0, __ATOMIC_ACQ_REL);
+    TlbBatch batch(*this);
+    batch.add(virt);
+    batch.flush();
+    if (!page_equal(phys_to_virt(old_phys), phys_to_virt(new_phys))) {
+        *entry = old;
+        return false;
+    }
+    frame_get(phys_to_frame(new_phys));
+    *entry = new_phys | (old & ~(kPageAddrMask | PageWritable | PageDirty));
+    batch.release(old_phys, 0);
+    return true;
+}
+
+bool AddressSpace::swap_slot(uintptr_t virt, uint64_t* slot) {
+    LockGuard<Spinlock> guard(lock_);
+    uint64_t table_phys = root_;
+    for (int level = 4; level >= 1; --level) {
+        uint64_t entry = table_virt(table_phys)[level_index(virt, level)];
+        if (level == 1) {
+            if ((entry & (PagePresent | PageSwapped)) != PageSwapped) {
+                return false;
+            }
+            *slot = swap_entry_slot(entry);
+            return true;
+        }
+        if (!(entry & PagePresent) || is_leaf(entry, level)) {
+            return false;
+        }
+        table_phys = entry & kPageAddrMask;
+    }
+    return false;
+}
+
+void AddressSpace::activate() {
+    AddressSpace** local = active.get();
+    unsigned index = this_cpu()->index;
+    // The CPU joins the mask before it can cache any of the space's
+    // translations or reads its TLB generation, so a shootdown that misses
+    // it finds nothing to flush or has bumped the generation already.
+    // Application processors activate the kernel space before they have
+    // an index, which is why it is left out.
+    if (this != &kernel) {
+        cpus_.set(index);
+    }
+    tlb_switch(*this);
+    if (*local != this && *local != &kernel) {
+        (*local)->cpus_.clear(index);
+    }
+    *local = this;
+}
+
+AddressSpace* AddressSpace::current() {
+    return *active.get();
+}
+
+bool AddressSpace::is_active() const {
+    return (read_cr3() & kPageAddrMask) == root_;
+}
+
+AddressSpace& kernel_space() {
+    return kernel;
+}
+
+void vmm_init(const BootInfo* boot_info) {
+    has_huge_leaves = cpuid(0x80000001).edx & (1u << 26);
+    has_no_execute = cpuid(0x80000001).edx & (1u << 20);
+    if (has_no_execute) {
+        write_msr(kMsrEfer, read_msr(kMsrEfer) | kEferNxe);
+    }
+    write_cr4(read_cr4() | kCr4Pge);
+
+    // Start from the bootloader's tables: the lower half still holds the
+    // firmware identity map we are running on, and the kernel image lives
+    // in the upper half.
+    list_init(&kernel.regions_);
+    kernel.root_ = alloc_table();
+    if (kernel.root_ == 0) {
+        panic("vmm: cannot allocate kernel PML4");
+    }
+    uint64_t* pml4 = table_virt(kernel.root_);
+    memcpy(pml4, table_virt(read_cr3() & kPageAddrMask), kPageSize);
+    for (unsigned i = kEntries / 2; i < kEntries; ++i) {
+        if (!(pml4[i] & PagePresent)) {
+            uint64_t pdpt = alloc_table();
+            if (pdpt == 0) {
+                panic("vmm: cannot allocate kernel PDPTs");
+            }
+            pml4[i] = pdpt | PagePresent | PageWritable;
+        }
+    }
+
+    const PhysMemoryMap& map = boot_info->phys_memory_map;
+    uint64_t flags = PageWritable | PageGlobal | PageNoExecute | PageMergeable;
+    uint64_t run_start = 0;
+    uint64_t run_end = 0;
+    for (size_t i = 0; i <= map.entry_count; ++i) {
+        if (i < map.entry_count && map.entries[i].frame_count == 0) {
+            continue;
+        }
+        if (i < map.entry_count && map.entries[i].start_frame == run_end) {
+            run_end += map.entries[i].frame_count;
+            continue;
+        }
+        if (run_end > run_start &&
+            !kernel.map(kPhysMapBase + (run_start << 12), run_start << 12, (run_end - run_start) << 12, flags)) {
+            panic("vmm: out of memory building the direct map");
+        }
+        if (i < map.entry_count) {
+            run_start = map.entries[i].start_frame;
+            run_end = run_start + map.entries[i].frame_count;
+        }
+    }
+
+    write_cr3(kernel.root_);
+    phys_offset = kPhysMapBase;
+}
+
+VmmStats vmm_stats() {
+    return stats;
+}
@@ -0,0 +1,233 @@
+#ifndef MM_VMM_H
+#define MM_VMM_H
+
+#include <stdint.h>
+
+#include "../../../common/bootinfo.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/list.h"
+#include "../lib/rbtree.h"
+#include "../sync/rwlock.h"
+#include "../sync/spinlock.h"
+#include "tlb.h"
+
+struct PageCache;
+struct VmRegion;
+
+enum PageFlags : uint64_t {
+    PagePresent = 1ull << 0,
+    PageWritable = 1ull << 1,
+    PageUser = 1ull << 2,
+    PageWriteThrough = 1ull << 3,
+    PageCacheDisable = 1ull << 4,
+    PageAccessed = 1ull << 5,
+    PageDirty = 1ull << 6,
+    // PS bit; only meaningful in PDPT and PD entries.
+    PageHuge = 1ull << 7,
+    PageGlobal = 1ull << 8,
+    // Software bit. A non-present 4 KiB leaf with it set holds a swap slot
+    // in its address bits.
+    PageSwapped = 1ull << 9,
+    // Software bit. Tables whose leaves all carry it may be folded into one
+    // large leaf; only set for memory mapped as one physical run, never for
+    // separately allocated frames.
+    PageMergeable = 1ull << 10,
+    PageNoExecute = 1ull << 63,
+};
+
+constexpr uint64_t kPageProtMask =
+    PageWritable | PageUser | PageWriteThrough | PageCacheDisable | PageGlobal | PageNoExecute;
+constexpr uint64_t kPageAddrMask = 0x000FFFFFFFFFF000;
+
+inline uint64_t page_level_size(int level) {
+    return 1ull << (12 + 9 * (level - 1));
+}
+
+// Physical address mapped by a leaf entry at `level` (1 for 4 KiB).
+inline uint64_t leaf_phys(uint64_t entry, int level) {
+    return entry & kPageAddrMask & ~(page_level_size(level) - 1);
+}
+
+inline uint64_t swap_entry(uint64_t slot) {
+    return (slot << 12) | PageSwapped;
+}
+
+inline uint64_t swap_entry_slot(uint64_t entry) {
+    return (entry & kPageAddrMask) >> 12;
+}
+
+struct VmmStats {
+    uint64_t large_leaves;
+    uint64_t huge_leaves;
+    uint64_t splits;
+    uint64_t merges;
+};
+
+// A four-level page table. The upper half is shared by every address
+// space; its PML4 entries are populated once in vmm_init and never change.
+//
+// Range operations pick 2 MiB and 1 GiB leaves whenever virtual address,
+// physical address and remaining length allow it, split large leaves that
+// are only partially affected, and fold a table back into a large leaf
+// once all of its entries are PageMergeable and describe one contiguous
+// run with equal attributes. Flags are PageFlags; PagePresent is implied,
+// and PageNoExecute is dropped on CPUs without NX, where it is reserved.
+class AddressSpace {
+public:
+    constexpr AddressSpace() = default;
+    AddressSpace(const AddressSpace&) = delete;
+    AddressSpace& operator=(const AddressSpace&) = delete;
+
+    bool init();
+    void destroy();
+
+    bool map(uintptr_t virt, uint64_t phys, uint64_t size, uint64_t flags);
+    bool unmap(uintptr_t virt, uint64_t size);
+    bool protect(uintptr_t virt, uint64_t size, uint64_t flags);
+
+    bool map(uintptr_t virt, uint64_t phys, uint64_t size, uint64_t flags, TlbBatch& batch);
+    // With `release`, the reference a removed leaf holds on each frame it
+    // maps is dropped once `batch` has been flushed.
+    bool unmap(uintptr_t virt, uint64_t size, TlbBatch& batch, bool release = false);
+    bool protect(uintptr_t virt, uint64_t size, uint64_t flags, TlbBatch& batch);
+
+    // `level` receives the level of the leaf, 1 for a 4 KiB page.
+    bool translate(uintptr_t virt, uint64_t* phys, uint64_t* flags = nullptr, int* level = nullptr);
+    // Maps the 4 KiB page at `virt` unless the entry already holds a page
+    // or a swap entry, or a larger leaf covers it. Needs no TLB flush.
+    bool map_new_page(uintptr_t virt, uint64_t phys, uint64_t flags);
+
+    // Calls `visit` for every present leaf and every swap entry overlapping
+    // [start, end) with the page-table lock held. The visitor may rewrite
+    // the entry, in which case it must record the change in `batch`.
+    using LeafVisitor = void (*)(void* context, uintptr_t virt, uint64_t* entry, int level, TlbBatch& batch);
+    void visit_leaves(uintptr_t start, uintptr_t end, LeafVisitor visit, void* context, TlbBatch& batch);
+
+    // Region descriptors for the lower half (mm/region.cc). Faults are
+    // resolved against these; nothing is mapped up front.
+    //
+    // Creating, removing and resizing regions takes the region lock for
+    // writing. Faults only take it for reading, plus the faulting region's
+    // own lock, so that faults in different regions run in parallel. The
+    // page-table lock nests inside both.
+    bool map_region(uintptr_t start, uint64_t size, uint32_t flags);
+    // Places the region in the lowest free range above kUserMmapBase that
+    // fits it, aligned to its page size.
+    bool map_region_anywhere(uint64_t size, uint32_t flags, uintptr_t* start);
+    // Maps `cache` from byte `offset` on. Faults bring its pages in through
+    // the page cache; writes to a private mapping go to copies.
+    bool map_file_region(uintptr_t start, uint64_t size, uint32_t flags, PageCache* cache, uint64_t offset);
+    bool unmap_region(uintptr_t start, uint64_t size);
+    // Copies the regions and mappings into `child`, which init() has just
+    // set up. On failure the child is destroyed again, dropping whatever
+    // it had been given, and only init() makes it usable.
+    bool fork(AddressSpace& child);
+    // Callers hold regions_lock(), for reading at least.
+    VmRegion* find_region(uintptr_t virt);
+    // First region that ends above `virt`.
+    VmRegion* next_region(uintptr_t virt);
+    RwLock& regions_lock() {
+        return regions_lock_;
+    }
+
+    // Moves the 4 KiB page at `virt` from `old_phys` to `new_phys`, copying
+    // its contents while the entry is not present, and hands the old
+    // frame's owner record and LRU position to the new one. Fails if `virt`
+    // is not mapped to `old_phys` by a 4 KiB leaf, or if anything but the
+    // mapping holds a reference to the old frame. The mapping's reference
+    // stays with the caller to drop.
+    bool migrate_page(uintptr_t virt, uint64_t old_phys, uint64_t new_phys);
+    // Keeps destroy() from tearing the space down, for code that found it
+    // through a frame's owner record rather than holding it.
+    void pin() {
+        __atomic_add_fetch(&pins_, 1, __ATOMIC_ACQUIRE);
+    }
+    void unpin() {
+        __atomic_sub_fetch(&pins_, 1, __ATOMIC_RELEASE);
+    }
+    // Replaces the 512 4 KiB leaves covering the 2 MiB range at `virt` by
+    // one large leaf for `phys`, copying every page into it while the range
+    // is not present. Fails unless all 512 pages are mapped. The references
+    // held by the old leaves are dropped.
+    bool collapse(uintptr_t virt, uint64_t phys, uint64_t flags);
+
+    // Reverse-map operations on the 4 KiB leaf that maps `phys` at `virt`;
+    // both fail if it no longer does. The first clears the Accessed bit and
+    // returns whether it was set, without flushing the TLB: a stale entry
+    // only delays the next time the bit is set. The second stores the page
+    // in swap and replaces the leaf with a swap entry, unless the page was
+    // accessed again in the meantime.
+    bool test_and_clear_accessed(uintptr_t virt, uint64_t phys);
+    bool swap_out(uintptr_t virt, uint64_t phys);
+    // The swap slot held by the entry for `virt`, if it is a swap entry.
+    bool swap_slot(uintptr_t virt, uint64_t* slot);
+    // Used by same-page merging. The first makes the leaf read-only, so
+    // that the page no longer changes under a comparison. The second maps
+    // `new_phys` read-only in place of `old_phys` if both pages hold the
+    // same data, taking a reference on the new frame and dropping the one
+    // held on the old frame.
+    bool write_protect_page(uintptr_t virt, uint64_t phys);
+    bool replace_page(uintptr_t virt, uint64_t old_phys, uint64_t new_phys);
+
+    // Loads the space on the calling CPU. Loading one of them records the
+    // CPU in the space's cpus(), so that TLB shootdowns know where to go.
+    void activate();
+    bool is_active() const;
+    // The CPUs that have this space loaded, lazily or not. Always empty for
+    // the kernel space, whose half is loaded everywhere.
+    const CpuMask& cpus() const {
+        return cpus_;
+    }
+    // Identifies the space to the PCID assignment, which the root cannot
+    // since a later space may reuse it. Zero for the kernel space.
+    uint64_t id() const {
+        return id_;
+    }
+    // Counts the flushes of the space's translations. A CPU that kept
+    // them under a PCID while it ran something else compares the count
+    // with the one it saw last to know whether they are still valid.
+    uint64_t tlb_generation() const {
+        return __atomic_load_n(&tlb_generation_, __ATOMIC_SEQ_CST);
+    }
+    // Returns the generation before the bump.
+    uint64_t advance_tlb_generation() {
+        return __atomic_fetch_add(&tlb_generation_, 1, __ATOMIC_SEQ_CST);
+    }
+    uint64_t root() const {
+        return root_;
+    }
+    static AddressSpace* current();
+
+private:
+    friend void vmm_init(const BootInfo* boot_info);
+
+    // map_region without populating hugetlb regions, which fork fills in
+    // with the parent's pages instead.
+    bool add_region(uintptr_t start, uint64_t size, uint32_t flags, bool populate, PageCache* cache,
+                    uint64_t cache_index);
+    bool insert_region(uintptr_t start, uint64_t size, uint32_t flags, bool populate, PageCache* cache,
+                       uint64_t cache_index);
+    // Lowest start of a free range of `size` bytes aligned to `align`, or
+    // zero if there is none.
+    uintptr_t find_free_range(uint64_t size, uint64_t align);
+    // Adds `region` to the list before `next`, and to the tree.
+    void link_region(VmRegion* region, ListNode* next);
+    void unlink_region(VmRegion* region);
+    void update_gap(VmRegion* region);
+
+    uint64_t root_ = 0;
+    Spinlock lock_;
+    ListNode regions_ = {nullptr, nullptr};
+    RbTree region_tree_ = {nullptr};
+    RwLock regions_lock_;
+    CpuMask cpus_;
+    uint64_t id_ = 0;
+    uint64_t tlb_generation_ = 0;
+    uint32_t pins_ = 0;
+};
+
+AddressSpace& kernel_space();
+void vmm_init(const BootInfo* boot_info);
+VmmStats vmm_stats();
+
+#endif // MM_VMM_H
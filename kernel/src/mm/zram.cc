@@ -0,0 +1,252 @@
+#include "zram.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/lz4.h"
+#include "../lib/page.h"
+#include "../lib/string.h"
+#include "../lib/util.h"
+#include "../log.h"
+#include "../panic.h"
+#include "../sync/spinlock.h"
+#include "frame.h"
+#include "slab.h"
+#include "swap.h"
+#include "vmalloc.h"
+
+// Compressed objects are rounded up to a multiple of kClassStep; anything
+// larger than kMaxClassSize saves too little to be worth it and is stored
+// uncompressed in a frame of its own.
+constexpr uint32_t kClassStep = 128;
+constexpr uint32_t kMaxClassSize = 3072;
+
+enum ZramSlotFlags : uint32_t {
+    ZramUsed = 1u << 0,
+    ZramSame = 1u << 1,
+    ZramHuge = 1u << 2,
+};
+
+struct ZramSlot {
+    // The object holding the data, or the repeated word of a same-filled page.
+    uint64_t value;
+    uint32_t size;
+    uint32_t flags;
+};
+
+// A compression workspace and output buffer. Each CPU has its own and
+// nothing else runs on a CPU while it compresses, so stores need no lock
+// to use it.
+struct ZramStream {
+    void* workspace = nullptr;
+    uint8_t* buffer = nullptr;
+};
+
+static SlabCache size_classes[] = {
+    {"zram-128", 128},   {"zram-256", 256},   {"zram-384", 384},   {"zram-512", 512},
+    {"zram-640", 640},   {"zram-768", 768},   {"zram-896", 896},   {"zram-1024", 1024},
+    {"zram-1152", 1152}, {"zram-1280", 1280}, {"zram-1408", 1408}, {"zram-1536", 1536},
+    {"zram-1664", 1664}, {"zram-1792", 1792}, {"zram-1920", 1920}, {"zram-2048", 2048},
+    {"zram-2176", 2176}, {"zram-2304", 2304}, {"zram-2432", 2432}, {"zram-2560", 2560},
+    {"zram-2688", 2688}, {"zram-2816", 2816}, {"zram-2944", 2944}, {"zram-3072", 3072},
+};
+
+static_assert(sizeof(size_classes) / sizeof(size_classes[0]) == kMaxClassSize / kClassStep);
+
+static Spinlock zram_lock;
+static ZramSlot* slots = nullptr;
+static uint64_t next_slot = 0;
+static PER_CPU PerCpu<ZramStream> streams;
+static ZramStats stats;
+
+static bool zram_store(void* context, const void* page, uint64_t* slot);
+static bool zram_load(void* context, uint64_t slot, void* page);
+static void zram_discard(void* context, uint64_t slot);
+
+static SwapBackend backend = {"zram", zram_store, zram_load, zram_discard, nullptr};
+
+void zram_init() {
+    FrameStats frames = frame_stats();
+    uint64_t disk_slots = min(frames.total_frames / 2, kMaxSwapSlot + 1);
+    slots = (ZramSlot*)vmalloc(disk_slots * sizeof(ZramSlot), VmallocZero);
+    if (!slots) {
+        kprintf("zram: cannot allocate the slot table\n");
+        return;
+    }
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        ZramStream* stream = streams.get(percpu_cpu(index));
+        stream->workspace = vmalloc(kLz4WorkspaceSize);
+        stream->buffer = (uint8_t*)vmalloc(kPageSize);
+        if (!stream->workspace || !stream->buffer) {
+            kprintf("zram: cannot allocate compression streams\n");
+            return;
+        }
+    }
+    stats.disk_slots = disk_slots;
+    stats.mem_limit = (frames.total_frames << kFrameShift) / 4;
+    swap_register(&backend);
+    kprintf("zram: %lu MiB disk, %lu MiB limit\n", (disk_slots << kFrameShift) >> 20, stats.mem_limit >> 20);
+}
+
+static void fill_page(void* page, uint64_t value) {
+    uint64_t* words = (uint64_t*)page;
+    for (size_t i = 0; i < kPageSize / sizeof(uint64_t); ++i) {
+        words[i] = value;
+    }
+}
+
+static uint32_t footprint(const ZramSlot& slot) {
+    if (slot.flags & ZramSame) {
+        return 0;
+    }
+    if (slot.flags & ZramHuge) {
+        return kPageSize;
+    }
+    return align_up(slot.size, kClassStep);
+}
+
+static SlabCache& size_class(uint32_t size) {
+    return size_classes[div_round_up(size, kClassStep) - 1];
+}
+
+// Claims a free slot for `entry`, accounting its memory against the limit.
+static bool insert(const ZramSlot& entry, uint64_t* slot) {
+    LockGuard<Spinlock> guard(zram_lock);
+    uint64_t used = footprint(entry);
+    if (stats.mem_used + used > stats.mem_limit) {
+        return false;
+    }
+    for (uint64_t n = 0; n < stats.disk_slots; ++n) {
+        uint64_t index = (next_slot + n) % stats.disk_slots;
+        if (slots[index].flags & ZramUsed) {
+            continue;
+        }
+        slots[index] = entry;
+        slots[index].flags |= ZramUsed;
+        next_slot = index + 1;
+        *slot = index;
+        stats.slots_in_use++;
+        stats.mem_used += used;
+        stats.orig_bytes += kPageSize;
+        stats.compressed_bytes += entry.size;
+        stats.same_pages += entry.flags & ZramSame ? 1 : 0;
+        stats.huge_pages += entry.flags & ZramHuge ? 1 : 0;
+        return true;
+    }
+    return false;
+}
+
+static void free_object(const ZramSlot& entry) {
+    if (entry.flags & ZramSame) {
+        return;
+    }
+    if (entry.flags & ZramHuge) {
+        frame_free(phys_to_frame(virt_to_phys((void*)entry.value)), 0);
+    } else {
+        size_class(entry.size).free((void*)entry.value);
+    }
+}
+
+// Compresses `page` into a new object; fills in everything but the flags
+// that insert() sets.
+static bool compress(const void* page, ZramSlot* entry) {
+    ZramStream& stream = *streams.get();
+    size_t size = lz4_compress(page, kPageSize, stream.buffer, kMaxClassSize, stream.workspace);
+    void* object;
+    if (size == 0) {
+        // Only AllocNoReclaim memory: this runs on behalf of reclaim.
+        Frame* frame = frame_alloc(0, AllocNoReclaim);
+        object = frame ? frame_to_virt(frame) : nullptr;
+        if (object) {
+            memcpy(object, page, kPageSize);
+        }
+        entry->size = kPageSize;
+        entry->flags = ZramHuge;
+    } else {
+        object = size_class(size).alloc();
+        if (object) {
+            memcpy(object, stream.buffer, size);
+        }
+        entry->size = size;
+        entry->flags = 0;
+    }
+    entry->value = (uint64_t)object;
+    return object != nullptr;
+}
+
+static bool zram_store(void*, const void* page, uint64_t* slot) {
+    uint64_t start = rdtsc();
+    ZramSlot entry;
+    bool stored;
+    if (page_same_filled(page, &entry.value)) {
+        entry.size = 0;
+        entry.flags = ZramSame;
+        stored = insert(entry, slot);
+    } else {
+        stored = compress(page, &entry);
+        if (stored && !insert(entry, slot)) {
+            free_object(entry);
+            stored = false;
+        }
+    }
+    LockGuard<Spinlock> guard(zram_lock);
+    if (stored) {
+        stats.stores++;
+        stats.store_cycles += rdtsc() - start;
+    } else {
+        stats.store_failures++;
+    }
+    return stored;
+}
+
+static bool zram_load(void*, uint64_t slot, void* page) {
+    uint64_t start = rdtsc();
+    ZramSlot entry;
+    {
+        LockGuard<Spinlock> guard(zram_lock);
+        if (slot >= stats.disk_slots || !(slots[slot].flags & ZramUsed)) {
+            stats.load_failures++;
+            return false;
+        }
+        entry = slots[slot];
+    }
+    // The slot stays in use, and its object alive, until discarded, which
+    // only happens after the entry referring to it is gone.
+    bool loaded = true;
+    if (entry.flags & ZramSame) {
+        fill_page(page, entry.value);
+    } else if (entry.flags & ZramHuge) {
+        memcpy(page, (void*)entry.value, kPageSize);
+    } else {
+        loaded = lz4_decompress((void*)entry.value, entry.size, page, kPageSize) == (int64_t)kPageSize;
+    }
+    LockGuard<Spinlock> guard(zram_lock);
+    if (loaded) {
+        stats.loads++;
+        stats.load_cycles += rdtsc() - start;
+    } else {
+        stats.load_failures++;
+    }
+    return loaded;
+}
+
+static void zram_discard(void*, uint64_t slot) {
+    ZramSlot entry;
+    {
+        LockGuard<Spinlock> guard(zram_lock);
+        KASSERT(slot < stats.disk_slots && (slots[slot].flags & ZramUsed));
+        entry = slots[slot];
+        slots[slot].flags = 0;
+        stats.slots_in_use--;
+        stats.mem_used -= footprint(entry);
+        stats.orig_bytes -= kPageSize;
+        stats.compressed_bytes -= entry.size;
+        stats.same_pages -= entry.flags & ZramSame ? 1 : 0;
+        stats.huge_pages -= entry.flags & ZramHuge ? 1 : 0;
+    }
+    free_object(entry);
+}
+
+ZramStats zram_stats() {
+    LockGuard<Spinlock> guard(zram_lock);
+    return stats;
+}
@@ -0,0 +1,37 @@
+#ifndef MM_ZRAM_H
+#define MM_ZRAM_H
+
+#include <stdint.h>
+
+struct ZramStats {
+    uint64_t disk_slots;
+    uint64_t slots_in_use;
+    // Pages stored as a single repeated word, and pages that did not
+    // compress and are kept whole.
+    uint64_t same_pages;
+    uint64_t huge_pages;
+    // Bytes handed to the backend and bytes of compressed data kept;
+    // their quotient is the compression ratio.
+    uint64_t orig_bytes;
+    uint64_t compressed_bytes;
+    // Memory held for stored pages, rounded up to size classes.
+    uint64_t mem_used;
+    uint64_t mem_limit;
+    uint64_t stores;
+    uint64_t loads;
+    uint64_t store_cycles;
+    uint64_t load_cycles;
+    uint64_t store_failures;
+    uint64_t load_failures;
+};
+
+// Compressed in-memory swap. Evicted pages are compressed with LZ4 into
+// objects drawn from a set of slab size classes, so the memory a page
+// takes tracks how well it compresses. Pages filled with a single
+// repeated word, all-zero pages among them, take no memory beyond their
+// slot. Registers itself as the swap backend. Runs once every CPU is up,
+// since each gets a compression stream of its own.
+void zram_init();
+ZramStats zram_stats();
+
+#endif // MM_ZRAM_H
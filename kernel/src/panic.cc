@@ -0,0 +1,19 @@
+#include "panic.h"
+
+#include <stdarg.h>
+
+#include "arch/x86_64/cpu.h"
+#include "log.h"
+
+void panic(const char* fmt, ...) {
+    irq_disable();
+    kprintf("\nKERNEL PANIC: ");
+    va_list args;
+    va_start(args, fmt);
+    kvprintf(fmt, args);
+    va_end(args);
+    kprintf("\n");
+    for (;;) {
+        cpu_halt();
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef PANIC_H
+#define PANIC_H
+
+[[noreturn]] void panic(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#define KASSERT(cond)                                                          \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            panic("assertion failed: %s (%s:%d)", #cond, __FILE__, __LINE__);  \
+        }                                                                      \
+    } while (0)
+
+#endif // PANIC_H
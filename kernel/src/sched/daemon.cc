@@ -0,0 +1,57 @@
+#include "daemon.h"
+
+#include "../arch/x86_64/cpu.h"
+#include "../mm/tlb.h"
+#include "../sync/spinlock.h"
+
+static ListNode daemons = {&daemons, &daemons};
+static Spinlock daemons_lock;
+
+static void wake_from_timer(void* context) {
+    daemon_wake((Daemon*)context);
+}
+
+void daemon_register(Daemon* daemon) {
+    timer_setup(&daemon->timer, wake_from_timer, daemon);
+    LockGuard<Spinlock> guard(daemons_lock);
+    list_push_back(&daemons, &daemon->node);
+}
+
+void daemon_wake(Daemon* daemon) {
+    __atomic_store_n(&daemon->pending, true, __ATOMIC_RELEASE);
+}
+
+void daemon_wake_at(Daemon* daemon, uint64_t deadline) {
+    timer_start(&daemon->timer, deadline);
+}
+
+bool daemon_run_pending() {
+    bool ran = false;
+    // Daemons are only registered during boot, so the list is stable.
+    for (ListNode* node = daemons.next; node != &daemons; node = node->next) {
+        Daemon* daemon = list_entry(node, Daemon, node);
+        if (!__atomic_exchange_n(&daemon->pending, false, __ATOMIC_ACQ_REL)) {
+            continue;
+        }
+        uint64_t start = rdtsc();
+        if (daemon->run(daemon->context)) {
+            daemon_wake(daemon);
+        }
+        daemon->cycles += rdtsc() - start;
+        daemon->runs++;
+        ran = true;
+    }
+    return ran;
+}
+
+void idle_loop() {
+    for (;;) {
+        // Interrupts stay disabled outside cpu_idle, so a handler that
+        // wakes a daemon cannot run between the check and the halt.
+        if (!daemon_run_pending()) {
+            tlb_enter_lazy();
+            cpu_idle();
+            tlb_leave_lazy();
+        }
+    }
+}
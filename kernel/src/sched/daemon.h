@@ -0,0 +1,46 @@
+#ifndef SCHED_DAEMON_H
+#define SCHED_DAEMON_H
+
+#include <stdint.h>
+
+#include "../lib/list.h"
+#include "../time/timer.h"
+
+// Background maintenance work. There are no threads yet, so a daemon is a
+// function the idle loop calls while the daemon is pending; each call does
+// a bounded amount of work and returns whether more remains.
+// Cycles a daemon may spend per run before yielding to the idle loop, so
+// that one daemon does not hold off the others for long.
+constexpr uint64_t kDaemonRunCycles = 2000000;
+
+// Declared `static Daemon name("name", run);`.
+struct Daemon {
+    constexpr Daemon(const char* name, bool (*run)(void* context), void* context = nullptr)
+        : name(name), run(run), context(context) {}
+    Daemon(const Daemon&) = delete;
+    Daemon& operator=(const Daemon&) = delete;
+
+    ListNode node = {nullptr, nullptr};
+    const char* name;
+    bool (*run)(void* context);
+    void* context;
+    bool pending = false;
+    // Wakes the daemon at the time given to daemon_wake_at.
+    Timer timer = {};
+    uint64_t runs = 0;
+    uint64_t cycles = 0;
+};
+
+void daemon_register(Daemon* daemon);
+// Safe to call from interrupt and fault handlers.
+void daemon_wake(Daemon* daemon);
+// Makes the daemon pending at clock_ns() time `deadline`, replacing any
+// earlier deadline.
+void daemon_wake_at(Daemon* daemon, uint64_t deadline);
+// Runs every pending daemon once. Returns whether any of them ran.
+bool daemon_run_pending();
+// Runs daemons until none is pending, then halts until an interrupt. There
+// is no periodic tick: an idle CPU only wakes for its next timer.
+[[noreturn]] void idle_loop();
+
+#endif // SCHED_DAEMON_H
@@ -0,0 +1,86 @@
+#ifndef SYNC_RWLOCK_H
+#define SYNC_RWLOCK_H
+
+#include <stdint.h>
+
+#include "../arch/x86_64/cpu.h"
+#include "../mm/tlb.h"
+
+// Spinning reader-writer lock. Any number of readers may hold it at once;
+// a writer holds it alone. A waiting writer keeps new readers out so that
+// a steady stream of them cannot starve it. lock() and unlock() are the
+// writer side, which lets LockGuard take it exclusively. Waiters run
+// queued TLB flushes, as Spinlock waiters do.
+class RwLock {
+public:
+    constexpr RwLock() = default;
+    RwLock(const RwLock&) = delete;
+    RwLock& operator=(const RwLock&) = delete;
+
+    void read_lock() {
+        for (;;) {
+            uint32_t state = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+            if (!(state & (kWriter | kWriterWaiting)) &&
+                __atomic_compare_exchange_n(&state_, &state, state + kReader, true, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                return;
+            }
+            tlb_drain();
+            cpu_pause();
+        }
+    }
+
+    void read_unlock() {
+        __atomic_sub_fetch(&state_, kReader, __ATOMIC_RELEASE);
+    }
+
+    void lock() {
+        for (;;) {
+            uint32_t state = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+            // Taking the lock clears the waiting bit; other waiting writers
+            // set it again on their next attempt.
+            if (!(state & ~kWriterWaiting) &&
+                __atomic_compare_exchange_n(&state_, &state, kWriter, true, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                return;
+            }
+            if (!(state & kWriterWaiting)) {
+                __atomic_or_fetch(&state_, kWriterWaiting, __ATOMIC_RELAXED);
+            }
+            tlb_drain();
+            cpu_pause();
+        }
+    }
+
+    void unlock() {
+        __atomic_and_fetch(&state_, ~kWriter, __ATOMIC_RELEASE);
+    }
+
+    bool is_locked() const {
+        return __atomic_load_n(&state_, __ATOMIC_RELAXED) & ~kWriterWaiting;
+    }
+
+private:
+    static constexpr uint32_t kWriter = 1u << 0;
+    static constexpr uint32_t kWriterWaiting = 1u << 1;
+    static constexpr uint32_t kReader = 1u << 2;
+
+    uint32_t state_ = 0;
+};
+
+class ReadGuard {
+public:
+    explicit ReadGuard(RwLock& lock) : lock_(lock) {
+        lock_.read_lock();
+    }
+    ~ReadGuard() {
+        lock_.read_unlock();
+    }
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+
+private:
+    RwLock& lock_;
+};
+
+#endif // SYNC_RWLOCK_H
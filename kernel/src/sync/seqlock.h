@@ -0,0 +1,56 @@
+#ifndef SYNC_SEQLOCK_H
+#define SYNC_SEQLOCK_H
+
+#include <stdint.h>
+
+#include "../arch/x86_64/cpu.h"
+#include "spinlock.h"
+
+// Sequence lock for small, rarely written data read on hot paths. Readers
+// take no lock and never write shared memory: they copy the data between
+// read_begin() and read_retry() and start over if a writer ran meanwhile.
+// lock() and unlock() are the writer side, serialised among writers.
+//
+//     uint32_t seq;
+//     do {
+//         seq = lock.read_begin();
+//         copy = data;
+//     } while (lock.read_retry(seq));
+class Seqlock {
+public:
+    constexpr Seqlock() = default;
+    Seqlock(const Seqlock&) = delete;
+    Seqlock& operator=(const Seqlock&) = delete;
+
+    uint32_t read_begin() const {
+        for (;;) {
+            uint32_t seq = __atomic_load_n(&seq_, __ATOMIC_ACQUIRE);
+            if (!(seq & 1)) {
+                return seq;
+            }
+            cpu_pause();
+        }
+    }
+
+    bool read_retry(uint32_t seq) const {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&seq_, __ATOMIC_RELAXED) != seq;
+    }
+
+    void lock() {
+        writer_.lock();
+        __atomic_store_n(&seq_, seq_ + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    void unlock() {
+        __atomic_store_n(&seq_, seq_ + 1, __ATOMIC_RELEASE);
+        writer_.unlock();
+    }
+
+private:
+    uint32_t seq_ = 0;
+    Spinlock writer_;
+};
+
+#endif // SYNC_SEQLOCK_H
@@ -0,0 +1,59 @@
+#ifndef SYNC_SPINLOCK_H
+#define SYNC_SPINLOCK_H
+
+#include <stdint.h>
+
+#include "../arch/x86_64/cpu.h"
+#include "../mm/tlb.h"
+
+// Waiters spin with interrupts disabled, so they run the TLB flushes other
+// CPUs queue for them meanwhile; the holder may be waiting for one.
+class Spinlock {
+public:
+    constexpr Spinlock() = default;
+    Spinlock(const Spinlock&) = delete;
+    Spinlock& operator=(const Spinlock&) = delete;
+
+    void lock() {
+        while (__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&locked_, __ATOMIC_RELAXED)) {
+                tlb_drain();
+                cpu_pause();
+            }
+        }
+    }
+
+    bool try_lock() {
+        return !__atomic_load_n(&locked_, __ATOMIC_RELAXED) &&
+               !__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE);
+    }
+
+    void unlock() {
+        __atomic_store_n(&locked_, 0, __ATOMIC_RELEASE);
+    }
+
+    bool is_locked() const {
+        return __atomic_load_n(&locked_, __ATOMIC_RELAXED);
+    }
+
+private:
+    uint32_t locked_ = 0;
+};
+
+template <typename Lock>
+class LockGuard {
+public:
+    explicit LockGuard(Lock& lock) : lock_(lock) {
+        lock_.lock();
+    }
+    ~LockGuard() {
+        lock_.unlock();
+    }
+    LockGuard(const LockGuard&) = delete;
+    LockGuard& operator=(const LockGuard&) = delete;
+
+private:
+    Lock& lock_;
+};
+
+#endif // SYNC_SPINLOCK_H
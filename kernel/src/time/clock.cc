@@ -0,0 +1,296 @@
+#include "clock.h"
+
+#include "../acpi/acpi.h"
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/string.h"
+#include "../lib/util.h"
+#include "../log.h"
+#include "../mm/layout.h"
+#include "../mm/vmalloc.h"
+#include "../sched/daemon.h"
+#include "../sync/seqlock.h"
+
+// A counter of known frequency to measure the TSC against.
+struct Reference {
+    const char* name;
+    uint64_t hz;
+    // The counter wraps at mask + 1.
+    uint64_t mask;
+    uint64_t (*read)();
+};
+
+// ns = base_ns + (tsc - base_tsc) * ns_mult / 2^32, and the inverse with
+// tsc_mult. Rebasing on every update keeps the clock continuous when the
+// frequency estimate changes.
+struct ClockParams {
+    uint64_t base_tsc;
+    uint64_t base_ns;
+    uint64_t ns_mult;
+    uint64_t tsc_mult;
+};
+
+struct [[gnu::packed]] HpetTable {
+    AcpiHeader header;
+    uint32_t block_id;
+    AcpiAddress base;
+    uint8_t number;
+    uint16_t min_tick;
+    uint8_t protection;
+};
+
+constexpr uint32_t kHpetCapabilities = 0x00;
+constexpr uint32_t kHpetConfig = 0x10;
+constexpr uint32_t kHpetCounter = 0xF0;
+constexpr uint64_t kHpetEnable = 1ull << 0;
+constexpr uint64_t kHpetCounter64 = 1ull << 13;
+// The specification caps the tick period at 100 ns.
+constexpr uint64_t kHpetMaxPeriodFs = 100000000;
+constexpr uint64_t kFsPerSecond = 1000000000000000;
+
+// FADT fields, by offset.
+constexpr uint32_t kFadtPmTimerBlock = 76;
+constexpr uint32_t kFadtFlags = 112;
+constexpr uint32_t kFadtExtendedPmTimerBlock = 208;
+constexpr uint32_t kFadtTimerValueExtended = 1u << 8;
+constexpr uint64_t kPmTimerHz = 3579545;
+
+constexpr uint32_t kCpuidInvariantTsc = 1u << 8;
+
+// The boot measurement takes a hundredth of a second; the refinement
+// measures from its start.
+constexpr uint64_t kCalibrationDivisor = 100;
+constexpr uint64_t kRefineSeconds = 1;
+
+static Seqlock params_lock;
+static ClockParams params;
+static ClockInfo info;
+// The latest time clock_ns() returned on each CPU, which a rebase never
+// goes below.
+static PER_CPU PerCpu<uint64_t> last_ns;
+
+static Reference reference;
+static volatile uint64_t* hpet;
+static uint16_t pm_timer_port;
+// The first sample of the boot measurement, which the refinement measures
+// from.
+static uint64_t start_ref;
+static uint64_t start_tsc;
+
+static bool refine_run(void* context);
+static Daemon refine_daemon("clock-refine", refine_run);
+
+// (a * b) >> 32, keeping the high half of the 128-bit product.
+static uint64_t mul_shr32(uint64_t a, uint64_t b) {
+    uint64_t a_lo = (uint32_t)a;
+    uint64_t a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b;
+    uint64_t b_hi = b >> 32;
+    return ((a_hi * b_hi) << 32) + a_hi * b_lo + a_lo * b_hi + ((a_lo * b_lo) >> 32);
+}
+
+// a * b / c through the 128-bit product; the quotient must fit in 64 bits.
+static uint64_t mul_div(uint64_t a, uint64_t b, uint64_t c) {
+    uint64_t low, high, quotient, remainder;
+    asm("mulq %3" : "=a"(low), "=d"(high) : "a"(a), "rm"(b));
+    asm("divq %4" : "=a"(quotient), "=d"(remainder) : "a"(low), "d"(high), "rm"(c));
+    return quotient;
+}
+
+static uint64_t to_ns(const ClockParams& p, uint64_t tsc) {
+    return p.base_ns + (tsc > p.base_tsc ? mul_shr32(tsc - p.base_tsc, p.ns_mult) : 0);
+}
+
+static uint64_t to_tsc(const ClockParams& p, uint64_t ns) {
+    if (ns >= p.base_ns) {
+        return p.base_tsc + mul_shr32(ns - p.base_ns, p.tsc_mult);
+    }
+    uint64_t back = mul_shr32(p.base_ns - ns, p.tsc_mult);
+    return back < p.base_tsc ? p.base_tsc - back : 0;
+}
+
+static ClockParams read_params() {
+    ClockParams p;
+    uint32_t seq;
+    do {
+        seq = params_lock.read_begin();
+        p = params;
+    } while (params_lock.read_retry(seq));
+    return p;
+}
+
+// Rebases at the current TSC, which is only read once readers are held
+// off, so that none of them can still extrapolate the old parameters past
+// it. The TSCs of different CPUs need not agree exactly, so the base is
+// also kept from dropping below a time another CPU has already returned.
+static void publish(uint64_t hz) {
+    LockGuard<Seqlock> guard(params_lock);
+    uint64_t tsc = rdtsc();
+    ClockParams next;
+    next.base_tsc = tsc;
+    next.base_ns = params.ns_mult ? to_ns(params, tsc) : 0;
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        next.base_ns = max(next.base_ns, __atomic_load_n(last_ns.get(percpu_cpu(index)), __ATOMIC_RELAXED));
+    }
+    next.ns_mult = (kNsPerSecond << 32) / hz;
+    // hz * 2^32 / 10^9, reduced by 2^9 so that it cannot overflow.
+    next.tsc_mult = (hz << 23) / (kNsPerSecond >> 9);
+    params = next;
+    info.tsc_hz = hz;
+}
+
+static uint64_t read_hpet() {
+    return hpet[kHpetCounter / 8];
+}
+
+static uint64_t read_pm_timer() {
+    return inl(pm_timer_port);
+}
+
+static bool find_hpet() {
+    const HpetTable* table = (const HpetTable*)acpi_find_table("HPET");
+    if (!table || table->header.length < sizeof(HpetTable) || table->base.space != AcpiSpaceMemory) {
+        return false;
+    }
+    hpet = (volatile uint64_t*)ioremap(table->base.address, kPageSize);
+    if (!hpet) {
+        return false;
+    }
+    uint64_t capabilities = hpet[kHpetCapabilities / 8];
+    uint64_t period = capabilities >> 32;
+    if (period == 0 || period > kHpetMaxPeriodFs) {
+        iounmap((void*)hpet);
+        hpet = nullptr;
+        return false;
+    }
+    hpet[kHpetConfig / 8] = hpet[kHpetConfig / 8] | kHpetEnable;
+    reference = {"HPET", kFsPerSecond / period, capabilities & kHpetCounter64 ? UINT64_MAX : UINT32_MAX, read_hpet};
+    return true;
+}
+
+static bool find_pm_timer() {
+    const AcpiHeader* fadt = acpi_find_table("FACP");
+    if (!fadt || fadt->length < kFadtFlags + sizeof(uint32_t)) {
+        return false;
+    }
+    const uint8_t* bytes = (const uint8_t*)fadt;
+    uint32_t port, flags;
+    memcpy(&port, bytes + kFadtPmTimerBlock, sizeof(port));
+    memcpy(&flags, bytes + kFadtFlags, sizeof(flags));
+    if (port == 0 && fadt->length >= kFadtExtendedPmTimerBlock + sizeof(AcpiAddress)) {
+        AcpiAddress extended;
+        memcpy(&extended, bytes + kFadtExtendedPmTimerBlock, sizeof(extended));
+        if (extended.space == AcpiSpaceIo) {
+            port = extended.address;
+        }
+    }
+    if (port == 0 || port > UINT16_MAX) {
+        return false;
+    }
+    pm_timer_port = port;
+    reference = {"ACPI PM timer", kPmTimerHz, flags & kFadtTimerValueExtended ? UINT32_MAX : 0xFFFFFF,
+                 read_pm_timer};
+    return true;
+}
+
+// The nominal frequency from CPUID leaf 0x15, or leaf 0x16 without a
+// crystal frequency. 0 if neither says.
+static uint64_t cpuid_tsc_hz() {
+    uint32_t max_leaf = cpuid(0).eax;
+    if (max_leaf >= 0x15) {
+        CpuidResult tsc = cpuid(0x15);
+        if (tsc.eax && tsc.ebx && tsc.ecx) {
+            return (uint64_t)tsc.ecx * tsc.ebx / tsc.eax;
+        }
+    }
+    if (max_leaf >= 0x16) {
+        return (uint64_t)(cpuid(0x16).eax & 0xFFFF) * 1000000;
+    }
+    return 0;
+}
+
+// Reads the reference together with the TSC, taking the TSC midway
+// between the values on either side of the read.
+static void sample(uint64_t* ref, uint64_t* tsc) {
+    uint64_t before = rdtsc();
+    *ref = reference.read();
+    uint64_t after = rdtsc();
+    *tsc = before + (after - before) / 2;
+}
+
+static uint64_t measured_hz(uint64_t ref, uint64_t tsc) {
+    uint64_t ticks = (ref - start_ref) & reference.mask;
+    return ticks ? mul_div(tsc - start_tsc, reference.hz, ticks) : 0;
+}
+
+static bool refine_run(void*) {
+    uint64_t ref, tsc;
+    sample(&ref, &tsc);
+    // A reference that may have wrapped since the start would read short.
+    if ((tsc - start_tsc) / info.tsc_hz >= reference.mask / reference.hz / 2) {
+        return false;
+    }
+    if (uint64_t hz = measured_hz(ref, tsc)) {
+        publish(hz);
+        info.refinements++;
+    }
+    return false;
+}
+
+void clock_init() {
+    CpuidResult extended = cpuid(0x80000000);
+    info.invariant = extended.eax >= 0x80000007 && (cpuid(0x80000007).edx & kCpuidInvariantTsc);
+    uint64_t hz = 0;
+    if (find_hpet() || find_pm_timer()) {
+        info.reference = reference.name;
+        uint64_t ref, tsc;
+        sample(&start_ref, &start_tsc);
+        do {
+            cpu_pause();
+            sample(&ref, &tsc);
+        } while (((ref - start_ref) & reference.mask) < reference.hz / kCalibrationDivisor);
+        hz = measured_hz(ref, tsc);
+    }
+    bool measured = hz != 0;
+    if (!measured && (hz = cpuid_tsc_hz())) {
+        info.reference = "CPUID";
+    } else if (!measured) {
+        hz = kNsPerSecond;
+        info.reference = "nothing";
+    }
+    publish(hz);
+    if (measured) {
+        daemon_register(&refine_daemon);
+        daemon_wake_at(&refine_daemon, clock_ns() + kRefineSeconds * kNsPerSecond);
+    }
+    kprintf("clock: TSC %lu MHz%s, measured against %s\n", hz / 1000000, info.invariant ? "" : " (not invariant)",
+            info.reference);
+}
+
+uint64_t clock_ns() {
+    ClockParams p;
+    uint64_t tsc;
+    uint32_t seq;
+    // Reading the TSC inside the section ties it to the parameters: a
+    // rebase in between sends the reader round again.
+    do {
+        seq = params_lock.read_begin();
+        p = params;
+        tsc = rdtsc();
+    } while (params_lock.read_retry(seq));
+    uint64_t ns = to_ns(p, tsc);
+    __atomic_store_n(last_ns.get(), ns, __ATOMIC_RELAXED);
+    return ns;
+}
+
+uint64_t clock_tsc_to_ns(uint64_t tsc) {
+    return to_ns(read_params(), tsc);
+}
+
+uint64_t clock_ns_to_tsc(uint64_t ns) {
+    return to_tsc(read_params(), ns);
+}
+
+ClockInfo clock_info() {
+    return info;
+}
@@ -0,0 +1,31 @@
+#ifndef TIME_CLOCK_H
+#define TIME_CLOCK_H
+
+#include <stdint.h>
+
+constexpr uint64_t kNsPerSecond = 1000000000;
+
+struct ClockInfo {
+    uint64_t tsc_hz;
+    // Whether the TSC keeps a constant rate across P-, C- and T-states.
+    bool invariant;
+    // What the frequency was measured against.
+    const char* reference;
+    // Times the parameters were republished after a longer measurement.
+    uint64_t refinements;
+};
+
+// Measures the TSC frequency against the HPET, or else the ACPI PM timer,
+// or else takes it from CPUID. Needs ACPI tables and ioremap. A second,
+// longer measurement a second later refines the first.
+void clock_init();
+
+// Monotonic nanoseconds since clock_init, from the TSC with no locking: a
+// handful of multiplies on top of RDTSC. 0 before clock_init.
+uint64_t clock_ns();
+// Converts between clock_ns() time and TSC values, for deadlines.
+uint64_t clock_tsc_to_ns(uint64_t tsc);
+uint64_t clock_ns_to_tsc(uint64_t ns);
+ClockInfo clock_info();
+
+#endif // TIME_CLOCK_H
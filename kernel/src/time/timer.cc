@@ -0,0 +1,312 @@
+#include "timer.h"
+
+#include "../arch/x86_64/lapic.h"
+#include "../arch/x86_64/percpu.h"
+#include "../sync/spinlock.h"
+#include "clock.h"
+
+constexpr uint64_t kSlotMask = kTimerWheelSlots - 1;
+constexpr unsigned kWheelRangeBits = kTimerWheelBits * kTimerWheelLevels;
+// Timer::slot of a timer that expired and waits for its callback.
+constexpr uint16_t kExpiredSlot = UINT16_MAX;
+constexpr uint64_t kNoEvent = UINT64_MAX;
+
+// Level L of the wheel has slots of 2^(6L) ticks and holds timers due in
+// 2^(6L) to 2^(6L+6) ticks. When the clock enters a level-L slot, its
+// timers cascade down to the levels below.
+struct TimerBase {
+    Spinlock lock;
+    // The next tick to process; every earlier one has been.
+    uint64_t clk = 0;
+    ListNode slots[kTimerWheelLevels][kTimerWheelSlots] = {};
+    // One bit per non-empty slot, which lets the wheel skip idle stretches
+    // instead of walking them tick by tick.
+    uint64_t occupied[kTimerWheelLevels] = {};
+    RbTree precise = {};
+    // Timers taken off the wheel and the tree whose callbacks have yet to
+    // run. They still count as pending and can be cancelled.
+    ListNode expired = {};
+    // The clock_ns() time the local APIC timer is armed for.
+    uint64_t next_event = kNoEvent;
+    TimerStats stats = {};
+};
+
+static PER_CPU PerCpu<TimerBase> bases;
+
+static TimerBase* this_cpu_base() {
+    return bases.get();
+}
+
+// Rounds up, so that a timer never fires before its expiry.
+static uint64_t to_tick(uint64_t ns) {
+    return (ns >> kTimerTickShift) + ((ns & (kTimerTickNs - 1)) != 0);
+}
+
+// The latest time in [expires, expires + slack] with the most trailing
+// zero bits, so that timers with overlapping windows agree on it.
+static uint64_t apply_slack(uint64_t expires, uint64_t slack) {
+    uint64_t limit = expires + slack;
+    if (slack == 0 || limit < expires) {
+        return expires;
+    }
+    uint64_t mask = (1ull << ilog2(expires ^ limit)) - 1;
+    return limit & ~mask;
+}
+
+static void wheel_add(TimerBase* base, Timer* timer) {
+    uint64_t tick = max(to_tick(timer->expires), base->clk);
+    uint64_t delta = tick - base->clk;
+    if (delta >> kWheelRangeBits) {
+        // Parked in the last slot in range; it cascades back up until its
+        // expiry comes within reach.
+        delta = (1ull << kWheelRangeBits) - 1;
+        tick = base->clk + delta;
+    }
+    unsigned level = 0;
+    while (delta >> (kTimerWheelBits * (level + 1))) {
+        level++;
+    }
+    unsigned index = (tick >> (kTimerWheelBits * level)) & kSlotMask;
+    list_push_back(&base->slots[level][index], &timer->node);
+    base->occupied[level] |= 1ull << index;
+    timer->slot = level * kTimerWheelSlots + index;
+}
+
+static void wheel_remove(TimerBase* base, Timer* timer) {
+    list_remove(&timer->node);
+    unsigned level = timer->slot / kTimerWheelSlots;
+    unsigned index = timer->slot % kTimerWheelSlots;
+    if (list_empty(&base->slots[level][index])) {
+        base->occupied[level] &= ~(1ull << index);
+    }
+}
+
+static void precise_add(TimerBase* base, Timer* timer) {
+    RbNode** link = &base->precise.root;
+    RbNode* parent = nullptr;
+    while (*link) {
+        parent = *link;
+        link = timer->expires < rb_entry(parent, Timer, rb)->expires ? &parent->left : &parent->right;
+    }
+    rb_link(&timer->rb, parent, link);
+    rb_insert(&base->precise, &timer->rb);
+    timer->slot = 0;
+}
+
+static void detach(TimerBase* base, Timer* timer) {
+    if (timer->slot == kExpiredSlot) {
+        list_remove(&timer->node);
+    } else if (timer->precise) {
+        rb_erase(&base->precise, &timer->rb);
+    } else {
+        wheel_remove(base, timer);
+    }
+    timer->base = nullptr;
+}
+
+static void cascade(TimerBase* base, unsigned level, unsigned index) {
+    ListNode pending;
+    list_init(&pending);
+    list_splice_back(&pending, &base->slots[level][index]);
+    base->occupied[level] &= ~(1ull << index);
+    while (ListNode* node = list_pop_front(&pending)) {
+        wheel_add(base, list_entry(node, Timer, node));
+        base->stats.cascaded++;
+    }
+}
+
+// The first tick from base->clk on at which a slot has timers to run or
+// to cascade, or kNoEvent if the wheel is empty. Slots behind the current
+// index of their level only come round after the level wraps, so the
+// wrap is returned for them. Past the levels below, `tick` is always a
+// slot boundary of the level being looked at.
+static uint64_t next_work(const TimerBase* base) {
+    uint64_t tick = base->clk;
+    for (unsigned level = 0; level < kTimerWheelLevels; ++level) {
+        unsigned shift = level * kTimerWheelBits;
+        uint64_t wrap = align_up(tick, 1ull << (shift + kTimerWheelBits));
+        uint64_t bits = base->occupied[level];
+        if (!bits) {
+            tick = wrap;
+            continue;
+        }
+        uint64_t ahead = bits >> ((tick >> shift) & kSlotMask);
+        return ahead ? tick + ((uint64_t)__builtin_ctzll(ahead) << shift) : wrap;
+    }
+    return kNoEvent;
+}
+
+// Turns the wheel up to and including `now_tick`, moving the timers that
+// expired onto base->expired.
+static void advance(TimerBase* base, uint64_t now_tick) {
+    while (base->clk <= now_tick) {
+        uint64_t clk = base->clk;
+        if (!(clk & kSlotMask)) {
+            for (unsigned level = 1; level < kTimerWheelLevels; ++level) {
+                unsigned index = (clk >> (level * kTimerWheelBits)) & kSlotMask;
+                cascade(base, level, index);
+                if (index) {
+                    break;
+                }
+            }
+        }
+        unsigned index = clk & kSlotMask;
+        for (ListNode* node = base->slots[0][index].next; node != &base->slots[0][index]; node = node->next) {
+            list_entry(node, Timer, node)->slot = kExpiredSlot;
+        }
+        list_splice_back(&base->expired, &base->slots[0][index]);
+        base->occupied[0] &= ~(1ull << index);
+        base->clk = clk + 1;
+        base->clk = min(next_work(base), now_tick + 1);
+    }
+}
+
+static void program_next(TimerBase* base) {
+    uint64_t next = kNoEvent;
+    uint64_t tick = next_work(base);
+    if (tick != kNoEvent) {
+        next = tick << kTimerTickShift;
+    }
+    if (RbNode* first = rb_first(&base->precise)) {
+        next = min(next, rb_entry(first, Timer, rb)->expires);
+    }
+    if (next == base->next_event) {
+        return;
+    }
+    base->next_event = next;
+    if (next == kNoEvent) {
+        lapic_timer_disarm();
+    } else {
+        lapic_timer_arm(clock_ns_to_tsc(next));
+    }
+}
+
+static void timer_interrupt() {
+    TimerBase* base = this_cpu_base();
+    uint64_t now = clock_ns();
+    LockGuard<Spinlock> guard(base->lock);
+    // The interrupt consumed whatever the timer was armed for.
+    base->next_event = kNoEvent;
+    advance(base, now >> kTimerTickShift);
+    while (RbNode* first = rb_first(&base->precise)) {
+        Timer* timer = rb_entry(first, Timer, rb);
+        if (timer->expires > now) {
+            break;
+        }
+        rb_erase(&base->precise, first);
+        timer->slot = kExpiredSlot;
+        list_push_back(&base->expired, &timer->node);
+        base->stats.precise_fired++;
+    }
+    if (!list_empty(&base->expired)) {
+        base->stats.batches++;
+    }
+    // Callbacks run unlocked so that they can restart their timers; each
+    // one is taken off the list under the lock, which lets it race with
+    // timer_cancel safely.
+    while (ListNode* node = list_pop_front(&base->expired)) {
+        Timer* timer = list_entry(node, Timer, node);
+        timer->base = nullptr;
+        base->stats.fired++;
+        base->lock.unlock();
+        timer->fire(timer->context);
+        base->lock.lock();
+    }
+    program_next(base);
+}
+
+void timers_init() {
+    TimerBase* base = this_cpu_base();
+    for (unsigned level = 0; level < kTimerWheelLevels; ++level) {
+        for (unsigned index = 0; index < kTimerWheelSlots; ++index) {
+            list_init(&base->slots[level][index]);
+        }
+    }
+    list_init(&base->expired);
+    base->clk = clock_ns() >> kTimerTickShift;
+    lapic_timer_set_handler(timer_interrupt);
+}
+
+void timer_setup(Timer* timer, void (*fire)(void* context), void* context) {
+    timer->fire = fire;
+    timer->context = context;
+    timer->base = nullptr;
+}
+
+static void start(Timer* timer, uint64_t expires, bool precise) {
+    timer_cancel(timer);
+    TimerBase* base = this_cpu_base();
+    LockGuard<Spinlock> guard(base->lock);
+    timer->expires = expires;
+    timer->precise = precise;
+    timer->base = base;
+    base->stats.started++;
+    if (precise) {
+        precise_add(base, timer);
+    } else {
+        // An empty wheel may have been left behind by a long idle
+        // stretch; catching it up keeps the new timer on a fine level.
+        bool empty = true;
+        for (unsigned level = 0; level < kTimerWheelLevels; ++level) {
+            empty &= !base->occupied[level];
+        }
+        if (empty) {
+            base->clk = max(base->clk, clock_ns() >> kTimerTickShift);
+        }
+        wheel_add(base, timer);
+    }
+    // Cancelling never rearms the timer: most timers are cancelled before
+    // they fire, and an early interrupt that finds nothing is cheaper.
+    // Only an expiry ahead of the armed event needs the timer moved.
+    uint64_t event = precise ? expires : to_tick(expires) << kTimerTickShift;
+    if (event < base->next_event) {
+        program_next(base);
+    }
+}
+
+void timer_start(Timer* timer, uint64_t expires, uint64_t slack) {
+    if (slack == kTimerDefaultSlack) {
+        uint64_t now = clock_ns();
+        slack = expires > now ? (expires - now) >> kTimerDefaultSlackShift : 0;
+    }
+    start(timer, apply_slack(expires, slack), false);
+}
+
+void timer_start_precise(Timer* timer, uint64_t expires) {
+    start(timer, expires, true);
+}
+
+bool timer_cancel(Timer* timer) {
+    for (;;) {
+        TimerBase* base = __atomic_load_n(&timer->base, __ATOMIC_ACQUIRE);
+        if (!base) {
+            return false;
+        }
+        LockGuard<Spinlock> guard(base->lock);
+        // It may have fired or moved to another CPU while unlocked.
+        if (timer->base == base) {
+            detach(base, timer);
+            base->stats.cancelled++;
+            return true;
+        }
+    }
+}
+
+bool timer_pending(const Timer* timer) {
+    return __atomic_load_n(&timer->base, __ATOMIC_RELAXED) != nullptr;
+}
+
+TimerStats timer_stats() {
+    TimerStats total = {};
+    for (unsigned index = 0; index < percpu_count(); ++index) {
+        TimerBase* base = bases.get(percpu_cpu(index));
+        LockGuard<Spinlock> guard(base->lock);
+        total.started += base->stats.started;
+        total.cancelled += base->stats.cancelled;
+        total.fired += base->stats.fired;
+        total.precise_fired += base->stats.precise_fired;
+        total.cascaded += base->stats.cascaded;
+        total.batches += base->stats.batches;
+    }
+    return total;
+}
@@ -0,0 +1,70 @@
+#ifndef TIME_TIMER_H
+#define TIME_TIMER_H
+
+#include <stdint.h>
+
+#include "../lib/list.h"
+#include "../lib/rbtree.h"
+
+struct TimerBase;
+
+// A one-shot callback at a clock_ns() time. Ordinary timers live in a
+// hierarchical wheel of kTimerTickNs granularity: starting and cancelling
+// them is O(1), and they fire up to one tick plus their slack late.
+// Precise timers sit in a tree ordered by expiry and arm the local APIC
+// for their exact deadline.
+//
+// Each CPU has its own wheel and tree under its own lock, and callbacks
+// run from that CPU's timer interrupt with the lock dropped and
+// interrupts disabled, so they must not block.
+struct Timer {
+    ListNode node;
+    RbNode rb;
+    uint64_t expires;
+    void (*fire)(void* context);
+    void* context;
+    // The base the timer is queued on, or null when it is not pending.
+    TimerBase* base;
+    // Wheel level * kTimerWheelSlots + slot index.
+    uint16_t slot;
+    bool precise;
+};
+
+constexpr unsigned kTimerTickShift = 20;
+constexpr uint64_t kTimerTickNs = 1ull << kTimerTickShift;
+constexpr unsigned kTimerWheelBits = 6;
+constexpr unsigned kTimerWheelSlots = 1u << kTimerWheelBits;
+constexpr unsigned kTimerWheelLevels = 6;
+// Lets timer_start pick slack in proportion to the delay, 1/256 of it.
+constexpr uint64_t kTimerDefaultSlack = UINT64_MAX;
+constexpr unsigned kTimerDefaultSlackShift = 8;
+
+struct TimerStats {
+    uint64_t started;
+    uint64_t cancelled;
+    uint64_t fired;
+    uint64_t precise_fired;
+    // Timers moved down a level as the wheel turned.
+    uint64_t cascaded;
+    // Timer interrupts that ran at least one timer.
+    uint64_t batches;
+};
+
+// Initialises the calling CPU's wheel and hooks the local APIC timer.
+// Runs on every CPU as it comes up.
+void timers_init();
+
+void timer_setup(Timer* timer, void (*fire)(void* context), void* context);
+// Arms `timer` for clock_ns() time `expires`, first cancelling it if it
+// is pending. The expiry may be pushed back by up to `slack` so that it
+// lands on a coarser boundary shared with nearby timers.
+void timer_start(Timer* timer, uint64_t expires, uint64_t slack = kTimerDefaultSlack);
+void timer_start_precise(Timer* timer, uint64_t expires);
+// Returns whether the timer was pending. A callback that is already
+// running is not waited for.
+bool timer_cancel(Timer* timer);
+bool timer_pending(const Timer* timer);
+// Counts summed over every CPU.
+TimerStats timer_stats();
+
+#endif // TIME_TIMER_H